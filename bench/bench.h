@@ -0,0 +1,66 @@
+#pragma once
+
+// Helpers of the Linux benchmarks, see bench/CMakeLists.txt.
+// Runs are short by default, so that ctest can run them on every build; pass --full for stable numbers.
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+
+
+namespace Bench
+{
+    inline bool& FullRun()
+    {
+        static bool full = false;
+        return full;
+    }
+
+    inline void Initialize(int argc, char** argv)
+    {
+        setvbuf(stdout, nullptr, _IONBF, 0);
+        for (int i = 1; i < argc; i++)
+        {
+            if (0 == std::strcmp(argv[i], "--full"))
+            {
+                FullRun() = true;
+            }
+        }
+    }
+
+    // Iteration count: the quick one under ctest, ten times that with --full.
+    inline long long Iterations(long long quick)
+    {
+        return FullRun() ? quick * 10 : quick;
+    }
+
+    inline double SecondsSince(std::chrono::steady_clock::time_point start)
+    {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    // Best of a few runs of fn(iterations), in nanoseconds per iteration.
+    template <typename TFn>
+    double NsPerIteration(long long iterations, TFn&& fn)
+    {
+        double best = 0;
+        for (int run = 0; run < 3; run++)
+        {
+            auto start = std::chrono::steady_clock::now();
+            fn(iterations);
+            double ns = SecondsSince(start) * 1e9 / static_cast<double>(iterations);
+            if (run == 0 || ns < best)
+            {
+                best = ns;
+            }
+        }
+        return best;
+    }
+
+    // Keeps a value alive without the compiler seeing through it.
+    template <typename T>
+    inline void DoNotOptimize(const T& value)
+    {
+        asm volatile("" : : "r,m"(value) : "memory");
+    }
+}
@@ -0,0 +1,117 @@
+// What a hook costs: per call through a chain of detours, and per enable, disable, install and uninstall.
+
+#define ASI_LOG_FNAME "hook_bench.log"
+#define ASI_SIGCACHE_FNAME "hook_bench.sigcache"
+
+#include "utils/hook.h"
+#include "spi/shared_hook_manager.h"
+#include "bench/bench.h"
+
+#include <initializer_list>
+
+
+#define NOINLINE __attribute__((noinline, used))
+
+static constexpr int MaxDepth = 8;
+
+static volatile int GSink;
+
+NOINLINE int Target(int a, int b)
+{
+    int result = a * 3 + b;
+    GSink = result;
+    return result ^ GSink ^ result;
+}
+
+typedef int (*TargetFn)(int, int);
+static TargetFn volatile GTarget = Target;
+static TargetFn GOriginals[MaxDepth];
+
+template <int N>
+NOINLINE int Detour(int a, int b)
+{
+    return GOriginals[N](a, b) + 1;
+}
+
+static const LPVOID GDetours[MaxDepth] = {
+    (LPVOID)Detour<0>, (LPVOID)Detour<1>, (LPVOID)Detour<2>, (LPVOID)Detour<3>,
+    (LPVOID)Detour<4>, (LPVOID)Detour<5>, (LPVOID)Detour<6>, (LPVOID)Detour<7>,
+};
+
+static double NsPerCall()
+{
+    return Bench::NsPerIteration(Bench::Iterations(5000000), [](long long iterations) {
+        int sum = 0;
+        for (long long i = 0; i < iterations; i++)
+        {
+            sum += GTarget(1, static_cast<int>(i));
+        }
+        Bench::DoNotOptimize(sum);
+    });
+}
+
+int main(int argc, char** argv)
+{
+    Bench::Initialize(argc, argv);
+    Utils::SetupOutput();
+    MH_Initialize();
+
+    SPI::SharedHookManager manager;
+    char names[MaxDepth][8];
+
+    double unhooked = NsPerCall();
+    std::printf("call, unhooked: %.2f ns\n", unhooked);
+
+    // Each level installs one more detour through the manager, every detour calls the next one down.
+    int depth = 0;
+    for (int level : { 1, 2, 4, 8 })
+    {
+        for (; depth < level; depth++)
+        {
+            std::snprintf(names[depth], sizeof(names[depth]), "d%d", depth);
+            if (!manager.Install((LPVOID)Target, GDetours[depth], (LPVOID*)&GOriginals[depth], names[depth]))
+            {
+                std::printf("installing detour %d failed\n", depth);
+                return 1;
+            }
+        }
+        if (GTarget(1, 1) != 4 + depth)
+        {
+            std::printf("wrong result through %d detour(s)\n", depth);
+            return 1;
+        }
+
+        double ns = NsPerCall();
+        std::printf("call, %d detour(s): %.2f ns (+%.2f ns per detour)\n", depth, ns, (ns - unhooked) / depth);
+    }
+    for (int i = 0; i < depth; i++)
+    {
+        manager.Uninstall(names[i]);
+    }
+
+    // Each one freezes and resumes the other threads.
+    MH_CreateHookEx(1, (LPVOID*)&GOriginals[0], GDetours[0], (LPVOID)Target);
+    double toggle = Bench::NsPerIteration(Bench::Iterations(2000), [](long long iterations) {
+        for (long long i = 0; i < iterations; i++)
+        {
+            MH_EnableHookEx(1, (LPVOID)Target);
+            MH_DisableHookEx(1, (LPVOID)Target);
+        }
+    });
+    std::printf("enable + disable: %.1f us (%.0f/s)\n", toggle / 1000, 1e9 / toggle);
+    MH_RemoveHookEx(nullptr, 1, (LPVOID)Target);
+
+    // With the name bookkeeping, the log line per step, and a trampoline retired per uninstall.
+    double cycle = Bench::NsPerIteration(Bench::Iterations(2000), [&](long long iterations) {
+        for (long long i = 0; i < iterations; i++)
+        {
+            manager.Install((LPVOID)Target, GDetours[0], (LPVOID*)&GOriginals[0], names[0]);
+            manager.Uninstall(names[0]);
+        }
+    });
+    std::printf("SharedHookManager install + uninstall: %.1f us (%.0f/s)\n", cycle / 1000, 1e9 / cycle);
+
+    MH_Uninitialize();
+    Utils::TeardownOutput();
+    return 0;
+}
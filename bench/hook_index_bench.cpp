@@ -0,0 +1,131 @@
+// The hook table with 10k hooks: create, look up and remove, against the linear search FindHookEntry used to be.
+
+#include "minhook/include/MinHook.h"
+#include "bench/bench.h"
+
+#include <algorithm>
+#include <random>
+#include <sys/mman.h>
+#include <vector>
+
+
+#define NOINLINE __attribute__((noinline, used))
+
+static constexpr UINT HookCount = 10000;
+static constexpr UINT IdentsPerTarget = 4;
+
+NOINLINE int Detour()
+{
+    return 0;
+}
+
+// What FindHookEntry did before the table was indexed.
+static UINT LinearFindHookEntry(ULONG_PTR hookIdent, LPVOID pTarget)
+{
+    for (UINT i = 0; i < g_hooks.size; ++i)
+    {
+        if (g_hooks.pItems[i].hookIdent == hookIdent && g_hooks.pItems[i].pTarget == pTarget)
+            return i;
+    }
+    return INVALID_HOOK_POS;
+}
+
+int main(int argc, char** argv)
+{
+    Bench::Initialize(argc, argv);
+
+    // Hooks are only created, never enabled, so the targets just have to be executable: a page run of rets.
+    const UINT targetCount = HookCount / IdentsPerTarget;
+    const size_t codeSize = (targetCount * 16 + 4095) & ~size_t(4095);
+    auto code = static_cast<uint8_t*>(mmap(nullptr, codeSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    std::fill(code, code + codeSize, 0xC3);
+    mprotect(code, codeSize, PROT_READ | PROT_EXEC);
+
+    // A few hooks on each target, in shuffled order.
+    struct Key { ULONG_PTR Ident; LPVOID Target; };
+    std::vector<Key> keys;
+    for (UINT i = 0; i < HookCount; i++)
+    {
+        keys.push_back({ 1 + i % IdentsPerTarget, code + (i / IdentsPerTarget) * 16 });
+    }
+    std::mt19937 rng(1);
+    std::shuffle(keys.begin(), keys.end(), rng);
+
+    MH_Initialize();
+
+    // On the POSIX backend this is mostly the two IsExecutableAddress checks, each of which reads /proc/self/maps.
+    auto start = std::chrono::steady_clock::now();
+    for (auto& key : keys)
+    {
+        if (MH_CreateHookEx(key.Ident, nullptr, (LPVOID)Detour, key.Target) != MH_OK)
+        {
+            std::printf("creating a hook failed\n");
+            return 1;
+        }
+    }
+    double create = Bench::SecondsSince(start);
+    std::printf("create %u hooks: %.2f ms (%.0f ns per hook)\n", HookCount, create * 1e3, create * 1e9 / HookCount);
+
+    // Through the public API: the mutex, then FindHookEntry. The hook is disabled already, so nothing else happens.
+    double api = Bench::NsPerIteration(Bench::Iterations(200000), [&](long long iterations) {
+        for (long long i = 0; i < iterations; i++)
+        {
+            auto& key = keys[i % HookCount];
+            Bench::DoNotOptimize(MH_DisableHookEx(key.Ident, key.Target));
+        }
+    });
+    std::printf("MH_DisableHookEx on a disabled hook: %.1f ns\n", api);
+
+    double indexed = Bench::NsPerIteration(Bench::Iterations(1000000), [&](long long iterations) {
+        for (long long i = 0; i < iterations; i++)
+        {
+            auto& key = keys[i % HookCount];
+            Bench::DoNotOptimize(FindHookEntry(key.Ident, key.Target));
+        }
+    });
+    double linear = Bench::NsPerIteration(Bench::Iterations(2000), [&](long long iterations) {
+        for (long long i = 0; i < iterations; i++)
+        {
+            auto& key = keys[i % HookCount];
+            Bench::DoNotOptimize(LinearFindHookEntry(key.Ident, key.Target));
+        }
+    });
+    std::printf("lookup: %.1f ns indexed, %.1f ns linear (%.0fx)\n", indexed, linear, linear / indexed);
+
+    for (auto& key : keys)
+    {
+        if (FindHookEntry(key.Ident, key.Target) != LinearFindHookEntry(key.Ident, key.Target))
+        {
+            std::printf("indexed and linear lookups disagree\n");
+            return 1;
+        }
+    }
+
+    ULONG_PTR idents[IdentsPerTarget];
+    UINT count = 0;
+    double enumerate = Bench::NsPerIteration(Bench::Iterations(200000), [&](long long iterations) {
+        for (long long i = 0; i < iterations; i++)
+        {
+            MH_EnumerateHooksOnTarget(code + (i % targetCount) * 16, idents, IdentsPerTarget, &count);
+        }
+        Bench::DoNotOptimize(count);
+    });
+    std::printf("MH_EnumerateHooksOnTarget (%u hooks each): %.1f ns\n", IdentsPerTarget, enumerate);
+
+    std::shuffle(keys.begin(), keys.end(), rng);
+    start = std::chrono::steady_clock::now();
+    for (auto& key : keys)
+    {
+        if (MH_RemoveHookEx(nullptr, key.Ident, key.Target) != MH_OK)
+        {
+            std::printf("removing a hook failed\n");
+            return 1;
+        }
+    }
+    double remove = Bench::SecondsSince(start);
+    std::printf("remove %u hooks: %.2f ms (%.0f ns per hook)\n", HookCount, remove * 1e3, remove * 1e9 / HookCount);
+
+    MH_Uninitialize();
+    munmap(code, codeSize);
+    return 0;
+}
@@ -0,0 +1,130 @@
+// A call through a multicast dispatcher with 1 to 16 subscribers, against the same number of chained detours.
+
+#define ASI_LOG_FNAME "multicast_bench.log"
+#define ASI_SIGCACHE_FNAME "multicast_bench.sigcache"
+
+#include "utils/hook.h"
+#include "spi/shared_hook_manager.h"
+#include "bench/bench.h"
+
+#include <initializer_list>
+
+
+#define NOINLINE __attribute__((noinline, used))
+
+static constexpr int MaxCount = 16;
+
+static volatile int GSink;
+
+// Called by the dispatcher, so with the Windows x64 convention; the chain uses the same one.
+__attribute__((ms_abi, noinline, used)) static int Target(int a, int b)
+{
+    int result = a * 3 + b;
+    GSink = result;
+    return result ^ GSink ^ result;
+}
+
+__attribute__((ms_abi, noinline, used)) static int ChainedTarget(int a, int b)
+{
+    int result = a * 3 + b;
+    GSink = result;
+    return result ^ GSink ^ result;
+}
+
+typedef int (__attribute__((ms_abi)) *TargetFn)(int, int);
+static TargetFn volatile GTarget = Target;
+static TargetFn volatile GChainedTarget = ChainedTarget;
+static TargetFn GOriginals[MaxCount];
+
+template <int N>
+__attribute__((ms_abi)) NOINLINE int Detour(int a, int b)
+{
+    return GOriginals[N](a, b) + 1;
+}
+
+template <int... N>
+static void FillDetours(LPVOID* detours, std::integer_sequence<int, N...>)
+{
+    ((detours[N] = (LPVOID)Detour<N>), ...);
+}
+
+static void CODEGEN_CALL Pre(Utils::MulticastContext* context, void*)
+{
+    context->IntArgs[1]++;
+}
+
+static void CODEGEN_CALL Post(Utils::MulticastContext* context, void*)
+{
+    context->ReturnValue++;
+}
+
+static double NsPerCall(TargetFn volatile& target)
+{
+    return Bench::NsPerIteration(Bench::Iterations(2000000), [&](long long iterations) {
+        int sum = 0;
+        for (long long i = 0; i < iterations; i++)
+        {
+            sum += target(1, static_cast<int>(i));
+        }
+        Bench::DoNotOptimize(sum);
+    });
+}
+
+int main(int argc, char** argv)
+{
+    Bench::Initialize(argc, argv);
+    Utils::SetupOutput();
+    MH_Initialize();
+
+    LPVOID detours[MaxCount];
+    FillDetours(detours, std::make_integer_sequence<int, MaxCount>{});
+
+    SPI::SharedHookManager manager;
+    char names[3][MaxCount][12];
+
+    std::printf("call, unhooked: %.2f ns\n", NsPerCall(GTarget));
+
+    // Every level adds subscribers and detours up to its count.
+    int count = 0;
+    for (int level : { 1, 2, 4, 8, 16 })
+    {
+        for (; count < level; count++)
+        {
+            std::snprintf(names[0][count], sizeof(names[0][count]), "pre%d", count);
+            std::snprintf(names[1][count], sizeof(names[1][count]), "both%d", count);
+            std::snprintf(names[2][count], sizeof(names[2][count]), "chain%d", count);
+            if (!manager.Subscribe((LPVOID)Target, Pre, nullptr, nullptr, 0, names[0][count])
+                || !manager.Install((LPVOID)ChainedTarget, detours[count], (LPVOID*)&GOriginals[count], names[2][count]))
+            {
+                std::printf("installing %d failed\n", count);
+                return 1;
+            }
+        }
+
+        double pre = NsPerCall(GTarget);
+
+        // The same number of subscriptions again, with a post callback each.
+        for (int i = 0; i < count; i++)
+        {
+            manager.Subscribe((LPVOID)Target, nullptr, Post, nullptr, 0, names[1][i]);
+        }
+        double both = NsPerCall(GTarget);
+        for (int i = 0; i < count; i++)
+        {
+            manager.Unsubscribe(names[1][i]);
+        }
+
+        if (GTarget(1, 1) != 4 + count || GChainedTarget(1, 1) != 4 + count)
+        {
+            std::printf("wrong result through %d subscriber(s)\n", count);
+            return 1;
+        }
+
+        double chain = NsPerCall(GChainedTarget);
+        std::printf("%2d: multicast, pre only: %.2f ns, pre and post: %.2f ns; chain of detours: %.2f ns\n", count, pre, both, chain);
+    }
+
+    MH_Uninitialize();
+    Utils::TeardownOutput();
+    return 0;
+}
@@ -0,0 +1,77 @@
+// Pattern scans over a 100 MB buffer: each scanner on one thread, then FindPatternParallel per thread count.
+
+#include "src/utils/scanner.h"
+#include "bench/bench.h"
+
+#include <random>
+#include <vector>
+
+
+static constexpr std::size_t BufferSize = 100 << 20;
+
+int main(int argc, char** argv)
+{
+    Bench::Initialize(argc, argv);
+
+    // Random bytes, with the only match in the last chunk, so that every scan reads the whole buffer.
+    std::vector<std::uint8_t> buffer(BufferSize);
+    std::mt19937 rng(1);
+    for (auto& b : buffer)
+    {
+        b = static_cast<std::uint8_t>(rng());
+    }
+
+    const std::uint8_t bytes[] = { 0x48, 0x89, 0x5C, 0x24, 0x08, 0x57, 0x48, 0x83, 0xEC, 0x20, 0x8B, 0xD9 };
+    const std::uint8_t masks[] = { 0xFF, 0xFF, 0xFF, 0xFF, 0x00, 0xFF, 0xFF, 0xFF, 0xFF, 0x00, 0xFF, 0xFF };
+    Utils::PatternView pattern{ bytes, masks, sizeof(bytes), 0, 0 };
+    Utils::PrepareAnchors(bytes, masks, sizeof(bytes), &pattern.AnchorA, &pattern.AnchorB);
+
+    const std::uint8_t* start = buffer.data();
+    const std::uint8_t* end = start + buffer.size();
+    std::uint8_t* planted = buffer.data() + BufferSize - 1000;
+    std::copy(bytes, bytes + sizeof(bytes), planted);
+
+    auto report = [](const char* name, double ns) {
+        std::printf("%s: %.2f ms (%.2f GB/s)\n", name, ns / 1e6, BufferSize / ns);
+        return ns;
+    };
+
+    auto scan = [&](const char* name, auto&& fn) {
+        if (fn() != planted)
+        {
+            std::printf("%s: wrong match\n", name);
+            std::exit(1);
+        }
+        return report(name, Bench::NsPerIteration(Bench::Iterations(2), [&](long long iterations) {
+            for (long long i = 0; i < iterations; i++)
+            {
+                Bench::DoNotOptimize(fn());
+            }
+        }));
+    };
+
+    scan("scalar", [&] { return Utils::FindPatternScalar(start, end, pattern); });
+    scan("SSE2", [&] { return Utils::FindPatternSSE2(start, end, pattern); });
+    if (Utils::CpuSupportsAVX2())
+    {
+        scan("AVX2", [&] { return Utils::FindPatternAVX2(start, end, pattern); });
+    }
+
+    std::printf("hardware threads: %u\n", std::thread::hardware_concurrency());
+    double single = 0;
+    for (unsigned threads : { 1u, 2u, 4u, 8u })
+    {
+        char name[32];
+        std::snprintf(name, sizeof(name), "parallel, %u thread(s)", threads);
+        double ns = scan(name, [&] { return Utils::FindPatternParallel(start, end, pattern, threads); });
+        if (threads == 1)
+        {
+            single = ns;
+        }
+        else
+        {
+            std::printf("  speedup: %.2fx\n", single / ns);
+        }
+    }
+    return 0;
+}
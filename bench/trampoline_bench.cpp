@@ -0,0 +1,45 @@
+// Trampolines built per second, on a mix of typical prologues, near and far from the trampoline.
+
+#include "minhook/src/trampoline_builder.h"
+#include "bench/bench.h"
+
+#include <initializer_list>
+
+
+int main(int argc, char** argv)
+{
+    Bench::Initialize(argc, argv);
+
+    static const uint8_t prologues[][16] = {
+        { 0x48, 0x89, 0x5C, 0x24, 0x08, 0x57, 0x48, 0x83, 0xEC, 0x20, 0x48, 0x8B, 0xD9, 0xCC, 0xCC, 0xCC },
+        { 0x40, 0x53, 0x48, 0x83, 0xEC, 0x20, 0x48, 0x8B, 0xD9, 0xCC, 0xCC, 0xCC, 0xCC, 0xCC, 0xCC, 0xCC },
+        { 0x48, 0x83, 0xEC, 0x28, 0xE8, 0x10, 0x20, 0x00, 0x00, 0x48, 0x83, 0xC4, 0x28, 0xC3, 0xCC, 0xCC },
+        { 0x48, 0x8B, 0x05, 0x00, 0x10, 0x00, 0x00, 0x48, 0x85, 0xC0, 0x74, 0x01, 0xC3, 0x33, 0xC0, 0xC3 },
+        { 0x85, 0xC9, 0x0F, 0x85, 0x00, 0x01, 0x00, 0x00, 0x33, 0xC0, 0xC3, 0xCC, 0xCC, 0xCC, 0xCC, 0xCC },
+    };
+    const size_t count = sizeof(prologues) / sizeof(prologues[0]);
+    const uintptr_t targetAddress = 0x140001000ULL;
+
+    for (uintptr_t trampolineAddress : { targetAddress - 0x100000, (uintptr_t)0x7FF712340000ULL })
+    {
+        unsigned built = 0;
+        double ns = Bench::NsPerIteration(Bench::Iterations(2000000), [&](long long iterations) {
+            uint8_t out[64];
+            for (long long i = 0; i < iterations; i++)
+            {
+                TRAMPOLINE_BUILD tb = {};
+                tb.pSource = prologues[i % count];
+                tb.sourceSize = sizeof(prologues[0]);
+                tb.targetAddress = targetAddress;
+                tb.trampolineAddress = trampolineAddress;
+                tb.pTrampoline = out;
+                tb.trampolineSize = 64 - 24;
+                built += BuildTrampoline(&tb);
+            }
+            Bench::DoNotOptimize(out);
+        });
+        std::printf("BuildTrampoline, %s: %.1f ns/trampoline (%.1fM/s) [%u]\n",
+            trampolineAddress < targetAddress ? "near" : "far", ns, 1000.0 / ns, built);
+    }
+    return 0;
+}
@@ -0,0 +1,566 @@
+#pragma once
+
+// The part of the Win32 API that the src/ headers use, over the hook engine's POSIX backend, so that the Linux
+// tests and benchmarks can build the managers as they are. See CMakeLists.txt, only that build puts compat/ on the
+// include path.
+//
+// Memory, time, thread ids and the logger's formatting behave like on Windows. Everything the tests never reach
+// (the console, message boxes, opening and suspending threads by id, module file names) is inert and fails.
+
+#include <cerrno>
+#include <cstdarg>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <cwchar>
+#include <initializer_list>
+#include <linux/membarrier.h>
+#include <sys/time.h>
+
+#include "minhook/src/platform.h"
+
+
+//-------------------------------------------------------------------------
+// Compiler
+
+#define __declspec(X) __attribute__((X))
+#define __forceinline inline __attribute__((always_inline))
+
+#define MAX_PATH 260
+#define FIELD_OFFSET(TYPE, FIELD) ((LONG)offsetof(TYPE, FIELD))
+
+typedef int32_t         LONG;
+typedef uint16_t        WORD;
+typedef int16_t         SHORT;
+typedef uint64_t        ULONGLONG;
+typedef int64_t         LONGLONG;
+typedef DWORD*          LPDWORD;
+typedef DWORD*          PDWORD;
+typedef wchar_t         WCHAR;
+typedef char*           LPSTR;
+typedef const char*     LPCSTR;
+typedef wchar_t*        LPWSTR;
+typedef const wchar_t*  LPCWSTR;
+typedef HANDLE          HMODULE;
+typedef HANDLE          HWND;
+typedef intptr_t        LONG_PTR;
+
+#define INVALID_HANDLE_VALUE ((HANDLE)(LONG_PTR)-1)
+
+#define ERROR_SUCCESS 0L
+#define ERROR_INVALID_HANDLE 6L
+#define ERROR_NOT_SUPPORTED 50L
+
+inline DWORD GetLastError()
+{
+    return static_cast<DWORD>(errno);
+}
+
+inline BOOL CloseHandle(HANDLE)
+{
+    return TRUE;
+}
+
+
+//-------------------------------------------------------------------------
+// Memory
+
+#define PAGE_NOACCESS           0x01
+#define PAGE_READONLY           0x02
+#define PAGE_READWRITE          0x04
+#define PAGE_WRITECOPY          0x08
+#define PAGE_EXECUTE            0x10
+#define PAGE_EXECUTE_READ       0x20
+#define PAGE_EXECUTE_READWRITE  0x40
+#define PAGE_EXECUTE_WRITECOPY  0x80
+#define PAGE_GUARD              0x100
+
+#define MEM_COMMIT              0x1000
+#define MEM_RESERVE             0x2000
+#define MEM_RELEASE             0x8000
+#define MEM_FREE                0x10000
+
+typedef struct _MEMORY_BASIC_INFORMATION
+{
+    LPVOID BaseAddress;
+    LPVOID AllocationBase;
+    DWORD AllocationProtect;
+    SIZE_T RegionSize;
+    DWORD State;
+    DWORD Protect;
+    DWORD Type;
+} MEMORY_BASIC_INFORMATION, *PMEMORY_BASIC_INFORMATION;
+
+inline DWORD CompatPageProtection_(int protect)
+{
+    if (protect & PLATFORM_PROT_EXEC)
+    {
+        return (protect & PLATFORM_PROT_WRITE) ? PAGE_EXECUTE_READWRITE : (protect & PLATFORM_PROT_READ) ? PAGE_EXECUTE_READ : PAGE_EXECUTE;
+    }
+    return (protect & PLATFORM_PROT_WRITE) ? PAGE_READWRITE : (protect & PLATFORM_PROT_READ) ? PAGE_READONLY : PAGE_NOACCESS;
+}
+
+inline int CompatMmapProtection_(DWORD protect)
+{
+    switch (protect & 0xFF)
+    {
+    case PAGE_READONLY:             return PROT_READ;
+    case PAGE_READWRITE:
+    case PAGE_WRITECOPY:            return PROT_READ | PROT_WRITE;
+    case PAGE_EXECUTE:              return PROT_EXEC;
+    case PAGE_EXECUTE_READ:         return PROT_READ | PROT_EXEC;
+    case PAGE_EXECUTE_READWRITE:
+    case PAGE_EXECUTE_WRITECOPY:    return PROT_READ | PROT_WRITE | PROT_EXEC;
+    default:                        return PROT_NONE;
+    }
+}
+
+inline SIZE_T VirtualQuery(LPCVOID address, PMEMORY_BASIC_INFORMATION info, SIZE_T length)
+{
+    PLATFORM_REGION region;
+    if (length < sizeof(MEMORY_BASIC_INFORMATION) || !PlatformQueryRegion(address, &region))
+    {
+        return 0;
+    }
+
+    info->BaseAddress = reinterpret_cast<LPVOID>(region.base);
+    info->AllocationBase = reinterpret_cast<LPVOID>(region.allocationBase);
+    info->RegionSize = region.size;
+    info->State = region.state == PLATFORM_MEM_COMMITTED ? MEM_COMMIT : region.state == PLATFORM_MEM_RESERVED ? MEM_RESERVE : MEM_FREE;
+    info->Protect = info->State == MEM_COMMIT ? CompatPageProtection_(region.protect) : 0;
+    info->AllocationProtect = info->Protect;
+    info->Type = 0;
+    return sizeof(MEMORY_BASIC_INFORMATION);
+}
+
+inline BOOL VirtualProtect(LPVOID address, SIZE_T size, DWORD newProtect, PDWORD oldProtect)
+{
+    MEMORY_BASIC_INFORMATION info;
+    if (!VirtualQuery(address, &info, sizeof(info)) || info.State != MEM_COMMIT)
+    {
+        return FALSE;
+    }
+
+    long page = sysconf(_SC_PAGESIZE);
+    auto start = reinterpret_cast<uintptr_t>(address) & ~static_cast<uintptr_t>(page - 1);
+    auto end = reinterpret_cast<uintptr_t>(address) + size;
+    if (mprotect(reinterpret_cast<void*>(start), end - start, CompatMmapProtection_(newProtect)) != 0)
+    {
+        return FALSE;
+    }
+
+    *oldProtect = info.Protect;
+    return TRUE;
+}
+
+inline LPVOID VirtualAlloc(LPVOID address, SIZE_T size, DWORD, DWORD protect)
+{
+    void* memory = mmap(address, size, CompatMmapProtection_(protect), MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return memory == MAP_FAILED ? nullptr : memory;
+}
+
+inline BOOL VirtualFree(LPVOID address, SIZE_T size, DWORD)
+{
+    return munmap(address, size) == 0;
+}
+
+inline HANDLE GetCurrentProcess()
+{
+    return reinterpret_cast<HANDLE>(static_cast<intptr_t>(-1));
+}
+
+inline BOOL FlushInstructionCache(HANDLE, LPCVOID address, SIZE_T size)
+{
+    PlatformFlushCode(const_cast<LPVOID>(address), size);
+    return TRUE;
+}
+
+// A membarrier on every thread of the process, registered on first use. The mprotect fallback makes the kernel
+// interrupt every processor running the process to flush its TLB, which drains their store buffers as well.
+inline void FlushProcessWriteBuffers()
+{
+    static const bool expedited = syscall(SYS_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0, 0) == 0;
+    if (expedited && syscall(SYS_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0, 0) == 0)
+    {
+        return;
+    }
+
+    static volatile BYTE* page = static_cast<volatile BYTE*>(mmap(nullptr, 4096, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    static pthread_mutex_t mtx = PTHREAD_MUTEX_INITIALIZER;
+    pthread_mutex_lock(&mtx);
+    page[0] = 1;
+    mprotect(const_cast<BYTE*>(page), 4096, PROT_READ);
+    mprotect(const_cast<BYTE*>(page), 4096, PROT_READ | PROT_WRITE);
+    pthread_mutex_unlock(&mtx);
+}
+
+inline LPVOID InterlockedCompareExchangePointer(LPVOID volatile* destination, LPVOID exchange, LPVOID comparand)
+{
+    return __sync_val_compare_and_swap(destination, comparand, exchange);
+}
+
+
+//-------------------------------------------------------------------------
+// Processes and modules
+
+typedef struct _MODULEINFO
+{
+    LPVOID lpBaseOfDll;
+    DWORD SizeOfImage;
+    LPVOID EntryPoint;
+} MODULEINFO;
+
+inline DWORD GetCurrentProcessId()
+{
+    return static_cast<DWORD>(getpid());
+}
+
+// Only the main executable is known, by its load address.
+inline HMODULE GetModuleHandle(LPCSTR name)
+{
+    ULONG_PTR start, end;
+    if (name || !PlatformGetMainImage(&start, &end))
+    {
+        return nullptr;
+    }
+    return reinterpret_cast<HMODULE>(start);
+}
+
+inline BOOL GetModuleInformation(HANDLE, HMODULE module, MODULEINFO* info, DWORD)
+{
+    ULONG_PTR start, end;
+    if (!PlatformGetMainImage(&start, &end) || reinterpret_cast<ULONG_PTR>(module) != start)
+    {
+        return FALSE;
+    }
+
+    info->lpBaseOfDll = module;
+    info->SizeOfImage = static_cast<DWORD>(end - start);
+    info->EntryPoint = nullptr;
+    return TRUE;
+}
+
+inline DWORD GetModuleFileNameW(HMODULE, LPWSTR, DWORD)
+{
+    errno = ERROR_NOT_SUPPORTED;
+    return 0;
+}
+
+
+//-------------------------------------------------------------------------
+// Threads
+
+#define THREAD_TERMINATE                0x0001
+#define THREAD_SUSPEND_RESUME           0x0002
+#define THREAD_GET_CONTEXT              0x0008
+#define THREAD_SET_CONTEXT              0x0010
+#define THREAD_QUERY_INFORMATION        0x0040
+#define THREAD_QUERY_LIMITED_INFORMATION 0x0800
+#define STILL_ACTIVE                    259
+
+#define CONTEXT_CONTROL                 0x00100001
+#define CONTEXT_INTEGER                 0x00100002
+#define CONTEXT_FULL                    0x0010000B
+
+typedef struct _CONTEXT
+{
+    DWORD ContextFlags;
+    ULONGLONG Rax, Rcx, Rdx, Rbx, Rsp, Rbp, Rsi, Rdi;
+    ULONGLONG R8, R9, R10, R11, R12, R13, R14, R15;
+    ULONGLONG Rip;
+} CONTEXT, *PCONTEXT;
+
+inline DWORD GetCurrentThreadId()
+{
+    return static_cast<DWORD>(syscall(SYS_gettid));
+}
+
+inline void Sleep(DWORD milliseconds)
+{
+    struct timespec duration = { static_cast<time_t>(milliseconds / 1000), static_cast<long>(milliseconds % 1000) * 1000000L };
+    while (nanosleep(&duration, &duration) != 0 && errno == EINTR)
+    {
+    }
+}
+
+// The hook engine freezes threads on its own; the src/ helpers that open threads by id never get a handle here.
+inline HANDLE OpenThread(DWORD, BOOL, DWORD)
+{
+    errno = ERROR_NOT_SUPPORTED;
+    return nullptr;
+}
+
+inline DWORD SuspendThread(HANDLE)
+{
+    return static_cast<DWORD>(-1);
+}
+
+inline DWORD ResumeThread(HANDLE)
+{
+    return static_cast<DWORD>(-1);
+}
+
+inline BOOL GetThreadContext(HANDLE, PCONTEXT)
+{
+    return FALSE;
+}
+
+inline BOOL GetExitCodeThread(HANDLE, LPDWORD)
+{
+    return FALSE;
+}
+
+
+//-------------------------------------------------------------------------
+// Time
+
+typedef union _LARGE_INTEGER
+{
+    struct
+    {
+        DWORD LowPart;
+        LONG HighPart;
+    };
+    LONGLONG QuadPart;
+} LARGE_INTEGER;
+
+typedef struct _SYSTEMTIME
+{
+    WORD wYear;
+    WORD wMonth;
+    WORD wDayOfWeek;
+    WORD wDay;
+    WORD wHour;
+    WORD wMinute;
+    WORD wSecond;
+    WORD wMilliseconds;
+} SYSTEMTIME;
+
+typedef struct _FILETIME
+{
+    DWORD dwLowDateTime;
+    DWORD dwHighDateTime;
+} FILETIME;
+
+inline BOOL QueryPerformanceFrequency(LARGE_INTEGER* frequency)
+{
+    frequency->QuadPart = 1000000000LL;
+    return TRUE;
+}
+
+inline BOOL QueryPerformanceCounter(LARGE_INTEGER* counter)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    counter->QuadPart = static_cast<LONGLONG>(now.tv_sec) * 1000000000LL + now.tv_nsec;
+    return TRUE;
+}
+
+inline void GetLocalTime(SYSTEMTIME* time)
+{
+    struct timeval now;
+    struct tm local;
+    gettimeofday(&now, nullptr);
+    localtime_r(&now.tv_sec, &local);
+
+    time->wYear = static_cast<WORD>(local.tm_year + 1900);
+    time->wMonth = static_cast<WORD>(local.tm_mon + 1);
+    time->wDayOfWeek = static_cast<WORD>(local.tm_wday);
+    time->wDay = static_cast<WORD>(local.tm_mday);
+    time->wHour = static_cast<WORD>(local.tm_hour);
+    time->wMinute = static_cast<WORD>(local.tm_min);
+    time->wSecond = static_cast<WORD>(local.tm_sec);
+    time->wMilliseconds = static_cast<WORD>(now.tv_usec / 1000);
+}
+
+
+//-------------------------------------------------------------------------
+// Files
+
+#define MOVEFILE_REPLACE_EXISTING 0x1
+
+typedef enum _GET_FILEEX_INFO_LEVELS
+{
+    GetFileExInfoStandard,
+} GET_FILEEX_INFO_LEVELS;
+
+typedef struct _WIN32_FILE_ATTRIBUTE_DATA
+{
+    DWORD dwFileAttributes;
+    FILETIME ftCreationTime;
+    FILETIME ftLastAccessTime;
+    FILETIME ftLastWriteTime;
+    DWORD nFileSizeHigh;
+    DWORD nFileSizeLow;
+} WIN32_FILE_ATTRIBUTE_DATA;
+
+inline BOOL GetFileAttributesExW(LPCWSTR, GET_FILEEX_INFO_LEVELS, LPVOID)
+{
+    errno = ERROR_NOT_SUPPORTED;
+    return FALSE;
+}
+
+inline BOOL MoveFileExA(LPCSTR from, LPCSTR to, DWORD)
+{
+    return std::rename(from, to) == 0;
+}
+
+inline int freopen_s(FILE** stream, const char* name, const char* mode, FILE* old)
+{
+    FILE* reopened = std::freopen(name, mode, old);
+    if (stream)
+    {
+        *stream = reopened;
+    }
+    return reopened ? 0 : errno;
+}
+
+
+//-------------------------------------------------------------------------
+// Formatting: Microsoft's wide printf takes %s as a wide string and %S as a narrow one, glibc's the other way around.
+// Pointers are passed on as 64-bit integers, which they are on x64.
+
+inline void CompatTranslateFormat_(const wchar_t* format, wchar_t* out, size_t capacity)
+{
+    size_t used = 0;
+    auto put = [&](wchar_t c) { if (used + 1 < capacity) out[used++] = c; };
+
+    while (*format)
+    {
+        if (*format != L'%')
+        {
+            put(*format++);
+            continue;
+        }
+
+        put(*format++);
+        bool sized = false;
+        while (*format && std::wcschr(L"-+ #0123456789.*hlLzjtI", *format))
+        {
+            sized |= *format == L'h' || *format == L'l' || *format == L'w';
+            put(*format++);
+        }
+
+        if (*format == L's' && !sized)
+        {
+            put(L'l');
+            put(L's');
+            format++;
+        }
+        else if (*format == L'S' && !sized)
+        {
+            put(L's');
+            format++;
+        }
+        else if (*format == L'p')
+        {
+            // Microsoft's is all 16 digits without a 0x, the logs put their own in front.
+            for (wchar_t c : { L'0', L'1', L'6', L'l', L'l', L'X' })
+            {
+                put(c);
+            }
+            format++;
+        }
+        else if (*format)
+        {
+            put(*format++);
+        }
+    }
+    out[used] = L'\0';
+}
+
+inline int _vsnwprintf(wchar_t* buffer, size_t count, const wchar_t* format, va_list args)
+{
+    wchar_t translated[1024];
+    CompatTranslateFormat_(format, translated, sizeof(translated) / sizeof(translated[0]));
+    return std::vswprintf(buffer, count, translated, args);
+}
+
+inline int wsprintf(wchar_t* buffer, const wchar_t* format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    int written = _vsnwprintf(buffer, 1024, format, args);
+    va_end(args);
+    return written;
+}
+
+inline int CompatFwprintf_(FILE* stream, const wchar_t* format, ...)
+{
+    wchar_t translated[1024];
+    CompatTranslateFormat_(format, translated, sizeof(translated) / sizeof(translated[0]));
+
+    va_list args;
+    va_start(args, format);
+    int written = std::vfwprintf(stream, translated, args);
+    va_end(args);
+    return written;
+}
+
+#define fwprintf(...) CompatFwprintf_(__VA_ARGS__)
+
+
+//-------------------------------------------------------------------------
+// Console and message boxes, there is no window to show them in.
+
+#define STD_OUTPUT_HANDLE ((DWORD)-11)
+#define MB_OK           0x00000000L
+#define MB_ICONERROR    0x00000010L
+#define MB_TOPMOST      0x00040000L
+#define IDOK            1
+
+typedef struct _COORD
+{
+    SHORT X;
+    SHORT Y;
+} COORD;
+
+typedef struct _SMALL_RECT
+{
+    SHORT Left;
+    SHORT Top;
+    SHORT Right;
+    SHORT Bottom;
+} SMALL_RECT;
+
+typedef struct _CONSOLE_SCREEN_BUFFER_INFO
+{
+    COORD dwSize;
+    COORD dwCursorPosition;
+    WORD wAttributes;
+    SMALL_RECT srWindow;
+    COORD dwMaximumWindowSize;
+} CONSOLE_SCREEN_BUFFER_INFO;
+
+inline BOOL AllocConsole()
+{
+    return TRUE;
+}
+
+inline BOOL FreeConsole()
+{
+    return TRUE;
+}
+
+inline HANDLE GetStdHandle(DWORD)
+{
+    return nullptr;
+}
+
+inline BOOL GetConsoleScreenBufferInfo(HANDLE, CONSOLE_SCREEN_BUFFER_INFO* info)
+{
+    std::memset(info, 0, sizeof(*info));
+    return FALSE;
+}
+
+inline BOOL SetConsoleScreenBufferSize(HANDLE, COORD)
+{
+    return FALSE;
+}
+
+inline int MessageBoxW(HWND, LPCWSTR text, LPCWSTR caption, UINT)
+{
+    std::fprintf(stderr, "%ls: %ls\n", caption, text);
+    return IDOK;
+}
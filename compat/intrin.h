@@ -0,0 +1,25 @@
+#pragma once
+
+// The MSVC intrinsics used by the src/ headers, over GCC's builtins.
+
+#include <x86intrin.h>
+
+inline unsigned char _BitScanForward(unsigned long* index, unsigned long mask)
+{
+    if (!mask)
+    {
+        return 0;
+    }
+    *index = static_cast<unsigned long>(__builtin_ctzl(mask));
+    return 1;
+}
+
+inline unsigned char _BitScanReverse64(unsigned long* index, unsigned long long mask)
+{
+    if (!mask)
+    {
+        return 0;
+    }
+    *index = static_cast<unsigned long>(63 - __builtin_clzll(mask));
+    return 1;
+}
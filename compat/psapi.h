@@ -0,0 +1,4 @@
+#pragma once
+
+// MODULEINFO and GetModuleInformation are in Windows.h.
+#include "Windows.h"
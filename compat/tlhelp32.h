@@ -0,0 +1,34 @@
+#pragma once
+
+#include "Windows.h"
+
+// Thread snapshots, which always fail: see OpenThread in Windows.h.
+
+#define TH32CS_SNAPTHREAD 0x00000004
+
+typedef struct tagTHREADENTRY32
+{
+    DWORD dwSize;
+    DWORD cntUsage;
+    DWORD th32ThreadID;
+    DWORD th32OwnerProcessID;
+    LONG tpBasePri;
+    LONG tpDeltaPri;
+    DWORD dwFlags;
+} THREADENTRY32;
+
+inline HANDLE CreateToolhelp32Snapshot(DWORD, DWORD)
+{
+    errno = ERROR_NOT_SUPPORTED;
+    return INVALID_HANDLE_VALUE;
+}
+
+inline BOOL Thread32First(HANDLE, THREADENTRY32*)
+{
+    return FALSE;
+}
+
+inline BOOL Thread32Next(HANDLE, THREADENTRY32*)
+{
+    return FALSE;
+}
@@ -0,0 +1,4 @@
+#pragma once
+
+// Lower-case spelling used by some of the src/ headers.
+#include "Windows.h"
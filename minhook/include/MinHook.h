@@ -32,9 +32,9 @@
     #error MinHook supports only x86 and x64 systems.
 #endif
 
-#include <windows.h>
-#include <tlhelp32.h>
 #include <limits.h>
+#include <stdlib.h>
+#include "../src/platform.h"
 #include "../src/buffer.h"
 #include "../src/trampoline.h"
 
@@ -97,22 +97,54 @@ MH_STATUS;
 // Initial capacity of the HOOK_ENTRY buffer.
 #define INITIAL_HOOK_CAPACITY   32
 
+// Initial capacity of the hook indices, must be a power of 2.
+#define INITIAL_INDEX_CAPACITY  64
+
 // Initial capacity of the thread IDs buffer.
 #define INITIAL_THREAD_CAPACITY 128
 
+// Minimum time the buffer of a removed hook stays retired before it may be reused, in ms.
+// Only applies to hooks created without ppOriginal, see RetireBuffer().
+#ifndef RETIRED_BUFFER_GRACE_MS
+#define RETIRED_BUFFER_GRACE_MS 500
+#endif
+
+// Lowest stack address of the application's frames, taken at a public entry point: it covers the return
+// address of the function calling it, and none of the locals MinHook keeps below, such as the buffer it checks.
+#if defined(_MSC_VER)
+#define MH_CALLER_STACK() ((DWORD_PTR)_AddressOfReturnAddress())
+#else
+#define MH_CALLER_STACK() ((DWORD_PTR)__builtin_frame_address(0))
+#endif
+
 // Special hook position values.
 #define INVALID_HOOK_POS UINT_MAX
 
-// Thread access rights for suspending/resuming threads.
-#define THREAD_ACCESS \
-    (THREAD_SUSPEND_RESUME | THREAD_GET_CONTEXT | THREAD_QUERY_INFORMATION | THREAD_SET_CONTEXT)
+// Lists the threads Freeze() suspends, instead of enumerating them every time, see MH_SetThreadSource().
+typedef struct _MH_THREAD_SOURCE
+{
+    // Copies the handles of every thread but the calling one into pThreads and returns their count.
+    // When they don't fit in capacity, returns the count without copying anything. Otherwise the
+    // handles stay owned by the source, and must stay open until Release() is called.
+    UINT(WINAPI* Acquire)(PLATFORM_THREAD* pThreads, UINT capacity, LPVOID pContext);
+    VOID(WINAPI* Release)(LPVOID pContext);
+    LPVOID pContext;
+} MH_THREAD_SOURCE;
+
+// Identifies one hook, see MH_ApplyQueuedEx().
+typedef struct _MH_HOOK_KEY
+{
+    ULONG_PTR hookIdent;
+    LPVOID    pTarget;
+} MH_HOOK_KEY;
 
 // Suspended threads for Freeze()/Unfreeze().
 typedef struct _FROZEN_THREADS
 {
-    LPHANDLE pItems;         // Data heap
+    PLATFORM_THREAD* pItems; // Data heap
     UINT     capacity;       // Size of allocated data heap, items
     UINT     size;           // Actual number of data items
+    BOOL     borrowed;       // Handles belong to g_threadSource, not to us.
 } FROZEN_THREADS, * PFROZEN_THREADS;
 
 // Function and function pointer declarations.
@@ -143,22 +175,45 @@ typedef struct _HOOK_ENTRY
     UINT8  patchAbove : 1;     // Uses the hot patch area.
     UINT8  isEnabled : 1;     // Enabled.
     UINT8  queueEnable : 1;     // Queued for enabling/disabling when != isEnabled.
+    UINT8  wasEnabled : 1;      // Has been enabled at least once, so threads may still run its buffer.
+    UINT8  sharedOriginal : 1;  // Its trampoline was handed out through ppOriginal, so a detour may call it at any time.
 
     UINT   nIP : 4;             // Count of the instruction boundaries.
     UINT8  oldIPs[8];           // Instruction boundaries of the target function.
     UINT8  newIPs[8];           // Instruction boundaries of the trampoline function.
+
+    UINT   prevOnTarget;        // Position of the previous hook on the same target (circular).
+    UINT   nextOnTarget;        // Position of the next hook on the same target (circular).
 } HOOK_ENTRY, * PHOOK_ENTRY;
 
+// Open-addressing hash table of positions in g_hooks, see HookIndex*().
+typedef struct _HOOK_INDEX
+{
+    UINT*  pSlots;      // Data heap, INVALID_HOOK_POS if empty
+    UINT   capacity;    // Size of allocated data heap, items (always a power of 2)
+    UINT   size;        // Actual number of data items
+} HOOK_INDEX, * PHOOK_INDEX;
+
+// Executable buffer of a removed hook, waiting until no thread can be running it.
+typedef struct _RETIRED_BUFFER
+{
+    LPVOID pBuffer;
+    DWORD  retiredAt;   // PlatformTickCount() when the hook was removed.
+} RETIRED_BUFFER, * PRETIRED_BUFFER;
+
 
 //-------------------------------------------------------------------------
 // Global Variables:
 //-------------------------------------------------------------------------
 
 // Mutex. If not NULL, this library is initialized.
-HANDLE g_hMutex = NULL;
+PLATFORM_MUTEX g_hMutex = NULL;
 
 // Private heap handle.
-HANDLE g_hHeap;
+PLATFORM_HEAP g_hHeap;
+
+// Where Freeze() gets its threads from, enumerates them itself if Acquire is NULL.
+MH_THREAD_SOURCE g_threadSource;
 
 // Hook entries.
 struct
@@ -168,41 +223,177 @@ struct
     UINT        size;       // Actual number of data items
 } g_hooks;
 
+// (hookIdent, pTarget) -> position of the hook.
+HOOK_INDEX g_hookIndex;
+
+// pTarget -> position of the first hook on that target, the rest are linked through nextOnTarget.
+HOOK_INDEX g_targetIndex;
+
+// Buffers of removed hooks, see RetireBuffer().
+struct
+{
+    PRETIRED_BUFFER pItems;     // Data heap
+    UINT            capacity;   // Size of allocated data heap, items
+    UINT            size;       // Actual number of data items
+} g_retired;
+
+// Number of buffers of removed hooks that are kept until MH_Uninitialize, see RetireBuffer().
+UINT g_pinnedBuffers;
+
 
 // Can be passed as a parameter to MH_EnableHook, MH_DisableHook,
 // MH_QueueEnableHook or MH_QueueDisableHook.
 #define MH_ALL_HOOKS NULL
 
 //-------------------------------------------------------------------------
-// Returns INVALID_HOOK_POS if not found.
-static UINT FindHookEntry(ULONG_PTR hookIdent, LPVOID pTarget)
+static UINT HashHookKey(ULONG_PTR hookIdent, LPVOID pTarget)
 {
-    UINT i;
-    for (i = 0; i < g_hooks.size; ++i)
+    // Fibonacci hashing of both halves of the key, good enough for pointers and small idents.
+    UINT64 h = ((UINT64)(ULONG_PTR)pTarget ^ ((UINT64)hookIdent * 0x9E3779B97F4A7C15ull)) * 0x9E3779B97F4A7C15ull;
+    return (UINT)(h >> 32);
+}
+
+//-------------------------------------------------------------------------
+// The target index only hashes the target, the hook index hashes both parts.
+static UINT HookIndexHash(PHOOK_INDEX pIndex, ULONG_PTR hookIdent, LPVOID pTarget)
+{
+    return HashHookKey(pIndex == &g_targetIndex ? 0 : hookIdent, pTarget) & (pIndex->capacity - 1);
+}
+
+//-------------------------------------------------------------------------
+static BOOL HookIndexMatches(PHOOK_INDEX pIndex, UINT pos, ULONG_PTR hookIdent, LPVOID pTarget)
+{
+    PHOOK_ENTRY pHook = &g_hooks.pItems[pos];
+    return pHook->pTarget == pTarget && (pIndex == &g_targetIndex || pHook->hookIdent == hookIdent);
+}
+
+//-------------------------------------------------------------------------
+// Returns the slot holding the key, or INVALID_HOOK_POS if not found.
+static UINT HookIndexFindSlot(PHOOK_INDEX pIndex, ULONG_PTR hookIdent, LPVOID pTarget)
+{
+    UINT mask, i;
+
+    if (pIndex->size == 0)
+        return INVALID_HOOK_POS;
+
+    mask = pIndex->capacity - 1;
+    for (i = HookIndexHash(pIndex, hookIdent, pTarget); pIndex->pSlots[i] != INVALID_HOOK_POS; i = (i + 1) & mask)
     {
-        PHOOK_ENTRY pHook = &g_hooks.pItems[i];
-        if ((ULONG_PTR)hookIdent == (ULONG_PTR)pHook->hookIdent && (ULONG_PTR)pTarget == (ULONG_PTR)pHook->pTarget)
+        if (HookIndexMatches(pIndex, pIndex->pSlots[i], hookIdent, pTarget))
             return i;
     }
 
     return INVALID_HOOK_POS;
 }
 
+//-------------------------------------------------------------------------
+// The hook at pos must already be filled in, and its key must not be in the index yet.
+static BOOL HookIndexInsert(PHOOK_INDEX pIndex, UINT pos)
+{
+    PHOOK_ENTRY pHook;
+    UINT mask, i;
+
+    // Keep the load factor at 1/2 at most.
+    if ((pIndex->size + 1) * 2 > pIndex->capacity)
+    {
+        UINT newCapacity = pIndex->capacity ? pIndex->capacity * 2 : INITIAL_INDEX_CAPACITY;
+        UINT* pNewSlots = (UINT*)PlatformAlloc(g_hHeap, newCapacity * sizeof(UINT));
+        UINT* pOldSlots = pIndex->pSlots;
+        UINT oldCapacity = pIndex->capacity;
+        if (pNewSlots == NULL)
+            return FALSE;
+
+        for (i = 0; i < newCapacity; ++i)
+            pNewSlots[i] = INVALID_HOOK_POS;
+
+        pIndex->pSlots = pNewSlots;
+        pIndex->capacity = newCapacity;
+        mask = newCapacity - 1;
+
+        for (i = 0; i < oldCapacity; ++i)
+        {
+            UINT oldPos = pOldSlots[i], j;
+            if (oldPos == INVALID_HOOK_POS)
+                continue;
+
+            pHook = &g_hooks.pItems[oldPos];
+            for (j = HookIndexHash(pIndex, pHook->hookIdent, pHook->pTarget); pNewSlots[j] != INVALID_HOOK_POS; j = (j + 1) & mask);
+            pNewSlots[j] = oldPos;
+        }
+
+        if (pOldSlots != NULL)
+            PlatformFree(g_hHeap, pOldSlots);
+    }
+
+    pHook = &g_hooks.pItems[pos];
+    mask = pIndex->capacity - 1;
+    for (i = HookIndexHash(pIndex, pHook->hookIdent, pHook->pTarget); pIndex->pSlots[i] != INVALID_HOOK_POS; i = (i + 1) & mask);
+    pIndex->pSlots[i] = pos;
+    pIndex->size++;
+
+    return TRUE;
+}
+
+//-------------------------------------------------------------------------
+// Linear probing deletion without tombstones: shift back every following entry
+// whose home slot is not between the hole and its current slot.
+static VOID HookIndexRemoveSlot(PHOOK_INDEX pIndex, UINT slot)
+{
+    UINT mask = pIndex->capacity - 1;
+    UINT hole = slot, i = slot;
+
+    for (;;)
+    {
+        PHOOK_ENTRY pHook;
+        UINT home;
+
+        i = (i + 1) & mask;
+        if (pIndex->pSlots[i] == INVALID_HOOK_POS)
+            break;
+
+        pHook = &g_hooks.pItems[pIndex->pSlots[i]];
+        home = HookIndexHash(pIndex, pHook->hookIdent, pHook->pTarget);
+        if (hole <= i ? (hole < home && home <= i) : (hole < home || home <= i))
+            continue;
+
+        pIndex->pSlots[hole] = pIndex->pSlots[i];
+        hole = i;
+    }
+
+    pIndex->pSlots[hole] = INVALID_HOOK_POS;
+    pIndex->size--;
+}
+
+//-------------------------------------------------------------------------
+// Returns INVALID_HOOK_POS if not found.
+static UINT FindHookEntry(ULONG_PTR hookIdent, LPVOID pTarget)
+{
+    UINT slot = HookIndexFindSlot(&g_hookIndex, hookIdent, pTarget);
+    return slot != INVALID_HOOK_POS ? g_hookIndex.pSlots[slot] : INVALID_HOOK_POS;
+}
+
+//-------------------------------------------------------------------------
+// Returns the position of the first hook on the target, or INVALID_HOOK_POS if there are none.
+// The others are reached through nextOnTarget, which wraps around to the first one.
+static UINT FindFirstHookOnTarget(LPVOID pTarget)
+{
+    UINT slot = HookIndexFindSlot(&g_targetIndex, 0, pTarget);
+    return slot != INVALID_HOOK_POS ? g_targetIndex.pSlots[slot] : INVALID_HOOK_POS;
+}
+
 //-------------------------------------------------------------------------
 static PHOOK_ENTRY AddHookEntry()
 {
     if (g_hooks.pItems == NULL)
     {
         g_hooks.capacity = INITIAL_HOOK_CAPACITY;
-        g_hooks.pItems = (PHOOK_ENTRY)HeapAlloc(
-            g_hHeap, 0, g_hooks.capacity * sizeof(HOOK_ENTRY));
+        g_hooks.pItems = (PHOOK_ENTRY)PlatformAlloc(g_hHeap, g_hooks.capacity * sizeof(HOOK_ENTRY));
         if (g_hooks.pItems == NULL)
             return NULL;
     }
     else if (g_hooks.size >= g_hooks.capacity)
     {
-        PHOOK_ENTRY p = (PHOOK_ENTRY)HeapReAlloc(
-            g_hHeap, 0, g_hooks.pItems, (g_hooks.capacity * 2) * sizeof(HOOK_ENTRY));
+        PHOOK_ENTRY p = (PHOOK_ENTRY)PlatformReAlloc(g_hHeap, g_hooks.pItems, (g_hooks.capacity * 2) * sizeof(HOOK_ENTRY));
         if (p == NULL)
             return NULL;
 
@@ -213,18 +404,98 @@ static PHOOK_ENTRY AddHookEntry()
     return &g_hooks.pItems[g_hooks.size++];
 }
 
+//-------------------------------------------------------------------------
+// Adds the hook at pos, already filled in by the caller, to both indices.
+// On failure the hook is dropped again, so it must be the last one.
+static BOOL IndexHookEntry(UINT pos)
+{
+    PHOOK_ENTRY pHook = &g_hooks.pItems[pos];
+    UINT first = FindFirstHookOnTarget(pHook->pTarget);
+
+    if (!HookIndexInsert(&g_hookIndex, pos))
+    {
+        g_hooks.size--;
+        return FALSE;
+    }
+
+    if (first == INVALID_HOOK_POS)
+    {
+        if (!HookIndexInsert(&g_targetIndex, pos))
+        {
+            HookIndexRemoveSlot(&g_hookIndex, HookIndexFindSlot(&g_hookIndex, pHook->hookIdent, pHook->pTarget));
+            g_hooks.size--;
+            return FALSE;
+        }
+
+        pHook->prevOnTarget = pos;
+        pHook->nextOnTarget = pos;
+    }
+    else
+    {
+        // Append at the end of the circular list, i.e. right before the first hook.
+        UINT last = g_hooks.pItems[first].prevOnTarget;
+        pHook->prevOnTarget = last;
+        pHook->nextOnTarget = first;
+        g_hooks.pItems[last].nextOnTarget = pos;
+        g_hooks.pItems[first].prevOnTarget = pos;
+    }
+
+    return TRUE;
+}
+
 //-------------------------------------------------------------------------
 static void DeleteHookEntry(UINT pos)
 {
-    if (pos < g_hooks.size - 1)
-        g_hooks.pItems[pos] = g_hooks.pItems[g_hooks.size - 1];
+    PHOOK_ENTRY pHook = &g_hooks.pItems[pos];
+    UINT last = g_hooks.size - 1;
+    UINT slot;
+
+    // Drop the hook from both indices.
+    HookIndexRemoveSlot(&g_hookIndex, HookIndexFindSlot(&g_hookIndex, pHook->hookIdent, pHook->pTarget));
+
+    slot = HookIndexFindSlot(&g_targetIndex, 0, pHook->pTarget);
+    if (pHook->nextOnTarget == pos)
+    {
+        HookIndexRemoveSlot(&g_targetIndex, slot);
+    }
+    else
+    {
+        g_hooks.pItems[pHook->prevOnTarget].nextOnTarget = pHook->nextOnTarget;
+        g_hooks.pItems[pHook->nextOnTarget].prevOnTarget = pHook->prevOnTarget;
+        if (g_targetIndex.pSlots[slot] == pos)
+            g_targetIndex.pSlots[slot] = pHook->nextOnTarget;
+    }
+
+    if (pos < last)
+    {
+        // The last hook is about to move into pos, so point everything that refers to it there.
+        PHOOK_ENTRY pLast = &g_hooks.pItems[last];
+
+        g_hookIndex.pSlots[HookIndexFindSlot(&g_hookIndex, pLast->hookIdent, pLast->pTarget)] = pos;
+
+        slot = HookIndexFindSlot(&g_targetIndex, 0, pLast->pTarget);
+        if (g_targetIndex.pSlots[slot] == last)
+            g_targetIndex.pSlots[slot] = pos;
+
+        if (pLast->nextOnTarget == last)
+        {
+            pLast->prevOnTarget = pos;
+            pLast->nextOnTarget = pos;
+        }
+        else
+        {
+            g_hooks.pItems[pLast->prevOnTarget].nextOnTarget = pos;
+            g_hooks.pItems[pLast->nextOnTarget].prevOnTarget = pos;
+        }
+
+        g_hooks.pItems[pos] = *pLast;
+    }
 
     g_hooks.size--;
 
     if (g_hooks.capacity / 2 >= INITIAL_HOOK_CAPACITY && g_hooks.capacity / 2 >= g_hooks.size)
     {
-        PHOOK_ENTRY p = (PHOOK_ENTRY)HeapReAlloc(
-            g_hHeap, 0, g_hooks.pItems, (g_hooks.capacity / 2) * sizeof(HOOK_ENTRY));
+        PHOOK_ENTRY p = (PHOOK_ENTRY)PlatformReAlloc(g_hHeap, g_hooks.pItems, (g_hooks.capacity / 2) * sizeof(HOOK_ENTRY));
         if (p == NULL)
             return;
 
@@ -268,99 +539,103 @@ static DWORD_PTR FindNewIP(PHOOK_ENTRY pHook, DWORD_PTR ip)
 }
 
 //-------------------------------------------------------------------------
-static void ProcessThreadIPs(HANDLE hThread, UINT pos, BOOL enable)
+static void ProcessThreadIPs(PLATFORM_THREAD hThread, UINT pos, BOOL enable)
 {
     // If the thread suspended in the overwritten area,
     // move IP to the proper address.
 
-    CONTEXT     c;
-#if defined(_M_X64) || defined(__x86_64__)
-    DWORD64* pIP = &c.Rip;
-#else
-    DWORD* pIP = &c.Eip;
-#endif
     PHOOK_ENTRY pHook = &g_hooks.pItems[pos];
-    DWORD_PTR   ip;
+    DWORD_PTR   ip, sp;
 
-    c.ContextFlags = CONTEXT_CONTROL;
-    if (!GetThreadContext(hThread, &c))
+    if (!PlatformGetThreadRegisters(hThread, &ip, &sp))
         return;
 
     if (enable)
-        ip = FindNewIP(pHook, *pIP);
+        ip = FindNewIP(pHook, ip);
     else
-        ip = FindOldIP(pHook, *pIP);
+        ip = FindOldIP(pHook, ip);
 
     if (ip != 0)
+        PlatformSetThreadIP(hThread, ip);
+}
+
+//-------------------------------------------------------------------------
+// Called for each thread by PlatformEnumerateOtherThreads().
+static BOOL AddFrozenThread(PLATFORM_THREAD hThread, LPVOID pContext)
+{
+    PFROZEN_THREADS pThreads = (PFROZEN_THREADS)pContext;
+
+    if (pThreads->size >= pThreads->capacity)
     {
-        *pIP = ip;
-        SetThreadContext(hThread, &c);
+        PLATFORM_THREAD* p = (PLATFORM_THREAD*)PlatformReAlloc(
+            g_hHeap, pThreads->pItems, (pThreads->capacity * 2) * sizeof(PLATFORM_THREAD));
+        if (p == NULL)
+        {
+            UINT i;
+
+            PlatformCloseThread(hThread);
+            for (i = 0; i < pThreads->size; ++i)
+            {
+                PlatformCloseThread(pThreads->pItems[i]);
+            }
+
+            PlatformFree(g_hHeap, pThreads->pItems);
+            pThreads->pItems = NULL;
+            return FALSE;
+        }
+
+        pThreads->capacity *= 2;
+        pThreads->pItems = p;
     }
+
+    pThreads->pItems[pThreads->size++] = hThread;
+    return TRUE;
 }
 
 //-------------------------------------------------------------------------
-static VOID EnumerateThreads(PFROZEN_THREADS pThreads)
+// Borrows the handles of g_threadSource, growing the array until they fit.
+static VOID AcquireSourceThreads(PFROZEN_THREADS pThreads)
 {
-    HANDLE hSnapshot = CreateToolhelp32Snapshot(TH32CS_SNAPTHREAD, 0);
-    if (hSnapshot != INVALID_HANDLE_VALUE)
+    for (;;)
     {
-        DWORD ti = GetCurrentThreadId(), pi = GetCurrentProcessId();
-        THREADENTRY32 te;
-        te.dwSize = sizeof(THREADENTRY32);
-        if (Thread32First(hSnapshot, &te))
+        UINT count = g_threadSource.Acquire(pThreads->pItems, pThreads->capacity, g_threadSource.pContext);
+        PLATFORM_THREAD* p;
+
+        if (count <= pThreads->capacity)
         {
-            do
-            {
-                if (te.dwSize >= (FIELD_OFFSET(THREADENTRY32, th32OwnerProcessID) + sizeof(DWORD))
-                    && te.th32OwnerProcessID == pi
-                    && te.th32ThreadID != ti)
-                {
-                    HANDLE hThread = OpenThread(THREAD_ACCESS, FALSE, te.th32ThreadID);
-                    if (hThread != NULL)
-                    {
-                        if (pThreads->pItems == NULL)
-                        {
-                            pThreads->capacity = INITIAL_THREAD_CAPACITY;
-                            pThreads->pItems = (LPHANDLE)HeapAlloc(g_hHeap, 0, pThreads->capacity * sizeof(HANDLE));
-                            if (pThreads->pItems == NULL)
-                            {
-                                CloseHandle(hThread);
-                                break;
-                            }
-                        }
-                        else if (pThreads->size >= pThreads->capacity)
-                        {
-                            LPHANDLE p = (LPHANDLE)HeapReAlloc(
-                                g_hHeap, 0, pThreads->pItems, (pThreads->capacity * 2) * sizeof(HANDLE));
-                            if (p == NULL)
-                            {
-                                CloseHandle(hThread);
-
-                                UINT i;
-                                for (i = 0; i < pThreads->size; ++i)
-                                {
-                                    CloseHandle(pThreads->pItems[i]);
-                                }
-
-                                HeapFree(g_hHeap, 0, pThreads->pItems);
-                                pThreads->pItems = NULL;
-                                break;
-                            }
-
-                            pThreads->capacity *= 2;
-                            pThreads->pItems = p;
-                        }
-                        pThreads->pItems[pThreads->size++] = hThread;
-                    }
-                }
+            pThreads->size = count;
+            pThreads->borrowed = TRUE;
+            return;
+        }
 
-                te.dwSize = sizeof(THREADENTRY32);
-            } while (Thread32Next(hSnapshot, &te));
+        p = (PLATFORM_THREAD*)PlatformReAlloc(g_hHeap, pThreads->pItems, count * sizeof(PLATFORM_THREAD));
+        if (p == NULL)
+        {
+            PlatformFree(g_hHeap, pThreads->pItems);
+            pThreads->pItems = NULL;
+            return;
         }
-        CloseHandle(hSnapshot);
+
+        pThreads->capacity = count;
+        pThreads->pItems = p;
     }
 }
 
+//-------------------------------------------------------------------------
+static VOID EnumerateThreads(PFROZEN_THREADS pThreads)
+{
+    // Allocated up front, the calling thread may be the only one.
+    pThreads->capacity = INITIAL_THREAD_CAPACITY;
+    pThreads->pItems = (PLATFORM_THREAD*)PlatformAlloc(g_hHeap, pThreads->capacity * sizeof(PLATFORM_THREAD));
+    if (pThreads->pItems == NULL)
+        return;
+
+    if (g_threadSource.Acquire != NULL)
+        AcquireSourceThreads(pThreads);
+    else
+        PlatformEnumerateOtherThreads(AddFrozenThread, pThreads);
+}
+
 //-------------------------------------------------------------------------
 static VOID ProcessFrozenThreads(PFROZEN_THREADS pThreads, UINT pos, BOOL enable)
 {
@@ -374,12 +649,44 @@ static VOID ProcessFrozenThreads(PFROZEN_THREADS pThreads, UINT pos, BOOL enable
     }
 }
 
+//-------------------------------------------------------------------------
+// Same as calling ProcessFrozenThreads for every hook in pPositions, in order,
+// but reads each thread's registers only once.
+static VOID ProcessFrozenThreadsBatch(PFROZEN_THREADS pThreads, const UINT* pPositions, UINT count)
+{
+    UINT i, j;
+
+    if (pThreads->pItems == NULL || count == 0)
+        return;
+
+    for (i = 0; i < pThreads->size; ++i)
+    {
+        DWORD_PTR ip, oldIp, sp;
+
+        if (!PlatformGetThreadRegisters(pThreads->pItems[i], &oldIp, &sp))
+            continue;
+
+        ip = oldIp;
+        for (j = 0; j < count; ++j)
+        {
+            PHOOK_ENTRY pHook = &g_hooks.pItems[pPositions[j]];
+            DWORD_PTR newIp = pHook->isEnabled ? FindNewIP(pHook, ip) : FindOldIP(pHook, ip);
+            if (newIp != 0)
+                ip = newIp;
+        }
+
+        if (ip != oldIp)
+            PlatformSetThreadIP(pThreads->pItems[i], ip);
+    }
+}
+
 //-------------------------------------------------------------------------
 static MH_STATUS Freeze(PFROZEN_THREADS pThreads)
 {
     pThreads->pItems = NULL;
     pThreads->capacity = 0;
     pThreads->size = 0;
+    pThreads->borrowed = FALSE;
     EnumerateThreads(pThreads);
 
     MH_STATUS status = MH_OK;
@@ -389,7 +696,12 @@ static MH_STATUS Freeze(PFROZEN_THREADS pThreads)
         UINT i;
         for (i = 0; i < pThreads->size; ++i)
         {
-            SuspendThread(pThreads->pItems[i]);
+            PlatformSuspendThread(pThreads->pItems[i]);
+        }
+
+        for (i = 0; i < pThreads->size; ++i)
+        {
+            PlatformWaitSuspended(pThreads->pItems[i]);
         }
     }
     else
@@ -404,13 +716,26 @@ static MH_STATUS Freeze(PFROZEN_THREADS pThreads)
 static VOID Unfreeze(PFROZEN_THREADS pThreads)
 {
     UINT i;
+
+    // Resume every thread before closing any, closing may need a lock a frozen thread holds.
     for (i = 0; i < pThreads->size; ++i)
     {
-        ResumeThread(pThreads->pItems[i]);
-        CloseHandle(pThreads->pItems[i]);
+        PlatformResumeThread(pThreads->pItems[i]);
+    }
+
+    if (pThreads->borrowed)
+    {
+        g_threadSource.Release(g_threadSource.pContext);
+    }
+    else
+    {
+        for (i = 0; i < pThreads->size; ++i)
+        {
+            PlatformCloseThread(pThreads->pItems[i]);
+        }
     }
 
-    HeapFree(g_hHeap, 0, pThreads->pItems);
+    PlatformFree(g_hHeap, pThreads->pItems);
 }
 
 //-------------------------------------------------------------------------
@@ -452,7 +777,7 @@ static MH_STATUS CreateHookTrampoline(UINT pos)
 static MH_STATUS WINAPI EnableHookLL(UINT pos, BOOL enable, PFROZEN_THREADS pThreads)
 {
     PHOOK_ENTRY pHook = &g_hooks.pItems[pos];
-    DWORD  oldProtect;
+    PLATFORM_PROTECTION oldProtect;
     SIZE_T patchSize = sizeof(JMP_REL);
     LPBYTE pPatchTarget = (LPBYTE)pHook->pTarget;
 
@@ -483,21 +808,18 @@ static MH_STATUS WINAPI EnableHookLL(UINT pos, BOOL enable, PFROZEN_THREADS pThr
         }
     }
 
-    if (!VirtualProtect(pPatchTarget, patchSize, PAGE_EXECUTE_READWRITE, &oldProtect))
+    // Built before the code is made writable, so that nothing needs undoing if the relay is out of reach.
+    // It lives in a buffer allocated near the target, so that only happens if the allocator got it wrong.
+    UINT8 patch[TRAMPOLINE_MAX_PATCH];
+    if (enable && BuildPatch((uintptr_t)pHook->pTarget, (uintptr_t)&pHook->pExecBuffer->jmpRelay, pHook->patchAbove, patch) != patchSize)
+        return MH_ERROR_UNSUPPORTED_FUNCTION;
+
+    if (!PlatformUnprotect(pPatchTarget, patchSize, &oldProtect))
         return MH_ERROR_MEMORY_PROTECT;
 
     if (enable)
     {
-        PJMP_REL pJmp = (PJMP_REL)pPatchTarget;
-        pJmp->opcode = 0xE9;
-        pJmp->operand = (UINT32)((LPBYTE)&pHook->pExecBuffer->jmpRelay - (pPatchTarget + sizeof(JMP_REL)));
-
-        if (pHook->patchAbove)
-        {
-            PJMP_REL_SHORT pShortJmp = (PJMP_REL_SHORT)pHook->pTarget;
-            pShortJmp->opcode = 0xEB;
-            pShortJmp->operand = (UINT8)(0 - (sizeof(JMP_REL_SHORT) + sizeof(JMP_REL)));
-        }
+        memcpy(pPatchTarget, patch, patchSize);
     }
     else
     {
@@ -507,15 +829,17 @@ static MH_STATUS WINAPI EnableHookLL(UINT pos, BOOL enable, PFROZEN_THREADS pThr
             memcpy(pPatchTarget, pHook->backup, sizeof(JMP_REL));
     }
 
-    VirtualProtect(pPatchTarget, patchSize, oldProtect, &oldProtect);
+    PlatformReprotect(pPatchTarget, patchSize, &oldProtect);
 
     // Just-in-case measure.
-    FlushInstructionCache(GetCurrentProcess(), pPatchTarget, patchSize);
+    PlatformFlushCode(pPatchTarget, patchSize);
 
     ProcessFrozenThreads(pThreads, pos, enable);
 
     pHook->isEnabled = enable;
     pHook->queueEnable = enable;
+    if (enable)
+        pHook->wasEnabled = TRUE;
 
     return MH_OK;
 }
@@ -572,35 +896,262 @@ static MH_STATUS EnableAllHooksLL(BOOL enable)
 }
 
 //-------------------------------------------------------------------------
-static HANDLE CreateProcessMutex(VOID)
+static int ComparePositions(const void* pLeft, const void* pRight)
+{
+    UINT left = *(const UINT*)pLeft;
+    UINT right = *(const UINT*)pRight;
+    return left < right ? -1 : left > right ? 1 : 0;
+}
+
+//-------------------------------------------------------------------------
+// Drops the queued changes of the given hooks, or of every hook if pKeys is NULL.
+static VOID DropQueuedLL(const MH_HOOK_KEY* pKeys, UINT keyCount)
 {
-    // minhook_multihook_12345678
-    // lebinka_hkkkkkkkk_12345678
-    TCHAR szMutexName[sizeof("lebinka_hkkkkkkkk_12345678")] = TEXT("lebinka_hkkkkkkkk_");
-    UINT mutexNameLen = sizeof("lebinka_hkkkkkkkk_") - 1;
-    DWORD dw = GetCurrentProcessId();
     UINT i;
 
-    // Build szMutexName in the following format:
-    // printf("lebinka_hkkkkkkkk_%08X", GetCurrentProcessId());
+    if (pKeys == NULL)
+    {
+        for (i = 0; i < g_hooks.size; ++i)
+            g_hooks.pItems[i].queueEnable = g_hooks.pItems[i].isEnabled;
+        return;
+    }
 
-    for (i = 0; i < 8; i++)
+    for (i = 0; i < keyCount; ++i)
     {
-        TCHAR ch;
-        BYTE b = dw >> (32 - 4);
+        UINT pos = FindHookEntry(pKeys[i].hookIdent, pKeys[i].pTarget);
+        if (pos != INVALID_HOOK_POS)
+            g_hooks.pItems[pos].queueEnable = g_hooks.pItems[pos].isEnabled;
+    }
+}
 
-        if (b < 0x0A)
-            ch = b + TEXT('0');
-        else
-            ch = b - 0x0A + TEXT('A');
+//-------------------------------------------------------------------------
+// Applies the queued enable/disable of the given hooks, or of every hook if pKeys is NULL, under a single freeze.
+// All or nothing: if any hook fails, the ones already applied are reverted and their queued changes dropped.
+// Other hooks keep theirs, so that batches of different callers don't interfere.
+static MH_STATUS ApplyQueuedLL(const MH_HOOK_KEY* pKeys, UINT keyCount)
+{
+    MH_STATUS status = MH_OK;
+    FROZEN_THREADS threads, noThreads;
+    UINT i, count = 0, applied = 0;
+    UINT capacity = pKeys != NULL ? keyCount : g_hooks.size;
+    UINT* pPending;
 
-        szMutexName[mutexNameLen++] = ch;
-        dw <<= 4;
+    if (capacity == 0)
+        return MH_OK;
+
+    pPending = (UINT*)PlatformAlloc(g_hHeap, capacity * sizeof(UINT));
+    if (pPending == NULL)
+        return MH_ERROR_MEMORY_ALLOC;
+
+    for (i = 0; i < capacity; ++i)
+    {
+        UINT pos = pKeys != NULL ? FindHookEntry(pKeys[i].hookIdent, pKeys[i].pTarget) : i;
+        if (pos == INVALID_HOOK_POS)
+        {
+            status = MH_ERROR_NOT_CREATED;
+            break;
+        }
+
+        if (g_hooks.pItems[pos].isEnabled != g_hooks.pItems[pos].queueEnable)
+            pPending[count++] = pos;
+    }
+
+    // In the order the hooks were created, like for the whole queue, so that hooks stacked on the same target go on in order.
+    if (pKeys != NULL)
+        qsort(pPending, count, sizeof(UINT), ComparePositions);
+
+    if (status == MH_OK && count != 0)
+    {
+        status = Freeze(&threads);
+        if (status == MH_OK)
+        {
+            // Patch everything first, with no threads to fix up, then fix up all threads in one pass.
+            ZeroMemory(&noThreads, sizeof(noThreads));
+
+            for (i = 0; i < count; ++i)
+            {
+                PHOOK_ENTRY pHook = &g_hooks.pItems[pPending[i]];
+
+                // The same key given twice.
+                if (pHook->isEnabled == pHook->queueEnable)
+                    continue;
+
+                status = EnableHookLL(pPending[i], pHook->queueEnable, &noThreads);
+                if (status != MH_OK)
+                    break;
+
+                pPending[applied++] = pPending[i];
+            }
+
+            if (status == MH_OK)
+            {
+                ProcessFrozenThreadsBatch(&threads, pPending, applied);
+            }
+            else
+            {
+                // Revert in reverse order, so that hooks stacked on the same target unwind cleanly.
+                // No thread can have run the patched code, so there is nothing to fix up.
+                while (applied > 0)
+                {
+                    UINT pos = pPending[--applied];
+                    EnableHookLL(pos, !g_hooks.pItems[pos].isEnabled, &noThreads);
+                }
+            }
+
+            Unfreeze(&threads);
+        }
+    }
+
+    if (status != MH_OK)
+        DropQueuedLL(pKeys, keyCount);
+
+    PlatformFree(g_hHeap, pPending);
+
+    return status;
+}
+
+//-------------------------------------------------------------------------
+// Returns TRUE if the stack region starting at pStackPointer holds any value pointing into the buffer.
+static BOOL IsBufferOnStack(DWORD_PTR stackPointer, DWORD_PTR bufferStart, DWORD_PTR bufferEnd)
+{
+    PLATFORM_REGION region;
+    DWORD_PTR* pWord;
+    DWORD_PTR* pEnd;
+
+    // The committed part of a stack is a single region, ending at the stack base.
+    if (!PlatformQueryRegion((LPCVOID)stackPointer, &region)
+        || region.state != PLATFORM_MEM_COMMITTED || (region.protect & PLATFORM_PROT_GUARD)
+        || !(region.protect & PLATFORM_PROT_READ))
+        return TRUE;
+
+    pWord = (DWORD_PTR*)(stackPointer & ~(DWORD_PTR)(sizeof(DWORD_PTR) - 1));
+    pEnd = (DWORD_PTR*)(region.base + region.size);
+    for (; pWord < pEnd; ++pWord)
+    {
+        if (*pWord >= bufferStart && *pWord < bufferEnd)
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+//-------------------------------------------------------------------------
+// Conservative quiescence check: the buffer is in use if any thread is executing it, is about to jump
+// into it through a register, or has a return address (or anything else) pointing into it on its stack.
+// The calling thread's stack is only scanned from callerStack up, see MH_CALLER_STACK().
+// Only meaningful for buffers whose trampoline address never left MinHook, see RetireBuffer().
+static BOOL IsBufferInUse(PFROZEN_THREADS pThreads, LPVOID pBuffer, DWORD_PTR callerStack)
+{
+    DWORD_PTR bufferStart = (DWORD_PTR)pBuffer;
+    DWORD_PTR bufferEnd = bufferStart + MEMORY_SLOT_SIZE;
+    UINT i, r;
+
+    // The calling thread isn't frozen, but may have come here from a detour.
+    if (IsBufferOnStack(callerStack, bufferStart, bufferEnd))
+        return TRUE;
+
+    for (i = 0; i < pThreads->size; ++i)
+    {
+        ULONG_PTR regs[PLATFORM_GPR_COUNT];
+
+        if (!PlatformGetThreadGprs(pThreads->pItems[i], regs))
+            return TRUE;
+
+        for (r = 0; r < PLATFORM_GPR_COUNT; ++r)
+        {
+            if (regs[r] >= bufferStart && regs[r] < bufferEnd)
+                return TRUE;
+        }
+
+        if (IsBufferOnStack(regs[1], bufferStart, bufferEnd))
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+//-------------------------------------------------------------------------
+// Disposes of the executable buffer of a removed hook, depending on who may still reach it:
+// - if the hook was never enabled, no thread can, and it is freed right away;
+// - if its trampoline was handed out, a detour may load it from wherever the plugin stored it and call it
+//   at any later time, and no scan of threads can rule that out. It is kept until MH_Uninitialize, and
+//   still jumps to the target past the copied prologue;
+// - otherwise it is retired, and freed once its grace period is over and no thread uses it (see IsBufferInUse).
+static VOID RetireBuffer(PHOOK_ENTRY pHook)
+{
+    LPVOID pBuffer = pHook->pExecBuffer;
+
+    if (!pHook->wasEnabled)
+    {
+        FreeBuffer(pBuffer);
+        return;
+    }
+
+    if (pHook->sharedOriginal)
+    {
+        g_pinnedBuffers++;
+        return;
+    }
+
+    if (g_retired.size >= g_retired.capacity)
+    {
+        UINT newCapacity = g_retired.capacity ? g_retired.capacity * 2 : INITIAL_HOOK_CAPACITY;
+        PRETIRED_BUFFER p = g_retired.pItems == NULL
+            ? (PRETIRED_BUFFER)PlatformAlloc(g_hHeap, newCapacity * sizeof(RETIRED_BUFFER))
+            : (PRETIRED_BUFFER)PlatformReAlloc(g_hHeap, g_retired.pItems, newCapacity * sizeof(RETIRED_BUFFER));
+
+        // Leaking a slot beats freeing it under a running thread.
+        if (p == NULL)
+            return;
+
+        g_retired.pItems = p;
+        g_retired.capacity = newCapacity;
     }
 
-    szMutexName[mutexNameLen] = TEXT('\0');
+    g_retired.pItems[g_retired.size].pBuffer = pBuffer;
+    g_retired.pItems[g_retired.size].retiredAt = PlatformTickCount();
+    g_retired.size++;
+}
+
+//-------------------------------------------------------------------------
+// Frees the retired buffers whose grace period is over and that no thread is using.
+// Only freezes the threads if some grace period is over; a buffer still in use starts a new one.
+static VOID ReclaimRetiredBuffers(DWORD_PTR callerStack)
+{
+    FROZEN_THREADS threads;
+    DWORD now = PlatformTickCount();
+    UINT i, due = 0;
+
+    for (i = 0; i < g_retired.size; ++i)
+    {
+        if (now - g_retired.pItems[i].retiredAt >= RETIRED_BUFFER_GRACE_MS)
+            ++due;
+    }
+
+    if (due == 0 || Freeze(&threads) != MH_OK)
+        return;
+
+    i = 0;
+    while (i < g_retired.size)
+    {
+        PRETIRED_BUFFER pRetired = &g_retired.pItems[i];
+        if (now - pRetired->retiredAt < RETIRED_BUFFER_GRACE_MS)
+        {
+            ++i;
+        }
+        else if (IsBufferInUse(&threads, pRetired->pBuffer, callerStack))
+        {
+            pRetired->retiredAt = now;
+            ++i;
+        }
+        else
+        {
+            FreeBuffer(pRetired->pBuffer);
+            *pRetired = g_retired.pItems[--g_retired.size];
+        }
+    }
 
-    return CreateMutex(NULL, FALSE, szMutexName);
+    Unfreeze(&threads);
 }
 
 #ifdef __cplusplus
@@ -632,9 +1183,12 @@ extern "C" {
         if (g_hMutex == NULL)
             return MH_ERROR_NOT_INITIALIZED;
 
-        if (WaitForSingleObject(g_hMutex, INFINITE) != WAIT_OBJECT_0)
+        if (!PlatformLockMutex(g_hMutex))
             return MH_ERROR_MUTEX_FAILURE;
 
+        // A good moment to reuse buffers of removed hooks, before allocating a new one.
+        ReclaimRetiredBuffers(MH_CALLER_STACK());
+
         MH_STATUS status = MH_OK;
 
         if (IsExecutableAddress(pTarget) && IsExecutableAddress(pDetour))
@@ -658,9 +1212,17 @@ extern "C" {
                         pHook->pExecBuffer = pBuffer;
                         pHook->isEnabled = FALSE;
                         pHook->queueEnable = FALSE;
+                        pHook->wasEnabled = FALSE;
+                        pHook->sharedOriginal = ppOriginal != NULL;
 
-                        if (ppOriginal != NULL)
+                        if (!IndexHookEntry(g_hooks.size - 1))
+                        {
+                            status = MH_ERROR_MEMORY_ALLOC;
+                        }
+                        else if (ppOriginal != NULL)
+                        {
                             *ppOriginal = pBuffer->trampoline;
+                        }
                     }
                     else
                     {
@@ -687,7 +1249,7 @@ extern "C" {
             status = MH_ERROR_NOT_EXECUTABLE;
         }
 
-        ReleaseMutex(g_hMutex);
+        PlatformUnlockMutex(g_hMutex);
 
         return status;
     }
@@ -704,12 +1266,14 @@ extern "C" {
     //   pTarget     [in]  A pointer to the target function.
     //                     If this parameter is MH_ALL_HOOKS, all created hooks are
     //                     removed in one go.
+    // If the hook was enabled and its trampoline was returned through
+    // ppOriginal, the trampoline stays valid until MH_Uninitialize.
     inline MH_STATUS WINAPI MH_RemoveHookEx(void* crap, ULONG_PTR hookIdent, LPVOID pTarget)
     {
         if (g_hMutex == NULL)
             return MH_ERROR_NOT_INITIALIZED;
 
-        if (WaitForSingleObject(g_hMutex, INFINITE) != WAIT_OBJECT_0)
+        if (!PlatformLockMutex(g_hMutex))
             return MH_ERROR_MUTEX_FAILURE;
 
         MH_STATUS status = MH_OK;
@@ -725,7 +1289,7 @@ extern "C" {
                     PHOOK_ENTRY pHook = &g_hooks.pItems[i];
                     if (pHook->hookIdent == hookIdent)
                     {
-                        FreeBuffer(pHook->pExecBuffer);
+                        RetireBuffer(pHook);
                         DeleteHookEntry(i);
                     }
                     else
@@ -754,7 +1318,7 @@ extern "C" {
 
                 if (status == MH_OK)
                 {
-                    FreeBuffer(g_hooks.pItems[pos].pExecBuffer);
+                    RetireBuffer(&g_hooks.pItems[pos]);
                     DeleteHookEntry(pos);
                 }
             }
@@ -764,7 +1328,9 @@ extern "C" {
             }
         }
 
-        ReleaseMutex(g_hMutex);
+        ReclaimRetiredBuffers(MH_CALLER_STACK());
+
+        PlatformUnlockMutex(g_hMutex);
 
         return status;
     }
@@ -779,7 +1345,7 @@ extern "C" {
         if (g_hMutex == NULL)
             return MH_ERROR_NOT_INITIALIZED;
 
-        if (WaitForSingleObject(g_hMutex, INFINITE) != WAIT_OBJECT_0)
+        if (!PlatformLockMutex(g_hMutex))
             return MH_ERROR_MUTEX_FAILURE;
 
         MH_STATUS status = MH_OK;
@@ -815,7 +1381,7 @@ extern "C" {
             }
         }
 
-        ReleaseMutex(g_hMutex);
+        PlatformUnlockMutex(g_hMutex);
 
         return status;
     }
@@ -855,6 +1421,177 @@ extern "C" {
         return MH_DisableHookEx(0, pTarget);
     }
 
+    //-------------------------------------------------------------------------
+    static MH_STATUS QueueHook(ULONG_PTR hookIdent, LPVOID pTarget, BOOL queueEnable)
+    {
+        if (g_hMutex == NULL)
+            return MH_ERROR_NOT_INITIALIZED;
+
+        if (!PlatformLockMutex(g_hMutex))
+            return MH_ERROR_MUTEX_FAILURE;
+
+        MH_STATUS status = MH_OK;
+
+        if (pTarget == MH_ALL_HOOKS)
+        {
+            UINT i;
+            for (i = 0; i < g_hooks.size; ++i)
+            {
+                if (g_hooks.pItems[i].hookIdent == hookIdent)
+                    g_hooks.pItems[i].queueEnable = queueEnable;
+            }
+        }
+        else
+        {
+            UINT pos = FindHookEntry(hookIdent, pTarget);
+            if (pos != INVALID_HOOK_POS)
+            {
+                g_hooks.pItems[pos].queueEnable = queueEnable;
+            }
+            else
+            {
+                status = MH_ERROR_NOT_CREATED;
+            }
+        }
+
+        PlatformUnlockMutex(g_hMutex);
+
+        return status;
+    }
+
+    // Queues to enable an already created hook, see MH_ApplyQueued.
+    // Parameters:
+    //   hookIdent   [in]  A hook identifier, can be set to different values for
+    //                     different hooks to hook the same function more than
+    //                     once. Default value: 0.
+    //   pTarget     [in]  A pointer to the target function.
+    //                     If this parameter is MH_ALL_HOOKS, all created hooks are
+    //                     queued to be enabled.
+    inline MH_STATUS WINAPI MH_QueueEnableHookEx(ULONG_PTR hookIdent, LPVOID pTarget)
+    {
+        return QueueHook(hookIdent, pTarget, TRUE);
+    }
+
+    // Queues to disable an already created hook, see MH_ApplyQueued.
+    // Parameters:
+    //   hookIdent   [in]  A hook identifier, can be set to different values for
+    //                     different hooks to hook the same function more than
+    //                     once. Default value: 0.
+    //   pTarget     [in]  A pointer to the target function.
+    //                     If this parameter is MH_ALL_HOOKS, all created hooks are
+    //                     queued to be disabled.
+    inline MH_STATUS WINAPI MH_QueueDisableHookEx(ULONG_PTR hookIdent, LPVOID pTarget)
+    {
+        return QueueHook(hookIdent, pTarget, FALSE);
+    }
+
+    // Applies all queued changes in one go, suspending the other threads only
+    // once. Either all of them are applied, or none: on failure the queue is
+    // dropped and every hook is left in the state it had before.
+    inline MH_STATUS WINAPI MH_ApplyQueued(VOID)
+    {
+        if (g_hMutex == NULL)
+            return MH_ERROR_NOT_INITIALIZED;
+
+        if (!PlatformLockMutex(g_hMutex))
+            return MH_ERROR_MUTEX_FAILURE;
+
+        MH_STATUS status = ApplyQueuedLL(NULL, 0);
+
+        PlatformUnlockMutex(g_hMutex);
+
+        return status;
+    }
+
+    // Applies the queued changes of the given hooks only, like MH_ApplyQueued().
+    // On failure, only their queued changes are dropped: changes other callers
+    // queued meanwhile stay queued.
+    // Parameters:
+    //   pKeys       [in]  The hooks to apply, by identifier and target.
+    //   count       [in]  Number of items of pKeys.
+    inline MH_STATUS WINAPI MH_ApplyQueuedEx(const MH_HOOK_KEY* pKeys, UINT count)
+    {
+        if (g_hMutex == NULL)
+            return MH_ERROR_NOT_INITIALIZED;
+
+        if (count == 0)
+            return MH_OK;
+
+        if (pKeys == NULL)
+            return MH_ERROR_NOT_CREATED;
+
+        if (!PlatformLockMutex(g_hMutex))
+            return MH_ERROR_MUTEX_FAILURE;
+
+        MH_STATUS status = ApplyQueuedLL(pKeys, count);
+
+        PlatformUnlockMutex(g_hMutex);
+
+        return status;
+    }
+
+    // Lists the identifiers of all hooks created for a target function, in
+    // the order they were created.
+    // Parameters:
+    //   pTarget     [in]  A pointer to the target function.
+    //   pIdents     [out] Receives up to capacity hook identifiers.
+    //                     This parameter can be NULL if capacity is 0.
+    //   capacity    [in]  Size of the pIdents buffer, in items.
+    //   pCount      [out] Receives the total number of hooks on the target,
+    //                     which may be more than capacity.
+    inline MH_STATUS WINAPI MH_EnumerateHooksOnTarget(LPVOID pTarget, ULONG_PTR* pIdents, UINT capacity, UINT* pCount)
+    {
+        UINT first, pos, count = 0;
+
+        if (g_hMutex == NULL)
+            return MH_ERROR_NOT_INITIALIZED;
+
+        if (!PlatformLockMutex(g_hMutex))
+            return MH_ERROR_MUTEX_FAILURE;
+
+        first = FindFirstHookOnTarget(pTarget);
+        if (first != INVALID_HOOK_POS)
+        {
+            pos = first;
+            do
+            {
+                if (count < capacity)
+                    pIdents[count] = g_hooks.pItems[pos].hookIdent;
+                count++;
+                pos = g_hooks.pItems[pos].nextOnTarget;
+            } while (pos != first);
+        }
+
+        *pCount = count;
+
+        PlatformUnlockMutex(g_hMutex);
+
+        return first != INVALID_HOOK_POS ? MH_OK : MH_ERROR_NOT_CREATED;
+    }
+
+    // Makes every later Freeze() take its threads from pSource instead of
+    // enumerating them, or go back to enumerating if pSource is NULL.
+    // Parameters:
+    //   pSource     [in]  The thread source, copied. Its Acquire is called
+    //                     with the library's mutex held.
+    inline MH_STATUS WINAPI MH_SetThreadSource(const MH_THREAD_SOURCE* pSource)
+    {
+        if (g_hMutex == NULL)
+            return MH_ERROR_NOT_INITIALIZED;
+
+        if (!PlatformLockMutex(g_hMutex))
+            return MH_ERROR_MUTEX_FAILURE;
+
+        if (pSource != NULL)
+            g_threadSource = *pSource;
+        else
+            ZeroMemory(&g_threadSource, sizeof(g_threadSource));
+
+        PlatformUnlockMutex(g_hMutex);
+
+        return MH_OK;
+    }
+
     // Translates the MH_STATUS to its name as a string.
     const char * WINAPI MH_StatusToString(MH_STATUS status)
     {
@@ -921,14 +1658,14 @@ MH_STATUS WINAPI MH_Initialize(VOID)
     if (g_hMutex != NULL)
         return MH_ERROR_ALREADY_INITIALIZED;
 
-    g_hMutex = CreateProcessMutex();
+    g_hMutex = PlatformCreateMutex();
     if (g_hMutex == NULL)
         return MH_ERROR_MUTEX_FAILURE;
 
-    g_hHeap = HeapCreate(0, 0, 0);
+    g_hHeap = PlatformHeapCreate();
     if (g_hHeap == NULL)
     {
-        CloseHandle(g_hMutex);
+        PlatformDestroyMutex(g_hMutex);
         g_hMutex = NULL;
         return MH_ERROR_MEMORY_ALLOC;
     }
@@ -945,29 +1682,38 @@ MH_STATUS WINAPI MH_Uninitialize(VOID)
     if (g_hMutex == NULL)
         return MH_ERROR_NOT_INITIALIZED;
 
-    if (WaitForSingleObject(g_hMutex, INFINITE) != WAIT_OBJECT_0)
+    if (!PlatformLockMutex(g_hMutex))
         return MH_ERROR_MUTEX_FAILURE;
 
     MH_STATUS status = EnableAllHooksLL(FALSE);
 
-    ReleaseMutex(g_hMutex);
+    PlatformUnlockMutex(g_hMutex);
 
     if (status != MH_OK)
         return status;
 
     // Free the internal function buffer.
-    // HeapFree is actually not required, but some tools detect a false
-    // memory leak without HeapFree.
+    // PlatformFree is actually not required, but some tools detect a false
+    // memory leak without it.
     UninitializeBuffer();
-    HeapFree(g_hHeap, 0, g_hooks.pItems);
-    HeapDestroy(g_hHeap);
+    PlatformFree(g_hHeap, g_hooks.pItems);
+    PlatformFree(g_hHeap, g_hookIndex.pSlots);
+    PlatformFree(g_hHeap, g_targetIndex.pSlots);
+    PlatformFree(g_hHeap, g_retired.pItems);
+    PlatformHeapDestroy(g_hHeap);
     g_hHeap = NULL;
 
     g_hooks.pItems = NULL;
     g_hooks.capacity = 0;
     g_hooks.size = 0;
 
-    CloseHandle(g_hMutex);
+    ZeroMemory(&g_hookIndex, sizeof(g_hookIndex));
+    ZeroMemory(&g_targetIndex, sizeof(g_targetIndex));
+    ZeroMemory(&g_retired, sizeof(g_retired));
+    g_pinnedBuffers = 0;
+    ZeroMemory(&g_threadSource, sizeof(g_threadSource));
+
+    PlatformDestroyMutex(g_hMutex);
     g_hMutex = NULL;
 
     return MH_OK;
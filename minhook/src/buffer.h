@@ -28,8 +28,11 @@
 
 #pragma once
 
-#include <windows.h>
-#include "buffer.h"
+#include <limits.h>
+#if defined(_MSC_VER)
+    #include <intrin.h>
+#endif
+#include "platform.h"
 
 // Size of each memory slot.
 #if defined(_M_X64) || defined(__x86_64__)
@@ -44,9 +47,17 @@
 // Max range for seeking a memory block. (= 1024MB)
 #define MAX_MEMORY_RANGE 0x40000000
 
-// Memory protection flags to check the executable address.
-#define PAGE_EXECUTE_FLAGS \
-    (PAGE_EXECUTE | PAGE_EXECUTE_READ | PAGE_EXECUTE_READWRITE | PAGE_EXECUTE_WRITECOPY)
+#if defined(_M_X64) || defined(__x86_64__)
+// Number of blocks in the trampoline arena reserved near the main module.
+// Each block holds 64 slots, one bit each in a UINT64, so this is room for 65536 hooks in 4MB.
+#define ARENA_BLOCK_COUNT 1024
+#define ARENA_SLOTS_PER_BLOCK (MEMORY_BLOCK_SIZE / MEMORY_SLOT_SIZE)
+#define ARENA_SIZE ((SIZE_T)ARENA_BLOCK_COUNT * MEMORY_BLOCK_SIZE)
+#define ARENA_MASK_WORDS (ARENA_BLOCK_COUNT / 64)
+
+// The slot bitmap of a block is a single UINT64.
+typedef char ARENA_SLOTS_PER_BLOCK_CHECK[ARENA_SLOTS_PER_BLOCK == 64 ? 1 : -1];
+#endif
 
 // Memory slot.
 typedef struct _MEMORY_SLOT
@@ -73,6 +84,21 @@ typedef struct _MEMORY_BLOCK
 // First element of the memory block list.
 PMEMORY_BLOCK g_pMemoryBlocks;
 
+#if defined(_M_X64) || defined(__x86_64__)
+// Region reserved once near the main module, and committed a block at a time.
+// Its slots are tracked in bitmaps rather than in the blocks themselves, so that
+// finding a free slot, or the block of a slot, needs neither a list walk nor VirtualQuery.
+struct
+{
+    LPBYTE pBase;                           // NULL if no arena could be reserved.
+    ULONG_PTR minOrigin;                    // Targets in [minOrigin, maxOrigin] can reach every slot.
+    ULONG_PTR maxOrigin;
+    UINT64 freeSlots[ARENA_BLOCK_COUNT];    // Bit i set if slot i of a committed block is free.
+    UINT64 committed[ARENA_MASK_WORDS];     // Bit i set if block i is committed.
+    UINT64 available[ARENA_MASK_WORDS];     // Bit i set if block i is committed and has a free slot.
+} g_arena;
+#endif
+
 //-------------------------------------------------------------------------
 #if defined(_M_X64) || defined(__x86_64__)
 static LPVOID FindPrevFreeRegion(LPVOID pAddress, LPVOID pMinAddr, DWORD dwAllocationGranularity)
@@ -87,17 +113,17 @@ static LPVOID FindPrevFreeRegion(LPVOID pAddress, LPVOID pMinAddr, DWORD dwAlloc
 
     while (tryAddr >= (ULONG_PTR)pMinAddr)
     {
-        MEMORY_BASIC_INFORMATION mbi;
-        if (VirtualQuery((LPVOID)tryAddr, &mbi, sizeof(mbi)) == 0)
+        PLATFORM_REGION region;
+        if (!PlatformQueryRegion((LPVOID)tryAddr, &region))
             break;
 
-        if (mbi.State == MEM_FREE)
+        if (region.state == PLATFORM_MEM_FREE)
             return (LPVOID)tryAddr;
 
-        if ((ULONG_PTR)mbi.AllocationBase < dwAllocationGranularity)
+        if (region.allocationBase < dwAllocationGranularity)
             break;
 
-        tryAddr = (ULONG_PTR)mbi.AllocationBase - dwAllocationGranularity;
+        tryAddr = region.allocationBase - dwAllocationGranularity;
     }
 
     return NULL;
@@ -117,14 +143,14 @@ static LPVOID FindNextFreeRegion(LPVOID pAddress, LPVOID pMaxAddr, DWORD dwAlloc
 
     while (tryAddr <= (ULONG_PTR)pMaxAddr)
     {
-        MEMORY_BASIC_INFORMATION mbi;
-        if (VirtualQuery((LPVOID)tryAddr, &mbi, sizeof(mbi)) == 0)
+        PLATFORM_REGION region;
+        if (!PlatformQueryRegion((LPVOID)tryAddr, &region))
             break;
 
-        if (mbi.State == MEM_FREE)
+        if (region.state == PLATFORM_MEM_FREE)
             return (LPVOID)tryAddr;
 
-        tryAddr = (ULONG_PTR)mbi.BaseAddress + mbi.RegionSize;
+        tryAddr = region.base + region.size;
 
         // Round up to the next allocation granularity.
         tryAddr += dwAllocationGranularity - 1;
@@ -136,6 +162,167 @@ static LPVOID FindNextFreeRegion(LPVOID pAddress, LPVOID pMaxAddr, DWORD dwAlloc
 #endif
 
 
+#if defined(_M_X64) || defined(__x86_64__)
+//-------------------------------------------------------------------------
+static UINT FindLowestSetBit(UINT64 value)
+{
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward64(&index, value);
+    return (UINT)index;
+#else
+    return (UINT)__builtin_ctzll(value);
+#endif
+}
+
+//-------------------------------------------------------------------------
+// Returns the index of the lowest set bit of a bitmap, or UINT_MAX if there is none.
+static UINT FindFirstInBitmap(const UINT64* pWords, UINT count, BOOL inverted)
+{
+    UINT i;
+    for (i = 0; i < count; ++i)
+    {
+        UINT64 word = inverted ? ~pWords[i] : pWords[i];
+        if (word != 0)
+            return i * 64 + FindLowestSetBit(word);
+    }
+
+    return UINT_MAX;
+}
+
+//-------------------------------------------------------------------------
+#define ARENA_SET_BIT(MAP, I)   ((MAP)[(I) / 64] |= (UINT64)1 << ((I) % 64))
+#define ARENA_CLEAR_BIT(MAP, I) ((MAP)[(I) / 64] &= ~((UINT64)1 << ((I) % 64)))
+
+//-------------------------------------------------------------------------
+// Reserves the arena in the closest free region below the main module, or above it,
+// so that every slot stays within MAX_MEMORY_RANGE of every byte of the module.
+static VOID InitializeArena(VOID)
+{
+    PLATFORM_REGION region;
+    ULONG_PTR imageStart, imageEnd, minAddr, maxAddr, tryAddr;
+    ULONG_PTR minApplicationAddress, maxApplicationAddress;
+    DWORD granularity;
+
+    if (!PlatformGetMainImage(&imageStart, &imageEnd) || imageEnd - imageStart + ARENA_SIZE > MAX_MEMORY_RANGE)
+        return;
+
+    PlatformGetAddressSpace(&minApplicationAddress, &maxApplicationAddress, &granularity);
+
+    minAddr = imageEnd > MAX_MEMORY_RANGE ? imageEnd - MAX_MEMORY_RANGE : 0;
+    if (minAddr < minApplicationAddress)
+        minAddr = minApplicationAddress;
+    maxAddr = imageStart + MAX_MEMORY_RANGE;
+    if (maxAddr > maxApplicationAddress)
+        maxAddr = maxApplicationAddress;
+
+    // Below the module, walking down from its base.
+    tryAddr = imageStart;
+    while (g_arena.pBase == NULL && tryAddr > minAddr + ARENA_SIZE)
+    {
+        if (!PlatformQueryRegion((LPVOID)(tryAddr - 1), &region))
+            break;
+
+        if (region.state == PLATFORM_MEM_FREE)
+        {
+            ULONG_PTR base = tryAddr - ARENA_SIZE;
+            base -= base % granularity;
+            if (base >= region.base && base >= minAddr)
+                g_arena.pBase = (LPBYTE)PlatformReserve((LPVOID)base, ARENA_SIZE);
+        }
+
+        tryAddr = region.base;
+    }
+
+    // Above the module, walking up from its end.
+    tryAddr = imageEnd;
+    while (g_arena.pBase == NULL && tryAddr + ARENA_SIZE < maxAddr)
+    {
+        if (!PlatformQueryRegion((LPVOID)tryAddr, &region))
+            break;
+
+        if (region.state == PLATFORM_MEM_FREE)
+        {
+            ULONG_PTR base = tryAddr + granularity - 1;
+            base -= base % granularity;
+            if (base + ARENA_SIZE <= region.base + region.size && base + ARENA_SIZE <= maxAddr)
+                g_arena.pBase = (LPBYTE)PlatformReserve((LPVOID)base, ARENA_SIZE);
+        }
+
+        tryAddr = region.base + region.size;
+    }
+
+    if (g_arena.pBase != NULL)
+    {
+        ULONG_PTR arenaEnd = (ULONG_PTR)g_arena.pBase + ARENA_SIZE;
+        g_arena.minOrigin = arenaEnd > MAX_MEMORY_RANGE ? arenaEnd - MAX_MEMORY_RANGE : 0;
+        g_arena.maxOrigin = (ULONG_PTR)g_arena.pBase + MAX_MEMORY_RANGE - MEMORY_BLOCK_SIZE;
+    }
+}
+
+//-------------------------------------------------------------------------
+// Returns NULL if the arena is missing, out of reach of pOrigin, or full.
+static LPVOID AllocateArenaSlot(LPVOID pOrigin)
+{
+    UINT block, slot;
+
+    if (g_arena.pBase == NULL || (ULONG_PTR)pOrigin < g_arena.minOrigin || (ULONG_PTR)pOrigin > g_arena.maxOrigin)
+        return NULL;
+
+    block = FindFirstInBitmap(g_arena.available, ARENA_MASK_WORDS, FALSE);
+    if (block == UINT_MAX)
+    {
+        // Commit a fresh block.
+        block = FindFirstInBitmap(g_arena.committed, ARENA_MASK_WORDS, TRUE);
+        if (block >= ARENA_BLOCK_COUNT)
+            return NULL;
+
+        if (!PlatformCommit(g_arena.pBase + (SIZE_T)block * MEMORY_BLOCK_SIZE, MEMORY_BLOCK_SIZE))
+            return NULL;
+
+        g_arena.freeSlots[block] = ~(UINT64)0;
+        ARENA_SET_BIT(g_arena.committed, block);
+        ARENA_SET_BIT(g_arena.available, block);
+    }
+
+    slot = FindLowestSetBit(g_arena.freeSlots[block]);
+    g_arena.freeSlots[block] &= ~((UINT64)1 << slot);
+    if (g_arena.freeSlots[block] == 0)
+        ARENA_CLEAR_BIT(g_arena.available, block);
+
+    return g_arena.pBase + (SIZE_T)block * MEMORY_BLOCK_SIZE + (SIZE_T)slot * MEMORY_SLOT_SIZE;
+}
+
+//-------------------------------------------------------------------------
+// Returns FALSE if pBuffer doesn't belong to the arena.
+static BOOL FreeArenaSlot(LPVOID pBuffer)
+{
+    SIZE_T offset;
+    UINT block, slot;
+
+    if (g_arena.pBase == NULL || (LPBYTE)pBuffer < g_arena.pBase || (LPBYTE)pBuffer >= g_arena.pBase + ARENA_SIZE)
+        return FALSE;
+
+    offset = (LPBYTE)pBuffer - g_arena.pBase;
+    block = (UINT)(offset / MEMORY_BLOCK_SIZE);
+    slot = (UINT)((offset % MEMORY_BLOCK_SIZE) / MEMORY_SLOT_SIZE);
+
+    g_arena.freeSlots[block] |= (UINT64)1 << slot;
+    ARENA_SET_BIT(g_arena.available, block);
+
+    // Decommit if unused.
+    if (g_arena.freeSlots[block] == ~(UINT64)0)
+    {
+        PlatformDecommit(g_arena.pBase + (SIZE_T)block * MEMORY_BLOCK_SIZE, MEMORY_BLOCK_SIZE);
+        g_arena.freeSlots[block] = 0;
+        ARENA_CLEAR_BIT(g_arena.committed, block);
+        ARENA_CLEAR_BIT(g_arena.available, block);
+    }
+
+    return TRUE;
+}
+#endif
+
 //-------------------------------------------------------------------------
 static PMEMORY_BLOCK GetMemoryBlock(LPVOID pOrigin)
 {
@@ -143,11 +330,9 @@ static PMEMORY_BLOCK GetMemoryBlock(LPVOID pOrigin)
 #if defined(_M_X64) || defined(__x86_64__)
     ULONG_PTR minAddr;
     ULONG_PTR maxAddr;
+    DWORD granularity;
 
-    SYSTEM_INFO si;
-    GetSystemInfo(&si);
-    minAddr = (ULONG_PTR)si.lpMinimumApplicationAddress;
-    maxAddr = (ULONG_PTR)si.lpMaximumApplicationAddress;
+    PlatformGetAddressSpace(&minAddr, &maxAddr, &granularity);
 
     // pOrigin ± 512MB
     if ((ULONG_PTR)pOrigin > MAX_MEMORY_RANGE && minAddr < (ULONG_PTR)pOrigin - MAX_MEMORY_RANGE)
@@ -179,12 +364,11 @@ static PMEMORY_BLOCK GetMemoryBlock(LPVOID pOrigin)
         LPVOID pAlloc = pOrigin;
         while ((ULONG_PTR)pAlloc >= minAddr)
         {
-            pAlloc = FindPrevFreeRegion(pAlloc, (LPVOID)minAddr, si.dwAllocationGranularity);
+            pAlloc = FindPrevFreeRegion(pAlloc, (LPVOID)minAddr, granularity);
             if (pAlloc == NULL)
                 break;
 
-            pBlock = (PMEMORY_BLOCK)VirtualAlloc(
-                pAlloc, MEMORY_BLOCK_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
+            pBlock = (PMEMORY_BLOCK)PlatformAllocate(pAlloc, MEMORY_BLOCK_SIZE);
             if (pBlock != NULL)
                 break;
         }
@@ -196,20 +380,18 @@ static PMEMORY_BLOCK GetMemoryBlock(LPVOID pOrigin)
         LPVOID pAlloc = pOrigin;
         while ((ULONG_PTR)pAlloc <= maxAddr)
         {
-            pAlloc = FindNextFreeRegion(pAlloc, (LPVOID)maxAddr, si.dwAllocationGranularity);
+            pAlloc = FindNextFreeRegion(pAlloc, (LPVOID)maxAddr, granularity);
             if (pAlloc == NULL)
                 break;
 
-            pBlock = (PMEMORY_BLOCK)VirtualAlloc(
-                pAlloc, MEMORY_BLOCK_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
+            pBlock = (PMEMORY_BLOCK)PlatformAllocate(pAlloc, MEMORY_BLOCK_SIZE);
             if (pBlock != NULL)
                 break;
         }
     }
 #else
     // In x86 mode, a memory block can be placed anywhere.
-    pBlock = (PMEMORY_BLOCK)VirtualAlloc(
-        NULL, MEMORY_BLOCK_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
+    pBlock = (PMEMORY_BLOCK)PlatformAllocate(NULL, MEMORY_BLOCK_SIZE);
 #endif
 
     if (pBlock != NULL)
@@ -234,24 +416,47 @@ static PMEMORY_BLOCK GetMemoryBlock(LPVOID pOrigin)
 
 VOID   InitializeBuffer(VOID)
 {
-    // Nothing to do for now.
+#if defined(_M_X64) || defined(__x86_64__)
+    InitializeArena();
+#endif
 }
 VOID   UninitializeBuffer(VOID)
 {
     PMEMORY_BLOCK pBlock = g_pMemoryBlocks;
     g_pMemoryBlocks = NULL;
 
+#if defined(_M_X64) || defined(__x86_64__)
+    if (g_arena.pBase != NULL)
+        PlatformRelease(g_arena.pBase, ARENA_SIZE);
+    ZeroMemory(&g_arena, sizeof(g_arena));
+#endif
+
     while (pBlock)
     {
         PMEMORY_BLOCK pNext = pBlock->pNext;
-        VirtualFree(pBlock, 0, MEM_RELEASE);
+        PlatformRelease(pBlock, MEMORY_BLOCK_SIZE);
         pBlock = pNext;
     }
 }
 LPVOID AllocateBuffer(LPVOID pOrigin)
 {
     PMEMORY_SLOT  pSlot;
-    PMEMORY_BLOCK pBlock = GetMemoryBlock(pOrigin);
+    PMEMORY_BLOCK pBlock;
+
+#if defined(_M_X64) || defined(__x86_64__)
+    // Targets near the main module are served from the arena, anything else from standalone blocks.
+    pSlot = (PMEMORY_SLOT)AllocateArenaSlot(pOrigin);
+    if (pSlot != NULL)
+    {
+#ifdef _DEBUG
+        // Fill the slot with INT3 for debugging.
+        memset(pSlot, 0xCC, sizeof(MEMORY_SLOT));
+#endif
+        return pSlot;
+    }
+#endif
+
+    pBlock = GetMemoryBlock(pOrigin);
     if (pBlock == NULL)
         return NULL;
 
@@ -271,6 +476,11 @@ VOID   FreeBuffer(LPVOID pBuffer)
     PMEMORY_BLOCK pPrev = NULL;
     ULONG_PTR pTargetBlock = ((ULONG_PTR)pBuffer / MEMORY_BLOCK_SIZE) * MEMORY_BLOCK_SIZE;
 
+#if defined(_M_X64) || defined(__x86_64__)
+    if (FreeArenaSlot(pBuffer))
+        return;
+#endif
+
     while (pBlock != NULL)
     {
         if ((ULONG_PTR)pBlock == pTargetBlock)
@@ -293,7 +503,7 @@ VOID   FreeBuffer(LPVOID pBuffer)
                 else
                     g_pMemoryBlocks = pBlock->pNext;
 
-                VirtualFree(pBlock, 0, MEM_RELEASE);
+                PlatformRelease(pBlock, MEMORY_BLOCK_SIZE);
             }
 
             break;
@@ -305,8 +515,9 @@ VOID   FreeBuffer(LPVOID pBuffer)
 }
 BOOL   IsExecutableAddress(LPVOID pAddress)
 {
-    MEMORY_BASIC_INFORMATION mi;
-    VirtualQuery(pAddress, &mi, sizeof(mi));
+    PLATFORM_REGION region;
+    if (!PlatformQueryRegion(pAddress, &region))
+        return FALSE;
 
-    return (mi.State == MEM_COMMIT && (mi.Protect & PAGE_EXECUTE_FLAGS));
+    return region.state == PLATFORM_MEM_COMMITTED && (region.protect & PLATFORM_PROT_EXEC);
 }
\ No newline at end of file
@@ -26,6 +26,7 @@
 
 #pragma once
 
+#if defined(_WIN32)
 #include <windows.h>
 
 // Integer types for HDE.
@@ -37,3 +38,6 @@ typedef UINT8  uint8_t;
 typedef UINT16 uint16_t;
 typedef UINT32 uint32_t;
 typedef UINT64 uint64_t;
+#else
+#include <stdint.h>
+#endif
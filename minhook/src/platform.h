@@ -0,0 +1,115 @@
+﻿/*
+ *  MinHook - The Minimalistic API Hooking Library for x64/x86
+ *  Copyright (C) 2009-2017 Tsuda Kageyu.
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ *  TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ *  PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER
+ *  OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ *  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ *  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ *  PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ *  LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ *  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ *  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+// Everything the hook engine needs from the OS: memory, a heap, a lock, a clock and other threads.
+// Each backend speaks the Windows base types (BOOL, LPVOID, DWORD, ...), the POSIX one defines them.
+//
+// Memory:
+//   PlatformGetAddressSpace(pMin, pMax, pGranularity)  Usable user addresses, and the alignment of reservations.
+//   PlatformQueryRegion(pAddress, pRegion)             Describe the region around an address, FALSE if outside of the address space.
+//   PlatformReserve(pAddress, size)                    Reserve inaccessible pages exactly at pAddress, or anywhere if NULL.
+//   PlatformCommit(pAddress, size)                     Make reserved pages readable, writable and executable.
+//   PlatformDecommit(pAddress, size)                   Drop the contents of committed pages, they stay reserved.
+//   PlatformRelease(pAddress, size)                    Release a whole reservation.
+//   PlatformUnprotect(pAddress, size, pOld)            Make code writable, saving its protection for PlatformReprotect.
+//   PlatformReprotect(pAddress, size, pOld)
+//   PlatformFlushCode(pAddress, size)                  After code was written.
+//   PlatformGetMainImage(pStart, pEnd)                 Bounds of the main executable, where the trampoline arena goes.
+//
+// Heap, must be usable before any thread is suspended, and is never used while they are:
+//   PlatformHeapCreate(), PlatformHeapDestroy(hHeap), PlatformAlloc(hHeap, size), PlatformReAlloc(hHeap, p, size), PlatformFree(hHeap, p)
+//
+// Lock, recursive, and shared by every copy of the engine in the process where the OS allows it:
+//   PlatformCreateMutex(), PlatformLockMutex(hMutex), PlatformUnlockMutex(hMutex), PlatformDestroyMutex(hMutex)
+//
+// Clock:
+//   PlatformTickCount()                                Milliseconds, wrapping around.
+//
+// Threads:
+//   PlatformEnumerateOtherThreads(callback, pContext)  Open every thread of the process but the calling one. The callback
+//                                                      owns the handle it is given, and returns FALSE to stop.
+//   PlatformSuspendThread(hThread)                     May return before the thread has stopped.
+//   PlatformWaitSuspended(hThread)                     Until the thread has stopped, FALSE if it didn't in time.
+//   PlatformResumeThread(hThread), PlatformCloseThread(hThread)
+//   PlatformGetThreadRegisters(hThread, pIP, pSP)      Of a suspended thread.
+//   PlatformGetThreadGprs(hThread, pRegs)              All PLATFORM_GPR_COUNT general-purpose registers of a suspended thread,
+//                                                      the IP and SP first.
+//   PlatformSetThreadIP(hThread, ip)                   Of a suspended thread, takes effect when it resumes.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// PLATFORM_REGION.state
+#define PLATFORM_MEM_FREE       0
+#define PLATFORM_MEM_RESERVED   1
+#define PLATFORM_MEM_COMMITTED  2
+
+// PLATFORM_REGION.protect
+#define PLATFORM_PROT_READ      0x1
+#define PLATFORM_PROT_WRITE     0x2
+#define PLATFORM_PROT_EXEC      0x4
+#define PLATFORM_PROT_GUARD     0x8
+
+// Registers filled in by PlatformGetThreadGprs: IP, SP and the other integer registers.
+#if defined(_M_X64) || defined(__x86_64__)
+#define PLATFORM_GPR_COUNT      17
+#else
+#define PLATFORM_GPR_COUNT      9
+#endif
+
+// Pages sharing the same state and protection.
+typedef struct _PLATFORM_REGION
+{
+    uintptr_t base;
+    size_t    size;
+    uintptr_t allocationBase;   // Start of the reservation the region belongs to.
+    unsigned  state;
+    unsigned  protect;
+} PLATFORM_REGION, *PPLATFORM_REGION;
+
+#if defined(_WIN32)
+    #include "platform_win32.h"
+#else
+    #include "platform_posix.h"
+#endif
+
+//-------------------------------------------------------------------------
+// Reserve and commit in one go, see PlatformReserve().
+static LPVOID PlatformAllocate(LPVOID pAddress, SIZE_T size)
+{
+    LPVOID p = PlatformReserve(pAddress, size);
+    if (p != NULL && !PlatformCommit(p, size))
+    {
+        PlatformRelease(p, size);
+        p = NULL;
+    }
+    return p;
+}
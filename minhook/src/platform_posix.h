@@ -0,0 +1,638 @@
+﻿/*
+ *  MinHook - The Minimalistic API Hooking Library for x64/x86
+ *  Copyright (C) 2009-2017 Tsuda Kageyu.
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ *  TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ *  PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER
+ *  OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ *  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ *  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ *  PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ *  LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ *  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ *  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+// Linux backend, so that the engine can hook native functions in tests and benchmarks.
+// Threads are stopped by a signal whose handler parks them until they are resumed; the registers
+// read and written while they are parked are the ones the kernel restores when the handler returns.
+
+// dl_iterate_phdr() and the ucontext register names, C++ compilers define it already.
+#if !defined(_GNU_SOURCE)
+    #error Build with -D_GNU_SOURCE, it has to be defined before the first system header.
+#endif
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <link.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <time.h>
+#include <ucontext.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+// The Windows base types the engine is written with.
+typedef int             BOOL;
+typedef unsigned char   BYTE;
+typedef BYTE*           LPBYTE;
+typedef unsigned int    UINT;
+typedef uint8_t         UINT8;
+typedef uint32_t        UINT32;
+typedef uint64_t        UINT64;
+typedef int8_t          INT8;
+typedef int32_t         INT32;
+typedef uint32_t        DWORD;
+typedef uintptr_t       ULONG_PTR;
+typedef uintptr_t       DWORD_PTR;
+typedef size_t          SIZE_T;
+typedef void            VOID;
+typedef void*           LPVOID;
+typedef const void*     LPCVOID;
+typedef void*           HANDLE;
+
+#ifndef TRUE
+#define TRUE 1
+#endif
+#ifndef FALSE
+#define FALSE 0
+#endif
+
+#define WINAPI
+#define ZeroMemory(P, S) memset((P), 0, (S))
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
+// Signal used to park threads, override if the host already uses it.
+#ifndef PLATFORM_SUSPEND_SIGNAL
+#define PLATFORM_SUSPEND_SIGNAL (SIGRTMIN + 3)
+#endif
+
+// How long to wait for a thread to park, a thread blocking the signal is left running.
+#define PLATFORM_SUSPEND_TIMEOUT_MS 1000
+
+// PLATFORM_THREAD_STATE.state
+#define PLATFORM_THREAD_RUNNING     0
+#define PLATFORM_THREAD_SIGNALED    1   // Signal sent, not handled yet.
+#define PLATFORM_THREAD_PARKED      2   // In the handler, pContext is valid.
+#define PLATFORM_THREAD_RESUMING    3   // Told to leave the handler.
+#define PLATFORM_THREAD_LEFT        4   // Out of the handler, the state isn't touched by the thread anymore.
+#define PLATFORM_THREAD_ABANDONED   5   // Didn't park in time, the signal may still be pending.
+
+typedef struct _PLATFORM_THREAD_STATE
+{
+    pid_t       tid;
+    int         state;      // Futex word.
+    DWORD       signaledAt; // Tick count when the signal was sent.
+    ucontext_t* pContext;   // Saved registers of the parked thread, on its own stack.
+} PLATFORM_THREAD_STATE, *PLATFORM_THREAD;
+
+typedef pthread_mutex_t* PLATFORM_MUTEX;
+typedef HANDLE PLATFORM_HEAP;
+
+// Protection of the first and the last page of a range, a patch never spans more than two.
+typedef struct _PLATFORM_PROTECTION
+{
+    int first;
+    int last;
+} PLATFORM_PROTECTION;
+
+//-------------------------------------------------------------------------
+static VOID PlatformGetAddressSpace(ULONG_PTR* pMin, ULONG_PTR* pMax, DWORD* pGranularity)
+{
+    DWORD page = (DWORD)sysconf(_SC_PAGESIZE);
+    *pMin = 0x10000;
+#if defined(__x86_64__)
+    *pMax = ((ULONG_PTR)1 << 47) - page;
+#else
+    *pMax = (ULONG_PTR)0xC0000000 - page;
+#endif
+    *pGranularity = page;
+}
+
+//-------------------------------------------------------------------------
+static ULONG_PTR PlatformParseHex(const char** ppText)
+{
+    ULONG_PTR value = 0;
+    for (;; ++*ppText)
+    {
+        char c = **ppText;
+        if (c >= '0' && c <= '9')
+            value = value * 16 + (c - '0');
+        else if (c >= 'a' && c <= 'f')
+            value = value * 16 + (c - 'a' + 10);
+        else
+            return value;
+    }
+}
+
+//-------------------------------------------------------------------------
+// Reads /proc/self/maps with plain syscalls, it runs while other threads may be parked holding the heap lock.
+static BOOL PlatformQueryRegion(LPCVOID pAddress, PPLATFORM_REGION pRegion)
+{
+    ULONG_PTR address = (ULONG_PTR)pAddress, minAddr, maxAddr, prevEnd;
+    DWORD granularity;
+    char buffer[4096];
+    size_t used = 0;
+    BOOL eof = FALSE;
+    int fd;
+
+    PlatformGetAddressSpace(&minAddr, &maxAddr, &granularity);
+    if (address >= maxAddr + granularity)
+        return FALSE;
+
+    fd = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return FALSE;
+
+    prevEnd = 0;
+    for (;;)
+    {
+        char* pLineEnd = (char*)memchr(buffer, '\n', used);
+        const char* p;
+        ULONG_PTR start, end;
+
+        if (pLineEnd == NULL)
+        {
+            ssize_t n;
+            if (eof || used == sizeof(buffer))
+                break;
+
+            n = read(fd, buffer + used, sizeof(buffer) - used);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                eof = TRUE;
+            else
+                used += (size_t)n;
+            continue;
+        }
+
+        // "start-end rwxp offset dev inode path"
+        p = buffer;
+        start = PlatformParseHex(&p);
+        ++p;
+        end = PlatformParseHex(&p);
+        ++p;
+
+        if (address < start)
+        {
+            // In the gap before this mapping.
+            pRegion->base = prevEnd;
+            pRegion->size = start - prevEnd;
+            pRegion->allocationBase = prevEnd;
+            pRegion->state = PLATFORM_MEM_FREE;
+            pRegion->protect = 0;
+            close(fd);
+            return TRUE;
+        }
+
+        if (address < end)
+        {
+            pRegion->base = start;
+            pRegion->size = end - start;
+            pRegion->allocationBase = start;
+            pRegion->protect = (p[0] == 'r' ? PLATFORM_PROT_READ : 0)
+                | (p[1] == 'w' ? PLATFORM_PROT_WRITE : 0)
+                | (p[2] == 'x' ? PLATFORM_PROT_EXEC : 0);
+            pRegion->state = pRegion->protect ? PLATFORM_MEM_COMMITTED : PLATFORM_MEM_RESERVED;
+            close(fd);
+            return TRUE;
+        }
+
+        prevEnd = end;
+        used -= (size_t)(pLineEnd + 1 - buffer);
+        memmove(buffer, pLineEnd + 1, used);
+    }
+
+    close(fd);
+
+    // Past the last mapping.
+    pRegion->base = prevEnd;
+    pRegion->size = maxAddr + granularity - prevEnd;
+    pRegion->allocationBase = prevEnd;
+    pRegion->state = PLATFORM_MEM_FREE;
+    pRegion->protect = 0;
+    return TRUE;
+}
+
+//-------------------------------------------------------------------------
+static LPVOID PlatformReserve(LPVOID pAddress, SIZE_T size)
+{
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | (pAddress != NULL ? MAP_FIXED_NOREPLACE : 0);
+    LPVOID p = mmap(pAddress, size, PROT_NONE, flags, -1, 0);
+    if (p == MAP_FAILED)
+        return NULL;
+
+    // Kernels before 4.17 take MAP_FIXED_NOREPLACE as a mere hint.
+    if (pAddress != NULL && p != pAddress)
+    {
+        munmap(p, size);
+        return NULL;
+    }
+    return p;
+}
+
+//-------------------------------------------------------------------------
+static BOOL PlatformCommit(LPVOID pAddress, SIZE_T size)
+{
+    return mprotect(pAddress, size, PROT_READ | PROT_WRITE | PROT_EXEC) == 0;
+}
+
+//-------------------------------------------------------------------------
+static VOID PlatformDecommit(LPVOID pAddress, SIZE_T size)
+{
+    mmap(pAddress, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+}
+
+//-------------------------------------------------------------------------
+static VOID PlatformRelease(LPVOID pAddress, SIZE_T size)
+{
+    munmap(pAddress, size);
+}
+
+//-------------------------------------------------------------------------
+static int PlatformGetPageProtection(ULONG_PTR page)
+{
+    PLATFORM_REGION region;
+    if (!PlatformQueryRegion((LPCVOID)page, &region) || region.state != PLATFORM_MEM_COMMITTED)
+        return -1;
+
+    return ((region.protect & PLATFORM_PROT_READ) ? PROT_READ : 0)
+        | ((region.protect & PLATFORM_PROT_WRITE) ? PROT_WRITE : 0)
+        | ((region.protect & PLATFORM_PROT_EXEC) ? PROT_EXEC : 0);
+}
+
+//-------------------------------------------------------------------------
+static BOOL PlatformUnprotect(LPVOID pAddress, SIZE_T size, PLATFORM_PROTECTION* pOld)
+{
+    ULONG_PTR page = (ULONG_PTR)sysconf(_SC_PAGESIZE);
+    ULONG_PTR first = (ULONG_PTR)pAddress & ~(page - 1);
+    ULONG_PTR last = ((ULONG_PTR)pAddress + size - 1) & ~(page - 1);
+
+    pOld->first = PlatformGetPageProtection(first);
+    pOld->last = last != first ? PlatformGetPageProtection(last) : pOld->first;
+    if (pOld->first < 0 || pOld->last < 0)
+        return FALSE;
+
+    return mprotect((LPVOID)first, last + page - first, PROT_READ | PROT_WRITE | PROT_EXEC) == 0;
+}
+
+//-------------------------------------------------------------------------
+static VOID PlatformReprotect(LPVOID pAddress, SIZE_T size, const PLATFORM_PROTECTION* pOld)
+{
+    ULONG_PTR page = (ULONG_PTR)sysconf(_SC_PAGESIZE);
+    ULONG_PTR first = (ULONG_PTR)pAddress & ~(page - 1);
+    ULONG_PTR last = ((ULONG_PTR)pAddress + size - 1) & ~(page - 1);
+
+    mprotect((LPVOID)first, page, pOld->first);
+    if (last != first)
+        mprotect((LPVOID)last, page, pOld->last);
+}
+
+//-------------------------------------------------------------------------
+static VOID PlatformFlushCode(LPVOID pAddress, SIZE_T size)
+{
+    __builtin___clear_cache((char*)pAddress, (char*)pAddress + size);
+}
+
+//-------------------------------------------------------------------------
+static int PlatformMainImageCallback(struct dl_phdr_info* pInfo, size_t size, void* pData)
+{
+    ULONG_PTR* pBounds = (ULONG_PTR*)pData;
+    int i;
+    (void)size;
+
+    // The main program is reported first.
+    for (i = 0; i < pInfo->dlpi_phnum; ++i)
+    {
+        const ElfW(Phdr)* pHeader = &pInfo->dlpi_phdr[i];
+        ULONG_PTR start, end;
+        if (pHeader->p_type != PT_LOAD)
+            continue;
+
+        start = pInfo->dlpi_addr + pHeader->p_vaddr;
+        end = start + pHeader->p_memsz;
+        if (pBounds[0] == 0 || start < pBounds[0])
+            pBounds[0] = start;
+        if (end > pBounds[1])
+            pBounds[1] = end;
+    }
+    return 1;
+}
+
+//-------------------------------------------------------------------------
+static BOOL PlatformGetMainImage(ULONG_PTR* pStart, ULONG_PTR* pEnd)
+{
+    ULONG_PTR bounds[2] = { 0, 0 };
+    dl_iterate_phdr(PlatformMainImageCallback, bounds);
+    if (bounds[1] == 0)
+        return FALSE;
+
+    *pStart = bounds[0];
+    *pEnd = bounds[1];
+    return TRUE;
+}
+
+//-------------------------------------------------------------------------
+// The process heap, there is no private one.
+static PLATFORM_HEAP PlatformHeapCreate(VOID)
+{
+    static int s_processHeap;
+    return (PLATFORM_HEAP)&s_processHeap;
+}
+
+static VOID PlatformHeapDestroy(PLATFORM_HEAP hHeap)
+{
+    (void)hHeap;
+}
+
+static LPVOID PlatformAlloc(PLATFORM_HEAP hHeap, SIZE_T size)
+{
+    (void)hHeap;
+    return malloc(size);
+}
+
+static LPVOID PlatformReAlloc(PLATFORM_HEAP hHeap, LPVOID p, SIZE_T size)
+{
+    (void)hHeap;
+    return realloc(p, size);
+}
+
+static VOID PlatformFree(PLATFORM_HEAP hHeap, LPVOID p)
+{
+    (void)hHeap;
+    free(p);
+}
+
+//-------------------------------------------------------------------------
+// Not shared with other copies of the engine, there is no named mutex to find them by.
+static PLATFORM_MUTEX PlatformCreateMutex(VOID)
+{
+    pthread_mutexattr_t attr;
+    PLATFORM_MUTEX hMutex = (PLATFORM_MUTEX)malloc(sizeof(pthread_mutex_t));
+    if (hMutex == NULL)
+        return NULL;
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    if (pthread_mutex_init(hMutex, &attr) != 0)
+    {
+        free(hMutex);
+        hMutex = NULL;
+    }
+    pthread_mutexattr_destroy(&attr);
+    return hMutex;
+}
+
+static BOOL PlatformLockMutex(PLATFORM_MUTEX hMutex)
+{
+    return pthread_mutex_lock(hMutex) == 0;
+}
+
+static VOID PlatformUnlockMutex(PLATFORM_MUTEX hMutex)
+{
+    pthread_mutex_unlock(hMutex);
+}
+
+static VOID PlatformDestroyMutex(PLATFORM_MUTEX hMutex)
+{
+    pthread_mutex_destroy(hMutex);
+    free(hMutex);
+}
+
+//-------------------------------------------------------------------------
+static DWORD PlatformTickCount(VOID)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (DWORD)((UINT64)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+//-------------------------------------------------------------------------
+static VOID PlatformFutexWait(int* pWord, int value, long timeoutNs)
+{
+    struct timespec ts = { timeoutNs / 1000000000, timeoutNs % 1000000000 };
+    syscall(SYS_futex, pWord, FUTEX_WAIT_PRIVATE, value, timeoutNs ? &ts : NULL, NULL, 0);
+}
+
+static VOID PlatformFutexWake(int* pWord)
+{
+    syscall(SYS_futex, pWord, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+//-------------------------------------------------------------------------
+// Only async-signal-safe calls in here.
+static void PlatformSuspendHandler(int sig, siginfo_t* pInfo, void* pContext)
+{
+    PLATFORM_THREAD hThread;
+    int savedErrno = errno;
+    int expected = PLATFORM_THREAD_SIGNALED;
+    (void)sig;
+
+    // Queued by PlatformSuspendThread(), which passes the thread's state along.
+    if (pInfo->si_code != SI_QUEUE || pInfo->si_pid != getpid())
+        return;
+
+    hThread = (PLATFORM_THREAD)pInfo->si_value.sival_ptr;
+    if (hThread == NULL || hThread->tid != (pid_t)syscall(SYS_gettid))
+        return;
+
+    // A late signal finds the state abandoned and leaves.
+    hThread->pContext = (ucontext_t*)pContext;
+    if (!__atomic_compare_exchange_n(&hThread->state, &expected, PLATFORM_THREAD_PARKED, FALSE, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        return;
+    PlatformFutexWake(&hThread->state);
+
+    while (__atomic_load_n(&hThread->state, __ATOMIC_ACQUIRE) == PLATFORM_THREAD_PARKED)
+        PlatformFutexWait(&hThread->state, PLATFORM_THREAD_PARKED, 0);
+
+    __atomic_store_n(&hThread->state, PLATFORM_THREAD_LEFT, __ATOMIC_RELEASE);
+    PlatformFutexWake(&hThread->state);
+    errno = savedErrno;
+}
+
+//-------------------------------------------------------------------------
+static VOID PlatformEnumerateOtherThreads(BOOL(*callback)(PLATFORM_THREAD hThread, LPVOID pContext), LPVOID pContext)
+{
+    pid_t self = (pid_t)syscall(SYS_gettid);
+    struct dirent* pEntry;
+    DIR* pDir = opendir("/proc/self/task");
+    if (pDir == NULL)
+        return;
+
+    while ((pEntry = readdir(pDir)) != NULL)
+    {
+        PLATFORM_THREAD hThread;
+        pid_t tid = (pid_t)atoi(pEntry->d_name);
+        if (tid <= 0 || tid == self)
+            continue;
+
+        hThread = (PLATFORM_THREAD)malloc(sizeof(PLATFORM_THREAD_STATE));
+        if (hThread == NULL)
+            break;
+
+        hThread->tid = tid;
+        hThread->state = PLATFORM_THREAD_RUNNING;
+        hThread->pContext = NULL;
+        if (!callback(hThread, pContext))
+            break;
+    }
+
+    closedir(pDir);
+}
+
+//-------------------------------------------------------------------------
+// Only sends the signal, PlatformWaitSuspended() waits for the thread to park.
+// Signaling every thread first lets them park concurrently instead of one after another.
+static BOOL PlatformSuspendThread(PLATFORM_THREAD hThread)
+{
+    static BOOL s_installed = FALSE;
+    siginfo_t si;
+
+    if (!s_installed)
+    {
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_sigaction = PlatformSuspendHandler;
+        sa.sa_flags = SA_SIGINFO | SA_RESTART;
+        sigfillset(&sa.sa_mask);
+        if (sigaction(PLATFORM_SUSPEND_SIGNAL, &sa, NULL) != 0)
+            return FALSE;
+        s_installed = TRUE;
+    }
+
+    memset(&si, 0, sizeof(si));
+    si.si_signo = PLATFORM_SUSPEND_SIGNAL;
+    si.si_code = SI_QUEUE;
+    si.si_pid = getpid();
+    si.si_uid = getuid();
+    si.si_value.sival_ptr = hThread;
+
+    hThread->signaledAt = PlatformTickCount();
+    __atomic_store_n(&hThread->state, PLATFORM_THREAD_SIGNALED, __ATOMIC_RELEASE);
+    if (syscall(SYS_rt_tgsigqueueinfo, getpid(), hThread->tid, PLATFORM_SUSPEND_SIGNAL, &si) != 0)
+    {
+        // The thread has exited since it was enumerated.
+        __atomic_store_n(&hThread->state, PLATFORM_THREAD_RUNNING, __ATOMIC_RELEASE);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+//-------------------------------------------------------------------------
+static BOOL PlatformWaitSuspended(PLATFORM_THREAD hThread)
+{
+    int expected = PLATFORM_THREAD_SIGNALED;
+
+    while (__atomic_load_n(&hThread->state, __ATOMIC_ACQUIRE) == PLATFORM_THREAD_SIGNALED
+        && PlatformTickCount() - hThread->signaledAt < PLATFORM_SUSPEND_TIMEOUT_MS)
+    {
+        PlatformFutexWait(&hThread->state, PLATFORM_THREAD_SIGNALED, 10000000);
+    }
+
+    // Still not parked, the handler won't park it anymore once the state has changed.
+    if (__atomic_compare_exchange_n(&hThread->state, &expected, PLATFORM_THREAD_ABANDONED, FALSE, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        return FALSE;
+
+    return expected == PLATFORM_THREAD_PARKED;
+}
+
+//-------------------------------------------------------------------------
+static VOID PlatformResumeThread(PLATFORM_THREAD hThread)
+{
+    if (__atomic_load_n(&hThread->state, __ATOMIC_ACQUIRE) != PLATFORM_THREAD_PARKED)
+        return;
+
+    __atomic_store_n(&hThread->state, PLATFORM_THREAD_RESUMING, __ATOMIC_RELEASE);
+    PlatformFutexWake(&hThread->state);
+}
+
+//-------------------------------------------------------------------------
+static VOID PlatformCloseThread(PLATFORM_THREAD hThread)
+{
+    // Wait until the thread is done with its state.
+    while (__atomic_load_n(&hThread->state, __ATOMIC_ACQUIRE) == PLATFORM_THREAD_RESUMING)
+        PlatformFutexWait(&hThread->state, PLATFORM_THREAD_RESUMING, 0);
+
+    // A pending signal still points at an abandoned state, leak it.
+    if (__atomic_load_n(&hThread->state, __ATOMIC_ACQUIRE) == PLATFORM_THREAD_ABANDONED)
+        return;
+
+    free(hThread);
+}
+
+//-------------------------------------------------------------------------
+static BOOL PlatformGetThreadRegisters(PLATFORM_THREAD hThread, ULONG_PTR* pIP, ULONG_PTR* pSP)
+{
+    if (__atomic_load_n(&hThread->state, __ATOMIC_ACQUIRE) != PLATFORM_THREAD_PARKED)
+        return FALSE;
+
+#if defined(__x86_64__)
+    *pIP = (ULONG_PTR)hThread->pContext->uc_mcontext.gregs[REG_RIP];
+    *pSP = (ULONG_PTR)hThread->pContext->uc_mcontext.gregs[REG_RSP];
+#else
+    *pIP = (ULONG_PTR)hThread->pContext->uc_mcontext.gregs[REG_EIP];
+    *pSP = (ULONG_PTR)hThread->pContext->uc_mcontext.gregs[REG_ESP];
+#endif
+    return TRUE;
+}
+
+//-------------------------------------------------------------------------
+static BOOL PlatformGetThreadGprs(PLATFORM_THREAD hThread, ULONG_PTR* pRegs)
+{
+#if defined(__x86_64__)
+    static const int order[PLATFORM_GPR_COUNT] = {
+        REG_RIP, REG_RSP, REG_RAX, REG_RCX, REG_RDX, REG_RBX, REG_RBP, REG_RSI, REG_RDI,
+        REG_R8, REG_R9, REG_R10, REG_R11, REG_R12, REG_R13, REG_R14, REG_R15
+    };
+#else
+    static const int order[PLATFORM_GPR_COUNT] = {
+        REG_EIP, REG_ESP, REG_EAX, REG_ECX, REG_EDX, REG_EBX, REG_EBP, REG_ESI, REG_EDI
+    };
+#endif
+    UINT i;
+
+    if (__atomic_load_n(&hThread->state, __ATOMIC_ACQUIRE) != PLATFORM_THREAD_PARKED)
+        return FALSE;
+
+    for (i = 0; i < PLATFORM_GPR_COUNT; ++i)
+        pRegs[i] = (ULONG_PTR)hThread->pContext->uc_mcontext.gregs[order[i]];
+    return TRUE;
+}
+
+//-------------------------------------------------------------------------
+static BOOL PlatformSetThreadIP(PLATFORM_THREAD hThread, ULONG_PTR ip)
+{
+    if (__atomic_load_n(&hThread->state, __ATOMIC_ACQUIRE) != PLATFORM_THREAD_PARKED)
+        return FALSE;
+
+#if defined(__x86_64__)
+    hThread->pContext->uc_mcontext.gregs[REG_RIP] = (greg_t)ip;
+#else
+    hThread->pContext->uc_mcontext.gregs[REG_EIP] = (greg_t)ip;
+#endif
+    return TRUE;
+}
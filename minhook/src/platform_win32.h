@@ -0,0 +1,348 @@
+﻿/*
+ *  MinHook - The Minimalistic API Hooking Library for x64/x86
+ *  Copyright (C) 2009-2017 Tsuda Kageyu.
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ *  TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ *  PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER
+ *  OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ *  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ *  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ *  PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ *  LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ *  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ *  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <windows.h>
+#include <tlhelp32.h>
+
+typedef HANDLE PLATFORM_MUTEX;
+typedef HANDLE PLATFORM_HEAP;
+typedef HANDLE PLATFORM_THREAD;
+typedef DWORD  PLATFORM_PROTECTION;
+
+// Thread access rights for suspending/resuming threads.
+#define THREAD_ACCESS \
+    (THREAD_SUSPEND_RESUME | THREAD_GET_CONTEXT | THREAD_QUERY_INFORMATION | THREAD_SET_CONTEXT)
+
+//-------------------------------------------------------------------------
+static VOID PlatformGetAddressSpace(ULONG_PTR* pMin, ULONG_PTR* pMax, DWORD* pGranularity)
+{
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    *pMin = (ULONG_PTR)si.lpMinimumApplicationAddress;
+    *pMax = (ULONG_PTR)si.lpMaximumApplicationAddress;
+    *pGranularity = si.dwAllocationGranularity;
+}
+
+//-------------------------------------------------------------------------
+static BOOL PlatformQueryRegion(LPCVOID pAddress, PPLATFORM_REGION pRegion)
+{
+    MEMORY_BASIC_INFORMATION mi;
+    if (VirtualQuery(pAddress, &mi, sizeof(mi)) == 0)
+        return FALSE;
+
+    pRegion->base = (uintptr_t)mi.BaseAddress;
+    pRegion->size = mi.RegionSize;
+    pRegion->allocationBase = (uintptr_t)mi.AllocationBase;
+    pRegion->state = mi.State == MEM_COMMIT ? PLATFORM_MEM_COMMITTED
+        : mi.State == MEM_RESERVE ? PLATFORM_MEM_RESERVED : PLATFORM_MEM_FREE;
+
+    pRegion->protect = 0;
+    if (mi.State == MEM_COMMIT)
+    {
+        DWORD protect = mi.Protect & 0xFF;
+        if (protect & (PAGE_READONLY | PAGE_READWRITE | PAGE_WRITECOPY | PAGE_EXECUTE_READ | PAGE_EXECUTE_READWRITE | PAGE_EXECUTE_WRITECOPY))
+            pRegion->protect |= PLATFORM_PROT_READ;
+        if (protect & (PAGE_READWRITE | PAGE_WRITECOPY | PAGE_EXECUTE_READWRITE | PAGE_EXECUTE_WRITECOPY))
+            pRegion->protect |= PLATFORM_PROT_WRITE;
+        if (protect & (PAGE_EXECUTE | PAGE_EXECUTE_READ | PAGE_EXECUTE_READWRITE | PAGE_EXECUTE_WRITECOPY))
+            pRegion->protect |= PLATFORM_PROT_EXEC;
+        if (mi.Protect & PAGE_GUARD)
+            pRegion->protect |= PLATFORM_PROT_GUARD;
+    }
+    return TRUE;
+}
+
+//-------------------------------------------------------------------------
+static LPVOID PlatformReserve(LPVOID pAddress, SIZE_T size)
+{
+    return VirtualAlloc(pAddress, size, MEM_RESERVE, PAGE_EXECUTE_READWRITE);
+}
+
+//-------------------------------------------------------------------------
+static BOOL PlatformCommit(LPVOID pAddress, SIZE_T size)
+{
+    return VirtualAlloc(pAddress, size, MEM_COMMIT, PAGE_EXECUTE_READWRITE) != NULL;
+}
+
+//-------------------------------------------------------------------------
+static VOID PlatformDecommit(LPVOID pAddress, SIZE_T size)
+{
+    VirtualFree(pAddress, size, MEM_DECOMMIT);
+}
+
+//-------------------------------------------------------------------------
+static VOID PlatformRelease(LPVOID pAddress, SIZE_T size)
+{
+    UNREFERENCED_PARAMETER(size);
+    VirtualFree(pAddress, 0, MEM_RELEASE);
+}
+
+//-------------------------------------------------------------------------
+static BOOL PlatformUnprotect(LPVOID pAddress, SIZE_T size, PLATFORM_PROTECTION* pOld)
+{
+    return VirtualProtect(pAddress, size, PAGE_EXECUTE_READWRITE, pOld);
+}
+
+//-------------------------------------------------------------------------
+static VOID PlatformReprotect(LPVOID pAddress, SIZE_T size, const PLATFORM_PROTECTION* pOld)
+{
+    DWORD oldProtect;
+    VirtualProtect(pAddress, size, *pOld, &oldProtect);
+}
+
+//-------------------------------------------------------------------------
+static VOID PlatformFlushCode(LPVOID pAddress, SIZE_T size)
+{
+    FlushInstructionCache(GetCurrentProcess(), pAddress, size);
+}
+
+//-------------------------------------------------------------------------
+static BOOL PlatformGetMainImage(ULONG_PTR* pStart, ULONG_PTR* pEnd)
+{
+    PIMAGE_DOS_HEADER pDos = (PIMAGE_DOS_HEADER)GetModuleHandle(NULL);
+    PIMAGE_NT_HEADERS pNt;
+
+    if (pDos == NULL || pDos->e_magic != IMAGE_DOS_SIGNATURE)
+        return FALSE;
+
+    pNt = (PIMAGE_NT_HEADERS)((LPBYTE)pDos + pDos->e_lfanew);
+    if (pNt->Signature != IMAGE_NT_SIGNATURE)
+        return FALSE;
+
+    *pStart = (ULONG_PTR)pDos;
+    *pEnd = *pStart + pNt->OptionalHeader.SizeOfImage;
+    return TRUE;
+}
+
+//-------------------------------------------------------------------------
+static PLATFORM_HEAP PlatformHeapCreate(VOID)
+{
+    return HeapCreate(0, 0, 0);
+}
+
+static VOID PlatformHeapDestroy(PLATFORM_HEAP hHeap)
+{
+    HeapDestroy(hHeap);
+}
+
+static LPVOID PlatformAlloc(PLATFORM_HEAP hHeap, SIZE_T size)
+{
+    return HeapAlloc(hHeap, 0, size);
+}
+
+static LPVOID PlatformReAlloc(PLATFORM_HEAP hHeap, LPVOID p, SIZE_T size)
+{
+    return HeapReAlloc(hHeap, 0, p, size);
+}
+
+static VOID PlatformFree(PLATFORM_HEAP hHeap, LPVOID p)
+{
+    HeapFree(hHeap, 0, p);
+}
+
+//-------------------------------------------------------------------------
+// Named after the process, so that every module carrying its own copy of the engine takes the same lock.
+static PLATFORM_MUTEX PlatformCreateMutex(VOID)
+{
+    // minhook_multihook_12345678
+    // lebinka_hkkkkkkkk_12345678
+    TCHAR szMutexName[sizeof("lebinka_hkkkkkkkk_12345678")] = TEXT("lebinka_hkkkkkkkk_");
+    UINT mutexNameLen = sizeof("lebinka_hkkkkkkkk_") - 1;
+    DWORD dw = GetCurrentProcessId();
+    UINT i;
+
+    // Build szMutexName in the following format:
+    // printf("lebinka_hkkkkkkkk_%08X", GetCurrentProcessId());
+
+    for (i = 0; i < 8; i++)
+    {
+        TCHAR ch;
+        BYTE b = dw >> (32 - 4);
+
+        if (b < 0x0A)
+            ch = b + TEXT('0');
+        else
+            ch = b - 0x0A + TEXT('A');
+
+        szMutexName[mutexNameLen++] = ch;
+        dw <<= 4;
+    }
+
+    szMutexName[mutexNameLen] = TEXT('\0');
+
+    return CreateMutex(NULL, FALSE, szMutexName);
+}
+
+static BOOL PlatformLockMutex(PLATFORM_MUTEX hMutex)
+{
+    return WaitForSingleObject(hMutex, INFINITE) == WAIT_OBJECT_0;
+}
+
+static VOID PlatformUnlockMutex(PLATFORM_MUTEX hMutex)
+{
+    ReleaseMutex(hMutex);
+}
+
+static VOID PlatformDestroyMutex(PLATFORM_MUTEX hMutex)
+{
+    CloseHandle(hMutex);
+}
+
+//-------------------------------------------------------------------------
+static DWORD PlatformTickCount(VOID)
+{
+    return GetTickCount();
+}
+
+//-------------------------------------------------------------------------
+static VOID PlatformEnumerateOtherThreads(BOOL(*callback)(PLATFORM_THREAD hThread, LPVOID pContext), LPVOID pContext)
+{
+    HANDLE hSnapshot = CreateToolhelp32Snapshot(TH32CS_SNAPTHREAD, 0);
+    if (hSnapshot != INVALID_HANDLE_VALUE)
+    {
+        DWORD ti = GetCurrentThreadId(), pi = GetCurrentProcessId();
+        THREADENTRY32 te;
+        te.dwSize = sizeof(THREADENTRY32);
+        if (Thread32First(hSnapshot, &te))
+        {
+            do
+            {
+                if (te.dwSize >= (FIELD_OFFSET(THREADENTRY32, th32OwnerProcessID) + sizeof(DWORD))
+                    && te.th32OwnerProcessID == pi
+                    && te.th32ThreadID != ti)
+                {
+                    HANDLE hThread = OpenThread(THREAD_ACCESS, FALSE, te.th32ThreadID);
+                    if (hThread != NULL && !callback(hThread, pContext))
+                        break;
+                }
+
+                te.dwSize = sizeof(THREADENTRY32);
+            } while (Thread32Next(hSnapshot, &te));
+        }
+        CloseHandle(hSnapshot);
+    }
+}
+
+//-------------------------------------------------------------------------
+static BOOL PlatformSuspendThread(PLATFORM_THREAD hThread)
+{
+    return SuspendThread(hThread) != (DWORD)-1;
+}
+
+// SuspendThread() doesn't wait for the thread to stop, GetThreadContext() does.
+static BOOL PlatformWaitSuspended(PLATFORM_THREAD hThread)
+{
+    (void)hThread;
+    return TRUE;
+}
+
+static VOID PlatformResumeThread(PLATFORM_THREAD hThread)
+{
+    ResumeThread(hThread);
+}
+
+static VOID PlatformCloseThread(PLATFORM_THREAD hThread)
+{
+    CloseHandle(hThread);
+}
+
+//-------------------------------------------------------------------------
+static BOOL PlatformGetThreadRegisters(PLATFORM_THREAD hThread, ULONG_PTR* pIP, ULONG_PTR* pSP)
+{
+    CONTEXT c;
+    c.ContextFlags = CONTEXT_CONTROL;
+    if (!GetThreadContext(hThread, &c))
+        return FALSE;
+
+#if defined(_M_X64) || defined(__x86_64__)
+    *pIP = (ULONG_PTR)c.Rip;
+    *pSP = (ULONG_PTR)c.Rsp;
+#else
+    *pIP = (ULONG_PTR)c.Eip;
+    *pSP = (ULONG_PTR)c.Esp;
+#endif
+    return TRUE;
+}
+
+//-------------------------------------------------------------------------
+static BOOL PlatformGetThreadGprs(PLATFORM_THREAD hThread, ULONG_PTR* pRegs)
+{
+    CONTEXT c;
+    c.ContextFlags = CONTEXT_CONTROL | CONTEXT_INTEGER;
+    if (!GetThreadContext(hThread, &c))
+        return FALSE;
+
+#if defined(_M_X64) || defined(__x86_64__)
+    pRegs[0] = (ULONG_PTR)c.Rip;
+    pRegs[1] = (ULONG_PTR)c.Rsp;
+    pRegs[2] = (ULONG_PTR)c.Rax;
+    pRegs[3] = (ULONG_PTR)c.Rcx;
+    pRegs[4] = (ULONG_PTR)c.Rdx;
+    pRegs[5] = (ULONG_PTR)c.Rbx;
+    pRegs[6] = (ULONG_PTR)c.Rbp;
+    pRegs[7] = (ULONG_PTR)c.Rsi;
+    pRegs[8] = (ULONG_PTR)c.Rdi;
+    pRegs[9] = (ULONG_PTR)c.R8;
+    pRegs[10] = (ULONG_PTR)c.R9;
+    pRegs[11] = (ULONG_PTR)c.R10;
+    pRegs[12] = (ULONG_PTR)c.R11;
+    pRegs[13] = (ULONG_PTR)c.R12;
+    pRegs[14] = (ULONG_PTR)c.R13;
+    pRegs[15] = (ULONG_PTR)c.R14;
+    pRegs[16] = (ULONG_PTR)c.R15;
+#else
+    pRegs[0] = (ULONG_PTR)c.Eip;
+    pRegs[1] = (ULONG_PTR)c.Esp;
+    pRegs[2] = (ULONG_PTR)c.Eax;
+    pRegs[3] = (ULONG_PTR)c.Ecx;
+    pRegs[4] = (ULONG_PTR)c.Edx;
+    pRegs[5] = (ULONG_PTR)c.Ebx;
+    pRegs[6] = (ULONG_PTR)c.Ebp;
+    pRegs[7] = (ULONG_PTR)c.Esi;
+    pRegs[8] = (ULONG_PTR)c.Edi;
+#endif
+    return TRUE;
+}
+
+//-------------------------------------------------------------------------
+static BOOL PlatformSetThreadIP(PLATFORM_THREAD hThread, ULONG_PTR ip)
+{
+    CONTEXT c;
+    c.ContextFlags = CONTEXT_CONTROL;
+    if (!GetThreadContext(hThread, &c))
+        return FALSE;
+
+#if defined(_M_X64) || defined(__x86_64__)
+    c.Rip = ip;
+#else
+    c.Eip = ip;
+#endif
+    return SetThreadContext(hThread, &c);
+}
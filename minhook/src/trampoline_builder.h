@@ -0,0 +1,470 @@
+﻿/*
+ *  MinHook - The Minimalistic API Hooking Library for x64/x86
+ *  Copyright (C) 2009-2017 Tsuda Kageyu.
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ *  TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ *  PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER
+ *  OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ *  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ *  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ *  PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ *  LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ *  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ *  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+// The byte transformations behind trampolines and patches, without any OS dependency.
+// Everything here works on buffers and addresses passed in, so it can run on a copy
+// of the target's code, and be tested outside of the game.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(_M_X64) || defined(__x86_64__)
+#include "./hde/hde64.h"
+typedef hde64s HDE;
+#define HDE_DISASM(code, hs) hde64_disasm(code, hs)
+#else
+#include "./hde/hde32.h"
+typedef hde32s HDE;
+#define HDE_DISASM(code, hs) hde32_disasm(code, hs)
+#endif
+
+#pragma pack(push, 1)
+
+// Structs for writing x86/x64 instructions.
+
+// 8-bit relative jump.
+typedef struct _JMP_REL_SHORT
+{
+    uint8_t  opcode;      // EB xx: JMP +2+xx
+    uint8_t  operand;     // Relative destination address
+} JMP_REL_SHORT, *PJMP_REL_SHORT;
+
+// 32-bit direct relative jump/call.
+typedef struct _JMP_REL
+{
+    uint8_t  opcode;      // E9/E8 xxxxxxxx: JMP/CALL +5+xxxxxxxx
+    uint32_t operand;     // Relative destination address
+} JMP_REL, *PJMP_REL, CALL_REL;
+
+// 64-bit indirect absolute jump.
+typedef struct _JMP_ABS
+{
+    uint8_t  opcode0;     // FF25 00000000: JMP [+6]
+    uint8_t  opcode1;
+    uint32_t dummy;
+    uint64_t address;     // Absolute destination address
+} JMP_ABS, *PJMP_ABS;
+
+// 64-bit indirect absolute call.
+typedef struct _CALL_ABS
+{
+    uint8_t  opcode0;     // FF15 00000002: CALL [+6]
+    uint8_t  opcode1;
+    uint32_t dummy0;
+    uint8_t  dummy1;      // EB 08:         JMP +10
+    uint8_t  dummy2;
+    uint64_t address;     // Absolute destination address
+} CALL_ABS;
+
+// 32-bit direct relative conditional jumps.
+typedef struct _JCC_REL
+{
+    uint8_t  opcode0;     // 0F8* xxxxxxxx: J** +6+xxxxxxxx
+    uint8_t  opcode1;
+    uint32_t operand;     // Relative destination address
+} JCC_REL;
+
+// 64bit indirect absolute conditional jumps that x64 lacks.
+typedef struct _JCC_ABS
+{
+    uint8_t  opcode;      // 7* 0E:         J** +16
+    uint8_t  dummy0;
+    uint8_t  dummy1;      // FF25 00000000: JMP [+6]
+    uint8_t  dummy2;
+    uint32_t dummy3;
+    uint64_t address;     // Absolute destination address
+} JCC_ABS;
+
+#pragma pack(pop)
+
+#if defined(_M_X64) || defined(__x86_64__)
+    typedef JMP_ABS  JMP_RELAY;
+    typedef PJMP_ABS PJMP_RELAY;
+#else
+    typedef JMP_REL  JMP_RELAY;
+    typedef PJMP_REL PJMP_RELAY;
+#endif
+
+// Max number of instructions moved into a trampoline.
+#define TRAMPOLINE_MAX_IPS 8
+
+// Max number of target bytes BuildTrampoline may look at (every moved instruction at its longest).
+#define TRAMPOLINE_MAX_SOURCE (TRAMPOLINE_MAX_IPS * 15)
+
+// Max size of the patch written over the target: a JMP_REL, and a JMP_REL_SHORT when patching above.
+#define TRAMPOLINE_MAX_PATCH (sizeof(JMP_REL) + sizeof(JMP_REL_SHORT))
+
+typedef struct _TRAMPOLINE_BUILD
+{
+    const uint8_t* pSource;         // [In] Code of the target function, may be a copy of it.
+    size_t    sourceSize;           // [In] Number of bytes readable at pSource, TRAMPOLINE_MAX_SOURCE is always enough.
+    const uint8_t* pAbove;          // [In] The sizeof(JMP_REL) bytes right above the target, NULL if they aren't executable.
+    uintptr_t targetAddress;        // [In] Address the target function runs at.
+    uintptr_t trampolineAddress;    // [In] Address the trampoline function will run at.
+    uint8_t*  pTrampoline;          // [In] Buffer to write the trampoline function to.
+    unsigned  trampolineSize;       // [In] The size of that buffer.
+
+    unsigned  codeSize;             // [Out] Number of bytes of the trampoline function.
+    int       patchAbove;           // [Out] Should use the hot patch area?
+    unsigned  nIP;                  // [Out] Number of the instruction boundaries.
+    uint8_t   oldIPs[TRAMPOLINE_MAX_IPS];   // [Out] Instruction boundaries of the target function.
+    uint8_t   newIPs[TRAMPOLINE_MAX_IPS];   // [Out] Instruction boundaries of the trampoline function.
+} TRAMPOLINE_BUILD, *PTRAMPOLINE_BUILD;
+
+//-------------------------------------------------------------------------
+static int IsCodePadding(const uint8_t* pInst, size_t size)
+{
+    size_t i;
+
+    if (pInst[0] != 0x00 && pInst[0] != 0x90 && pInst[0] != 0xCC)
+        return 0;
+
+    for (i = 1; i < size; ++i)
+    {
+        if (pInst[i] != pInst[0])
+            return 0;
+    }
+    return 1;
+}
+
+//-------------------------------------------------------------------------
+// Can an instruction ending at 'from' reach 'to' with a 32-bit displacement?
+static int IsRel32Reachable(uintptr_t from, uintptr_t to)
+{
+#if defined(_M_X64) || defined(__x86_64__)
+    int64_t distance = (int64_t)(to - from);
+    return distance >= INT32_MIN && distance <= INT32_MAX;
+#else
+    (void)from;
+    (void)to;
+    return 1;
+#endif
+}
+
+//-------------------------------------------------------------------------
+// Move the first instructions of the target into a trampoline, which then jumps back to the rest of the target.
+// Branches are re-encoded for the trampoline's address: with a 32-bit displacement whenever it reaches,
+// otherwise (x64 only) with an absolute indirect form, which is 2-3 times longer.
+static int BuildTrampoline(PTRAMPOLINE_BUILD tb)
+{
+    CALL_REL callRel = { 0xE8, 0x00000000 };        // E8 xxxxxxxx: CALL +5+xxxxxxxx
+    JMP_REL  jmpRel = { 0xE9, 0x00000000 };         // E9 xxxxxxxx: JMP +5+xxxxxxxx
+    JCC_REL  jccRel = { 0x0F, 0x80, 0x00000000 };   // 0F8* xxxxxxxx: J** +6+xxxxxxxx
+#if defined(_M_X64) || defined(__x86_64__)
+    CALL_ABS callAbs = {
+        0xFF, 0x15, 0x00000002, // FF15 00000002: CALL [RIP+8]
+        0xEB, 0x08,             // EB 08:         JMP +10
+        0x0000000000000000ULL   // Absolute destination address
+    };
+    JMP_ABS jmpAbs = {
+        0xFF, 0x25, 0x00000000, // FF25 00000000: JMP [RIP+6]
+        0x0000000000000000ULL   // Absolute destination address
+    };
+    JCC_ABS jccAbs = {
+        0x70, 0x0E,             // 7* 0E:         J** +16
+        0xFF, 0x25, 0x00000000, // FF25 00000000: JMP [RIP+6]
+        0x0000000000000000ULL   // Absolute destination address
+    };
+    uint8_t   instBuf[16];
+#endif
+
+    uint8_t   oldPos = 0;
+    uint8_t   newPos = 0;
+    uintptr_t jmpDest = 0;      // Destination address of an internal jump.
+    int       resized = 0;      // Has an instruction changed its length so far?
+    int       finished = 0;     // Is the function completed?
+
+    tb->codeSize = 0;
+    tb->patchAbove = 0;
+    tb->nIP = 0;
+
+    do
+    {
+        HDE       hs;
+        unsigned  copySize;
+        const void* pCopySrc;
+        uintptr_t pOldInst = tb->targetAddress + oldPos;
+        uintptr_t pNewInst = tb->trampolineAddress + newPos;
+        uint8_t   window[32];
+        size_t    available;
+
+        if (oldPos >= sizeof(JMP_REL))
+        {
+            // The trampoline function is long enough.
+            // Complete the function with the jump to the target function,
+            // without decoding what follows: it is never moved, so it doesn't have to be understood.
+            if (IsRel32Reachable(pNewInst + sizeof(jmpRel), pOldInst))
+            {
+                jmpRel.operand = (uint32_t)(pOldInst - (pNewInst + sizeof(jmpRel)));
+                pCopySrc = &jmpRel;
+                copySize = sizeof(jmpRel);
+            }
+#if defined(_M_X64) || defined(__x86_64__)
+            else
+            {
+                jmpAbs.address = pOldInst;
+                pCopySrc = &jmpAbs;
+                copySize = sizeof(jmpAbs);
+            }
+#endif
+            if ((unsigned)newPos + copySize > tb->trampolineSize)
+                return 0;
+
+            memcpy(tb->pTrampoline + newPos, pCopySrc, copySize);
+            newPos += (uint8_t)copySize;
+            break;
+        }
+
+        // Decode from a zero-padded window, so that the decoder never reads past the source.
+        if (oldPos >= tb->sourceSize)
+            return 0;
+        available = tb->sourceSize - oldPos;
+        memset(window, 0, sizeof(window));
+        memcpy(window, tb->pSource + oldPos, available < sizeof(window) ? available : sizeof(window));
+
+        copySize = HDE_DISASM(window, &hs);
+        if ((hs.flags & F_ERROR) || hs.len > available)
+            return 0;
+
+        pCopySrc = tb->pSource + oldPos;
+#if defined(_M_X64) || defined(__x86_64__)
+        if ((hs.modrm & 0xC7) == 0x05)
+        {
+            // Instructions using RIP relative addressing. (ModR/M = 00???101B)
+
+            // Modify the RIP relative address.
+            uintptr_t dest = pOldInst + hs.len + (int32_t)hs.disp.disp32;
+            unsigned  relPos = hs.len - ((hs.flags & 0x3C) >> 2) - 4;
+            uint32_t  relAddr;
+
+            // Relative address is stored at (instruction length - immediate value length - 4),
+            // a malformed encoding could put it before the instruction.
+            if (!(hs.flags & F_DISP32) || hs.len < ((hs.flags & 0x3C) >> 2) + 4 + 1)
+                return 0;
+
+            if (!IsRel32Reachable(pNewInst + hs.len, dest))
+                return 0;
+
+            memcpy(instBuf, window, hs.len);
+            pCopySrc = instBuf;
+
+            relAddr = (uint32_t)(dest - (pNewInst + hs.len));
+            memcpy(instBuf + relPos, &relAddr, sizeof(relAddr));
+
+            // Complete the function if JMP (FF /4).
+            if (hs.opcode == 0xFF && hs.modrm_reg == 4)
+                finished = 1;
+        }
+        else
+#endif
+        if (hs.opcode == 0xE8)
+        {
+            // Direct relative CALL
+            uintptr_t dest = pOldInst + hs.len + (int32_t)hs.imm.imm32;
+            if (IsRel32Reachable(pNewInst + sizeof(callRel), dest))
+            {
+                callRel.operand = (uint32_t)(dest - (pNewInst + sizeof(callRel)));
+                pCopySrc = &callRel;
+                copySize = sizeof(callRel);
+            }
+#if defined(_M_X64) || defined(__x86_64__)
+            else
+            {
+                callAbs.address = dest;
+                pCopySrc = &callAbs;
+                copySize = sizeof(callAbs);
+            }
+#endif
+        }
+        else if ((hs.opcode & 0xFD) == 0xE9)
+        {
+            // Direct relative JMP (EB or E9)
+            uintptr_t dest = pOldInst + hs.len;
+
+            if (hs.opcode == 0xEB) // isShort jmp
+                dest += (int8_t)hs.imm.imm8;
+            else
+                dest += (int32_t)hs.imm.imm32;
+
+            // Simply copy an internal jump.
+            if (tb->targetAddress <= dest
+                && dest < (tb->targetAddress + sizeof(JMP_REL)))
+            {
+                // A backward jump over a re-encoded instruction would land in the wrong place.
+                if (dest <= pOldInst && resized)
+                    return 0;
+                if (jmpDest < dest)
+                    jmpDest = dest;
+            }
+            else
+            {
+                if (IsRel32Reachable(pNewInst + sizeof(jmpRel), dest))
+                {
+                    jmpRel.operand = (uint32_t)(dest - (pNewInst + sizeof(jmpRel)));
+                    pCopySrc = &jmpRel;
+                    copySize = sizeof(jmpRel);
+                }
+#if defined(_M_X64) || defined(__x86_64__)
+                else
+                {
+                    jmpAbs.address = dest;
+                    pCopySrc = &jmpAbs;
+                    copySize = sizeof(jmpAbs);
+                }
+#endif
+
+                // Exit the function if it is not in the branch.
+                finished = (pOldInst >= jmpDest);
+            }
+        }
+        else if ((hs.opcode & 0xF0) == 0x70
+            || (hs.opcode & 0xFC) == 0xE0
+            || (hs.opcode2 & 0xF0) == 0x80)
+        {
+            // Direct relative Jcc
+            uintptr_t dest = pOldInst + hs.len;
+
+            if ((hs.opcode & 0xF0) == 0x70      // Jcc
+                || (hs.opcode & 0xFC) == 0xE0)  // LOOPNZ/LOOPZ/LOOP/JECXZ
+                dest += (int8_t)hs.imm.imm8;
+            else
+                dest += (int32_t)hs.imm.imm32;
+
+            // Simply copy an internal jump.
+            if (tb->targetAddress <= dest
+                && dest < (tb->targetAddress + sizeof(JMP_REL)))
+            {
+                if (dest <= pOldInst && resized)
+                    return 0;
+                if (jmpDest < dest)
+                    jmpDest = dest;
+            }
+            else if ((hs.opcode & 0xFC) == 0xE0)
+            {
+                // LOOPNZ/LOOPZ/LOOP/JCXZ/JECXZ to the outside are not supported.
+                return 0;
+            }
+            else
+            {
+                uint8_t cond = ((hs.opcode != 0x0F ? hs.opcode : hs.opcode2) & 0x0F);
+                if (IsRel32Reachable(pNewInst + sizeof(jccRel), dest))
+                {
+                    jccRel.opcode1 = 0x80 | cond;
+                    jccRel.operand = (uint32_t)(dest - (pNewInst + sizeof(jccRel)));
+                    pCopySrc = &jccRel;
+                    copySize = sizeof(jccRel);
+                }
+#if defined(_M_X64) || defined(__x86_64__)
+                else
+                {
+                    // Invert the condition in x64 mode to simplify the conditional jump logic.
+                    jccAbs.opcode = 0x71 ^ cond;
+                    jccAbs.address = dest;
+                    pCopySrc = &jccAbs;
+                    copySize = sizeof(jccAbs);
+                }
+#endif
+            }
+        }
+        else if ((hs.opcode & 0xFE) == 0xC2)
+        {
+            // RET (C2 or C3)
+
+            // Complete the function if not in a branch.
+            finished = (pOldInst >= jmpDest);
+        }
+
+        // Can't alter the instruction length in a branch.
+        if (pOldInst < jmpDest && copySize != hs.len)
+            return 0;
+
+        // Trampoline function is too large.
+        if ((unsigned)newPos + copySize > tb->trampolineSize)
+            return 0;
+
+        // Trampoline function has too many instructions.
+        if (tb->nIP >= TRAMPOLINE_MAX_IPS)
+            return 0;
+
+        tb->oldIPs[tb->nIP] = oldPos;
+        tb->newIPs[tb->nIP] = newPos;
+        tb->nIP++;
+
+        resized |= (copySize != hs.len);
+
+        memcpy(tb->pTrampoline + newPos, pCopySrc, copySize);
+        newPos += (uint8_t)copySize;
+        oldPos += hs.len;
+    } while (!finished);
+
+    tb->codeSize = newPos;
+
+    // Is there enough place for a long jump?
+    if (oldPos < sizeof(JMP_REL)
+        && (tb->sourceSize < sizeof(JMP_REL) || !IsCodePadding(tb->pSource + oldPos, sizeof(JMP_REL) - oldPos)))
+    {
+        // Is there enough place for a short jump?
+        if (oldPos < sizeof(JMP_REL_SHORT)
+            && (tb->sourceSize < sizeof(JMP_REL_SHORT) || !IsCodePadding(tb->pSource + oldPos, sizeof(JMP_REL_SHORT) - oldPos)))
+        {
+            return 0;
+        }
+
+        // Can we place the long jump above the function?
+        if (!tb->pAbove || !IsCodePadding(tb->pAbove, sizeof(JMP_REL)))
+            return 0;
+
+        tb->patchAbove = 1;
+    }
+
+    return 1;
+}
+
+//-------------------------------------------------------------------------
+// Build the bytes redirecting the target to its relay, to be written at (target - sizeof(JMP_REL)) when patching above.
+// Returns their count, 0 if the relay is out of reach of a JMP_REL.
+static unsigned BuildPatch(uintptr_t targetAddress, uintptr_t relayAddress, int patchAbove, uint8_t* pPatch)
+{
+    uintptr_t jmpAddress = patchAbove ? targetAddress - sizeof(JMP_REL) : targetAddress;
+    JMP_REL jmp = { 0xE9, 0x00000000 };
+    JMP_REL_SHORT shortJmp = { 0xEB, (uint8_t)(0 - (sizeof(JMP_REL_SHORT) + sizeof(JMP_REL))) };
+
+    if (!IsRel32Reachable(jmpAddress + sizeof(JMP_REL), relayAddress))
+        return 0;
+
+    jmp.operand = (uint32_t)(relayAddress - (jmpAddress + sizeof(JMP_REL)));
+    memcpy(pPatch, &jmp, sizeof(jmp));
+    if (!patchAbove)
+        return sizeof(JMP_REL);
+
+    memcpy(pPatch + sizeof(JMP_REL), &shortJmp, sizeof(shortJmp));
+    return sizeof(JMP_REL) + sizeof(JMP_REL_SHORT);
+}
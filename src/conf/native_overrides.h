@@ -0,0 +1,127 @@
+#pragma once
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "../utils/io.h"
+#include "../spi/interface.h"
+
+
+#ifndef ASI_NATIVES_FNAME
+#error Must set ASI native overrides filename!
+#endif
+
+
+// Natives replaced by the console enabler when UFunction::Bind binds a function, one override per line:
+//   <function name>  <games it applies to, e.g. LE1,LE3>  <replacement native>
+// Anything after a '#' is a comment. The file lives next to the log, and the defaults below are used without one.
+
+constexpr const char* NativeOverridesDefault =
+    "IsShippingPCBuild                LE1,LE2,LE3  AlwaysPositiveNative\n"
+    "IsShippingBuild                  LE1,LE2,LE3  AlwaysPositiveNative\n"
+    "IsFinalReleaseDebugConsoleBuild  LE1,LE2,LE3  AlwaysPositiveNative\n"
+    "# Thanks to Mgamerz's research into why LE3 profiles disappeared:\n"
+    "IsShip                           LE3          AlwaysNegativeNative\n";
+
+struct NativeOverrideConfig
+{
+    std::string Function;
+    int GameMask;  // SPI_GAME_LE1 | SPI_GAME_LE2 | SPI_GAME_LE3
+    std::string Native;
+};
+
+
+// Parse "LE1,LE3" into a mask of SPI_GAME_* flags, zero if anything is unknown.
+int ParseNativeOverrideGames(const std::string& text)
+{
+    int mask = 0;
+    size_t start = 0;
+    while (start <= text.size())
+    {
+        auto end = text.find(',', start);
+        if (end == std::string::npos)
+        {
+            end = text.size();
+        }
+
+        auto game = text.substr(start, end - start);
+        if (game == "LE1")       mask |= SPI_GAME_LE1;
+        else if (game == "LE2")  mask |= SPI_GAME_LE2;
+        else if (game == "LE3")  mask |= SPI_GAME_LE3;
+        else                     return 0;
+
+        start = end + 1;
+    }
+    return mask;
+}
+
+// Parse the text of an overrides file, logging and skipping lines that don't make sense.
+void ParseNativeOverrides(const char* text, std::vector<NativeOverrideConfig>& outOverrides)
+{
+    int lineNumber = 0;
+    while (*text != '\0')
+    {
+        lineNumber++;
+
+        auto lineEnd = strchr(text, '\n');
+        std::string line{ text, lineEnd ? static_cast<size_t>(lineEnd - text) : strlen(text) };
+        text = lineEnd ? lineEnd + 1 : text + line.size();
+
+        auto comment = line.find('#');
+        if (comment != std::string::npos)
+        {
+            line.resize(comment);
+        }
+
+        std::vector<std::string> tokens;
+        size_t position = 0;
+        while (true)
+        {
+            auto start = line.find_first_not_of(" \t\r", position);
+            if (start == std::string::npos)
+            {
+                break;
+            }
+            position = line.find_first_of(" \t\r", start);
+            tokens.push_back(line.substr(start, position == std::string::npos ? std::string::npos : position - start));
+        }
+
+        if (tokens.empty())
+        {
+            continue;
+        }
+
+        int gameMask = tokens.size() == 3 ? ParseNativeOverrideGames(tokens[1]) : 0;
+        if (gameMask == 0)
+        {
+            GLogger.writeln(L"ParseNativeOverrides: ERROR: ignoring line %d, expected <function> <games> <native>.", lineNumber);
+            continue;
+        }
+
+        outOverrides.push_back({ tokens[0], gameMask, tokens[2] });
+    }
+}
+
+// Read the overrides file, or the defaults if there isn't one.
+void LoadNativeOverrides(std::vector<NativeOverrideConfig>& outOverrides)
+{
+    FILE* file = fopen(ASI_NATIVES_FNAME, "rb");
+    if (file == nullptr)
+    {
+        ParseNativeOverrides(NativeOverridesDefault, outOverrides);
+        return;
+    }
+
+    std::string text;
+    char buffer[4096];
+    size_t read;
+    while ((read = fread(buffer, 1, sizeof(buffer), file)) > 0)
+    {
+        text.append(buffer, read);
+    }
+    fclose(file);
+
+    GLogger.writeln(L"LoadNativeOverrides: using " ASI_NATIVES_FNAME L".");
+    ParseNativeOverrides(text.c_str(), outOverrides);
+}
@@ -1,5 +1,8 @@
 #include "dllexports.h"
 #define ASI_LOG_FNAME "bink2w64_proxy.log"
+#define ASI_SIGCACHE_FNAME "bink2w64_proxy.sigcache"
+#define ASI_NATIVES_FNAME "bink2w64_proxy.natives"
+#define ASI_SCRIPTPROF_FNAME "bink2w64_proxy_script"
 
 #include <Windows.h>
 #include <Dbghelp.h>
@@ -12,10 +15,12 @@
 #include "utils/hook.h"
 #include "dllstruct.h"
 #include "utils/memory.h"
+#include "utils/thread_registry.h"
 #include "spi.h"
 #include "modules/asi_loader.h"
 #include "modules/console_enabler.h"
 #include "modules/launcher_args.h"
+#include "modules/script_profiler.h"
 
 
 PVOID GhVEH = NULL;
@@ -138,13 +143,24 @@ void __stdcall OnAttach()
         return;
     }
 
+    // Suspend threads from the registry when enabling and disabling hooks, instead of a snapshot each time.
+    MH_THREAD_SOURCE threadSource{ Utils::ThreadRegistry::AcquireForHooks, Utils::ThreadRegistry::ReleaseForHooks, &GThreadRegistry };
+    MH_SetThreadSource(&threadSource);
+
+    // With -profilehooks, instrument every hook installed from here on, ours and plugins' alike.
+    if (nullptr != std::wcsstr(GetCommandLineW(), L" -profilehooks"))
+    {
+        GHookProfiler.Enable();
+    }
+
     // Initialize global settings.
     GLEBinkProxy.Initialize();
 
-    // Register modules (console enabler, launcher arg handler, asi loader).
+    // Register modules (console enabler, launcher arg handler, asi loader, script profiler).
     GLEBinkProxy.AsiLoader = new AsiLoaderModule;
     GLEBinkProxy.ConsoleEnabler = new ConsoleEnablerModule;
     GLEBinkProxy.LauncherArgs = new LauncherArgsModule;
+    GLEBinkProxy.ScriptProfiler = new ScriptProfilerModule;
 
     // Spawn the SPI implementation.
     GLEBinkProxy.SPI = new SPI::SharedProxyInterface();
@@ -175,6 +191,13 @@ void __stdcall OnAttach()
             // Keep trying to find a pattern we are *almost* guaranteed to have until we find it.
             DRM::WaitForDRMv3();
 
+            // With -profilescript, time every UnrealScript function bound from here on.
+            if (nullptr != std::wcsstr(GetCommandLineW(), L" -profilescript")
+                && !GLEBinkProxy.ScriptProfiler->Activate())
+            {
+                GLogger.writeln(L"OnAttach: ERROR: script profiler activation failed.");
+            }
+
             // Unlock the console.
             if (!GLEBinkProxy.ConsoleEnabler->Activate())
             {
@@ -216,6 +239,9 @@ void __stdcall OnDetach()
     if (GLEBinkProxy.LauncherArgs)    GLEBinkProxy.LauncherArgs->Deactivate();
     if (GLEBinkProxy.ConsoleEnabler)  GLEBinkProxy.ConsoleEnabler->Deactivate();
 
+    // Writes the report of a profiling session.
+    if (GLEBinkProxy.ScriptProfiler)  GLEBinkProxy.ScriptProfiler->Deactivate();
+
     GLogger.writeln(L"OnDetach: goodbye, I thought we were friends :(");
     Utils::TeardownOutput();
 
@@ -233,6 +259,14 @@ BOOL WINAPI DllMain(HMODULE hModule, DWORD dwReason, LPVOID lpReserved) {
         OnDetach();
         return TRUE;
 
+    case DLL_THREAD_ATTACH:
+        GThreadRegistry.OnThreadAttach();
+        return TRUE;
+
+    case DLL_THREAD_DETACH:
+        GThreadRegistry.OnThreadDetach();
+        return TRUE;
+
     default:
         return TRUE;
     }
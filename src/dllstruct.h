@@ -12,6 +12,7 @@
 class AsiLoaderModule;
 class ConsoleEnablerModule;
 class LauncherArgsModule;
+class ScriptProfilerModule;
 
 
 struct LEBinkProxy
@@ -27,6 +28,7 @@ public:
     AsiLoaderModule*       AsiLoader;
     ConsoleEnablerModule*  ConsoleEnabler;
     LauncherArgsModule*    LauncherArgs;
+    ScriptProfilerModule*  ScriptProfiler;
 
     ISharedProxyInterface* SPI;
 
@@ -1,9 +1,13 @@
 #pragma once
 
+#include <algorithm>
+#include <cstring>
+#include <vector>
 #include "gamever.h"
 #include "utils/io.h"
 #include "utils/event.h"
 #include "utils/hook.h"
+#include "utils/memory.h"
 #include "dllstruct.h"
 
 
@@ -62,39 +66,158 @@ namespace DRM
     // Version 3
     // ======================================================================
 
+    // Give up waiting after this long; the old busy poll gave up after 20000 full scans.
+    constexpr DWORD DRMv3_TimeoutMs = 60000;
+
+    // Trust a cached offset for this long before also watching the rest of the module.
+    constexpr DWORD DRMv3_CachedOnlyMs = 5000;
+
+    constexpr size_t DRMv3_PageSize = 0x1000;
+
+    // Cheap fingerprint of a page: eight qwords spread over it.
+    // Decrypting a page rewrites all of it, so this flips as soon as a pass touches it.
+    std::uint64_t SamplePageChecksum_(const BYTE* page, size_t length)
+    {
+        std::uint64_t checksum = 0;
+        for (size_t offset = 0; offset + sizeof(std::uint64_t) <= length; offset += DRMv3_PageSize / 8)
+        {
+            std::uint64_t value;
+            memcpy(&value, page + offset, sizeof(value));
+            checksum = (checksum ^ value) * 0x100000001B3ull;
+        }
+        return checksum;
+    }
+
     void WaitForDRMv3()
     {
-        int iterations = 0;
-        bool foundPattern = false;
-        BYTE* offset = nullptr;
+        LARGE_INTEGER frequency, started, now;
+        QueryPerformanceFrequency(&frequency);
+        QueryPerformanceCounter(&started);
+        auto elapsedMs = [&]() -> double
+        {
+            QueryPerformanceCounter(&now);
+            return static_cast<double>(now.QuadPart - started.QuadPart) * 1000.0 / static_cast<double>(frequency.QuadPart);
+        };
+
+        Utils::PatternView view;
+        switch (GLEBinkProxy.Game)
+        {
+        case LEGameVersion::LE1:
+            view = LE1_UFunctionBind_Pattern.View();
+            break;
+        case LEGameVersion::LE2:
+            view = LE2_UFunctionBind_Pattern.View();
+            break;
+        case LEGameVersion::LE3:
+            view = LE3_UFunctionBind_Pattern.View();
+            break;
+        default:
+            return;
+        }
+
+        BYTE* moduleStart, * moduleEnd;
+        std::vector<Utils::ModuleRange> ranges;
+        if (!Utils::GetGameModuleRange(&moduleStart, &moduleEnd) || !Utils::GetGameModuleScanRanges(nullptr, ranges))
+        {
+            GLogger.writeln(L"WaitForDRMv3: ERROR: nothing to scan, not waiting.");
+            return;
+        }
+
+        // The console enabler caches where the pattern ends up once unpacked (see findOffsets_),
+        // so on most launches polling that single address is enough.
+        const BYTE* cached = nullptr;
+        std::uint32_t cachedRva = 0;
+        auto key = Utils::SignatureCache::HashPattern(view, nullptr, true);
+        if (GSignatureCache.Lookup(moduleStart, moduleEnd - moduleStart, key, &cachedRva)
+            && cachedRva < static_cast<size_t>(moduleEnd - moduleStart) && static_cast<size_t>(moduleEnd - moduleStart) - cachedRva >= view.Length)
+        {
+            cached = moduleStart + cachedRva;
+        }
 
-        do
+        // Otherwise, keep a sampled checksum of every page and only scan pages that changed
+        // during the last two polls (a page may still have been mid-decryption when it was first seen changing).
+        struct WatchedPage
+        {
+            const BYTE* Start;
+            const BYTE* End;
+            const BYTE* ScanEnd;  // matches starting in this page may run into the next one
+            std::uint64_t Checksum;
+            int Age;
+        };
+        std::vector<WatchedPage> pages;
+        for (auto& range : ranges)
         {
-            switch (GLEBinkProxy.Game)
+            for (auto page = range.Start; page < range.End; page += DRMv3_PageSize)
             {
-            case LEGameVersion::LE1:
-                foundPattern = nullptr != Utils::ScanProcess(LE1_UFunctionBind_Pattern, LE1_UFunctionBind_Mask);
-                break;
-            case LEGameVersion::LE2:
-                foundPattern = nullptr != Utils::ScanProcess(LE2_UFunctionBind_Pattern, LE2_UFunctionBind_Mask);
-                break;
-            case LEGameVersion::LE3:
-                foundPattern = nullptr != Utils::ScanProcess(LE3_UFunctionBind_Pattern, LE3_UFunctionBind_Mask);
+                auto pageEnd = (std::min)(page + DRMv3_PageSize, range.End);
+                pages.push_back({ page, pageEnd, (std::min)(pageEnd + view.Length - 1, range.End), 0, 0 });
+            }
+        }
+
+        const BYTE* found = nullptr;
+        int polls = 0, pageScans = 0;
+        DWORD backoffMs = 0;
+        bool firstPass = true;
+
+        while (!found && elapsedMs() < DRMv3_TimeoutMs)
+        {
+            polls++;
+
+            if (cached && Utils::MatchesAt_(cached, view))
+            {
+                found = cached;
                 break;
-            default:
-                foundPattern = true;
             }
 
-            iterations++;
+            if (!cached || elapsedMs() >= DRMv3_CachedOnlyMs)
+            {
+                for (size_t i = 0; i < pages.size() && !found; i++)
+                {
+                    auto& page = pages[i];
+                    auto checksum = SamplePageChecksum_(page.Start, page.End - page.Start);
+                    if (firstPass)
+                    {
+                        page.Age = 1;
+                    }
+                    else if (checksum != page.Checksum)
+                    {
+                        page.Age = 2;
+
+                        // Matches starting in the previous page run into this one, and it was scanned before this one changed.
+                        if (i > 0 && pages[i - 1].ScanEnd > page.Start)
+                        {
+                            auto& previous = pages[i - 1];
+                            previous.Age = 1;
+                            pageScans++;
+                            found = Utils::FindPattern(previous.Start, previous.ScanEnd, view);
+                        }
+                    }
+                    page.Checksum = checksum;
+
+                    if (page.Age > 0 && !found)
+                    {
+                        page.Age--;
+                        pageScans++;
+                        found = Utils::FindPattern(page.Start, page.ScanEnd, view);
+                    }
+                }
+                firstPass = false;
+            }
 
-        } while (!foundPattern && iterations < 20000);
+            if (!found)
+            {
+                Sleep(backoffMs);
+                backoffMs = backoffMs == 0 ? 1 : (std::min)(backoffMs * 2, static_cast<DWORD>(16));
+            }
+        }
 
-        if (!foundPattern)
+        if (!found)
         {
-            GLogger.writeln(L"WaitForDRMv3 - FAILED TO FIND THE PATTERN in %d iteration(s), but still stopping the poll because YOLO.", iterations);
+            GLogger.writeln(L"WaitForDRMv3: FAILED TO FIND THE PATTERN in %.1f ms (%d polls, %d page scans), but still stopping the poll because YOLO.", elapsedMs(), polls, pageScans);
             return;
         }
 
-        GLogger.writeln(L"WaitForDRMv3 - found the pattern in %d iteration(s), stopping the poll.", iterations);
+        GLogger.writeln(L"WaitForDRMv3: found the pattern at %p in %.1f ms (%d polls, %d page scans%s), stopping the poll.",
+            found, elapsedMs(), polls, pageScans, found == cached ? L", cached offset" : L"");
     }
 }
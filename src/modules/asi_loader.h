@@ -5,6 +5,7 @@
 #include "../utils/io.h"
 #include "_base.h"
 #include "../spi/interface.h"
+#include "../spi/implementation.h"
 
 
 typedef void(* AsiSpiSupportType)(wchar_t** name, wchar_t** author, wchar_t** version, int* gameIndex, int* spiMinVersion);
@@ -435,6 +436,11 @@ public:
             {
                 GLogger.writeln(L"AsiLoaderModule.Deactivate:   ERROR: detach reported a failure, continuing...");
             }
+
+            if (loadInfo.SupportsSPI())
+            {
+                static_cast<SPI::SharedProxyInterface*>(GLEBinkProxy.SPI)->OnPluginDetached(loadInfo.LibInstance);
+            }
         }
     }
 
@@ -9,14 +9,13 @@
 #include "ue_types.h"
 
 
-#define FIND_PATTERN(TYPE,VAR,NAME,PAT,MASK) \
-temp = Utils::ScanProcess(PAT, MASK); \
-if (!temp) { \
+#define SET_FOUND_PATTERN(TYPE,VAR,NAME,REQUEST) \
+if (!(REQUEST).Result) { \
     GLogger.writeln(L"findOffsets_: ERROR: failed to find " NAME L"."); \
     return false; \
 } \
-GLogger.writeln(L"findOffsets_: found " NAME L" at %p.", temp); \
-VAR = (TYPE)temp;
+GLogger.writeln(L"findOffsets_: found " NAME L" at %p.", (REQUEST).Result); \
+VAR = (TYPE)(REQUEST).Result;
 
 
 class ConsoleEnablerModule
@@ -32,21 +31,31 @@ private:
 
     bool findOffsets_()
     {
-        BYTE* temp = nullptr;
+        // All signatures of a game match function starts, and are resolved in a single pass over them.
+        Utils::ScanRequest requests[2];
 
         switch (GLEBinkProxy.Game)
         {
         case LEGameVersion::LE1:
-            FIND_PATTERN(UE::tUFunctionBind, UE::UFunctionBind, L"UFunction::Bind", LE1_UFunctionBind_Pattern, LE1_UFunctionBind_Mask);
-            FIND_PATTERN(UE::tGetName, UE::GetName, L"GetName", LE1_GetName_Pattern, LE1_GetName_Mask);
+            requests[0] = { LE1_UFunctionBind_Pattern.View() };
+            requests[1] = { LE1_GetName_Pattern.View() };
+            Utils::ScanProcessBatch(requests, 2, nullptr, Utils::ScanAnchor::FunctionStart);
+            SET_FOUND_PATTERN(UE::tUFunctionBind, UE::UFunctionBind, L"UFunction::Bind", requests[0]);
+            SET_FOUND_PATTERN(UE::tGetName, UE::GetName, L"GetName", requests[1]);
             break;
         case LEGameVersion::LE2:
-            FIND_PATTERN(UE::tUFunctionBind, UE::UFunctionBind, L"UFunction::Bind", LE2_UFunctionBind_Pattern, LE2_UFunctionBind_Mask);
-            FIND_PATTERN(UE::tGetName, UE::NewGetName, L"NewGetName", LE2_NewGetName_Pattern, LE2_NewGetName_Mask);
+            requests[0] = { LE2_UFunctionBind_Pattern.View() };
+            requests[1] = { LE2_NewGetName_Pattern.View() };
+            Utils::ScanProcessBatch(requests, 2, nullptr, Utils::ScanAnchor::FunctionStart);
+            SET_FOUND_PATTERN(UE::tUFunctionBind, UE::UFunctionBind, L"UFunction::Bind", requests[0]);
+            SET_FOUND_PATTERN(UE::tGetName, UE::NewGetName, L"NewGetName", requests[1]);
             break;
         case LEGameVersion::LE3:
-            FIND_PATTERN(UE::tUFunctionBind, UE::UFunctionBind, L"UFunction::Bind", LE3_UFunctionBind_Pattern, LE3_UFunctionBind_Mask);
-            FIND_PATTERN(UE::tGetName, UE::NewGetName, L"NewGetName", LE3_NewGetName_Pattern, LE3_NewGetName_Mask);
+            requests[0] = { LE3_UFunctionBind_Pattern.View() };
+            requests[1] = { LE3_NewGetName_Pattern.View() };
+            Utils::ScanProcessBatch(requests, 2, nullptr, Utils::ScanAnchor::FunctionStart);
+            SET_FOUND_PATTERN(UE::tUFunctionBind, UE::UFunctionBind, L"UFunction::Bind", requests[0]);
+            SET_FOUND_PATTERN(UE::tGetName, UE::NewGetName, L"NewGetName", requests[1]);
             break;
         default:
             GLogger.writeln(L"findOffsets_: ERROR: unsupported game version.");
@@ -59,7 +68,13 @@ private:
     {
         GLogger.writeln(L"detourOffsets_: installing %p into %p, preserving into %p",
             UE::HookedUFunctionBind, UE::UFunctionBind, reinterpret_cast<LPVOID*>(&UE::UFunctionBind_orig));
-        return GHookManager.Install(UE::UFunctionBind, UE::HookedUFunctionBind, reinterpret_cast<LPVOID*>(&UE::UFunctionBind_orig), "UFunctionBind");
+
+        // Every detour of the module goes in together, so the game's threads are only suspended once.
+        Utils::HookRequest requests[] =
+        {
+            { UE::UFunctionBind, UE::HookedUFunctionBind, reinterpret_cast<LPVOID*>(&UE::UFunctionBind_orig), "UFunctionBind" },
+        };
+        return GHookManager.InstallBatch(requests, ARRAYSIZE(requests));
     }
 
 public:
@@ -76,6 +91,11 @@ public:
             return false;
         }
 
+        if (!UE::GNativeOverrides.Initialize(GLEBinkProxy.Game))
+        {
+            return false;
+        }
+
         if (!this->detourOffsets_())
         {
             return false;
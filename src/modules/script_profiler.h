@@ -0,0 +1,492 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <intrin.h>
+#include <Windows.h>
+#include "../utils/codegen.h"
+#include "../utils/hook_stats.h"
+#include "../utils/io.h"
+#include "../utils/per_thread.h"
+#include "../dllstruct.h"
+#include "_base.h"
+#include "ue_types.h"
+
+
+#ifndef ASI_SCRIPTPROF_FNAME
+#error Must set ASI script profile filename!
+#endif
+
+
+// Opt-in profiler of UnrealScript functions, for finding out which ones cause hitches.
+//
+// The proxy's UFunction::Bind hook sees every function the game binds, and leaves its Func pointing at either
+// the native or UObject::ProcessInternal, through which both ProcessEvent and CallFunction dispatch it.
+// The profiler swaps Func for a small generated thunk which times the call, so no signature of the VM is needed.
+// Script functions called from script which the VM runs without going through Func, and natives called
+// straight from the GNatives table, are not seen: their time counts as exclusive time of their caller.
+//
+// Every thread records into its own call tree keyed by FName index, holding calls, inclusive and exclusive time
+// per call path, plus a ring of the most recent calls slower than SlowCallMicros_. Pressing Ctrl+Shift+F12,
+// or exiting the game, writes:
+//   ASI_SCRIPTPROF_FNAME.txt     Functions sorted by exclusive time, same-named functions of different classes merged.
+//   ASI_SCRIPTPROF_FNAME.folded  Exclusive time per call path in microseconds, for flamegraph.pl or speedscope.
+//   ASI_SCRIPTPROF_FNAME.json    The slow calls, for chrome://tracing or Perfetto.
+
+class ScriptProfilerModule
+    : public IModule
+{
+private:
+    static constexpr std::uint32_t MaxDepth_ = 256;
+    static constexpr std::uint32_t NodesPerChunk_ = 4096;
+    static constexpr std::uint32_t MaxChunks_ = 1024;
+    static constexpr std::uint32_t TraceCapacity_ = 65536;
+    static constexpr std::uint64_t SlowCallMicros_ = 100;
+    static constexpr DWORD HotkeyPollMs_ = 100;
+
+    // Lives right after the code of its thunk.
+    struct Function_
+    {
+        void* Original;
+        std::int32_t NameIndex;
+    };
+
+    // lea r9, [rip+11h] (the record, 24 bytes into the thunk); jmp [rip], followed by the address of dispatch_.
+    static constexpr BYTE ThunkPrefix_[13] = { 0x4C, 0x8D, 0x0D, 0x11, 0x00, 0x00, 0x00, 0xFF, 0x25, 0x00, 0x00, 0x00, 0x00 };
+
+    // A call path: the function called, and the node of its caller.
+    // Counters are only ever written by the owning thread, and read by whoever writes the report.
+    struct Node_
+    {
+        std::uint32_t Parent;
+        std::int32_t NameIndex;
+        std::atomic<std::uint64_t> Calls;
+        std::atomic<std::uint64_t> InclusiveTicks;
+        std::atomic<std::uint64_t> ExclusiveTicks;
+    };
+
+    struct Frame_
+    {
+        std::uint32_t Node;
+        std::uint64_t Start;
+        std::uint64_t ChildTicks;
+    };
+
+    struct TraceEvent_
+    {
+        std::uint64_t Start;
+        std::uint64_t Ticks;
+        std::int32_t NameIndex;
+    };
+
+    struct ThreadState_
+    {
+        DWORD ThreadId;
+
+        // Nodes are only appended, and published by NodeCount once written.
+        std::atomic<Node_*> Chunks[MaxChunks_];
+        std::atomic<std::uint32_t> NodeCount;
+
+        // (parent, name) to node, only used by the owning thread.
+        std::vector<std::uint64_t> IndexKeys;
+        std::vector<std::uint32_t> IndexNodes;
+
+        Frame_ Frames[MaxDepth_];
+        std::uint32_t Depth;
+
+        TraceEvent_ Trace[TraceCapacity_];
+        std::atomic<std::uint64_t> TraceCount;
+    };
+
+    static inline ScriptProfilerModule* instance_ = nullptr;
+
+    Utils::PerThread<ThreadState_> threads_;
+    std::uint64_t ticksPerSecond_ = 0;
+    std::uint64_t slowCallTicks_ = 0;
+    std::uint64_t startTicks_ = 0;
+    void (*wrap_)(UE::UObjectPartial* pFunction) = nullptr;
+    std::atomic<std::uint64_t> wrapped_{ 0 };
+
+    // Methods.
+
+    static Node_& node_(ThreadState_* state, std::uint32_t index)
+    {
+        return state->Chunks[index / NodesPerChunk_].load(std::memory_order_relaxed)[index % NodesPerChunk_];
+    }
+
+    static std::uint32_t appendNode_(ThreadState_* state, std::uint32_t parent, std::int32_t nameIndex)
+    {
+        auto index = state->NodeCount.load(std::memory_order_relaxed);
+        auto& chunk = state->Chunks[index / NodesPerChunk_];
+        if (!chunk.load(std::memory_order_relaxed))
+        {
+            chunk.store(new Node_[NodesPerChunk_](), std::memory_order_release);
+        }
+
+        auto& node = node_(state, index);
+        node.Parent = parent;
+        node.NameIndex = nameIndex;
+        state->NodeCount.store(index + 1, std::memory_order_release);
+        return index;
+    }
+
+    static ThreadState_* threadState_()
+    {
+        return instance_->threads_.Get([](ThreadState_* state)
+        {
+            state->ThreadId = GetCurrentThreadId();
+            state->IndexKeys.assign(4096, 0);
+            state->IndexNodes.assign(4096, 0);
+            appendNode_(state, 0, -1);  // the root, i.e. whatever called into script
+        });
+    }
+
+    // The node of a function called from a given node, created on first call.
+    static std::uint32_t child_(ThreadState_* state, std::uint32_t parent, std::int32_t nameIndex)
+    {
+        // Node 0 is the root and never a child, so a zero node marks an empty slot.
+        auto key = (static_cast<std::uint64_t>(parent) << 32) | static_cast<std::uint32_t>(nameIndex);
+        auto mask = state->IndexKeys.size() - 1;
+        auto slot = static_cast<size_t>((key * 0x9E3779B97F4A7C15ull) >> 40) & mask;
+        for (; state->IndexNodes[slot] != 0; slot = (slot + 1) & mask)
+        {
+            if (state->IndexKeys[slot] == key)
+            {
+                return state->IndexNodes[slot];
+            }
+        }
+
+        // Out of nodes: keep counting into the caller.
+        if (state->NodeCount.load(std::memory_order_relaxed) == NodesPerChunk_ * MaxChunks_)
+        {
+            return parent;
+        }
+
+        auto created = appendNode_(state, parent, nameIndex);
+        state->IndexKeys[slot] = key;
+        state->IndexNodes[slot] = created;
+
+        if (static_cast<size_t>(created) * 2 > state->IndexKeys.size())
+        {
+            std::vector<std::uint64_t> keys(state->IndexKeys.size() * 2, 0);
+            std::vector<std::uint32_t> nodes(keys.size(), 0);
+            for (size_t i = 0; i < state->IndexKeys.size(); i++)
+            {
+                if (state->IndexNodes[i] == 0)
+                {
+                    continue;
+                }
+                auto moved = static_cast<size_t>((state->IndexKeys[i] * 0x9E3779B97F4A7C15ull) >> 40) & (keys.size() - 1);
+                for (; nodes[moved] != 0; moved = (moved + 1) & (keys.size() - 1));
+                keys[moved] = state->IndexKeys[i];
+                nodes[moved] = state->IndexNodes[i];
+            }
+            state->IndexKeys.swap(keys);
+            state->IndexNodes.swap(nodes);
+        }
+        return created;
+    }
+
+    // Where every thunk jumps to, with the arguments of the native still in place and the function's record added.
+    static void dispatch_(void* pObject, void* pFrame, void* pResult, const Function_* function)
+    {
+        typedef void (*tNative)(void* pObject, void* pFrame, void* pResult);
+
+        auto state = threadState_();
+        if (state->Depth == MaxDepth_)
+        {
+            reinterpret_cast<tNative>(function->Original)(pObject, pFrame, pResult);
+            return;
+        }
+
+        auto caller = state->Depth > 0 ? state->Frames[state->Depth - 1].Node : 0;
+        auto node = child_(state, caller, function->NameIndex);
+        auto& frame = state->Frames[state->Depth++];
+        frame.Node = node;
+        frame.ChildTicks = 0;
+        frame.Start = __rdtsc();
+
+        reinterpret_cast<tNative>(function->Original)(pObject, pFrame, pResult);
+
+        auto end = __rdtsc();
+        auto ticks = end - frame.Start;
+        auto exclusive = ticks > frame.ChildTicks ? ticks - frame.ChildTicks : 0;
+        state->Depth--;
+        if (state->Depth > 0)
+        {
+            state->Frames[state->Depth - 1].ChildTicks += ticks;
+        }
+
+        auto& counters = node_(state, node);
+        Utils::BumpCounter(counters.Calls, 1);
+        Utils::BumpCounter(counters.InclusiveTicks, ticks);
+        Utils::BumpCounter(counters.ExclusiveTicks, exclusive);
+
+        if (ticks >= instance_->slowCallTicks_)
+        {
+            auto count = state->TraceCount.load(std::memory_order_relaxed);
+            state->Trace[count % TraceCapacity_] = { frame.Start, ticks, function->NameIndex };
+            state->TraceCount.store(count + 1, std::memory_order_release);
+        }
+    }
+
+    // Give a function being bound a thunk instead of its native, unless it already has one.
+    template <typename TFunction>
+    static void wrapFunction_(UE::UObjectPartial* pFunction)
+    {
+        auto function = reinterpret_cast<TFunction*>(pFunction);
+        auto current = static_cast<const BYTE*>(function->Func);
+        if (current == nullptr)
+        {
+            return;
+        }
+        if (0 == memcmp(current, ThunkPrefix_, sizeof(ThunkPrefix_))
+            && *reinterpret_cast<void* const*>(current + sizeof(ThunkPrefix_)) == reinterpret_cast<void*>(&dispatch_))
+        {
+            return;
+        }
+
+        // Decoded now, while the game runs, so that writing the report never has to call into it.
+        UE::GNameCache.Find(pFunction->Name.Index);
+
+        Utils::CodeBuilder code;
+        code.Emit({ ThunkPrefix_[0], ThunkPrefix_[1], ThunkPrefix_[2], ThunkPrefix_[3], ThunkPrefix_[4], ThunkPrefix_[5], ThunkPrefix_[6],
+            ThunkPrefix_[7], ThunkPrefix_[8], ThunkPrefix_[9], ThunkPrefix_[10], ThunkPrefix_[11], ThunkPrefix_[12] });
+        code.Emit64(reinterpret_cast<std::uint64_t>(&dispatch_));
+        code.Emit({ 0xCC, 0xCC, 0xCC });                                // pad the record to 8 bytes
+        code.Emit64(reinterpret_cast<std::uint64_t>(function->Func));  // Function_::Original
+        code.Emit32(static_cast<std::uint32_t>(pFunction->Name.Index)); // Function_::NameIndex
+
+        auto thunk = GCodeHeap.Commit(code);
+        if (!thunk)
+        {
+            return;
+        }
+
+        function->Func = thunk;
+        instance_->wrapped_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    static void onFunctionBound_(UE::UObjectPartial* pFunction)
+    {
+        instance_->wrap_(pFunction);
+    }
+
+    double micros_(std::uint64_t ticks) const
+    {
+        return static_cast<double>(ticks) * 1e6 / static_cast<double>(ticksPerSecond_);
+    }
+
+    static std::wstring nameOf_(std::int32_t nameIndex)
+    {
+        auto text = UE::GNameCache.Find(nameIndex);
+        return text ? std::wstring{ text } : L"Name" + std::to_wstring(nameIndex);
+    }
+
+    // Functions by name, across every thread and call path.
+    void writeReport_(const std::vector<ThreadState_*>& threads)
+    {
+        struct Totals
+        {
+            std::uint64_t Calls;
+            std::uint64_t InclusiveTicks;
+            std::uint64_t ExclusiveTicks;
+        };
+        std::unordered_map<std::int32_t, Totals> totals;
+
+        for (auto state : threads)
+        {
+            auto count = state->NodeCount.load(std::memory_order_acquire);
+            for (std::uint32_t i = 1; i < count; i++)
+            {
+                auto& node = node_(state, i);
+                auto& entry = totals[node.NameIndex];
+                entry.Calls += node.Calls.load(std::memory_order_relaxed);
+                entry.ExclusiveTicks += node.ExclusiveTicks.load(std::memory_order_relaxed);
+
+                // A recursive call's time is already part of the outermost one's.
+                bool recursive = false;
+                for (auto parent = node.Parent; parent != 0 && !recursive; parent = node_(state, parent).Parent)
+                {
+                    recursive = node_(state, parent).NameIndex == node.NameIndex;
+                }
+                if (!recursive)
+                {
+                    entry.InclusiveTicks += node.InclusiveTicks.load(std::memory_order_relaxed);
+                }
+            }
+        }
+
+        std::vector<std::pair<std::int32_t, Totals>> sorted{ totals.begin(), totals.end() };
+        std::sort(sorted.begin(), sorted.end(), [](const auto& a, const auto& b) { return a.second.ExclusiveTicks > b.second.ExclusiveTicks; });
+
+        FILE* file = fopen(ASI_SCRIPTPROF_FNAME ".txt", "w");
+        if (!file)
+        {
+            GLogger.writeln(L"ScriptProfiler: ERROR: failed to open " ASI_SCRIPTPROF_FNAME L".txt.");
+            return;
+        }
+
+        fprintf(file, "%14s %14s %14s %12s  %s\n", "calls", "exclusive ms", "inclusive ms", "avg incl us", "function");
+        for (const auto& [nameIndex, entry] : sorted)
+        {
+            fprintf(file, "%14llu %14.3f %14.3f %12.2f  %ls\n", entry.Calls, micros_(entry.ExclusiveTicks) / 1000.0, micros_(entry.InclusiveTicks) / 1000.0,
+                entry.Calls ? micros_(entry.InclusiveTicks) / static_cast<double>(entry.Calls) : 0.0, nameOf_(nameIndex).c_str());
+        }
+        fclose(file);
+    }
+
+    // Exclusive time per call path, one line per path: Thread 1234;Outer;Inner <microseconds>.
+    void writeFolded_(const std::vector<ThreadState_*>& threads)
+    {
+        FILE* file = fopen(ASI_SCRIPTPROF_FNAME ".folded", "w");
+        if (!file)
+        {
+            GLogger.writeln(L"ScriptProfiler: ERROR: failed to open " ASI_SCRIPTPROF_FNAME L".folded.");
+            return;
+        }
+
+        std::vector<std::int32_t> path;
+        for (auto state : threads)
+        {
+            auto count = state->NodeCount.load(std::memory_order_acquire);
+            for (std::uint32_t i = 1; i < count; i++)
+            {
+                auto micros = static_cast<std::uint64_t>(micros_(node_(state, i).ExclusiveTicks.load(std::memory_order_relaxed)));
+                if (micros == 0)
+                {
+                    continue;
+                }
+
+                path.clear();
+                for (auto n = i; n != 0; n = node_(state, n).Parent)
+                {
+                    path.push_back(node_(state, n).NameIndex);
+                }
+
+                fprintf(file, "Thread %lu", state->ThreadId);
+                for (auto it = path.rbegin(); it != path.rend(); ++it)
+                {
+                    fprintf(file, ";%ls", nameOf_(*it).c_str());
+                }
+                fprintf(file, " %llu\n", micros);
+            }
+        }
+        fclose(file);
+    }
+
+    // The slow calls still in the rings, as complete events of the Chrome trace format.
+    void writeTrace_(const std::vector<ThreadState_*>& threads)
+    {
+        FILE* file = fopen(ASI_SCRIPTPROF_FNAME ".json", "w");
+        if (!file)
+        {
+            GLogger.writeln(L"ScriptProfiler: ERROR: failed to open " ASI_SCRIPTPROF_FNAME L".json.");
+            return;
+        }
+
+        fprintf(file, "{\"traceEvents\":[");
+        bool first = true;
+        for (auto state : threads)
+        {
+            // Skip the oldest part of a full ring, which the thread may be overwriting right now.
+            auto count = state->TraceCount.load(std::memory_order_acquire);
+            auto begin = count > TraceCapacity_ ? count - TraceCapacity_ + TraceCapacity_ / 16 : 0;
+            for (auto i = begin; i < count; i++)
+            {
+                auto event = state->Trace[i % TraceCapacity_];
+                auto start = event.Start > startTicks_ ? event.Start - startTicks_ : 0;
+                fprintf(file, "%s\n{\"name\":\"%ls\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%lu}",
+                    first ? "" : ",", nameOf_(event.NameIndex).c_str(), micros_(start), micros_(event.Ticks), state->ThreadId);
+                first = false;
+            }
+        }
+        fprintf(file, "\n],\"displayTimeUnit\":\"ms\"}\n");
+        fclose(file);
+    }
+
+public:
+    ScriptProfilerModule()
+        : IModule{ "ScriptProfiler" }
+    {
+        active_ = false;
+    }
+
+    bool Activate() override
+    {
+        if (active_)
+        {
+            return true;
+        }
+
+        switch (GLEBinkProxy.Game)
+        {
+        case LEGameVersion::LE1:  wrap_ = &ScriptProfilerModule::wrapFunction_<UE::UFunctionPartialLE1>;  break;
+        case LEGameVersion::LE2:  wrap_ = &ScriptProfilerModule::wrapFunction_<UE::UFunctionPartialLE2>;  break;
+        case LEGameVersion::LE3:  wrap_ = &ScriptProfilerModule::wrapFunction_<UE::UFunctionPartialLE3>;  break;
+        default:
+            GLogger.writeln(L"ScriptProfiler: ERROR: unsupported game version.");
+            return false;
+        }
+
+        ticksPerSecond_ = Utils::HookProfiler::CalibrateTicksPerSecond();
+        if (!ticksPerSecond_)
+        {
+            GLogger.writeln(L"ScriptProfiler: ERROR: failed to calibrate the clock.");
+            return false;
+        }
+        slowCallTicks_ = ticksPerSecond_ * SlowCallMicros_ / 1000000;
+        startTicks_ = __rdtsc();
+
+        instance_ = this;
+        UE::OnFunctionBound = &ScriptProfilerModule::onFunctionBound_;
+        active_ = true;
+
+        std::thread([this]()
+        {
+            bool wasDown = false;
+            while (true)
+            {
+                Sleep(HotkeyPollMs_);
+                bool down = (GetAsyncKeyState(VK_CONTROL) & 0x8000) && (GetAsyncKeyState(VK_SHIFT) & 0x8000) && (GetAsyncKeyState(VK_F12) & 0x8000);
+                if (down && !wasDown)
+                {
+                    this->WriteReport();
+                }
+                wasDown = down;
+            }
+        }).detach();
+
+        GLogger.writeln(L"ScriptProfiler: functions bound from now on are profiled, Ctrl+Shift+F12 writes a report (%llu ticks/s).", ticksPerSecond_);
+        return true;
+    }
+
+    void Deactivate() override
+    {
+        if (active_)
+        {
+            this->WriteReport();
+        }
+    }
+
+    /// <summary>
+    /// Write the report, the folded stacks and the trace of everything recorded so far.
+    /// </summary>
+    void WriteReport()
+    {
+        auto threads = threads_.All();
+
+        writeReport_(threads);
+        writeFolded_(threads);
+        writeTrace_(threads);
+
+        GLogger.writeln(L"ScriptProfiler: wrote " ASI_SCRIPTPROF_FNAME L".txt/.folded/.json (%llu functions profiled, %d threads).",
+            wrapped_.load(std::memory_order_relaxed), static_cast<int>(threads.size()));
+    }
+};
@@ -1,17 +1,25 @@
 #pragma once
 
+#include <cstddef>
 #include <cstring>
+#include <intrin.h>
+#include <memory>
 #include <mutex>
 #include <new>
+#include <string_view>
 #include <thread>
+#include <vector>
 #include <Windows.h>
 #include "../conf/version.h"
 #include "../utils/io.h"
 #include "../utils/hook.h"
 #include "../utils/classutils.h"
 #include "../utils/memory.h"
+#include "../utils/pattern.h"
 #include "../dllstruct.h"
+#include "../ue_types.h"
 #include "../spi/shared_hook_manager.h"
+#include "../spi/shared_patch_manager.h"
 #include "../spi/interface.h"
 
 
@@ -33,83 +41,65 @@ namespace SPI
         BOOL isRelease_;
 
         SharedHookManager hookMngr_;
+        SharedPatchManager patchMngr_;
 
         std::mutex mtxGetVersion_;
         std::mutex mtxGetBuildMode_;
         std::mutex mtxGetHostGame_;
         std::mutex mtxFindPattern_;
         std::mutex mtxInstallHook_;
-        std::mutex mtxUninstallHook_;
+        std::mutex mtxFreezeThreads_;
+        std::mutex mtxPatchMemory_;
+
+        std::unique_ptr<Utils::ScopedThreadFreeze> threadFreeze_;
+        DWORD threadFreezeOwner_ = 0;
 
         // Implementation methods.
 
         __forceinline DWORD getVersion_() const noexcept { return version_; }
         __forceinline bool getReleaseMode_() const noexcept { return isRelease_; }
 
-        __declspec(noinline) bool parseCombinedPattern_(char* inPattern, BYTE* outPatternBuffer, BYTE* outMaskBuffer, size_t* outLength)
+        // Parse a plugin-supplied pattern into storage owned by the caller.
+        SPIReturn parsePattern_(const char* combinedPattern, std::vector<BYTE>& storage, Utils::PatternView* outView)
         {
-            auto len = inPattern ? std::strlen(inPattern) : 0;
-            if (len < 6)
+            std::string_view text{ combinedPattern };
+            storage.resize(Utils::PatternStorageSize(text));
+
+            auto rc = Utils::ParsePatternView(text, storage.data(), storage.size(), outView);
+            if (rc != Utils::PatternParseResult::Success)
             {
-                return false;
+                GLogger.writeln(L"parsePattern_: ERROR: failed to parse pattern (code = %d): %S", static_cast<int>(rc), combinedPattern);
+                return SPIReturn::FailurePatternInvalid;
             }
+            return SPIReturn::Success;
+        }
 
-            char* token = nullptr;
-            char* endPtr = nullptr;
-            long byteValue = 0;
-            size_t parsedLength = 0;
-            size_t patternLength = 0;
+        SPIReturn findPattern_(void** outOffsetPtr, char* combinedPattern, const char* sectionName, Utils::ScanAnchor anchor)
+        {
+            if (!outOffsetPtr || !combinedPattern)
+            {
+                return SPIReturn::FailureInvalidParam;
+            }
 
-            do
+            std::vector<BYTE> storage;
+            Utils::PatternView view;
+            auto rc = this->parsePattern_(combinedPattern, storage, &view);
+            if (rc != SPIReturn::Success)
             {
-                token = std::strtok(parsedLength == 0 ? inPattern : nullptr, " ");
-                if (token)
-                {
-                    parsedLength = token + 2 - inPattern;
-
-                    //GLogger.writeln(L"parseCombinedPattern_: token = %S, parsedLength = %llu, len = %llu, strlen(token) = %llu", token, parsedLength, len, strlen(token));
-                    
-                    if (strlen(token) != 2)
-                    {
-                        GLogger.writeln(L"parseCombinedPattern_: ERROR: parsed token was not 2 chars long: %S", token);
-                        return false;
-                    }
-
-                    if (0 == strcmp(token, "??"))
-                    {
-                        outPatternBuffer[patternLength] = 0u;
-                        outMaskBuffer[patternLength] = '?';
-                        ++patternLength;
-                    }
-                    else
-                    {
-                        errno = 0;
-                        if (0 == (byteValue = std::strtol(token, &endPtr, 0x10)) && errno != 0)
-                        {
-                            GLogger.writeln(L"parseCombinedPattern_: ERROR: strtol returned an error (errno = %d)", errno);
-                            return false;
-                        }
-                        else
-                        {
-                            auto foo = (*outPatternBuffer);
-                            outPatternBuffer[patternLength] = static_cast<BYTE>(byteValue);
-                            outMaskBuffer[patternLength] = 'x';
-                            ++patternLength;
-                        }
-                    }
-                }
-                else
-                {
-                    if (parsedLength != len)
-                    {
-                        GLogger.writeln(L"parseCombinedPattern_: ERROR: token was null but inPattern end wasn't reached (%d != %d)", parsedLength, len);
-                        return false;
-                    }
-                }
-            } while (token);
+                return rc;
+            }
+
+            // Use the built-in memory scanner.
+
+            auto offset = Utils::ScanProcess(view, sectionName, anchor);
+            if (!offset)
+            {
+                *outOffsetPtr = nullptr;
+                return SPIReturn::FailureGeneric;
+            }
 
-            *outLength = patternLength;
-            return true;
+            *outOffsetPtr = offset;
+            return SPIReturn::Success;
         }
 
     public:
@@ -118,6 +108,7 @@ namespace SPI
             , version_{ ASI_SPI_VERSION }
             , isRelease_{ false }
             , hookMngr_{ }
+            , patchMngr_{ }
         {
 #ifndef ASI_DEBUG
             isRelease_ = true;
@@ -168,50 +159,52 @@ namespace SPI
         SPIDEFN FindPattern(void** outOffsetPtr, char* combinedPattern)
         {
             SPI_IMPL_INSTANCE_LOCK(mtxFindPattern_);
+            return this->findPattern_(outOffsetPtr, combinedPattern, nullptr, Utils::ScanAnchor::Anywhere);
+        }
 
-            if (!outOffsetPtr || !combinedPattern)
+        SPIDEFN FindPatterns(void** outOffsetPtrs, char** combinedPatterns, int count)
+        {
+            SPI_IMPL_INSTANCE_LOCK(mtxFindPattern_);
+
+            if (!outOffsetPtrs || !combinedPatterns || count <= 0)
             {
                 return SPIReturn::FailureInvalidParam;
             }
-            if (strlen(combinedPattern) > 300)
+            for (int i = 0; i < count; i++)
             {
-                return SPIReturn::FailurePatternTooLong;
-            }
+                outOffsetPtrs[i] = nullptr;
 
+                if (!combinedPatterns[i])
+                {
+                    return SPIReturn::FailureInvalidParam;
+                }
+            }
 
-            // Unpack the combined pattern into pattern and a mask.
 
-            auto inPatternCopy = _strdup(combinedPattern);
+            // Parse every pattern into its own storage.
 
-            BYTE patternBytes[100];
-            BYTE maskBytes[100];
-            size_t patternLength = 0;
+            std::vector<std::vector<BYTE>> storages(count);
+            std::vector<Utils::ScanRequest> requests(count);
 
-            ZeroMemory(patternBytes, 100);
-            ZeroMemory(maskBytes, 100);
-            
-            if (!this->parseCombinedPattern_(inPatternCopy, (BYTE*)patternBytes, (BYTE*)maskBytes, &patternLength))
+            for (int i = 0; i < count; i++)
             {
-                return SPIReturn::FailurePatternInvalid;
+                auto rc = this->parsePattern_(combinedPatterns[i], storages[i], &requests[i].Pattern);
+                if (rc != SPIReturn::Success)
+                {
+                    GLogger.writeln(L"FindPatterns: ERROR: pattern #%d is invalid", i);
+                    return rc;
+                }
             }
 
-            //GLogger.writeln(L"Pattern length = %llu", patternLength);
-            //for (size_t i = 0; i < patternLength; i++) printf(" %02x", patternBytes[i]);  printf("\n\n");
-            //for (size_t i = 0; i < patternLength; i++) printf(" %02x", maskBytes[i]);     printf("\n\n");
+            // Use the built-in memory scanner, all patterns in one sweep.
 
-            free(inPatternCopy);
-
-            // Use the built-in memory scanner.
-
-            auto offset = Utils::ScanProcess(patternBytes, maskBytes);
-            if (!offset)
+            auto found = Utils::ScanProcessBatch(requests.data(), count);
+            for (int i = 0; i < count; i++)
             {
-                *outOffsetPtr = nullptr;
-                return SPIReturn::FailureGeneric;
+                outOffsetPtrs[i] = requests[i].Result;
             }
 
-            *outOffsetPtr = offset;
-            return SPIReturn::Success;
+            return found == static_cast<size_t>(count) ? SPIReturn::Success : SPIReturn::FailureGeneric;
         }
 
         SPIDEFN InstallHook(const char* name, void* target, void* detour, void** original)
@@ -235,7 +228,8 @@ namespace SPI
 
         SPIDEFN UninstallHook(const char* name)
         {
-            SPI_IMPL_INSTANCE_LOCK(mtxUninstallHook_);
+            // Shares the install lock, as both read and change the set of hook names.
+            SPI_IMPL_INSTANCE_LOCK(mtxInstallHook_);
 
             if (!hookMngr_.HookExists(const_cast<char*>(name)))
             {
@@ -252,6 +246,426 @@ namespace SPI
             return SPIReturn::Success;
         }
 
+        SPIDEFN FindPatternInSection(void** outOffsetPtr, char* combinedPattern, const char* sectionName)
+        {
+            SPI_IMPL_INSTANCE_LOCK(mtxFindPattern_);
+
+            if (!sectionName)
+            {
+                return SPIReturn::FailureInvalidParam;
+            }
+
+            return this->findPattern_(outOffsetPtr, combinedPattern, sectionName, Utils::ScanAnchor::Anywhere);
+        }
+
+        SPIDEFN FindPatternAtFunctionStart(void** outOffsetPtr, char* combinedPattern)
+        {
+            SPI_IMPL_INSTANCE_LOCK(mtxFindPattern_);
+            return this->findPattern_(outOffsetPtr, combinedPattern, nullptr, Utils::ScanAnchor::FunctionStart);
+        }
+
+        SPIDEFN GetFunctionBounds(void* address, void** outBegin, void** outEnd)
+        {
+            if (!outBegin || !outEnd)
+            {
+                return SPIReturn::FailureInvalidParam;
+            }
+
+            *outBegin = nullptr;
+            *outEnd = nullptr;
+
+            BYTE* moduleStart, * moduleEnd;
+            if (!Utils::GetGameModuleRange(&moduleStart, &moduleEnd))
+            {
+                return SPIReturn::ErrorWinApi;
+            }
+            if (static_cast<BYTE*>(address) < moduleStart || static_cast<BYTE*>(address) >= moduleEnd)
+            {
+                return SPIReturn::FailureInvalidParam;
+            }
+
+            auto functionIndex = Utils::GetGameFunctionIndex();
+            if (!functionIndex)
+            {
+                return SPIReturn::FailureGeneric;
+            }
+
+            auto function = functionIndex->FindContaining(static_cast<std::uint32_t>(static_cast<BYTE*>(address) - moduleStart));
+            if (!function)
+            {
+                return SPIReturn::FailureGeneric;
+            }
+
+            *outBegin = moduleStart + function->Begin;
+            *outEnd = moduleStart + function->End;
+            return SPIReturn::Success;
+        }
+
+        SPIDEFN BeginHookBatch()
+        {
+            SPI_IMPL_INSTANCE_LOCK(mtxInstallHook_);
+
+            if (!hookMngr_.BeginBatch())
+            {
+                return SPIReturn::FailureDuplicacy;
+            }
+            return SPIReturn::Success;
+        }
+
+        SPIDEFN InstallHookBatched(const char* name, void* target, void* detour, void** original)
+        {
+            SPI_IMPL_INSTANCE_LOCK(mtxInstallHook_);
+
+            if (!name || !target || !detour)
+            {
+                return SPIReturn::FailureInvalidParam;
+            }
+
+            if (hookMngr_.HookExists(const_cast<char*>(name)))
+            {
+                GLogger.writeln(L"Failed to queue the hook [%S] because it already exists", name);
+                return SPIReturn::FailureDuplicacy;
+            }
+
+            if (!hookMngr_.QueueInstall(target, detour, original, const_cast<char*>(name)))
+            {
+                GLogger.writeln(L"Failed to queue the hook [%S]", name);
+                return SPIReturn::FailureDuplicacy;
+            }
+
+            return SPIReturn::Success;
+        }
+
+        SPIDEFN CommitHookBatch()
+        {
+            SPI_IMPL_INSTANCE_LOCK(mtxInstallHook_);
+
+            if (!hookMngr_.CommitBatch())
+            {
+                GLogger.writeln(L"Failed to install the hook batch");
+                return SPIReturn::FailureHooking;
+            }
+
+            return SPIReturn::Success;
+        }
+
+        SPIDEFN AbortHookBatch()
+        {
+            SPI_IMPL_INSTANCE_LOCK(mtxInstallHook_);
+
+            if (!hookMngr_.AbortBatch())
+            {
+                return SPIReturn::FailureDuplicacy;
+            }
+            return SPIReturn::Success;
+        }
+
+        SPIDEFN GetHookStats(const char* name, SPIHookStats* outStats)
+        {
+            if (!name || !outStats)
+            {
+                return SPIReturn::FailureInvalidParam;
+            }
+
+            if (!GHookProfiler.IsEnabled())
+            {
+                return SPIReturn::FailureUnsupportedYet;
+            }
+
+            Utils::HookStatsSnapshot stats;
+            if (!hookMngr_.GetStats(const_cast<char*>(name), &stats))
+            {
+                return SPIReturn::FailureDuplicacy;
+            }
+
+            outStats->Calls = stats.Calls;
+            outStats->TotalTicks = stats.TotalTicks;
+            outStats->TicksPerSecond = GHookProfiler.TicksPerSecond();
+            for (std::uint32_t i = 0; i < Utils::HOOK_STATS_BUCKETS; i++)
+            {
+                outStats->Buckets[i] = stats.Buckets[i];
+            }
+            return SPIReturn::Success;
+        }
+
+        SPIDEFN SubscribeHook(const char* name, void* target, SPIMulticastCallback pre, SPIMulticastCallback post, void* userData, int priority)
+        {
+            SPI_IMPL_INSTANCE_LOCK(mtxInstallHook_);
+
+            if (!name || !target || (!pre && !post))
+            {
+                return SPIReturn::FailureInvalidParam;
+            }
+
+            if (hookMngr_.HookExists(const_cast<char*>(name)) || hookMngr_.SubscriptionExists(const_cast<char*>(name)))
+            {
+                GLogger.writeln(L"Failed to subscribe [%S] because a hook of that name already exists", name);
+                return SPIReturn::FailureDuplicacy;
+            }
+
+            // The SPI context is the same struct as the one the dispatcher fills, spelled without std types.
+            static_assert(sizeof(SPIMulticastContext) == sizeof(Utils::MulticastContext), "context layouts must match");
+            static_assert(offsetof(SPIMulticastContext, StackArgs) == offsetof(Utils::MulticastContext, StackArgs), "context layouts must match");
+            static_assert(offsetof(SPIMulticastContext, SkipOriginal) == offsetof(Utils::MulticastContext, SkipOriginal), "context layouts must match");
+
+            if (!hookMngr_.Subscribe(target, reinterpret_cast<Utils::MulticastCallback>(pre), reinterpret_cast<Utils::MulticastCallback>(post),
+                userData, priority, const_cast<char*>(name)))
+            {
+                GLogger.writeln(L"Failed to subscribe [%S]", name);
+                return SPIReturn::FailureHooking;
+            }
+
+            return SPIReturn::Success;
+        }
+
+        SPIDEFN UnsubscribeHook(const char* name)
+        {
+            SPI_IMPL_INSTANCE_LOCK(mtxInstallHook_);
+
+            if (!name)
+            {
+                return SPIReturn::FailureInvalidParam;
+            }
+
+            if (!hookMngr_.Unsubscribe(const_cast<char*>(name)))
+            {
+                return SPIReturn::FailureDuplicacy;
+            }
+
+            return SPIReturn::Success;
+        }
+
+        SPIDEFN InstallVirtualHook(const char* name, void** vtable, int index, void* detour, void** original)
+        {
+            SPI_IMPL_INSTANCE_LOCK(mtxInstallHook_);
+
+            if (!name || !vtable || index < 0 || !detour)
+            {
+                return SPIReturn::FailureInvalidParam;
+            }
+
+            if (hookMngr_.HookExists(const_cast<char*>(name)) || hookMngr_.SubscriptionExists(const_cast<char*>(name)))
+            {
+                GLogger.writeln(L"Failed to install the virtual hook [%S] because it already exists", name);
+                return SPIReturn::FailureDuplicacy;
+            }
+
+            if (!hookMngr_.InstallSlot(vtable + index, detour, original, const_cast<char*>(name)))
+            {
+                GLogger.writeln(L"Failed to install the virtual hook [%S]", name);
+                return SPIReturn::FailureHooking;
+            }
+
+            return SPIReturn::Success;
+        }
+
+        SPIDEFN InstallImportHook(const char* name, const char* moduleName, const char* functionName, void* detour, void** original)
+        {
+            SPI_IMPL_INSTANCE_LOCK(mtxInstallHook_);
+
+            if (!name || !moduleName || !functionName || !detour)
+            {
+                return SPIReturn::FailureInvalidParam;
+            }
+
+            if (hookMngr_.HookExists(const_cast<char*>(name)) || hookMngr_.SubscriptionExists(const_cast<char*>(name)))
+            {
+                GLogger.writeln(L"Failed to install the import hook [%S] because it already exists", name);
+                return SPIReturn::FailureDuplicacy;
+            }
+
+            auto slot = Utils::GetGameImportSlot(moduleName, functionName);
+            if (!slot)
+            {
+                GLogger.writeln(L"Failed to install the import hook [%S]: the game doesn't import %S!%S", name, moduleName, functionName);
+                return SPIReturn::FailureGeneric;
+            }
+
+            if (!hookMngr_.InstallSlot(slot, detour, original, const_cast<char*>(name)))
+            {
+                GLogger.writeln(L"Failed to install the import hook [%S]", name);
+                return SPIReturn::FailureHooking;
+            }
+
+            return SPIReturn::Success;
+        }
+
+        SPIDEFN FreezeThreads()
+        {
+            SPI_IMPL_INSTANCE_LOCK(mtxFreezeThreads_);
+
+            if (threadFreeze_)
+            {
+                return SPIReturn::FailureDuplicacy;
+            }
+
+            threadFreeze_ = std::make_unique<Utils::ScopedThreadFreeze>();
+            threadFreezeOwner_ = GetCurrentThreadId();
+            return SPIReturn::Success;
+        }
+
+        SPIDEFN ThawThreads()
+        {
+            SPI_IMPL_INSTANCE_LOCK(mtxFreezeThreads_);
+
+            if (!threadFreeze_ || threadFreezeOwner_ != GetCurrentThreadId())
+            {
+                return SPIReturn::FailureDuplicacy;
+            }
+
+            threadFreeze_.reset();
+            threadFreezeOwner_ = 0;
+            return SPIReturn::Success;
+        }
+
+        SPIDEFN PatchMemory(const char* name, void* address, const void* bytes, size_t size)
+        {
+            SPI_IMPL_INSTANCE_LOCK(mtxPatchMemory_);
+
+            if (!name || !address || !bytes || size == 0)
+            {
+                return SPIReturn::FailureInvalidParam;
+            }
+
+            // Patches belong to the plugin calling us, so that they can be reverted when it detaches.
+            HMODULE owner = nullptr;
+            GetModuleHandleExW(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT,
+                reinterpret_cast<LPCWSTR>(_ReturnAddress()), &owner);
+
+            if (patchMngr_.PatchExists(name))
+            {
+                GLogger.writeln(L"Failed to patch [%S] because it already exists", name);
+                return SPIReturn::FailureDuplicacy;
+            }
+
+            if (!patchMngr_.Patch(name, static_cast<BYTE*>(address), static_cast<const BYTE*>(bytes), size, owner))
+            {
+                GLogger.writeln(L"Failed to patch [%S]", name);
+                return SPIReturn::FailureDuplicacy;
+            }
+
+            return SPIReturn::Success;
+        }
+
+        SPIDEFN BeginPatchTransaction()
+        {
+            SPI_IMPL_INSTANCE_LOCK(mtxPatchMemory_);
+
+            if (!patchMngr_.BeginTransaction())
+            {
+                return SPIReturn::FailureDuplicacy;
+            }
+            return SPIReturn::Success;
+        }
+
+        SPIDEFN CommitPatchTransaction()
+        {
+            SPI_IMPL_INSTANCE_LOCK(mtxPatchMemory_);
+
+            if (!patchMngr_.CommitTransaction())
+            {
+                GLogger.writeln(L"Failed to apply the patch transaction");
+                return SPIReturn::FailureGeneric;
+            }
+            return SPIReturn::Success;
+        }
+
+        SPIDEFN AbortPatchTransaction()
+        {
+            SPI_IMPL_INSTANCE_LOCK(mtxPatchMemory_);
+
+            if (!patchMngr_.AbortTransaction())
+            {
+                return SPIReturn::FailureDuplicacy;
+            }
+            return SPIReturn::Success;
+        }
+
+        SPIDEFN RevertPatch(const char* name)
+        {
+            SPI_IMPL_INSTANCE_LOCK(mtxPatchMemory_);
+
+            if (!name)
+            {
+                return SPIReturn::FailureInvalidParam;
+            }
+
+            if (!patchMngr_.Revert(name))
+            {
+                GLogger.writeln(L"Failed to revert the patch [%S]", name);
+                return SPIReturn::FailureGeneric;
+            }
+            return SPIReturn::Success;
+        }
+
+        // No instance lock for names, the cache is read without one.
+
+        SPIDEFN GetNameText(int index, const wchar_t** outText)
+        {
+            if (!outText)
+            {
+                return SPIReturn::FailureInvalidParam;
+            }
+
+            auto text = UE::GNameCache.Find(index);
+            if (!text)
+            {
+                return SPIReturn::FailureGeneric;
+            }
+
+            *outText = text;
+            return SPIReturn::Success;
+        }
+
+        SPIDEFN FindNameIndex(const wchar_t* text, int* outIndex)
+        {
+            if (!text || !outIndex)
+            {
+                return SPIReturn::FailureInvalidParam;
+            }
+
+            auto index = UE::GNameCache.FindIndex(text);
+            if (index == Utils::NameCache::NotFound)
+            {
+                return SPIReturn::FailureDuplicacy;
+            }
+
+            *outIndex = index;
+            return SPIReturn::Success;
+        }
+
+        SPIDEFN RegisterNativeOverride(const char* name, void* native, int gameMask)
+        {
+            if (!name || !*name || !native || !gameMask)
+            {
+                return SPIReturn::FailureInvalidParam;
+            }
+
+            if (!(gameMask & UE::NativeOverrideTable::GameMaskOf(GLEBinkProxy.Game)))
+            {
+                return SPIReturn::Success;
+            }
+
+            std::wstring function{ name, name + strlen(name) };
+            char nativeName[32];
+            sprintf_s(nativeName, sizeof(nativeName), "native at %p", native);
+
+            if (!UE::GNativeOverrides.Register(function.c_str(), native, nativeName))
+            {
+                return SPIReturn::FailureDuplicacy;
+            }
+            return SPIReturn::Success;
+        }
+
         // End of ISharedProxyInterface implementation.
+
+        /// <summary>
+        /// Revert whatever a plugin left patched, once its SpiOnDetach has returned.
+        /// </summary>
+        void OnPluginDetached(HMODULE plugin)
+        {
+            SPI_IMPL_INSTANCE_LOCK(mtxPatchMemory_);
+            patchMngr_.RevertOwnedBy(plugin);
+        }
     };
 }
@@ -16,7 +16,7 @@
 /// Duplicate the stuff in version.h!!!
 
 #define SPI_VERSION_ANY     3
-#define SPI_VERSION_LATEST  3
+#define SPI_VERSION_LATEST  4
 
 /// Plugin-side definition which marks the dll as supporting SPI.
 #define SPI_PLUGINSIDE_SUPPORT(NAME,AUTHOR,VERSION,GAME_FLAGS,SPIMINVER) \
@@ -116,6 +116,29 @@ enum class SPIGameVersion
     LE3 = 3
 };
 
+/// Counters of an instrumented hook for GetHookStats.
+struct SPIHookStats
+{
+    unsigned long long Calls;
+    unsigned long long TotalTicks;          // TSC ticks spent in the detour, including the original it calls.
+    unsigned long long TicksPerSecond;      // TSC rate, to turn ticks into time.
+    unsigned long long Buckets[32];         // Calls that took [2^i, 2^(i+1)) ticks; the last bucket also holds anything longer.
+};
+
+/// Arguments and return value of a call, passed to the callbacks of SubscribeHook.
+/// Pre callbacks may change the arguments or skip the original, post callbacks may change the return value.
+struct SPIMulticastContext
+{
+    unsigned long long IntArgs[4];          // rcx, rdx, r8, r9
+    unsigned long long FloatArgs[4];        // raw low 64 bits of xmm0 - xmm3
+    unsigned long long* StackArgs;          // the fifth argument onward, in the caller's frame
+    unsigned long long ReturnValue;         // rax
+    unsigned long long FloatReturnValue;    // raw low 64 bits of xmm0
+    int SkipOriginal;                       // set by a pre callback to not call the original, ReturnValue is returned as is
+};
+
+typedef void (*SPIMulticastCallback)(SPIMulticastContext* context, void* userData);
+
 /// <summary>
 /// SPI declaration for use in ASI mods.
 /// </summary>
@@ -142,10 +165,12 @@ public:
     SPIDECL GetHostGame(SPIGameVersion* outGameVersion) = 0;
 
     /// <summary>
-    /// Search the main game module for a PEiD-style pattern.
+    /// Search executable sections of the main game module for a PEiD-style pattern.
     /// </summary>
     /// <param name="outOffsetPtr">Output value for the offset, set to NULL if not found.</param>
-    /// <param name="combinedPattern">PEiD-style pattern specifying 100 bytes (299 chars + \0) at most.</param>
+    /// <param name="combinedPattern">PEiD-style pattern of any length, e.g. "48 8B ?? 4? 40:F8".
+    /// Besides hex bytes and "??" / "?" wildcards, it accepts nibble wildcards ("4?", "?F")
+    /// and bytes with an explicit mask of the bits to compare ("40:F8" matches 40-47).</param>
     /// <returns>An appropriate <see cref="SPIReturn"/> code.</returns>
     SPIDECL FindPattern(void** outOffsetPtr, char* combinedPattern) = 0;
 
@@ -164,6 +189,206 @@ public:
     /// <param name="name">Name of the hook to remove.</param>
     /// <returns>An appropriate <see cref="SPIReturn"/> code.</returns>
     SPIDECL UninstallHook(const char* name) = 0;
+
+    /// <summary>
+    /// Search the main game module for several PEiD-style patterns in a single pass.
+    /// Much cheaper than calling <see cref="ISharedProxyInterface::FindPattern"/> once per pattern.
+    /// </summary>
+    /// <param name="outOffsetPtrs">Array of count output values, each set to NULL if its pattern was not found.</param>
+    /// <param name="combinedPatterns">Array of count PEiD-style patterns, with the same syntax as in FindPattern.</param>
+    /// <param name="count">Number of patterns.</param>
+    /// <returns>An appropriate <see cref="SPIReturn"/> code, Success only if all patterns were found.</returns>
+    SPIDECL FindPatterns(void** outOffsetPtrs, char** combinedPatterns, int count) = 0;
+
+    /// <summary>
+    /// Search a single section of the main game module (e.g. ".rdata") for a PEiD-style pattern.
+    /// <see cref="ISharedProxyInterface::FindPattern"/> only searches executable sections.
+    /// </summary>
+    /// <param name="outOffsetPtr">Output value for the offset, set to NULL if not found.</param>
+    /// <param name="combinedPattern">PEiD-style pattern, with the same syntax as in FindPattern.</param>
+    /// <param name="sectionName">Name of the section as it appears in the section table, 8 chars at most.</param>
+    /// <returns>An appropriate <see cref="SPIReturn"/> code.</returns>
+    SPIDECL FindPatternInSection(void** outOffsetPtr, char* combinedPattern, const char* sectionName) = 0;
+
+    /// <summary>
+    /// Search the main game module for a PEiD-style pattern that starts a function,
+    /// testing only function starts listed in the module's exception directory.
+    /// Much cheaper than <see cref="ISharedProxyInterface::FindPattern"/>, but misses leaf functions without unwind info.
+    /// </summary>
+    /// <param name="outOffsetPtr">Output value for the offset, set to NULL if not found.</param>
+    /// <param name="combinedPattern">PEiD-style pattern, with the same syntax as in FindPattern.</param>
+    /// <returns>An appropriate <see cref="SPIReturn"/> code.</returns>
+    SPIDECL FindPatternAtFunctionStart(void** outOffsetPtr, char* combinedPattern) = 0;
+
+    /// <summary>
+    /// Find the bounds of the game function containing an address, according to the exception directory.
+    /// </summary>
+    /// <param name="address">Any address inside the main game module.</param>
+    /// <param name="outBegin">Output value for the first byte of the function.</param>
+    /// <param name="outEnd">Output value for the byte right after the function.</param>
+    /// <returns>An appropriate <see cref="SPIReturn"/> code, FailureGeneric if no function contains the address.</returns>
+    SPIDECL GetFunctionBounds(void* address, void** outBegin, void** outEnd) = 0;
+
+    /// <summary>
+    /// Start a hook batch on the calling thread: hooks passed to <see cref="ISharedProxyInterface::InstallHookBatched"/>
+    /// are only queued, and get installed together by <see cref="ISharedProxyInterface::CommitHookBatch"/>,
+    /// suspending the game's threads once instead of once per hook.
+    /// </summary>
+    /// <returns>An appropriate <see cref="SPIReturn"/> code, FailureDuplicacy if the thread already has a batch open.</returns>
+    SPIDECL BeginHookBatch() = 0;
+    /// <summary>
+    /// Queue a hook into the calling thread's batch, same parameters as <see cref="ISharedProxyInterface::InstallHook"/>.
+    /// The original procedure is only written out once the batch is committed.
+    /// </summary>
+    /// <returns>An appropriate <see cref="SPIReturn"/> code.</returns>
+    SPIDECL InstallHookBatched(const char* name, void* target, void* detour, void** original) = 0;
+    /// <summary>
+    /// Install every hook queued into the calling thread's batch, and close the batch.
+    /// Either all of them get installed, or none of them (and their originals are set to NULL).
+    /// </summary>
+    /// <returns>An appropriate <see cref="SPIReturn"/> code.</returns>
+    SPIDECL CommitHookBatch() = 0;
+    /// <summary>
+    /// Close the calling thread's batch without installing anything.
+    /// </summary>
+    /// <returns>An appropriate <see cref="SPIReturn"/> code.</returns>
+    SPIDECL AbortHookBatch() = 0;
+
+    /// <summary>
+    /// Get call counts and detour latencies of a hook installed through SPI.
+    /// Only available when the game was started with -profilehooks, which instruments every hook installed afterwards.
+    /// </summary>
+    /// <param name="name">Name the hook was installed under.</param>
+    /// <param name="outStats">Output value for the counters, merged across threads.</param>
+    /// <returns>An appropriate <see cref="SPIReturn"/> code, FailureUnsupportedYet if profiling is off.</returns>
+    SPIDECL GetHookStats(const char* name, SPIHookStats* outStats) = 0;
+
+    /// <summary>
+    /// Subscribe callbacks to a procedure's multicast hook, an alternative to <see cref="ISharedProxyInterface::InstallHook"/>
+    /// for hot targets shared by many plugins (e.g. ProcessEvent). Every target gets a single dispatcher
+    /// which calls all subscribers and the original once, instead of chaining a trampoline per plugin.
+    /// Pre callbacks run by descending priority before the original, post callbacks in the reverse order after it.
+    /// The original receives at most 8 stack arguments.
+    /// </summary>
+    /// <param name="name">Name of the subscription, unique among hooks and subscriptions.</param>
+    /// <param name="target">Pointer to the procedure.</param>
+    /// <param name="pre">Callback to run before the original, may be NULL.</param>
+    /// <param name="post">Callback to run after the original, may be NULL.</param>
+    /// <param name="userData">Passed to both callbacks as is.</param>
+    /// <param name="priority">Order of this subscription relative to others on the same target.</param>
+    /// <returns>An appropriate <see cref="SPIReturn"/> code.</returns>
+    SPIDECL SubscribeHook(const char* name, void* target, SPIMulticastCallback pre, SPIMulticastCallback post, void* userData, int priority) = 0;
+    /// <summary>
+    /// Remove a subscription added by <see cref="ISharedProxyInterface::SubscribeHook"/>.
+    /// Calls that already ran its pre callback still run its post callback.
+    /// </summary>
+    /// <param name="name">Name of the subscription to remove.</param>
+    /// <returns>An appropriate <see cref="SPIReturn"/> code.</returns>
+    SPIDECL UnsubscribeHook(const char* name) = 0;
+
+    /// <summary>
+    /// Detour a virtual function by swapping its entry in a vtable, which affects every object sharing that vtable.
+    /// Unlike <see cref="ISharedProxyInterface::InstallHook"/>, no code is patched and no thread is suspended,
+    /// and calls reach the detour without a relay jump. Removed by <see cref="ISharedProxyInterface::UninstallHook"/>,
+    /// as long as no other hook was installed on the same slot afterwards.
+    /// </summary>
+    /// <param name="name">Name of the hook, unique among all hooks.</param>
+    /// <param name="vtable">Pointer to the vtable, i.e. the first pointer-sized field of an object.</param>
+    /// <param name="index">Index of the virtual function in the vtable.</param>
+    /// <param name="detour">Pointer to what to detour the function with.</param>
+    /// <param name="original">Pointer to where to write out the original function, written before the detour can be called.</param>
+    /// <returns>An appropriate <see cref="SPIReturn"/> code.</returns>
+    SPIDECL InstallVirtualHook(const char* name, void** vtable, int index, void* detour, void** original) = 0;
+    /// <summary>
+    /// Detour a function imported by the game executable by swapping its import address table slot,
+    /// e.g. ("user32.dll", "CreateWindowExW"). Only calls made by the game module itself are affected.
+    /// Same mechanics as <see cref="ISharedProxyInterface::InstallVirtualHook"/>.
+    /// </summary>
+    /// <param name="name">Name of the hook, unique among all hooks.</param>
+    /// <param name="moduleName">Name of the imported DLL, case-insensitive.</param>
+    /// <param name="functionName">Name of the imported function.</param>
+    /// <param name="detour">Pointer to what to detour the function with.</param>
+    /// <param name="original">Pointer to where to write out the original function.</param>
+    /// <returns>An appropriate <see cref="SPIReturn"/> code, FailureGeneric if the game doesn't import that function.</returns>
+    SPIDECL InstallImportHook(const char* name, const char* moduleName, const char* functionName, void* detour, void** original) = 0;
+
+    /// <summary>
+    /// Suspend every thread of the game but the calling one, for patching that must not race running code.
+    /// Until <see cref="ISharedProxyInterface::ThawThreads"/>, the caller must not allocate, log, or take locks:
+    /// a suspended thread may be holding them. Threads started in the meantime are not suspended.
+    /// </summary>
+    /// <returns>An appropriate <see cref="SPIReturn"/> code, FailureDuplicacy if the threads are already frozen.</returns>
+    SPIDECL FreezeThreads() = 0;
+    /// <summary>
+    /// Resume the threads suspended by <see cref="ISharedProxyInterface::FreezeThreads"/>, from the same thread.
+    /// </summary>
+    /// <returns>An appropriate <see cref="SPIReturn"/> code, FailureDuplicacy if the calling thread didn't freeze them.</returns>
+    SPIDECL ThawThreads() = 0;
+
+    /// <summary>
+    /// Overwrite bytes of the game, e.g. to NOP out a call or turn a jz into a jmp, with every other thread suspended.
+    /// The original bytes are kept, and restored by <see cref="ISharedProxyInterface::RevertPatch"/> or once the calling
+    /// plugin's SpiOnDetach has returned. Queued instead if the calling thread has a patch transaction open.
+    /// </summary>
+    /// <param name="name">Name of the patch, unique among all patches.</param>
+    /// <param name="address">Address of the first byte to overwrite.</param>
+    /// <param name="bytes">Bytes to write, copied.</param>
+    /// <param name="size">Number of bytes to write.</param>
+    /// <returns>An appropriate <see cref="SPIReturn"/> code, FailureDuplicacy if the bytes overlap another patch.</returns>
+    SPIDECL PatchMemory(const char* name, void* address, const void* bytes, size_t size) = 0;
+    /// <summary>
+    /// Start a patch transaction on the calling thread: patches passed to <see cref="ISharedProxyInterface::PatchMemory"/>
+    /// are only queued, and get applied together by <see cref="ISharedProxyInterface::CommitPatchTransaction"/>.
+    /// </summary>
+    /// <returns>An appropriate <see cref="SPIReturn"/> code, FailureDuplicacy if the thread already has a transaction open.</returns>
+    SPIDECL BeginPatchTransaction() = 0;
+    /// <summary>
+    /// Apply every patch queued into the calling thread's transaction under a single thread freeze, and close the transaction.
+    /// Either all of them get applied, or none of them.
+    /// </summary>
+    /// <returns>An appropriate <see cref="SPIReturn"/> code.</returns>
+    SPIDECL CommitPatchTransaction() = 0;
+    /// <summary>
+    /// Close the calling thread's patch transaction without applying anything.
+    /// </summary>
+    /// <returns>An appropriate <see cref="SPIReturn"/> code.</returns>
+    SPIDECL AbortPatchTransaction() = 0;
+    /// <summary>
+    /// Restore the original bytes of a patch applied by <see cref="ISharedProxyInterface::PatchMemory"/>.
+    /// </summary>
+    /// <param name="name">Name of the patch to revert.</param>
+    /// <returns>An appropriate <see cref="SPIReturn"/> code.</returns>
+    SPIDECL RevertPatch(const char* name) = 0;
+
+    /// <summary>
+    /// Get the text of a name, i.e. of an FName's index, decoded once and shared with the proxy and every other plugin.
+    /// An FName with instance number N > 0 is displayed by the game as this text followed by _N-1.
+    /// Doesn't lock, and only calls into the game the first time a name is asked for.
+    /// </summary>
+    /// <param name="index">Index of the name.</param>
+    /// <param name="outText">Where to write out the text, which stays valid until the game exits.</param>
+    /// <returns>An appropriate <see cref="SPIReturn"/> code, FailureGeneric if the name couldn't be decoded.</returns>
+    SPIDECL GetNameText(int index, const wchar_t** outText) = 0;
+    /// <summary>
+    /// Get the index of a name from its text, compared case-insensitively like the game does.
+    /// Only names decoded before, by <see cref="ISharedProxyInterface::GetNameText"/> or by the proxy itself, are known.
+    /// </summary>
+    /// <param name="text">Text of the name, without an instance number suffix.</param>
+    /// <param name="outIndex">Where to write out the index.</param>
+    /// <returns>An appropriate <see cref="SPIReturn"/> code, FailureDuplicacy if the name isn't known.</returns>
+    SPIDECL FindNameIndex(const wchar_t* text, int* outIndex) = 0;
+
+    /// <summary>
+    /// Replace the native of an UnrealScript function through the proxy's own UFunction::Bind hook, instead of hooking it again,
+    /// e.g. ("IsShippingPCBuild", MyNative, SPI_GAME_LE1 | SPI_GAME_LE2 | SPI_GAME_LE3). Functions of that name which were
+    /// bound before the call get their native replaced too. The native is called as native(UObject* object, FFrame& stack, void* result),
+    /// and must stay loaded until the game exits.
+    /// </summary>
+    /// <param name="name">Name of the function, compared case-insensitively like the game does.</param>
+    /// <param name="native">Pointer to the replacement native.</param>
+    /// <param name="gameMask">SPI_GAME_* flags of the games to replace it in, nothing happens in the others.</param>
+    /// <returns>An appropriate <see cref="SPIReturn"/> code, FailureDuplicacy if the function is already overridden, by the proxy or a plugin.</returns>
+    SPIDECL RegisterNativeOverride(const char* name, void* native, int gameMask) = 0;
 };
 
 #pragma endregion
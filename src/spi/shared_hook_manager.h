@@ -2,23 +2,54 @@
 
 #include "../minhook/include/MinHook.h"
 #include "utils/classutils.h"
-#include "../dllstruct.h"
+#include "utils/hook.h"
+#include "utils/memory.h"
+#include "utils/multicast.h"
+#include "utils/pointer_hook.h"
 #include <map>
 #include <mutex>
 #include <string>
 #include <thread>
+#include <vector>
 
 #define SHOOKMNGR_LOCK(MUTEX) const std::lock_guard<std::mutex> lock(MUTEX);
 
 namespace SPI
 {
+    enum class HookKind
+    {
+        Inline = 0,         // MinHook detour of the target's code
+        PointerSlot = 1,    // swapped vtable or import address table slot
+    };
+
     struct HookComboData
     {
         LPVOID Target;
         ULONG_PTR Identity;
+        std::uint32_t StatsId = Utils::HOOK_STATS_INVALID_ID;
+
+        // Only for pointer slot hooks: what was swapped in, and what to swap back.
+        HookKind Kind = HookKind::Inline;
+        LPVOID Detour = nullptr;
+        LPVOID Original = nullptr;
 
         HookComboData() = default;
-        HookComboData(ULONG_PTR ident, LPVOID target) : Identity{ ident }, Target{ target } { }
+        HookComboData(ULONG_PTR ident, LPVOID target) : Target{ target }, Identity{ ident } { }
+        HookComboData(ULONG_PTR ident, LPVOID target, std::uint32_t statsId) : Target{ target }, Identity{ ident }, StatsId{ statsId } { }
+    };
+
+    struct PendingHookData
+    {
+        std::string Name;
+        LPVOID Target;
+        LPVOID Detour;
+        LPVOID* Original;
+    };
+
+    struct SubscriptionData
+    {
+        LPVOID Target;
+        std::uint64_t Serial;
     };
 
     /// <summary>
@@ -34,11 +65,35 @@ namespace SPI
         bool mhInitialized_;
         MH_STATUS mhLastStatus_;
 
-        std::mutex installMtx_;
-        std::mutex uninstallMtx_;
+        std::mutex installMtx_;   // also guards nameToHookMap_, so uninstalling takes it too
 
         std::map<std::string, HookComboData> nameToHookMap_;
 
+        // Multicast hooks, one dispatcher per target shared by all subscriptions to it.
+        // Also guarded by installMtx_.
+        std::map<LPVOID, Utils::MulticastHook*> targetToMulticastMap_;
+        std::map<std::string, SubscriptionData> nameToSubscriptionMap_;
+
+        // Open batches, keyed by the id of the thread that began them.
+        std::mutex batchMtx_;
+        std::map<DWORD, std::vector<PendingHookData>> threadToBatchMap_;
+
+        // Take the calling thread's batch out of the map, whether there was one.
+        bool takeBatch_(std::vector<PendingHookData>& outBatch)
+        {
+            SHOOKMNGR_LOCK(batchMtx_);
+
+            auto it = threadToBatchMap_.find(GetCurrentThreadId());
+            if (it == threadToBatchMap_.end())
+            {
+                return false;
+            }
+
+            outBatch = std::move(it->second);
+            threadToBatchMap_.erase(it);
+            return true;
+        }
+
     public:
 
         SharedHookManager()
@@ -60,6 +115,11 @@ namespace SPI
             return nameToHookMap_.find(std::string{ name }) != nameToHookMap_.end();
         }
 
+        bool SubscriptionExists(char* name)
+        {
+            return nameToSubscriptionMap_.find(std::string{ name }) != nameToSubscriptionMap_.end();
+        }
+
         bool Install(LPVOID target, LPVOID detour, LPVOID* original, char* name)
         {
             SHOOKMNGR_LOCK(installMtx_);
@@ -70,7 +130,7 @@ namespace SPI
                 return false;
             }
 
-            if (HookExists(name))
+            if (HookExists(name) || SubscriptionExists(name))
             {
                 GLogger.writeln(L"SharedHookMngr.Install: hook of this name already exists");
                 return false;
@@ -80,10 +140,13 @@ namespace SPI
             // Sometime around v3 I want to limit it to one hook per plugin for the same function.
             ++hookCounter_;
 
-            mhLastStatus_ = MH_CreateHookEx(hookCounter_, original, detour, target);
+            std::uint32_t statsId;
+            auto installed = GHookProfiler.Instrument(detour, name, &statsId);
+            mhLastStatus_ = MH_CreateHookEx(hookCounter_, original, installed, target);
             if (mhLastStatus_ != MH_OK)
             {
                 GLogger.writeln(L"SharedHookMngr.Install: create failed, status = %d", mhLastStatus_);
+                GHookProfiler.Discard(statsId, installed);
                 return false;
             }
 
@@ -93,20 +156,282 @@ namespace SPI
             if (mhLastStatus_ != MH_OK)
             {
                 GLogger.writeln(L"SharedHookMngr.Install: enable failed, status = %d", mhLastStatus_);
+                // Never enabled, so no thread can have reached the thunk.
+                MH_RemoveHookEx(nullptr, hookCounter_, target);
+                GHookProfiler.Discard(statsId, installed);
                 return false;
             }
 
             // Save the installed hook info
-            nameToHookMap_.insert({ name, HookComboData{ hookCounter_, target } });
+            nameToHookMap_.insert({ name, HookComboData{ hookCounter_, target, statsId } });
 
             GLogger.writeln(L"SharedHookMngr.Install: enabled [%S] 0x%p", name, target);
             return true;
 
         }
 
+        /// <summary>
+        /// Hook through a function pointer slot (a vtable entry, an import address table entry) by swapping it.
+        /// Unlike Install, nothing is frozen or patched, and calls don't go through a relay.
+        /// Hooking a slot that's already hooked chains onto the previous detour.
+        /// </summary>
+        bool InstallSlot(LPVOID* slot, LPVOID detour, LPVOID* original, char* name)
+        {
+            SHOOKMNGR_LOCK(installMtx_);
+
+            if (!IsInitialized() || !IsOK(mhLastStatus_))
+            {
+                GLogger.writeln(L"SharedHookMngr.InstallSlot: was not initialized or was in bad status");
+                return false;
+            }
+
+            if (HookExists(name) || SubscriptionExists(name))
+            {
+                GLogger.writeln(L"SharedHookMngr.InstallSlot: hook of this name already exists");
+                return false;
+            }
+
+            std::uint32_t statsId;
+            auto installed = GHookProfiler.Instrument(detour, name, &statsId);
+
+            // The original must be in place before the detour can be reached, so retry if the slot changes in between.
+            LPVOID previous;
+            while (true)
+            {
+                previous = *reinterpret_cast<LPVOID volatile*>(slot);
+                if (!Utils::IsExecutableAddress(previous))
+                {
+                    GLogger.writeln(L"SharedHookMngr.InstallSlot: slot 0x%p doesn't hold a function pointer (0x%p)", slot, previous);
+                    GHookProfiler.Discard(statsId, installed);
+                    return false;
+                }
+                if (original)
+                {
+                    *original = previous;
+                }
+
+                if (Utils::ExchangePointerSlot(slot, previous, installed))
+                {
+                    break;
+                }
+                if (*reinterpret_cast<LPVOID volatile*>(slot) == previous)
+                {
+                    GLogger.writeln(L"SharedHookMngr.InstallSlot: failed to make slot 0x%p writable", slot);
+                    GHookProfiler.Discard(statsId, installed);
+                    return false;
+                }
+            }
+
+            HookComboData data{ 0, slot, statsId };
+            data.Kind = HookKind::PointerSlot;
+            data.Detour = installed;
+            data.Original = previous;
+            nameToHookMap_.insert({ name, data });
+
+            GLogger.writeln(L"SharedHookMngr.InstallSlot: swapped [%S] 0x%p: 0x%p -> 0x%p", name, slot, previous, detour);
+            return true;
+        }
+
+        /// <summary>
+        /// Start queueing hooks for the calling thread, see QueueInstall and CommitBatch.
+        /// </summary>
+        /// <returns>False if the thread already has a batch open.</returns>
+        bool BeginBatch()
+        {
+            SHOOKMNGR_LOCK(batchMtx_);
+
+            if (!threadToBatchMap_.insert({ GetCurrentThreadId(), std::vector<PendingHookData>{} }).second)
+            {
+                GLogger.writeln(L"SharedHookMngr.BeginBatch: this thread already has a batch open");
+                return false;
+            }
+            return true;
+        }
+
+        /// <summary>
+        /// Add a hook to the calling thread's batch. Nothing is created until CommitBatch.
+        /// </summary>
+        bool QueueInstall(LPVOID target, LPVOID detour, LPVOID* original, char* name)
+        {
+            SHOOKMNGR_LOCK(batchMtx_);
+
+            auto it = threadToBatchMap_.find(GetCurrentThreadId());
+            if (it == threadToBatchMap_.end())
+            {
+                GLogger.writeln(L"SharedHookMngr.QueueInstall: this thread has no batch open");
+                return false;
+            }
+
+            for (auto& pending : it->second)
+            {
+                if (pending.Name == name)
+                {
+                    GLogger.writeln(L"SharedHookMngr.QueueInstall: hook of this name is already queued");
+                    return false;
+                }
+            }
+
+            it->second.push_back({ name, target, detour, original });
+            return true;
+        }
+
+        /// <summary>
+        /// Create and enable every hook queued by the calling thread with a single thread freeze, and close the batch.
+        /// Either all of them get installed, or none.
+        /// </summary>
+        bool CommitBatch()
+        {
+            std::vector<PendingHookData> batch;
+            if (!takeBatch_(batch))
+            {
+                GLogger.writeln(L"SharedHookMngr.CommitBatch: this thread has no batch open");
+                return false;
+            }
+
+            SHOOKMNGR_LOCK(installMtx_);
+
+            if (!IsInitialized() || !IsOK(mhLastStatus_))
+            {
+                GLogger.writeln(L"SharedHookMngr.CommitBatch: was not initialized or was in bad status");
+                return false;
+            }
+
+            std::vector<Utils::HookRequest> requests;
+            requests.reserve(batch.size());
+            for (auto& pending : batch)
+            {
+                auto name = const_cast<char*>(pending.Name.c_str());
+                if (HookExists(name) || SubscriptionExists(name))
+                {
+                    GLogger.writeln(L"SharedHookMngr.CommitBatch: hook [%S] already exists, dropping the batch", pending.Name.c_str());
+                    return false;
+                }
+
+                // Each hook gets its own identity, same as in Install.
+                requests.push_back({ pending.Target, pending.Detour, pending.Original, pending.Name.c_str(), ++hookCounter_, Utils::HOOK_STATS_INVALID_ID });
+            }
+
+            // A failed batch leaves nothing behind, so it doesn't put the manager in bad status.
+            auto status = Utils::InstallHookBatch(requests.data(), requests.size());
+            if (status != MH_OK)
+            {
+                GLogger.writeln(L"SharedHookMngr.CommitBatch: installing %d hook(s) failed, status = %d", static_cast<int>(requests.size()), status);
+                return false;
+            }
+
+            for (auto& request : requests)
+            {
+                nameToHookMap_.insert({ request.Name, HookComboData{ request.Ident, request.Target, request.StatsId } });
+            }
+            return true;
+        }
+
+        /// <summary>
+        /// Drop the calling thread's batch without installing anything.
+        /// </summary>
+        bool AbortBatch()
+        {
+            std::vector<PendingHookData> batch;
+            return takeBatch_(batch);
+        }
+
+        /// <summary>
+        /// Get the merged counters of a hook installed while the HookProfiler was enabled.
+        /// </summary>
+        bool GetStats(char* name, Utils::HookStatsSnapshot* outStats)
+        {
+            SHOOKMNGR_LOCK(installMtx_);
+
+            auto it = nameToHookMap_.find(std::string{ name });
+            if (it == nameToHookMap_.end() || it->second.StatsId == Utils::HOOK_STATS_INVALID_ID)
+            {
+                return false;
+            }
+
+            return GHookProfiler.Query(it->second.StatsId, outStats);
+        }
+
+        /// <summary>
+        /// Add callbacks to the multicast hook of a target, installing its dispatcher on first use.
+        /// The dispatcher stays installed after the last subscription is gone, with nothing to call.
+        /// </summary>
+        bool Subscribe(LPVOID target, Utils::MulticastCallback pre, Utils::MulticastCallback post, void* userData, int priority, char* name)
+        {
+            SHOOKMNGR_LOCK(installMtx_);
+
+            if (!IsInitialized() || !IsOK(mhLastStatus_))
+            {
+                GLogger.writeln(L"SharedHookMngr.Subscribe: was not initialized or was in bad status");
+                return false;
+            }
+
+            if (HookExists(name) || SubscriptionExists(name))
+            {
+                GLogger.writeln(L"SharedHookMngr.Subscribe: hook of this name already exists");
+                return false;
+            }
+
+            auto it = targetToMulticastMap_.find(target);
+            if (it == targetToMulticastMap_.end())
+            {
+                auto hook = Utils::MulticastHook::Create();
+                if (!hook)
+                {
+                    GLogger.writeln(L"SharedHookMngr.Subscribe: failed to generate a dispatcher");
+                    return false;
+                }
+
+                // The dispatcher is chained with regular hooks of the target like any other detour.
+                ++hookCounter_;
+
+                auto status = MH_CreateHookEx(hookCounter_, hook->OriginalSlot(), hook->Dispatcher(), target);
+                if (status == MH_OK)
+                {
+                    status = MH_EnableHookEx(hookCounter_, target);
+                    if (status != MH_OK)
+                    {
+                        MH_RemoveHookEx(nullptr, hookCounter_, target);
+                    }
+                }
+                if (status != MH_OK)
+                {
+                    GLogger.writeln(L"SharedHookMngr.Subscribe: installing the dispatcher failed, status = %d", status);
+                    Utils::MulticastHook::Destroy(hook);
+                    return false;
+                }
+
+                GLogger.writeln(L"SharedHookMngr.Subscribe: installed a dispatcher 0x%p -> 0x%p", target, hook->Dispatcher());
+                it = targetToMulticastMap_.insert({ target, hook }).first;
+            }
+
+            auto serial = it->second->Subscribe(pre, post, userData, priority);
+            nameToSubscriptionMap_.insert({ name, SubscriptionData{ target, serial } });
+
+            GLogger.writeln(L"SharedHookMngr.Subscribe: subscribed [%S] to 0x%p with priority %d", name, target, priority);
+            return true;
+        }
+
+        bool Unsubscribe(char* name)
+        {
+            SHOOKMNGR_LOCK(installMtx_);
+
+            auto it = nameToSubscriptionMap_.find(std::string{ name });
+            if (it == nameToSubscriptionMap_.end())
+            {
+                GLogger.writeln(L"SharedHookMngr.Unsubscribe: subscription of this name doesn't exist");
+                return false;
+            }
+
+            targetToMulticastMap_.at(it->second.Target)->Unsubscribe(it->second.Serial);
+            nameToSubscriptionMap_.erase(it);
+
+            GLogger.writeln(L"SharedHookMngr.Unsubscribe: removed [%S]", name);
+            return true;
+        }
+
         bool Uninstall(char* name)
         {
-            SHOOKMNGR_LOCK(uninstallMtx_);
+            SHOOKMNGR_LOCK(installMtx_);
 
             if (!IsInitialized() || !IsOK(mhLastStatus_))
             {
@@ -114,20 +439,40 @@ namespace SPI
                 return false;
             }
 
-            if (!HookExists(name))
+            auto it = nameToHookMap_.find(std::string{ name });
+            if (it == nameToHookMap_.end())
             {
-                GLogger.writeln(L"SharedHookMngr.Uninstall: hook of this name already exists");
+                GLogger.writeln(L"SharedHookMngr.Uninstall: hook of this name doesn't exist");
                 return false;
             }
 
-            auto hookInfo = nameToHookMap_.at(std::string{ name });
-            mhLastStatus_ = MH_RemoveHookEx((void*)4123, hookInfo.Identity, hookInfo.Target);
+            if (it->second.Kind == HookKind::PointerSlot)
+            {
+                // Only possible while nobody chained onto the slot after us, or their detour would be dropped.
+                if (!Utils::ExchangePointerSlot(static_cast<LPVOID*>(it->second.Target), it->second.Detour, it->second.Original))
+                {
+                    GLogger.writeln(L"SharedHookMngr.Uninstall: slot 0x%p was hooked again or isn't writable, can't restore it", it->second.Target);
+                    return false;
+                }
+
+                nameToHookMap_.erase(it);
+
+                GLogger.writeln(L"SharedHookMngr.Uninstall: restored [%S]", name);
+                return true;
+            }
+
+            // Disables the hook. Its trampoline stays valid until MH_Uninitialize, so a detour still running can call it.
+            mhLastStatus_ = MH_RemoveHookEx((void*)4123, it->second.Identity, it->second.Target);
             if (mhLastStatus_ != MH_OK)
             {
                 GLogger.writeln(L"SharedHookMngr.Uninstall: remove failed, status = %d", mhLastStatus_);
                 return false;
             }
 
+            // The name is free to be installed again.
+            nameToHookMap_.erase(it);
+
+            GLogger.writeln(L"SharedHookMngr.Uninstall: removed [%S]", name);
             return true;
         }
     };
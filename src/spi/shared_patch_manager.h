@@ -0,0 +1,439 @@
+#pragma once
+
+#include "utils/classutils.h"
+#include "utils/io.h"
+#include "utils/memory.h"
+#include <algorithm>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <Windows.h>
+
+#define SPATCHMNGR_LOCK(MUTEX) const std::lock_guard<std::mutex> lock(MUTEX);
+
+namespace SPI
+{
+    struct PatchData
+    {
+        BYTE* Address;
+        std::vector<BYTE> Original;
+        std::vector<BYTE> Patched;
+        HMODULE Owner;      // plugin that applied the patch, reverted when it detaches
+    };
+
+    struct PendingPatchData
+    {
+        std::string Name;
+        PatchData Patch;
+    };
+
+    /// <summary>
+    /// Byte patch manager to be used internally by SPI.
+    /// Patches are written with every other thread suspended, and their original bytes are kept to revert them.
+    /// No two patches may overlap, whoever applied them.
+    /// </summary>
+    class SharedPatchManager
+        : public NonCopyMovable
+    {
+    private:
+        static constexpr int MaxWriteAttempts_ = 16;
+
+        struct Write_
+        {
+            BYTE* Address;
+            const BYTE* Bytes;
+            size_t Size;
+        };
+
+        struct ProtectedRun_
+        {
+            BYTE* Start;
+            SIZE_T Size;
+            DWORD OldProtect;
+        };
+
+        std::mutex patchMtx_;   // guards nameToPatchMap_, and serializes writes
+        std::map<std::string, PatchData> nameToPatchMap_;
+
+        // Open transactions, keyed by the id of the thread that began them.
+        std::mutex transactionMtx_;
+        std::map<DWORD, std::vector<PendingPatchData>> threadToTransactionMap_;
+
+        static bool overlaps_(const BYTE* address, size_t size, const PatchData& patch)
+        {
+            return address < patch.Address + patch.Patched.size() && patch.Address < address + size;
+        }
+
+        // Name of an applied patch overlapping the range, nullptr if there's none.
+        // Must be called with patchMtx_ held.
+        const char* findConflict_(const BYTE* address, size_t size)
+        {
+            for (const auto& entry : nameToPatchMap_)
+            {
+                if (overlaps_(address, size, entry.second))
+                {
+                    return entry.first.c_str();
+                }
+            }
+            return nullptr;
+        }
+
+        // Whether the whole range is committed and readable, so that its original bytes can be saved.
+        static bool isReadable_(const BYTE* address, size_t size)
+        {
+            const BYTE* end = address + size;
+            while (address < end)
+            {
+                MEMORY_BASIC_INFORMATION mi;
+                if (!VirtualQuery(address, &mi, sizeof(mi)) || mi.State != MEM_COMMIT
+                    || (mi.Protect & (PAGE_GUARD | PAGE_NOACCESS)) || mi.Protect == PAGE_EXECUTE)
+                {
+                    return false;
+                }
+                address = static_cast<const BYTE*>(mi.BaseAddress) + mi.RegionSize;
+            }
+            return true;
+        }
+
+        // Make every page the writes touch writable, with a single protection change per run of pages
+        // sharing the same attributes, however many writes land on them.
+        static bool unprotect_(const std::vector<Write_>& writes, std::vector<ProtectedRun_>& outRuns)
+        {
+            SYSTEM_INFO systemInfo;
+            GetSystemInfo(&systemInfo);
+            const DWORD_PTR pageSize = systemInfo.dwPageSize;
+
+            std::vector<BYTE*> pages;
+            for (const auto& write : writes)
+            {
+                auto first = reinterpret_cast<DWORD_PTR>(write.Address) & ~(pageSize - 1);
+                auto last = (reinterpret_cast<DWORD_PTR>(write.Address) + write.Size - 1) & ~(pageSize - 1);
+                for (auto page = first; page <= last; page += pageSize)
+                {
+                    pages.push_back(reinterpret_cast<BYTE*>(page));
+                }
+            }
+            std::sort(pages.begin(), pages.end());
+            pages.erase(std::unique(pages.begin(), pages.end()), pages.end());
+
+            for (size_t i = 0; i < pages.size(); )
+            {
+                MEMORY_BASIC_INFORMATION mi;
+                if (!VirtualQuery(pages[i], &mi, sizeof(mi)) || mi.State != MEM_COMMIT || (mi.Protect & (PAGE_GUARD | PAGE_NOACCESS)))
+                {
+                    GLogger.writeln(L"SharedPatchMngr.unprotect_: page 0x%p isn't accessible", pages[i]);
+                    reprotect_(outRuns);
+                    return false;
+                }
+
+                // Consecutive pages of the same region share its protection.
+                auto regionEnd = static_cast<BYTE*>(mi.BaseAddress) + mi.RegionSize;
+                size_t j = i + 1;
+                while (j < pages.size() && pages[j] == pages[j - 1] + pageSize && pages[j] < regionEnd)
+                {
+                    j++;
+                }
+
+                ProtectedRun_ run{ pages[i], (j - i) * pageSize, 0 };
+                i = j;
+                if (Utils::IsWritableProtection(mi.Protect))
+                {
+                    continue;
+                }
+
+                if (!VirtualProtect(run.Start, run.Size, Utils::IsExecutableProtection(mi.Protect) ? PAGE_EXECUTE_READWRITE : PAGE_READWRITE, &run.OldProtect))
+                {
+                    GLogger.writeln(L"SharedPatchMngr.unprotect_: failed to unprotect 0x%p (last error = %d)", run.Start, GetLastError());
+                    reprotect_(outRuns);
+                    return false;
+                }
+                outRuns.push_back(run);
+            }
+            return true;
+        }
+
+        static void reprotect_(std::vector<ProtectedRun_>& runs)
+        {
+            for (const auto& run : runs)
+            {
+                DWORD ignored;
+                VirtualProtect(run.Start, run.Size, run.OldProtect, &ignored);
+            }
+            runs.clear();
+        }
+
+        // Write everything under a single thread freeze. A thread stopped in the middle of a patched range
+        // would resume mid-instruction, so the freeze is retried until none is.
+        // Must be called with patchMtx_ held.
+        static bool write_(const std::vector<Write_>& writes)
+        {
+            std::vector<ProtectedRun_> runs;
+            if (!unprotect_(writes, runs))
+            {
+                return false;
+            }
+
+            bool written = false;
+            for (int attempt = 0; attempt < MaxWriteAttempts_ && !written; attempt++)
+            {
+                if (attempt != 0)
+                {
+                    Sleep(1);
+                }
+
+                Utils::ScopedThreadFreeze freeze;
+                bool busy = freeze.AnyInstructionPointer([&writes](DWORD_PTR ip)
+                    {
+                        for (const auto& write : writes)
+                        {
+                            if (ip > reinterpret_cast<DWORD_PTR>(write.Address) && ip < reinterpret_cast<DWORD_PTR>(write.Address) + write.Size)
+                            {
+                                return true;
+                            }
+                        }
+                        return false;
+                    });
+                if (busy)
+                {
+                    continue;
+                }
+
+                for (const auto& write : writes)
+                {
+                    std::memcpy(write.Address, write.Bytes, write.Size);
+                    FlushInstructionCache(GetCurrentProcess(), write.Address, write.Size);
+                }
+                written = true;
+            }
+
+            reprotect_(runs);
+
+            if (!written)
+            {
+                GLogger.writeln(L"SharedPatchMngr.write_: a thread kept running inside the patched bytes, gave up after %d attempts", MaxWriteAttempts_);
+            }
+            return written;
+        }
+
+        // Restore the original bytes of the named patches and forget them.
+        // Patches whose bytes were changed behind our back are forgotten but left alone.
+        // Must be called with patchMtx_ held.
+        bool revert_(const std::vector<std::string>& names)
+        {
+            std::vector<Write_> writes;
+            for (const auto& name : names)
+            {
+                const auto& patch = nameToPatchMap_.at(name);
+                if (std::memcmp(patch.Address, patch.Patched.data(), patch.Patched.size()) != 0)
+                {
+                    GLogger.writeln(L"SharedPatchMngr.revert_: [%S] at 0x%p was overwritten since, leaving it", name.c_str(), patch.Address);
+                    continue;
+                }
+                writes.push_back({ patch.Address, patch.Original.data(), patch.Original.size() });
+            }
+
+            if (!writes.empty() && !write_(writes))
+            {
+                return false;
+            }
+
+            for (const auto& name : names)
+            {
+                nameToPatchMap_.erase(name);
+            }
+            return true;
+        }
+
+        // Take the calling thread's transaction out of the map, whether there was one.
+        bool takeTransaction_(std::vector<PendingPatchData>& outTransaction)
+        {
+            SPATCHMNGR_LOCK(transactionMtx_);
+
+            auto it = threadToTransactionMap_.find(GetCurrentThreadId());
+            if (it == threadToTransactionMap_.end())
+            {
+                return false;
+            }
+
+            outTransaction = std::move(it->second);
+            threadToTransactionMap_.erase(it);
+            return true;
+        }
+
+        // Apply a group of patches at once, or none of them.
+        bool apply_(std::vector<PendingPatchData>& patches)
+        {
+            SPATCHMNGR_LOCK(patchMtx_);
+
+            std::vector<Write_> writes;
+            writes.reserve(patches.size());
+            for (auto& pending : patches)
+            {
+                if (nameToPatchMap_.find(pending.Name) != nameToPatchMap_.end())
+                {
+                    GLogger.writeln(L"SharedPatchMngr.apply_: patch [%S] already exists", pending.Name.c_str());
+                    return false;
+                }
+
+                auto& patch = pending.Patch;
+                if (auto other = findConflict_(patch.Address, patch.Patched.size()))
+                {
+                    GLogger.writeln(L"SharedPatchMngr.apply_: patch [%S] overlaps [%S] at 0x%p", pending.Name.c_str(), other, patch.Address);
+                    return false;
+                }
+
+                if (!isReadable_(patch.Address, patch.Patched.size()))
+                {
+                    GLogger.writeln(L"SharedPatchMngr.apply_: patch [%S] targets unreadable memory at 0x%p", pending.Name.c_str(), patch.Address);
+                    return false;
+                }
+
+                patch.Original.assign(patch.Address, patch.Address + patch.Patched.size());
+                writes.push_back({ patch.Address, patch.Patched.data(), patch.Patched.size() });
+            }
+
+            if (!write_(writes))
+            {
+                return false;
+            }
+
+            for (auto& pending : patches)
+            {
+                GLogger.writeln(L"SharedPatchMngr.apply_: patched [%S] 0x%p, %d byte(s)", pending.Name.c_str(), pending.Patch.Address, static_cast<int>(pending.Patch.Patched.size()));
+                nameToPatchMap_.insert({ pending.Name, std::move(pending.Patch) });
+            }
+            return true;
+        }
+
+    public:
+
+        SharedPatchManager()
+            : nameToPatchMap_{ }
+            , threadToTransactionMap_{ }
+        {
+        }
+
+        bool PatchExists(const char* name)
+        {
+            SPATCHMNGR_LOCK(patchMtx_);
+            return nameToPatchMap_.find(std::string{ name }) != nameToPatchMap_.end();
+        }
+
+        /// <summary>
+        /// Start queueing patches for the calling thread, see Patch and CommitTransaction.
+        /// </summary>
+        /// <returns>False if the thread already has a transaction open.</returns>
+        bool BeginTransaction()
+        {
+            SPATCHMNGR_LOCK(transactionMtx_);
+
+            if (!threadToTransactionMap_.insert({ GetCurrentThreadId(), std::vector<PendingPatchData>{} }).second)
+            {
+                GLogger.writeln(L"SharedPatchMngr.BeginTransaction: this thread already has a transaction open");
+                return false;
+            }
+            return true;
+        }
+
+        /// <summary>
+        /// Write bytes over the given address, or queue them if the calling thread has a transaction open.
+        /// </summary>
+        bool Patch(const char* name, BYTE* address, const BYTE* bytes, size_t size, HMODULE owner)
+        {
+            PendingPatchData pending{ name, PatchData{ address, {}, std::vector<BYTE>(bytes, bytes + size), owner } };
+
+            {
+                SPATCHMNGR_LOCK(transactionMtx_);
+
+                auto it = threadToTransactionMap_.find(GetCurrentThreadId());
+                if (it != threadToTransactionMap_.end())
+                {
+                    for (const auto& queued : it->second)
+                    {
+                        if (queued.Name == pending.Name || overlaps_(address, size, queued.Patch))
+                        {
+                            GLogger.writeln(L"SharedPatchMngr.Patch: [%S] conflicts with [%S] in the same transaction", name, queued.Name.c_str());
+                            return false;
+                        }
+                    }
+
+                    it->second.push_back(std::move(pending));
+                    return true;
+                }
+            }
+
+            std::vector<PendingPatchData> single;
+            single.push_back(std::move(pending));
+            return apply_(single);
+        }
+
+        /// <summary>
+        /// Apply every patch queued by the calling thread with a single thread freeze, and close the transaction.
+        /// Either all of them get applied, or none.
+        /// </summary>
+        bool CommitTransaction()
+        {
+            std::vector<PendingPatchData> transaction;
+            if (!takeTransaction_(transaction))
+            {
+                GLogger.writeln(L"SharedPatchMngr.CommitTransaction: this thread has no transaction open");
+                return false;
+            }
+
+            return transaction.empty() || apply_(transaction);
+        }
+
+        /// <summary>
+        /// Drop the calling thread's transaction without applying anything.
+        /// </summary>
+        bool AbortTransaction()
+        {
+            std::vector<PendingPatchData> transaction;
+            return takeTransaction_(transaction);
+        }
+
+        /// <summary>
+        /// Restore the original bytes of a patch.
+        /// </summary>
+        bool Revert(const char* name)
+        {
+            SPATCHMNGR_LOCK(patchMtx_);
+
+            if (nameToPatchMap_.find(std::string{ name }) == nameToPatchMap_.end())
+            {
+                GLogger.writeln(L"SharedPatchMngr.Revert: patch of this name doesn't exist");
+                return false;
+            }
+
+            return revert_({ name });
+        }
+
+        /// <summary>
+        /// Restore the original bytes of every patch applied by a plugin, with a single thread freeze.
+        /// </summary>
+        /// <returns>The number of patches reverted.</returns>
+        int RevertOwnedBy(HMODULE owner)
+        {
+            SPATCHMNGR_LOCK(patchMtx_);
+
+            std::vector<std::string> names;
+            for (const auto& entry : nameToPatchMap_)
+            {
+                if (entry.second.Owner == owner)
+                {
+                    names.push_back(entry.first);
+                }
+            }
+
+            if (names.empty() || !revert_(names))
+            {
+                return 0;
+            }
+
+            GLogger.writeln(L"SharedPatchMngr.RevertOwnedBy: reverted %d patch(es) of 0x%p", static_cast<int>(names.size()), owner);
+            return static_cast<int>(names.size());
+        }
+    };
+}
@@ -1,7 +1,17 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "conf/native_overrides.h"
 #include "gamever.h"
 #include "utils/io.h"
+#include "utils/name_cache.h"
+#include "utils/perfect_hash.h"
 #include "dllstruct.h"
 
 
@@ -9,6 +19,10 @@
 #define SYMCONCAT(X, Y) SYMCONCAT_INNER(X, Y)
 
 
+// The structures below are 4-byte packed, which must not leak into whatever gets included after this.
+#pragma pack(push)
+
+
 namespace UE
 {
     // Structure of a generic array used across the engine.
@@ -51,38 +65,79 @@ namespace UE
     tUFunctionBind UFunctionBind_orig = nullptr;
 
 
+    // A name as the engine stores it: an index into the name table, and an instance number.
+
+    struct FNamePartial
+    {
+        int Index;
+        int Number;
+    };
+
+
+    // Decode the name at an index of the name table, i.e. an FName without instance number,
+    // into a string valid until the next call. Nothing can be decoded until the game's function is found.
+    const wchar_t* DecodeNameIndex(int index)
+    {
+        wchar_t bufferLE1[2048];
+        memset(bufferLE1, 0, 2048);
+        wchar_t bufferLE23[16];
+        memset(bufferLE23, 0, 16);
+
+        FNamePartial name{ index, 0 };
+
+        switch (GLEBinkProxy.Game)
+        {
+        case LEGameVersion::LE1:
+            if (UE::GetName == nullptr)
+            {
+                return nullptr;
+            }
+            return *(wchar_t**)UE::GetName(&name, bufferLE1);
+        case LEGameVersion::LE2:
+        case LEGameVersion::LE3:
+            if (UE::NewGetName == nullptr)
+            {
+                return nullptr;
+            }
+            UE::NewGetName(&name, bufferLE23);
+            return *(wchar_t**)bufferLE23;
+        default:
+            GLogger.writeln(L"DecodeNameIndex: ERROR: unsupported game version.");
+            return nullptr;
+        }
+    }
+
+    // Decoded names shared by the proxy and, through SPI, its plugins.
+    static Utils::NameCache GNameCache{ DecodeNameIndex };
+
+
     // A partial representation of a UObject class.
 
     struct UObjectPartial
     {
         BYTE a[0x48];  // 0x48 seems to be the offset to Name across all three games
-        void* Name;
+        FNamePartial Name;
 
-        // A game-agnostic wrapper around GetName to retrieve object names.
-        wchar_t* GetName()
+        // The raw name, equal for two objects exactly when their names are.
+        __forceinline std::uint64_t NameKey() const noexcept
         {
-            wchar_t bufferLE1[2048];
-            memset(bufferLE1, 0, 2048);
-            wchar_t bufferLE23[16];
-            memset(bufferLE23, 0, 16);
-
-            //GLogger.writeln(L"DEBUG DEBUG DEBUG: ATTACH AT %p", &Name);
-            //Sleep(30 * 1000);
-
-            auto nameEntryPtr = &Name;
+            return *reinterpret_cast<const std::uint64_t*>(&Name);
+        }
 
-            switch (GLEBinkProxy.Game)
+        // A game-agnostic wrapper around GetName to retrieve object names, decoded once per name index.
+        // Names with an instance number are formatted into a per-thread buffer, valid until the next call on the same thread.
+        const wchar_t* GetName()
+        {
+            auto text = GNameCache.Find(Name.Index);
+            if (text == nullptr || Name.Number == 0)
             {
-            case LEGameVersion::LE1:
-                return *(wchar_t**)UE::GetName(nameEntryPtr, bufferLE1);
-            case LEGameVersion::LE2:
-            case LEGameVersion::LE3:
-                UE::NewGetName(nameEntryPtr, bufferLE23);
-                return *(wchar_t**)bufferLE23;
-            default:
-                GLogger.writeln(L"GetObjectName: ERROR: unsupported game version.");
-                return nullptr;
+                return text;
             }
+
+            // The engine displays instance number N as a _N-1 suffix.
+            thread_local wchar_t numbered[1024];
+            swprintf(numbered, 1024, L"%s_%d", text, Name.Number - 1);
+            return numbered;
         }
     };
 
@@ -131,92 +186,450 @@ namespace UE
 
 
     // A GNative function which takes no arguments and returns TRUE.
+    // Instantiated for each game's FFrame, so that the script VM's calls never branch on the game version.
+    template <typename TFrame>
     void AlwaysPositiveNative(UObjectPartial* pObject, void* pFrame, void* pResult)
     {
-        GLogger.writeln(L"UE::AlwaysPositiveNative: called for %s.", pObject->GetName());
-
-        switch (GLEBinkProxy.Game)
-        {
-        case LEGameVersion::LE1:
-            ((FFramePartialLE1*)(pFrame))->Code++;
-            *(long long*)pResult = TRUE;
-            break;
-        case LEGameVersion::LE2:
-            ((FFramePartialLE2*)(pFrame))->Code++;
-            *(long long*)pResult = TRUE;
-            break;
-        case LEGameVersion::LE3:
-            ((FFramePartialLE3*)(pFrame))->Code++;
-            *(long long*)pResult = TRUE;
-            break;
-        default:
-            GLogger.writeln(L"UE::AlwaysPositiveNative: ERROR: unsupported game version.");
-            break;
-        }
+        ((TFrame*)(pFrame))->Code++;
+        *(long long*)pResult = TRUE;
     }
 
     // A GNative function which takes no arguments and returns FALSE.
+    template <typename TFrame>
     void AlwaysNegativeNative(UObjectPartial* pObject, void* pFrame, void* pResult)
     {
-        GLogger.writeln(L"UE::AlwaysNegativeNative: called for %s.", pObject->GetName());
+        ((TFrame*)(pFrame))->Code++;
+        *(long long*)pResult = FALSE;
+    }
 
-        switch (GLEBinkProxy.Game)
+
+    // Natives of a game and how to bind them, picked once by NativeOverrideTable::Initialize.
+
+    template <typename TFrame, typename TFunction>
+    struct GameNatives
+    {
+        static void Bind(UObjectPartial* pFunction, void* native)
         {
-        case LEGameVersion::LE1:
-            ((FFramePartialLE1*)(pFrame))->Code++;
-            *(long long*)pResult = FALSE;
-            break;
-        case LEGameVersion::LE2:
-            ((FFramePartialLE2*)(pFrame))->Code++;
-            *(long long*)pResult = FALSE;
-            break;
-        case LEGameVersion::LE3:
-            ((FFramePartialLE3*)(pFrame))->Code++;
-            *(long long*)pResult = FALSE;
-            break;
-        default:
-            GLogger.writeln(L"UE::AlwaysNegativeNative: ERROR: unsupported game version.");
-            break;
+            ((TFunction*)pFunction)->Func = native;
         }
-    }
 
+        static void* Find(const char* name)
+        {
+            if (0 == strcmp(name, "AlwaysPositiveNative"))
+            {
+                return reinterpret_cast<void*>(&AlwaysPositiveNative<TFrame>);
+            }
+            if (0 == strcmp(name, "AlwaysNegativeNative"))
+            {
+                return reinterpret_cast<void*>(&AlwaysNegativeNative<TFrame>);
+            }
+            return nullptr;
+        }
+    };
 
-    // A hooked wrapper around UFunction::Bind which calls the original and then
-    // binds IsShippingPCBuild and IsFinalReleaseDebugConsoleBuild to AlwaysPositiveNative.
-    void HookedUFunctionBind(UObjectPartial* pFunction)
+
+    // Natives to replace when UFunction::Bind binds a function, from conf/native_overrides.h and from plugins.
+    // Functions are found by a perfect hash of their name's text, and the raw FName of each one is
+    // remembered the first time it's bound: from then on it's matched without looking at the name at all,
+    // and once every override has been seen, no other name gets looked at either.
+    // Every function the hook sees is recorded, so that an override added later can be applied to those bound before it.
+    class NativeOverrideTable
     {
-        UFunctionBind_orig(pFunction);
+    public:
+        static constexpr int MaxOverrides = 64;
+
+    private:
+        using Table_ = Utils::PerfectHashTable<9>;
+        static constexpr size_t MinCompactSize_ = 65536;
+
+        struct Override_
+        {
+            std::wstring Function;
+            std::string NativeName;
+            void* Native;
+        };
+
+        struct Bound_
+        {
+            UObjectPartial* Function;
+            void* VTable;
+            std::uint64_t Key;
+        };
+
+        // Overrides are only appended, each one fully written before a table pointing at it is published.
+        Override_ overrides_[MaxOverrides];
+        std::atomic<int> count_{ 0 };
+        std::atomic<const Table_*> byText_{ nullptr };
+        void (*bindNative_)(UObjectPartial* pFunction, void* native) = nullptr;
+        std::mutex addMtx_;
+        std::uint64_t textKeys_[MaxOverrides] = {};
+        std::int32_t textIndices_[MaxOverrides] = {};
+
+        // Raw FNames of the overrides bound so far.
+        std::atomic<const Table_*> byName_{ nullptr };
+        std::atomic<bool> complete_{ true };
+        std::mutex learnMtx_;
+        std::uint64_t knownKeys_[MaxOverrides] = {};
+        std::int32_t knownOverrides_[MaxOverrides] = {};
+        int knownCount_ = 0;
+
+        // Tables are kept until exit, a reader may still be probing a replaced one.
+        std::mutex tablesMtx_;
+        std::vector<std::unique_ptr<Table_>> ownedTables_;
+
+        // Every function bound so far, dead ones included until the next compaction.
+        std::mutex boundMtx_;
+        std::vector<Bound_> bound_;
+        size_t compactAt_ = MinCompactSize_;
+
+        // Names are compared case-insensitively like the engine does, and hashed the same way as in the name cache.
+        static bool equalsText_(const wchar_t* a, const wchar_t* b) noexcept
+        {
+            for (; *a != L'\0' && Utils::NameCache::FoldChar(*a) == Utils::NameCache::FoldChar(*b); a++, b++);
+            return Utils::NameCache::FoldChar(*a) == Utils::NameCache::FoldChar(*b);
+        }
+
+        const Table_* publish_(std::unique_ptr<Table_> table)
+        {
+            const std::lock_guard<std::mutex> lock(tablesMtx_);
+            ownedTables_.push_back(std::move(table));
+            return ownedTables_.back().get();
+        }
+
+        void learn_(std::uint64_t key, int index)
+        {
+            const std::lock_guard<std::mutex> lock(learnMtx_);
+
+            auto current = byName_.load(std::memory_order_relaxed);
+            if ((current != nullptr && current->Find(key) != Table_::NotFound) || knownCount_ == MaxOverrides)
+            {
+                return;
+            }
+
+            knownKeys_[knownCount_] = key;
+            knownOverrides_[knownCount_] = index;
+
+            auto table = std::make_unique<Table_>();
+            if (!table->Build(knownKeys_, knownOverrides_, knownCount_ + 1))
+            {
+                // The override is still found by its text, just not as quickly.
+                GLogger.writeln(L"NativeOverrideTable: ERROR: failed to build a table of %d names.", knownCount_ + 1);
+                return;
+            }
+
+            knownCount_++;
+            byName_.store(publish_(std::move(table)), std::memory_order_release);
+
+            if (knownCount_ == count_.load(std::memory_order_acquire))
+            {
+                complete_.store(true, std::memory_order_release);
+            }
+        }
+
+        // The index of the override of a function being bound, or -1.
+        int match_(UObjectPartial* pFunction)
+        {
+            // Read before the table, so that a table read after the table became complete has every override in it.
+            bool complete = complete_.load(std::memory_order_acquire);
+
+            auto key = pFunction->NameKey();
+            auto table = byName_.load(std::memory_order_acquire);
+            if (table != nullptr)
+            {
+                auto found = table->Find(key);
+                if (found != Table_::NotFound)
+                {
+                    return found;
+                }
+            }
+
+            // Functions don't have instance numbers, one that does isn't what the table means.
+            if (complete || pFunction->Name.Number != 0)
+            {
+                return -1;
+            }
+
+            auto text = GNameCache.Find(pFunction->Name.Index);
+            auto byText = byText_.load(std::memory_order_acquire);
+            if (text == nullptr || byText == nullptr)
+            {
+                return -1;
+            }
+
+            auto found = byText->Find(Utils::NameCache::HashText(text));
+            if (found == Table_::NotFound || !equalsText_(text, overrides_[found].Function.c_str()))
+            {
+                return -1;
+            }
+
+            learn_(key, found);
+            return found;
+        }
 
-        auto name = pFunction->GetName();
+        // Whether a recorded function still is what it was when it was bound, i.e. hasn't been freed meanwhile.
+        // The region of the previous call is reused, functions are allocated close together.
+        static bool alive_(const Bound_& bound, MEMORY_BASIC_INFORMATION& region)
+        {
+            auto address = reinterpret_cast<BYTE*>(bound.Function);
+            auto regionStart = static_cast<BYTE*>(region.BaseAddress);
+            if (regionStart == nullptr || address < regionStart || address + sizeof(UObjectPartial) > regionStart + region.RegionSize)
+            {
+                if (!VirtualQuery(address, &region, sizeof(region)))
+                {
+                    region.BaseAddress = nullptr;
+                    return false;
+                }
+                regionStart = static_cast<BYTE*>(region.BaseAddress);
+            }
+
+            if (region.State != MEM_COMMIT || (region.Protect & (PAGE_GUARD | PAGE_NOACCESS))
+                || address + sizeof(UObjectPartial) > regionStart + region.RegionSize)
+            {
+                return false;
+            }
+            return *reinterpret_cast<void**>(bound.Function) == bound.VTable && bound.Function->NameKey() == bound.Key;
+        }
 
-        if (0 == wcscmp(name, L"IsShippingPCBuild") || 0 == wcscmp(name, L"IsShippingBuild")
-            || 0 == wcscmp(name, L"IsFinalReleaseDebugConsoleBuild"))
+        // Drop dead functions and ones bound more than once, so that reloading packages doesn't grow the list forever.
+        // Must be called with boundMtx_ held.
+        void compact_()
         {
-            switch (GLEBinkProxy.Game)
+            MEMORY_BASIC_INFORMATION region{};
+            size_t kept = 0;
+            for (const auto& bound : bound_)
+            {
+                if (alive_(bound, region))
+                {
+                    bound_[kept++] = bound;
+                }
+            }
+            bound_.resize(kept);
+
+            std::sort(bound_.begin(), bound_.end(), [](const Bound_& a, const Bound_& b) { return a.Function < b.Function; });
+            bound_.erase(std::unique(bound_.begin(), bound_.end(), [](const Bound_& a, const Bound_& b) { return a.Function == b.Function; }), bound_.end());
+
+            compactAt_ = bound_.size() * 2 > MinCompactSize_ ? bound_.size() * 2 : MinCompactSize_;
+        }
+
+        void record_(UObjectPartial* pFunction)
+        {
+            const std::lock_guard<std::mutex> lock(boundMtx_);
+
+            bound_.push_back({ pFunction, *reinterpret_cast<void**>(pFunction), pFunction->NameKey() });
+            if (bound_.size() >= compactAt_)
+            {
+                compact_();
+            }
+        }
+
+        // Apply a new override to the functions bound before it was added.
+        void applyRetroactively_(int index)
+        {
+            const auto& entry = overrides_[index];
+            const std::lock_guard<std::mutex> lock(boundMtx_);
+
+            // Once one function of that name is found, the others are matched by name index alone.
+            int nameIndex = GNameCache.FindIndex(entry.Function.c_str());
+            MEMORY_BASIC_INFORMATION region{};
+            int applied = 0;
+
+            for (const auto& bound : bound_)
+            {
+                auto name = reinterpret_cast<const FNamePartial*>(&bound.Key);
+                if (name->Number != 0)
+                {
+                    continue;
+                }
+
+                if (nameIndex == Utils::NameCache::NotFound)
+                {
+                    auto text = GNameCache.Find(name->Index);
+                    if (text == nullptr || !equalsText_(text, entry.Function.c_str()))
+                    {
+                        continue;
+                    }
+                    nameIndex = name->Index;
+                }
+                else if (name->Index != nameIndex)
+                {
+                    continue;
+                }
+
+                if (alive_(bound, region))
+                {
+                    bindNative_(bound.Function, entry.Native);
+                    learn_(bound.Key, index);
+                    applied++;
+                }
+            }
+
+            if (applied > 0)
+            {
+                GLogger.writeln(L"NativeOverrideTable: %s -> %S applied to %d functions bound before.", entry.Function.c_str(), entry.NativeName.c_str(), applied);
+            }
+        }
+
+        // Append an override and publish a table which finds it.
+        // Must be called with addMtx_ held.
+        bool add_(std::wstring function, std::string nativeName, void* native)
+        {
+            auto count = count_.load(std::memory_order_relaxed);
+            auto key = Utils::NameCache::HashText(function.c_str());
+            for (int i = 0; i < count; i++)
+            {
+                if (textKeys_[i] == key)
+                {
+                    GLogger.writeln(L"NativeOverrideTable: ERROR: %s is overridden more than once, keeping the first.", function.c_str());
+                    return false;
+                }
+            }
+            if (count == MaxOverrides)
+            {
+                GLogger.writeln(L"NativeOverrideTable: ERROR: more than %d overrides, ignoring %s.", MaxOverrides, function.c_str());
+                return false;
+            }
+
+            textKeys_[count] = key;
+            textIndices_[count] = count;
+            auto table = std::make_unique<Table_>();
+            if (!table->Build(textKeys_, textIndices_, count + 1))
+            {
+                GLogger.writeln(L"NativeOverrideTable: ERROR: failed to build a table of %d names.", count + 1);
+                return false;
+            }
+
+            overrides_[count] = { std::move(function), std::move(nativeName), native };
+            byText_.store(publish_(std::move(table)), std::memory_order_release);
+            {
+                // Under the learning lock, which decides when the table is complete.
+                const std::lock_guard<std::mutex> learnLock(learnMtx_);
+                count_.store(count + 1, std::memory_order_release);
+                complete_.store(false, std::memory_order_release);
+            }
+            return true;
+        }
+
+    public:
+        // The SPI_GAME_* flag of a game.
+        static int GameMaskOf(LEGameVersion game)
+        {
+            switch (game)
+            {
+            case LEGameVersion::Launcher:  return SPI_GAME_LEL;
+            case LEGameVersion::LE1:       return SPI_GAME_LE1;
+            case LEGameVersion::LE2:       return SPI_GAME_LE2;
+            case LEGameVersion::LE3:       return SPI_GAME_LE3;
+            default:                       return 0;
+            }
+        }
+
+        // Load the overrides which apply to a game and pick its natives, before the bind hook is installed.
+        bool Initialize(LEGameVersion game)
+        {
+            void* (*findNative)(const char* name) = nullptr;
+            void (*bindNative)(UObjectPartial* pFunction, void* native) = nullptr;
+            switch (game)
             {
             case LEGameVersion::LE1:
-                GLogger.writeln(L"UFunctionBind (LE1): %s (pFunction = 0x%p).", name, pFunction);
-                ((UFunctionPartialLE1*)pFunction)->Func = AlwaysPositiveNative;
+                findNative = GameNatives<FFramePartialLE1, UFunctionPartialLE1>::Find;
+                bindNative = GameNatives<FFramePartialLE1, UFunctionPartialLE1>::Bind;
                 break;
             case LEGameVersion::LE2:
-                GLogger.writeln(L"UFunctionBind (LE2): %s (pFunction = 0x%p).", name, pFunction);
-                ((UFunctionPartialLE2*)pFunction)->Func = AlwaysPositiveNative;
+                findNative = GameNatives<FFramePartialLE2, UFunctionPartialLE2>::Find;
+                bindNative = GameNatives<FFramePartialLE2, UFunctionPartialLE2>::Bind;
                 break;
             case LEGameVersion::LE3:
-                GLogger.writeln(L"UFunctionBind (LE3): %s (pFunction = 0x%p).", name, pFunction);
-                ((UFunctionPartialLE3*)pFunction)->Func = AlwaysPositiveNative;
+                findNative = GameNatives<FFramePartialLE3, UFunctionPartialLE3>::Find;
+                bindNative = GameNatives<FFramePartialLE3, UFunctionPartialLE3>::Bind;
                 break;
             default:
-                GLogger.writeln(L"HookedUFunctionBind: ERROR: unsupported game version.");
-                break;
+                GLogger.writeln(L"NativeOverrideTable: ERROR: unsupported game version.");
+                return false;
+            }
+
+            std::vector<NativeOverrideConfig> config;
+            LoadNativeOverrides(config);
+
+            const std::lock_guard<std::mutex> lock(addMtx_);
+            bindNative_ = bindNative;
+
+            for (const auto& entry : config)
+            {
+                if (!(entry.GameMask & GameMaskOf(game)))
+                {
+                    continue;
+                }
+
+                auto native = findNative(entry.Native.c_str());
+                if (native == nullptr)
+                {
+                    GLogger.writeln(L"NativeOverrideTable: ERROR: unknown native %S for %S.", entry.Native.c_str(), entry.Function.c_str());
+                    continue;
+                }
+
+                add_({ entry.Function.begin(), entry.Function.end() }, entry.Native, native);
+            }
+
+            GLogger.writeln(L"NativeOverrideTable: %d overrides apply to this game.", count_.load(std::memory_order_relaxed));
+            return true;
+        }
+
+        // Add an override at any time, e.g. for a plugin, and apply it to the functions of that name already bound.
+        // Fails if the function is already overridden.
+        bool Register(const wchar_t* function, void* native, const char* nativeName)
+        {
+            const std::lock_guard<std::mutex> lock(addMtx_);
+
+            if (!add_(function, nativeName, native))
+            {
+                return false;
+            }
+
+            // Before Initialize, the hook isn't installed and nothing has been bound yet.
+            if (bindNative_ != nullptr)
+            {
+                applyRetroactively_(count_.load(std::memory_order_relaxed) - 1);
             }
+            return true;
         }
 
-        // Thanks to Mgamerz's research into why LE3 profiles disappeared:
-        if (0 == wcscmp(name, L"IsShip") && GLEBinkProxy.Game == LEGameVersion::LE3)
+        // Record a function being bound, and replace its native if it's overridden.
+        void Apply(UObjectPartial* pFunction)
         {
-            GLogger.writeln(L"UFunctionBind (LE3): %s (pFunction = 0x%p).", name, pFunction);
-            ((UFunctionPartialLE3*)pFunction)->Func = AlwaysNegativeNative;
+            record_(pFunction);
+
+            auto index = match_(pFunction);
+            if (index < 0)
+            {
+                return;
+            }
+
+            const auto& entry = overrides_[index];
+            bindNative_(pFunction, entry.Native);
+            GLogger.writeln(L"UFunctionBind: %s -> %S (pFunction = 0x%p).", entry.Function.c_str(), entry.NativeName.c_str(), pFunction);
+        }
+    };
+
+    static NativeOverrideTable GNativeOverrides;
+
+
+    // Called for every function once it's bound and its native possibly overridden, e.g. by the script profiler.
+    typedef void (*tOnFunctionBound)(UObjectPartial* pFunction);
+    tOnFunctionBound OnFunctionBound = nullptr;
+
+
+    // A hooked wrapper around UFunction::Bind which calls the original and then replaces the native
+    // of functions listed in GNativeOverrides, e.g. binds IsShippingPCBuild to AlwaysPositiveNative.
+    void HookedUFunctionBind(UObjectPartial* pFunction)
+    {
+        UFunctionBind_orig(pFunction);
+        GNativeOverrides.Apply(pFunction);
+
+        if (OnFunctionBound)
+        {
+            OnFunctionBound(pFunction);
         }
     }
 }
+
+#pragma pack(pop)
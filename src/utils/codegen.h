@@ -0,0 +1,288 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <initializer_list>
+#include <mutex>
+#include <utility>
+#include <vector>
+#include <Windows.h>
+
+// Generated code calls out with the Windows x64 convention, whatever the compiler's default is.
+// Functions it calls are declared with this; it only matters to the Linux test build.
+#ifdef _WIN32
+#define CODEGEN_CALL
+#else
+#define CODEGEN_CALL __attribute__((ms_abi))
+#endif
+
+
+namespace Utils
+{
+    /// <summary>
+    /// Byte buffer to assemble a piece of machine code into, see CodeHeap.
+    /// </summary>
+    struct CodeBuilder
+    {
+        std::vector<BYTE> Bytes;
+
+        void Emit(std::initializer_list<BYTE> bytes)
+        {
+            Bytes.insert(Bytes.end(), bytes);
+        }
+
+        void Emit32(std::uint32_t value)
+        {
+            for (int i = 0; i < 4; i++)
+            {
+                Bytes.push_back(static_cast<BYTE>(value >> (i * 8)));
+            }
+        }
+
+        void Emit64(std::uint64_t value)
+        {
+            for (int i = 0; i < 8; i++)
+            {
+                Bytes.push_back(static_cast<BYTE>(value >> (i * 8)));
+            }
+        }
+
+        // Overwrite a rel32 emitted earlier, so that it points at the current end of the code.
+        void PatchRel32(std::size_t at)
+        {
+            auto rel = static_cast<std::uint32_t>(Bytes.size() - (at + 4));
+            std::memcpy(Bytes.data() + at, &rel, sizeof(rel));
+        }
+
+        [[nodiscard]] std::size_t Size() const noexcept { return Bytes.size(); }
+    };
+
+    /// <summary>
+    /// Windows x64 unwind data for generated code with a fixed prologue, so that exceptions, debuggers and
+    /// profilers can walk the stack through its frame. Record each prologue instruction right after emitting it,
+    /// then commit with CodeHeap::CommitFunction.
+    /// </summary>
+    /// <remarks>
+    /// Only fits code that keeps rsp where the prologue left it until the epilogue.
+    /// </remarks>
+    class UnwindInfo
+    {
+    private:
+        enum Op_ : BYTE
+        {
+            PushNonvol_ = 0,
+            AllocLarge_ = 1,
+            AllocSmall_ = 2,
+            SetFpreg_ = 3,
+        };
+
+        struct Code_
+        {
+            BYTE Offset;    // of the end of the instruction
+            BYTE Op;
+            BYTE Info;
+            std::vector<std::uint16_t> Extra;
+        };
+
+        std::vector<Code_> codes_;
+        BYTE prologSize_ = 0;
+        BYTE frameRegister_ = 0;
+
+        static BYTE offset_(const CodeBuilder& code) noexcept
+        {
+            return static_cast<BYTE>(code.Size());
+        }
+
+    public:
+        // Register numbers as the unwind codes use them.
+        enum Register : BYTE
+        {
+            Rax = 0, Rcx = 1, Rdx = 2, Rbx = 3, Rsp = 4, Rbp = 5, Rsi = 6, Rdi = 7,
+            R8 = 8, R9 = 9, R10 = 10, R11 = 11, R12 = 12, R13 = 13, R14 = 14, R15 = 15,
+        };
+
+        // push reg
+        void PushNonvol(const CodeBuilder& code, Register reg)
+        {
+            codes_.push_back({ offset_(code), PushNonvol_, reg, {} });
+        }
+
+        // mov reg, rsp
+        void SetFrame(const CodeBuilder& code, Register reg)
+        {
+            frameRegister_ = reg;
+            codes_.push_back({ offset_(code), SetFpreg_, 0, {} });
+        }
+
+        // sub rsp, size
+        void Alloc(const CodeBuilder& code, std::uint32_t size)
+        {
+            if (size <= 128)
+            {
+                codes_.push_back({ offset_(code), AllocSmall_, static_cast<BYTE>(size / 8 - 1), {} });
+            }
+            else if (size / 8 <= 0xFFFF)
+            {
+                codes_.push_back({ offset_(code), AllocLarge_, 0, { static_cast<std::uint16_t>(size / 8) } });
+            }
+            else
+            {
+                codes_.push_back({ offset_(code), AllocLarge_, 1, { static_cast<std::uint16_t>(size), static_cast<std::uint16_t>(size >> 16) } });
+            }
+        }
+
+        void EndPrologue(const CodeBuilder& code)
+        {
+            prologSize_ = offset_(code);
+        }
+
+        /// <summary>
+        /// Append a RUNTIME_FUNCTION covering the code emitted so far, followed by its UNWIND_INFO.
+        /// Addresses in both are relative to the start of the code.
+        /// </summary>
+        /// <returns>Offset of the RUNTIME_FUNCTION.</returns>
+        std::size_t AppendTo(CodeBuilder& code) const
+        {
+            auto codeSize = static_cast<std::uint32_t>(code.Size());
+            while (code.Size() % 4)
+            {
+                code.Emit({ 0xCC });
+            }
+
+            auto table = code.Size();
+            code.Emit32(0);                                             // BeginAddress
+            code.Emit32(codeSize);                                      // EndAddress
+            code.Emit32(static_cast<std::uint32_t>(table + 12));        // UnwindData
+
+            // The codes go in the reverse order of the prologue, padded to an even count of slots.
+            std::size_t slots = 0;
+            for (auto& unwindCode : codes_)
+            {
+                slots += 1 + unwindCode.Extra.size();
+            }
+            code.Emit({ 0x01, prologSize_, static_cast<BYTE>(slots), frameRegister_ });  // version 1, no flags, frame offset 0
+            for (auto it = codes_.rbegin(); it != codes_.rend(); ++it)
+            {
+                code.Emit({ it->Offset, static_cast<BYTE>(it->Op | (it->Info << 4)) });
+                for (auto extra : it->Extra)
+                {
+                    code.Emit({ static_cast<BYTE>(extra), static_cast<BYTE>(extra >> 8) });
+                }
+            }
+            if (slots % 2)
+            {
+                code.Emit({ 0x00, 0x00 });
+            }
+            return table;
+        }
+    };
+
+    /// <summary>
+    /// Bump allocator for small pieces of generated code (thunks, stubs).
+    /// Code is only freed on request, by owners who know that no thread can reach it; the memory is
+    /// then kept for code of the same size, so that thunks created and dropped over and over don't grow the heap.
+    /// </summary>
+    class CodeHeap
+    {
+    private:
+        static constexpr std::size_t PageSize_ = 0x10000;
+
+        std::mutex mtx_;
+        BYTE* cursor_ = nullptr;
+        BYTE* end_ = nullptr;
+        std::vector<std::pair<std::size_t, BYTE*>> free_;
+
+        static std::size_t roundUp_(std::size_t size) noexcept
+        {
+            return (size + 15) & ~static_cast<std::size_t>(15);
+        }
+
+    public:
+        /// <summary>
+        /// Copy assembled code into executable memory.
+        /// </summary>
+        /// <returns>Address of the code, or nullptr if no memory could be allocated.</returns>
+        BYTE* Commit(const CodeBuilder& code)
+        {
+            const std::lock_guard<std::mutex> lock(mtx_);
+
+            auto size = roundUp_(code.Size());
+            if (size > PageSize_)
+            {
+                return nullptr;
+            }
+
+            BYTE* address = nullptr;
+            for (size_t i = 0; i < free_.size(); i++)
+            {
+                if (free_[i].first == size)
+                {
+                    address = free_[i].second;
+                    free_[i] = free_.back();
+                    free_.pop_back();
+                    break;
+                }
+            }
+
+            if (!address)
+            {
+                if (!cursor_ || cursor_ + size > end_)
+                {
+                    cursor_ = static_cast<BYTE*>(VirtualAlloc(nullptr, PageSize_, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE));
+                    if (!cursor_)
+                    {
+                        return nullptr;
+                    }
+                    end_ = cursor_ + PageSize_;
+                }
+
+                address = cursor_;
+                cursor_ += size;
+            }
+
+            std::memcpy(address, code.Bytes.data(), code.Size());
+            FlushInstructionCache(GetCurrentProcess(), address, code.Size());
+            return address;
+        }
+
+        /// <summary>
+        /// Commit a function along with its unwind data, and register that with the system on Windows x64.
+        /// Code committed this way must never be freed, its function table entry stays registered.
+        /// </summary>
+        /// <returns>Address of the function, or nullptr if no memory could be allocated.</returns>
+        BYTE* CommitFunction(CodeBuilder code, const UnwindInfo& unwind)
+        {
+            auto table = unwind.AppendTo(code);
+            BYTE* address = Commit(code);
+#if defined(_WIN32) && defined(_M_X64)
+            // A frame without unwind data only breaks stack walks through it, which is no reason to fail the caller.
+            if (address)
+            {
+                RtlAddFunctionTable(reinterpret_cast<PRUNTIME_FUNCTION>(address + table), 1, reinterpret_cast<DWORD64>(address));
+            }
+#else
+            (void)table;
+#endif
+            return address;
+        }
+
+        /// <summary>
+        /// Give back code returned by Commit, for a later Commit of the same size to reuse.
+        /// Only call this once no thread can be running it or about to jump to it.
+        /// </summary>
+        /// <param name="size">Size of the code that was committed.</param>
+        void Free(BYTE* address, std::size_t size)
+        {
+            if (!address)
+            {
+                return;
+            }
+
+            const std::lock_guard<std::mutex> lock(mtx_);
+            free_.emplace_back(roundUp_(size), address);
+        }
+    };
+}
+
+// Global instance.
+static Utils::CodeHeap GCodeHeap;
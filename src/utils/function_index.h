@@ -0,0 +1,131 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "../utils/pe_image.h"
+#include "../utils/scanner.h"
+
+// This header is intentionally free of Windows and proxy dependencies, like scanner.h and pe_image.h.
+
+
+namespace Utils
+{
+    /// <summary>
+    /// Sorted list of function starts of an x64 image, built from its exception directory.
+    /// Covers every function that has unwind info, i.e. everything but leaf functions that don't touch the stack.
+    /// </summary>
+    class FunctionIndex
+    {
+    private:
+        std::vector<PeFunction> functions_;
+
+    public:
+        FunctionIndex() = default;
+
+        /// <summary>
+        /// (Re)build the index from a parsed image.
+        /// </summary>
+        /// <returns>False if the image has no usable exception directory.</returns>
+        bool Build(const PeImage& image)
+        {
+            return image.ReadFunctions(functions_) && !functions_.empty();
+        }
+
+        [[nodiscard]] const std::vector<PeFunction>& Functions() const noexcept { return functions_; }
+        [[nodiscard]] std::size_t Size() const noexcept { return functions_.size(); }
+
+        /// <summary>
+        /// Find the function whose [Begin, End) contains an RVA.
+        /// </summary>
+        [[nodiscard]] const PeFunction* FindContaining(std::uint32_t rva) const
+        {
+            auto it = std::upper_bound(functions_.begin(), functions_.end(), rva, [](std::uint32_t value, const PeFunction& f) { return value < f.Begin; });
+            if (it == functions_.begin())
+            {
+                return nullptr;
+            }
+
+            --it;
+            return rva < it->End ? &*it : nullptr;
+        }
+
+        /// <summary>
+        /// Get the first function starting at or after an RVA.
+        /// </summary>
+        [[nodiscard]] std::vector<PeFunction>::const_iterator LowerBound(std::uint32_t rva) const
+        {
+            return std::lower_bound(functions_.begin(), functions_.end(), rva, [](const PeFunction& f, std::uint32_t value) { return f.Begin < value; });
+        }
+    };
+
+    /// <summary>
+    /// Scan [start, end) for a pattern, only testing addresses where a function starts.
+    /// Returns the lowest such match, or nullptr.
+    /// </summary>
+    /// <param name="imageBase">Address the index's RVAs are relative to.</param>
+    const std::uint8_t* FindPatternAtFunctionStarts(const std::uint8_t* imageBase, const FunctionIndex& index, const std::uint8_t* start, const std::uint8_t* end, const PatternView& pattern)
+    {
+        if (pattern.Length == 0 || start < imageBase || end < start || static_cast<std::size_t>(end - start) < pattern.Length)
+        {
+            return nullptr;
+        }
+
+        const std::uint8_t* last = end - pattern.Length;
+        const auto& functions = index.Functions();
+        for (auto it = index.LowerBound(static_cast<std::uint32_t>(start - imageBase)); it != functions.end(); ++it)
+        {
+            auto candidate = imageBase + it->Begin;
+            if (candidate > last)
+            {
+                break;
+            }
+            if (MatchesAt_(candidate, pattern))
+            {
+                return candidate;
+            }
+        }
+        return nullptr;
+    }
+
+    /// <summary>
+    /// Batch counterpart of FindPatternAtFunctionStarts, same contract as FindPatterns.
+    /// </summary>
+    /// <returns>Number of patterns that were found.</returns>
+    std::size_t FindPatternsAtFunctionStarts(const std::uint8_t* imageBase, const FunctionIndex& index, const std::uint8_t* start, const std::uint8_t* end, BatchScanEntry* entries, std::size_t count)
+    {
+        std::size_t found = 0;
+        for (std::size_t e = 0; e < count; e++)
+        {
+            entries[e].Result = nullptr;
+        }
+        if (start < imageBase || end < start)
+        {
+            return 0;
+        }
+
+        const auto& functions = index.Functions();
+        for (auto it = index.LowerBound(static_cast<std::uint32_t>(start - imageBase)); it != functions.end() && found < count; ++it)
+        {
+            auto candidate = imageBase + it->Begin;
+            if (candidate >= end)
+            {
+                break;
+            }
+
+            for (std::size_t e = 0; e < count; e++)
+            {
+                auto& entry = entries[e];
+                if (!entry.Result && entry.Pattern.Length != 0
+                    && static_cast<std::size_t>(end - candidate) >= entry.Pattern.Length
+                    && MatchesAt_(candidate, entry.Pattern))
+                {
+                    entry.Result = candidate;
+                    found++;
+                }
+            }
+        }
+        return found;
+    }
+}
@@ -1,11 +1,96 @@
 #pragma once
 
+#include <vector>
+
 #include "../minhook/include/MinHook.h"
+#include "utils/hook_stats.h"
 #include "utils/io.h"
 
 
 namespace Utils
 {
+    /// <summary>
+    /// A hook to be created and enabled as part of a batch, see InstallHookBatch.
+    /// </summary>
+    struct HookRequest
+    {
+        LPVOID Target;
+        LPVOID Detour;
+        LPVOID* Original;
+        const char* Name;
+        ULONG_PTR Ident;
+        std::uint32_t StatsId;  // Set by InstallHookBatch, see HookProfiler::Instrument.
+        LPVOID Installed;       // Set by InstallHookBatch: the detour, or the thunk instrumenting it.
+    };
+
+    /// <summary>
+    /// Create and enable several hooks as a single transaction, suspending the game's threads only once.
+    /// Either every hook ends up enabled, or all of them are removed again and their originals reset to null.
+    /// Only this batch's hooks are applied, whatever other callers have queued meanwhile.
+    /// </summary>
+    MH_STATUS InstallHookBatch(HookRequest* requests, size_t count)
+    {
+        MH_STATUS status = MH_OK;
+        size_t created = 0;
+        std::vector<MH_HOOK_KEY> keys;
+        keys.reserve(count);
+
+        for (; created < count; created++)
+        {
+            auto& request = requests[created];
+            request.Installed = GHookProfiler.Instrument(request.Detour, request.Name, &request.StatsId);
+            status = MH_CreateHookEx(request.Ident, request.Original, request.Installed, request.Target);
+            if (status != MH_OK)
+            {
+                GLogger.writeln(L"InstallHookBatch: ERROR: creating [%S] failed, status = %d", request.Name, status);
+                GHookProfiler.Discard(request.StatsId, request.Installed);
+                request.StatsId = HOOK_STATS_INVALID_ID;
+                break;
+            }
+
+            keys.push_back({ request.Ident, request.Target });
+            status = MH_QueueEnableHookEx(request.Ident, request.Target);
+            if (status != MH_OK)
+            {
+                GLogger.writeln(L"InstallHookBatch: ERROR: queueing [%S] failed, status = %d", request.Name, status);
+                created++;
+                break;
+            }
+        }
+
+        if (status == MH_OK)
+        {
+            status = MH_ApplyQueuedEx(keys.data(), static_cast<UINT>(keys.size()));
+            if (status != MH_OK)
+            {
+                GLogger.writeln(L"InstallHookBatch: ERROR: enabling %d hook(s) failed, status = %d", static_cast<int>(count), status);
+            }
+        }
+
+        if (status != MH_OK)
+        {
+            // Nothing was enabled, so the created hooks can be dropped without touching other threads.
+            while (created > 0)
+            {
+                auto& request = requests[--created];
+                MH_RemoveHookEx(nullptr, request.Ident, request.Target);
+                GHookProfiler.Discard(request.StatsId, request.Installed);
+                request.StatsId = HOOK_STATS_INVALID_ID;
+                if (request.Original)
+                {
+                    *request.Original = nullptr;
+                }
+            }
+            return status;
+        }
+
+        for (size_t i = 0; i < count; i++)
+        {
+            GLogger.writeln(L"InstallHookBatch: installed hook [%S] 0x%p -> 0x%p", requests[i].Name, requests[i].Target, requests[i].Detour);
+        }
+        return MH_OK;
+    }
+
     class HookManager
     {
     private:
@@ -29,10 +114,13 @@ namespace Utils
                 return false;
             }
 
-            lastStatus_ = MH_CreateHook(pTarget, pDetour, ppOriginal);
+            std::uint32_t statsId;
+            auto installed = GHookProfiler.Instrument(pDetour, name, &statsId);
+            lastStatus_ = MH_CreateHook(pTarget, installed, ppOriginal);
             if (lastStatus_ != MH_OK)
             {
                 GLogger.writeln(L"HookManager.Install: ERROR: creating [%S] failed, status = %d", name, lastStatus_);
+                GHookProfiler.Discard(statsId, installed);
                 return false;
             }
             GLogger.writeln(L"HookManager.Install: created hook [%S]", name);
@@ -42,6 +130,9 @@ namespace Utils
             if (lastStatus_ != MH_OK)
             {
                 GLogger.writeln(L"HookManager.Install: ERROR: enabling [%S] failed, status = %d", name, lastStatus_);
+                // Never enabled, so no thread can have reached the thunk.
+                MH_RemoveHook(nullptr, pTarget);
+                GHookProfiler.Discard(statsId, installed);
                 return false;
             }
             GLogger.writeln(L"HookManager.Install: installed hook [%S]", name);
@@ -49,8 +140,49 @@ namespace Utils
             return true;
         }
 
+        /// <summary>
+        /// Install several hooks at once, see InstallHookBatch.
+        /// </summary>
+        bool InstallBatch(HookRequest* requests, size_t count)
+        {
+            if (!initialized_)
+            {
+                GLogger.writeln(L"HookManager.InstallBatch: ERROR: the manager wasn't initialized properly.");
+                return false;
+            }
+
+            // Hooks of this manager all share the default identity, like MH_CreateHook.
+            for (size_t i = 0; i < count; i++)
+            {
+                requests[i].Ident = 0;
+            }
+
+            lastStatus_ = InstallHookBatch(requests, count);
+            return lastStatus_ == MH_OK;
+        }
+
+        /// <summary>
+        /// Disable and remove a hook installed by this manager.
+        /// Its trampoline is never reused before MH_Uninitialize, so a detour that is still running may keep calling
+        /// the original pointer; it then goes straight to the unhooked target. The detour itself must stay loaded
+        /// until no thread can still be inside it, which the manager can't tell.
+        /// </summary>
         bool Uninstall(LPVOID pTarget)
         {
+            if (!initialized_)
+            {
+                GLogger.writeln(L"HookManager.Uninstall: ERROR: the manager wasn't initialized properly.");
+                return false;
+            }
+
+            lastStatus_ = MH_RemoveHook(nullptr, pTarget);
+            if (lastStatus_ != MH_OK)
+            {
+                GLogger.writeln(L"HookManager.Uninstall: ERROR: removing hook at 0x%p failed, status = %d", pTarget, lastStatus_);
+                return false;
+            }
+            GLogger.writeln(L"HookManager.Uninstall: removed hook at 0x%p", pTarget);
+
             return true;
         }
     };
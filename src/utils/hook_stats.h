@@ -0,0 +1,424 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <intrin.h>
+#include <Windows.h>
+#include "../utils/codegen.h"
+#include "../utils/io.h"
+#include "../utils/per_thread.h"
+
+
+namespace Utils
+{
+    constexpr std::uint32_t HOOK_STATS_MAX_HOOKS = 1024;
+    constexpr std::uint32_t HOOK_STATS_BUCKETS = 32;
+    constexpr std::uint32_t HOOK_STATS_INVALID_ID = 0xFFFFFFFF;
+
+    /// <summary>
+    /// Counters of a single instrumented hook, merged across threads.
+    /// </summary>
+    struct HookStatsSnapshot
+    {
+        std::uint64_t Calls;
+        std::uint64_t TotalTicks;                       // TSC ticks spent in the detour, including the original it calls.
+        std::uint64_t Buckets[HOOK_STATS_BUCKETS];      // Calls that took [2^i, 2^(i+1)) ticks; the last bucket also holds anything longer.
+    };
+
+    /// <summary>
+    /// Opt-in instrumentation of hook detours.
+    /// Once enabled, every hook installed afterwards gets its detour wrapped in a generated relay thunk,
+    /// which counts calls and measures the time until the detour returns with RDTSC.
+    /// Hooks installed while it's disabled are left untouched, so the mode costs nothing when off.
+    /// </summary>
+    /// <remarks>
+    /// The thunk swaps the return address of the detour's frame to regain control after it returns.
+    /// Exceptions unwinding through an instrumented detour are therefore not supported, and neither are
+    /// processes with hardware-enforced shadow stacks. That is fine for a profiling session, not for regular play.
+    /// </remarks>
+    class HookProfiler
+    {
+    private:
+        static constexpr std::uint32_t HooksPerChunk_ = 64;
+        static constexpr std::uint32_t MaxDepth_ = 128;
+        static constexpr DWORD DumpIntervalMs_ = 30000;
+
+        // Counters of one hook on one thread, only ever written by that thread.
+        // Padded to whole cache lines, so no two hooks or threads share one.
+        struct alignas(64) Counters_
+        {
+            std::atomic<std::uint64_t> Calls;
+            std::atomic<std::uint64_t> Ticks;
+            std::atomic<std::uint64_t> Buckets[HOOK_STATS_BUCKETS];
+        };
+
+        // A detour call in flight, whose return address was swapped for the exit stub.
+        struct Frame_
+        {
+            void** ReturnSlot;
+            void* ReturnAddress;
+            std::uint32_t HookId;
+            std::uint64_t Start;
+        };
+
+        struct ThreadState_
+        {
+            std::atomic<Counters_*> Chunks[HOOK_STATS_MAX_HOOKS / HooksPerChunk_];
+            Frame_ Frames[MaxDepth_];
+            std::uint32_t Depth;
+        };
+
+        static inline HookProfiler* active_ = nullptr;
+
+        std::mutex mtx_;
+        PerThread<ThreadState_> threads_;
+        std::vector<std::string> names_;
+        std::vector<std::uint32_t> freeIds_;     // of discarded thunks, reused by Instrument
+        std::size_t thunkSize_ = 0;
+        std::uint64_t dumpedCalls_[HOOK_STATS_MAX_HOOKS] = {};   // only touched by the dump thread
+        std::uint64_t ticksPerSecond_ = 0;
+
+        BYTE* exitStub_ = nullptr;
+
+        static ThreadState_* threadState_()
+        {
+            return active_->threads_.Get();
+        }
+
+        static Counters_& counters_(ThreadState_* state, std::uint32_t hookId)
+        {
+            auto& chunk = state->Chunks[hookId / HooksPerChunk_];
+            auto counters = chunk.load(std::memory_order_relaxed);
+            if (!counters)
+            {
+                counters = new Counters_[HooksPerChunk_]();
+                chunk.store(counters, std::memory_order_release);
+            }
+            return counters[hookId % HooksPerChunk_];
+        }
+
+        // Called by a hook's thunk before its detour runs.
+        static void CODEGEN_CALL enter_(std::uint64_t hookId, void** returnSlot)
+        {
+            auto state = threadState_();
+            BumpCounter(counters_(state, static_cast<std::uint32_t>(hookId)).Calls, 1);
+
+            // Frames above this one on the stack were abandoned (e.g. by a longjmp).
+            while (state->Depth > 0 && state->Frames[state->Depth - 1].ReturnSlot <= returnSlot)
+            {
+                state->Depth--;
+            }
+
+            // Too deep a recursion: count the call, but don't time it.
+            if (state->Depth == MaxDepth_)
+            {
+                return;
+            }
+
+            state->Frames[state->Depth++] = { returnSlot, *returnSlot, static_cast<std::uint32_t>(hookId), __rdtsc() };
+            *returnSlot = active_->exitStub_;
+        }
+
+        // Called by the exit stub once a detour returned, gives back the address to return to.
+        static void* CODEGEN_CALL exit_(void** callerStack)
+        {
+            auto end = __rdtsc();
+            auto state = threadState_();
+
+            while (state->Depth > 0)
+            {
+                auto& frame = state->Frames[--state->Depth];
+                if (frame.ReturnSlot + 1 != callerStack)
+                {
+                    continue;
+                }
+
+                auto ticks = end - frame.Start;
+                unsigned long bucket = 0;
+                _BitScanReverse64(&bucket, ticks | 1);
+                if (bucket >= HOOK_STATS_BUCKETS)
+                {
+                    bucket = HOOK_STATS_BUCKETS - 1;
+                }
+
+                auto& counters = counters_(state, frame.HookId);
+                BumpCounter(counters.Ticks, ticks);
+                BumpCounter(counters.Buckets[bucket], 1);
+                return frame.ReturnAddress;
+            }
+
+            // The original return address is lost, there is nowhere sane to go.
+            GLogger.writeln(L"HookProfiler.exit_: ERROR: no frame for a returning detour, terminating.");
+            std::terminate();
+        }
+
+        // Shared by all thunks: entered by the detour's ret, with its return values in rax / xmm0.
+        bool buildExitStub_()
+        {
+            CodeBuilder code;
+            code.Emit({ 0x50 });                                        // push rax
+            code.Emit({ 0x48, 0x83, 0xEC, 0x38 });                      // sub rsp, 38h
+            code.Emit({ 0xF3, 0x0F, 0x7F, 0x44, 0x24, 0x20 });          // movdqu [rsp+20h], xmm0
+            code.Emit({ 0x48, 0x8D, 0x4C, 0x24, 0x40 });                // lea rcx, [rsp+40h]
+            code.Emit({ 0x48, 0xB8 });                                  // mov rax, exit_
+            code.Emit64(reinterpret_cast<std::uint64_t>(&HookProfiler::exit_));
+            code.Emit({ 0xFF, 0xD0 });                                  // call rax
+            code.Emit({ 0x49, 0x89, 0xC3 });                            // mov r11, rax
+            code.Emit({ 0xF3, 0x0F, 0x6F, 0x44, 0x24, 0x20 });          // movdqu xmm0, [rsp+20h]
+            code.Emit({ 0x48, 0x83, 0xC4, 0x38 });                      // add rsp, 38h
+            code.Emit({ 0x58 });                                        // pop rax
+            code.Emit({ 0x41, 0xFF, 0xE3 });                            // jmp r11
+
+            exitStub_ = GCodeHeap.Commit(code);
+            return exitStub_ != nullptr;
+        }
+
+        // Per hook: preserve the argument registers around enter_, then jump to the detour.
+        BYTE* buildThunk_(std::uint32_t hookId, LPVOID detour)
+        {
+            CodeBuilder code;
+            code.Emit({ 0x51, 0x52, 0x41, 0x50, 0x41, 0x51 });          // push rcx; push rdx; push r8; push r9
+            code.Emit({ 0x48, 0x81, 0xEC, 0x88, 0x00, 0x00, 0x00 });    // sub rsp, 88h
+            code.Emit({ 0xF3, 0x0F, 0x7F, 0x44, 0x24, 0x20 });          // movdqu [rsp+20h], xmm0
+            code.Emit({ 0xF3, 0x0F, 0x7F, 0x4C, 0x24, 0x30 });          // movdqu [rsp+30h], xmm1
+            code.Emit({ 0xF3, 0x0F, 0x7F, 0x54, 0x24, 0x40 });          // movdqu [rsp+40h], xmm2
+            code.Emit({ 0xF3, 0x0F, 0x7F, 0x5C, 0x24, 0x50 });          // movdqu [rsp+50h], xmm3
+            code.Emit({ 0xF3, 0x0F, 0x7F, 0x64, 0x24, 0x60 });          // movdqu [rsp+60h], xmm4
+            code.Emit({ 0xF3, 0x0F, 0x7F, 0x6C, 0x24, 0x70 });          // movdqu [rsp+70h], xmm5
+            code.Emit({ 0x48, 0x8D, 0x94, 0x24, 0xA8, 0x00, 0x00, 0x00 });    // lea rdx, [rsp+0A8h] (the return address)
+            code.Emit({ 0x48, 0xB9 });                                  // mov rcx, hookId
+            code.Emit64(hookId);
+            code.Emit({ 0x48, 0xB8 });                                  // mov rax, enter_
+            code.Emit64(reinterpret_cast<std::uint64_t>(&HookProfiler::enter_));
+            code.Emit({ 0xFF, 0xD0 });                                  // call rax
+            code.Emit({ 0xF3, 0x0F, 0x6F, 0x44, 0x24, 0x20 });          // movdqu xmm0, [rsp+20h]
+            code.Emit({ 0xF3, 0x0F, 0x6F, 0x4C, 0x24, 0x30 });          // movdqu xmm1, [rsp+30h]
+            code.Emit({ 0xF3, 0x0F, 0x6F, 0x54, 0x24, 0x40 });          // movdqu xmm2, [rsp+40h]
+            code.Emit({ 0xF3, 0x0F, 0x6F, 0x5C, 0x24, 0x50 });          // movdqu xmm3, [rsp+50h]
+            code.Emit({ 0xF3, 0x0F, 0x6F, 0x64, 0x24, 0x60 });          // movdqu xmm4, [rsp+60h]
+            code.Emit({ 0xF3, 0x0F, 0x6F, 0x6C, 0x24, 0x70 });          // movdqu xmm5, [rsp+70h]
+            code.Emit({ 0x48, 0x81, 0xC4, 0x88, 0x00, 0x00, 0x00 });    // add rsp, 88h
+            code.Emit({ 0x41, 0x59, 0x41, 0x58, 0x5A, 0x59 });          // pop r9; pop r8; pop rdx; pop rcx
+            code.Emit({ 0xFF, 0x25, 0x00, 0x00, 0x00, 0x00 });          // jmp [rip]
+            code.Emit64(reinterpret_cast<std::uint64_t>(detour));
+
+            thunkSize_ = code.Size();
+            return GCodeHeap.Commit(code);
+        }
+
+        // Upper bound of the bucket holding the given fraction of calls, in microseconds.
+        double percentileMicros_(const HookStatsSnapshot& stats, double fraction) const
+        {
+            std::uint64_t threshold = static_cast<std::uint64_t>(static_cast<double>(stats.Calls) * fraction);
+            std::uint64_t seen = 0;
+            for (std::uint32_t i = 0; i < HOOK_STATS_BUCKETS; i++)
+            {
+                seen += stats.Buckets[i];
+                if (seen > threshold)
+                {
+                    return static_cast<double>(2ull << i) * 1e6 / static_cast<double>(ticksPerSecond_);
+                }
+            }
+            return 0.0;
+        }
+
+    public:
+        HookProfiler() = default;
+
+        [[nodiscard]] bool IsEnabled() const noexcept { return active_ == this; }
+        [[nodiscard]] std::uint64_t TicksPerSecond() const noexcept { return ticksPerSecond_; }
+
+        /// <summary>
+        /// Measure the TSC rate against the performance counter, to turn ticks into time. Takes about 50 ms.
+        /// </summary>
+        static std::uint64_t CalibrateTicksPerSecond()
+        {
+            LARGE_INTEGER frequency, start, end;
+            QueryPerformanceFrequency(&frequency);
+            QueryPerformanceCounter(&start);
+            auto tscStart = __rdtsc();
+            Sleep(50);
+            auto tscEnd = __rdtsc();
+            QueryPerformanceCounter(&end);
+
+            auto elapsed = static_cast<double>(end.QuadPart - start.QuadPart) / static_cast<double>(frequency.QuadPart);
+            return elapsed > 0 ? static_cast<std::uint64_t>(static_cast<double>(tscEnd - tscStart) / elapsed) : 0;
+        }
+
+        /// <summary>
+        /// Turn the instrumentation on for hooks installed from now on, and start dumping stats to the log periodically.
+        /// </summary>
+        bool Enable()
+        {
+#if defined(_M_X64) || defined(__x86_64__)
+            const std::lock_guard<std::mutex> lock(mtx_);
+
+            if (active_)
+            {
+                return active_ == this;
+            }
+            if (!buildExitStub_())
+            {
+                GLogger.writeln(L"HookProfiler.Enable: ERROR: failed to allocate the exit stub.");
+                return false;
+            }
+
+            ticksPerSecond_ = CalibrateTicksPerSecond();
+            active_ = this;
+
+            std::thread([this]()
+            {
+                while (true)
+                {
+                    Sleep(DumpIntervalMs_);
+                    this->DumpToLog();
+                }
+            }).detach();
+
+            GLogger.writeln(L"HookProfiler.Enable: hooks installed from now on are instrumented (%llu ticks/s).", ticksPerSecond_);
+            return true;
+#else
+            GLogger.writeln(L"HookProfiler.Enable: ERROR: only supported in x64 builds.");
+            return false;
+#endif
+        }
+
+        /// <summary>
+        /// Wrap a detour in an instrumented thunk, if the profiler is enabled.
+        /// </summary>
+        /// <param name="outId">Output value for the hook's id to query its stats with, HOOK_STATS_INVALID_ID if not instrumented.</param>
+        /// <returns>The detour to install: either the thunk or the given detour itself.</returns>
+        LPVOID Instrument(LPVOID detour, const char* name, std::uint32_t* outId)
+        {
+            *outId = HOOK_STATS_INVALID_ID;
+            if (!IsEnabled())
+            {
+                return detour;
+            }
+
+            const std::lock_guard<std::mutex> lock(mtx_);
+
+            auto id = freeIds_.empty() ? static_cast<std::uint32_t>(names_.size()) : freeIds_.back();
+            if (id >= HOOK_STATS_MAX_HOOKS)
+            {
+                GLogger.writeln(L"HookProfiler.Instrument: WARNING: too many hooks, [%S] is not instrumented.", name);
+                return detour;
+            }
+
+            auto thunk = buildThunk_(id, detour);
+            if (!thunk)
+            {
+                GLogger.writeln(L"HookProfiler.Instrument: WARNING: failed to allocate a thunk, [%S] is not instrumented.", name);
+                return detour;
+            }
+
+            if (id == names_.size())
+            {
+                names_.emplace_back(name ? name : "");
+            }
+            else
+            {
+                freeIds_.pop_back();
+                names_[id] = name ? name : "";
+            }
+            *outId = id;
+            return thunk;
+        }
+
+        /// <summary>
+        /// Free the thunk of a hook that never got installed, on the error path after Instrument.
+        /// The thunk must never have been reachable: its id and memory are reused by the next Instrument.
+        /// </summary>
+        /// <param name="id">The id Instrument gave out, nothing is done for HOOK_STATS_INVALID_ID.</param>
+        /// <param name="thunk">The detour Instrument returned.</param>
+        void Discard(std::uint32_t id, LPVOID thunk)
+        {
+            if (id == HOOK_STATS_INVALID_ID)
+            {
+                return;
+            }
+
+            const std::lock_guard<std::mutex> lock(mtx_);
+
+            if (id >= names_.size())
+            {
+                return;
+            }
+            GCodeHeap.Free(static_cast<BYTE*>(thunk), thunkSize_);
+            names_[id].clear();
+            freeIds_.push_back(id);
+        }
+
+        /// <summary>
+        /// Merge the per-thread counters of an instrumented hook.
+        /// </summary>
+        bool Query(std::uint32_t id, HookStatsSnapshot* outStats)
+        {
+            const std::lock_guard<std::mutex> lock(mtx_);
+
+            if (id >= names_.size())
+            {
+                return false;
+            }
+
+            std::memset(outStats, 0, sizeof(HookStatsSnapshot));
+            for (auto state : threads_.All())
+            {
+                auto chunk = state->Chunks[id / HooksPerChunk_].load(std::memory_order_acquire);
+                if (!chunk)
+                {
+                    continue;
+                }
+
+                auto& counters = chunk[id % HooksPerChunk_];
+                outStats->Calls += counters.Calls.load(std::memory_order_relaxed);
+                outStats->TotalTicks += counters.Ticks.load(std::memory_order_relaxed);
+                for (std::uint32_t i = 0; i < HOOK_STATS_BUCKETS; i++)
+                {
+                    outStats->Buckets[i] += counters.Buckets[i].load(std::memory_order_relaxed);
+                }
+            }
+            return true;
+        }
+
+        /// <summary>
+        /// Write the stats of every instrumented hook called since the last dump to the log.
+        /// </summary>
+        void DumpToLog()
+        {
+            for (std::uint32_t id = 0; id < HOOK_STATS_MAX_HOOKS; id++)
+            {
+                HookStatsSnapshot stats;
+                if (!Query(id, &stats))
+                {
+                    break;
+                }
+                if (stats.Calls == dumpedCalls_[id] || !ticksPerSecond_)
+                {
+                    continue;
+                }
+                dumpedCalls_[id] = stats.Calls;
+
+                std::string name;
+                {
+                    const std::lock_guard<std::mutex> lock(mtx_);
+                    name = names_[id];
+                }
+
+                GLogger.writeln(L"HookProfiler: [%S] calls = %llu, avg = %.2f us, p50 <= %.2f us, p99 <= %.2f us",
+                    name.c_str(), stats.Calls,
+                    static_cast<double>(stats.TotalTicks) * 1e6 / static_cast<double>(ticksPerSecond_) / static_cast<double>(stats.Calls),
+                    percentileMicros_(stats, 0.50), percentileMicros_(stats, 0.99));
+            }
+        }
+    };
+}
+
+// Global instance.
+static Utils::HookProfiler GHookProfiler;
@@ -1,19 +1,41 @@
 #pragma once
 
+#include <algorithm>
+#include <mutex>
 #include <vector>
 #include <Windows.h>
 #include <psapi.h>
-#include <tlhelp32.h>
+#include "../utils/function_index.h"
 #include "../utils/io.h"
+#include "../utils/pe_image.h"
+#include "../utils/scanner.h"
+#include "../utils/sigcache.h"
+#include "../utils/thread_registry.h"
 
 
 namespace Utils
 {
+    /// <summary>
+    /// Whether pages with this protection can be written to as they are, copy-on-write included.
+    /// </summary>
+    bool IsWritableProtection(DWORD protect)
+    {
+        return (protect & (PAGE_READWRITE | PAGE_WRITECOPY | PAGE_EXECUTE_READWRITE | PAGE_EXECUTE_WRITECOPY)) != 0;
+    }
+
+    /// <summary>
+    /// Whether pages with this protection can be executed.
+    /// </summary>
+    bool IsExecutableProtection(DWORD protect)
+    {
+        return (protect & (PAGE_EXECUTE | PAGE_EXECUTE_READ | PAGE_EXECUTE_READWRITE | PAGE_EXECUTE_WRITECOPY)) != 0;
+    }
+
     bool IsExecutableAddress(LPVOID pAddress)
     {
         MEMORY_BASIC_INFORMATION mi;
         VirtualQuery(pAddress, &mi, sizeof(mi));
-        return (mi.State == MEM_COMMIT && (mi.Protect & (PAGE_EXECUTE | PAGE_EXECUTE_READ | PAGE_EXECUTE_READWRITE | PAGE_EXECUTE_WRITECOPY)));
+        return mi.State == MEM_COMMIT && IsExecutableProtection(mi.Protect);
     }
 
     HMODULE GetGameModuleRange(BYTE** pStart, BYTE** pEnd)
@@ -31,140 +53,341 @@ namespace Utils
     }
 
     /// <summary>
-    /// Scan the game module for a sequence of bytes defined by a pattern and a mask.
-    /// TODO: refactor it to use PEiD patterns.
+    /// A contiguous piece of the game module.
     /// </summary>
-    BYTE* ScanProcess(BYTE* pattern, BYTE* mask)
+    struct ModuleRange
     {
-        size_t patternLength = strlen((char*)mask);
+        BYTE* Start;
+        BYTE* End;
+    };
 
-        BYTE* start, * end, * pointer;
+    /// <summary>
+    /// Collect the parts of the game module worth scanning, in ascending address order.
+    /// With no section name, that's every executable section; otherwise, only the named section.
+    /// If the headers can't be parsed and no section was requested, the whole module is used.
+    /// </summary>
+    /// <returns>False if nothing can be scanned (including if the requested section doesn't exist).</returns>
+    bool GetGameModuleScanRanges(const char* sectionName, std::vector<ModuleRange>& outRanges)
+    {
+        outRanges.clear();
+
+        BYTE* start, * end;
         if (!GetGameModuleRange(&start, &end))
         {
-            GLogger.writeln(L"ScanProcess: ERROR: GetGameModuleRange failed.");
+            GLogger.writeln(L"GetGameModuleScanRanges: ERROR: GetGameModuleRange failed.");
+            return false;
+        }
+
+        PeImage image;
+        if (!image.Parse(start, end - start, PeLayout::Mapped))
+        {
+            if (sectionName)
+            {
+                GLogger.writeln(L"GetGameModuleScanRanges: ERROR: failed to parse module headers, can't look up %S.", sectionName);
+                return false;
+            }
+
+            GLogger.writeln(L"GetGameModuleScanRanges: WARNING: failed to parse module headers, using the whole module.");
+            outRanges.push_back({ start, end });
+            return true;
+        }
+
+        for (auto& section : image.Sections())
+        {
+            if (sectionName ? 0 != strncmp(section.Name, sectionName, 8) : !section.IsExecutable())
+            {
+                continue;
+            }
+
+            const std::uint8_t* sectionStart, * sectionEnd;
+            if (image.SectionBytes(section, &sectionStart, &sectionEnd))
+            {
+                outRanges.push_back({ const_cast<BYTE*>(sectionStart), const_cast<BYTE*>(sectionEnd) });
+            }
+        }
+
+        std::sort(outRanges.begin(), outRanges.end(), [](const ModuleRange& a, const ModuleRange& b) { return a.Start < b.Start; });
+        return !outRanges.empty();
+    }
+
+    /// <summary>
+    /// Where a pattern may match.
+    /// </summary>
+    enum class ScanAnchor
+    {
+        Anywhere = 0,       // at any byte
+        FunctionStart = 1,  // only where a function starts, according to the exception directory
+    };
+
+    /// <summary>
+    /// Get the function-start index of the game module, built from its exception directory on first use.
+    /// </summary>
+    /// <returns>Null if the module has no usable exception directory (building is retried on the next call).</returns>
+    const FunctionIndex* GetGameFunctionIndex()
+    {
+        static std::mutex mtx;
+        static FunctionIndex index;
+        static bool built = false;
+
+        const std::lock_guard<std::mutex> lock(mtx);
+        if (built)
+        {
+            return &index;
+        }
+
+        BYTE* start, * end;
+        PeImage image;
+        if (!GetGameModuleRange(&start, &end) || !image.Parse(start, end - start, PeLayout::Mapped) || !index.Build(image))
+        {
+            GLogger.writeln(L"GetGameFunctionIndex: ERROR: failed to read the exception directory.");
+            return nullptr;
+        }
+
+        GLogger.writeln(L"GetGameFunctionIndex: indexed %d function(s).", static_cast<int>(index.Size()));
+        built = true;
+        return &index;
+    }
+
+    /// <summary>
+    /// Find the import address table slot the game module calls an imported function through.
+    /// </summary>
+    /// <returns>Pointer to the slot, or nullptr if the game doesn't import that function by name.</returns>
+    LPVOID* GetGameImportSlot(const char* moduleName, const char* functionName)
+    {
+        BYTE* start, * end;
+        PeImage image;
+        std::uint32_t slotRva = 0;
+        if (!GetGameModuleRange(&start, &end) || !image.Parse(start, end - start, PeLayout::Mapped)
+            || !image.FindImport(moduleName, functionName, &slotRva))
+        {
             return nullptr;
         }
 
-        pointer = start;
-        while (pointer < end)
+        return reinterpret_cast<LPVOID*>(start + slotRva);
+    }
+
+    /// <summary>
+    /// Check the offset remembered for a pattern in the signature cache.
+    /// The pattern has to fit and match there, inside one of the scanned ranges.
+    /// </summary>
+    /// <returns>The cached match, or nullptr if there is none or it went stale.</returns>
+    BYTE* ProbeCachedPattern_(BYTE* moduleStart, BYTE* moduleEnd, const std::vector<ModuleRange>& ranges, const PatternView& view, std::uint64_t key)
+    {
+        std::uint32_t rva = 0;
+        if (!GSignatureCache.Lookup(moduleStart, moduleEnd - moduleStart, key, &rva))
         {
-            for (size_t matchLength = 0; matchLength < patternLength; matchLength++)
+            return nullptr;
+        }
+
+        auto candidate = moduleStart + rva;
+        for (auto& range : ranges)
+        {
+            if (candidate >= range.Start && candidate < range.End
+                && static_cast<size_t>(range.End - candidate) >= view.Length
+                && MatchesAt_(candidate, view))
             {
-                if (matchLength + 1 == patternLength)
-                {
-                    return pointer;
-                }
-                if (pointer + matchLength >= end)
+                return candidate;
+            }
+        }
+        return nullptr;
+    }
+
+    /// <summary>
+    /// Scan the game module for a pattern, see PatternView and MakePattern.
+    /// Only executable sections are scanned, unless a section name (e.g. ".rdata") is given.
+    /// With ScanAnchor::FunctionStart only function starts are tested, which is far cheaper than a sweep;
+    /// if the function index is unavailable, this falls back to a normal scan.
+    /// Large sections are split up between several threads.
+    /// Offsets found in earlier launches of the same executable are checked first, see SignatureCache.
+    /// </summary>
+    BYTE* ScanProcess(const PatternView& view, const char* sectionName = nullptr, ScanAnchor anchor = ScanAnchor::Anywhere)
+    {
+        BYTE* moduleStart, * moduleEnd;
+        std::vector<ModuleRange> ranges;
+        if (!GetGameModuleRange(&moduleStart, &moduleEnd) || !GetGameModuleScanRanges(sectionName, ranges))
+        {
+            GLogger.writeln(L"ScanProcess: ERROR: nothing to scan (section = %S).", sectionName ? sectionName : "<executable>");
+            return nullptr;
+        }
+
+        auto functionIndex = anchor == ScanAnchor::FunctionStart ? GetGameFunctionIndex() : nullptr;
+
+        auto key = SignatureCache::HashPattern(view, sectionName, functionIndex != nullptr);
+        if (auto cached = ProbeCachedPattern_(moduleStart, moduleEnd, ranges, view, key))
+        {
+            return cached;
+        }
+
+        for (auto& range : ranges)
+        {
+            auto found = functionIndex
+                ? FindPatternAtFunctionStarts(moduleStart, *functionIndex, range.Start, range.End, view)
+                : FindPatternParallel(range.Start, range.End, view);
+            if (found)
+            {
+                GSignatureCache.Store(moduleStart, moduleEnd - moduleStart, key, static_cast<std::uint32_t>(found - moduleStart));
+                return const_cast<BYTE*>(found);
+            }
+        }
+        return nullptr;
+    }
+
+    /// <summary>
+    /// A pattern for ScanProcessBatch and the slot for its result.
+    /// </summary>
+    struct ScanRequest
+    {
+        PatternView Pattern;
+        BYTE* Result;
+    };
+
+    /// <summary>
+    /// Scan the game module for several patterns in a single sweep.
+    /// Every request's Result is set to the lowest match or nullptr.
+    /// Sections, anchoring and the signature cache work the same way as in ScanProcess.
+    /// </summary>
+    /// <returns>Number of patterns that were found.</returns>
+    size_t ScanProcessBatch(ScanRequest* requests, size_t count, const char* sectionName = nullptr, ScanAnchor anchor = ScanAnchor::Anywhere)
+    {
+        for (size_t r = 0; r < count; r++)
+        {
+            requests[r].Result = nullptr;
+        }
+
+        BYTE* moduleStart, * moduleEnd;
+        std::vector<ModuleRange> ranges;
+        if (!GetGameModuleRange(&moduleStart, &moduleEnd) || !GetGameModuleScanRanges(sectionName, ranges))
+        {
+            GLogger.writeln(L"ScanProcessBatch: ERROR: nothing to scan (section = %S).", sectionName ? sectionName : "<executable>");
+            return 0;
+        }
+
+        auto functionIndex = anchor == ScanAnchor::FunctionStart ? GetGameFunctionIndex() : nullptr;
+
+        // Resolve what we can from the signature cache first.
+
+        size_t found = 0;
+        std::vector<BatchScanEntry> entries(count);
+        std::vector<std::uint64_t> keys(count);
+        for (size_t r = 0; r < count; r++)
+        {
+            entries[r].Pattern = requests[r].Pattern;
+            keys[r] = SignatureCache::HashPattern(entries[r].Pattern, sectionName, functionIndex != nullptr);
+            requests[r].Result = ProbeCachedPattern_(moduleStart, moduleEnd, ranges, entries[r].Pattern, keys[r]);
+            if (requests[r].Result)
+            {
+                found++;
+            }
+        }
+
+        // Sweep the ranges in order, each time only with the patterns still missing.
+
+        std::vector<BatchScanEntry> pending;
+        std::vector<size_t> pendingIndices;
+        for (auto& range : ranges)
+        {
+            pending.clear();
+            pendingIndices.clear();
+            for (size_t r = 0; r < count; r++)
+            {
+                if (!requests[r].Result)
                 {
-                    return nullptr;
+                    pending.push_back(entries[r]);
+                    pendingIndices.push_back(r);
                 }
-                if ((pattern[matchLength] != pointer[matchLength]) && (mask[matchLength] != '?'))
+            }
+            if (pending.empty())
+            {
+                break;
+            }
+
+            found += functionIndex
+                ? FindPatternsAtFunctionStarts(moduleStart, *functionIndex, range.Start, range.End, pending.data(), pending.size())
+                : FindPatterns(range.Start, range.End, pending.data(), pending.size());
+            for (size_t p = 0; p < pending.size(); p++)
+            {
+                if (auto result = const_cast<BYTE*>(pending[p].Result))
                 {
-                    break;
+                    auto r = pendingIndices[p];
+                    requests[r].Result = result;
+                    GSignatureCache.Store(moduleStart, moduleEnd - moduleStart, keys[r], static_cast<std::uint32_t>(result - moduleStart));
                 }
             }
-
-            pointer++;
         }
-        return nullptr;
+        return found;
     }
 
 
     /// <summary>
     /// Object which freezes all but the current thread for the duration of the scope.
+    /// Threads come from <see cref="GThreadRegistry"/>, whose handles are borrowed until the threads are resumed.
     /// </summary>
     class ScopedThreadFreeze
     {
     private:
 
-        std::vector<DWORD> suspendedThreadIds_;
+        std::vector<HANDLE> registeredThreads_;
+        std::vector<HANDLE> suspendedThreads_;
+        bool borrowed_ = false;
 
         // Private methods which do the heavy lifting.
 
         void suspendAllOtherThreadsAndStore_()
         {
-            int suspendedCount = 0;
-
-            DWORD currentThreadId = GetCurrentThreadId();
-            DWORD currentProcessId = GetCurrentProcessId();
+            registeredThreads_.resize(64);
+            UINT count;
+            while ((count = GThreadRegistry.Acquire(registeredThreads_.data(), static_cast<UINT>(registeredThreads_.size()))) > registeredThreads_.size())
+            {
+                registeredThreads_.resize(count);
+            }
+            registeredThreads_.resize(count);
+            borrowed_ = true;
 
-            GLogger.writeln(L"suspendAllOtherThreadsAndStore_: currentThreadId = %d / %x", currentProcessId, currentProcessId);
+            GLogger.writeln(L"suspendAllOtherThreadsAndStore_: currentThreadId = %d, %u registered threads", GetCurrentThreadId(), count);
 
-            HANDLE h = CreateToolhelp32Snapshot(TH32CS_SNAPTHREAD, 0);
-            if (h != INVALID_HANDLE_VALUE)
+            // Nothing may be allocated or logged once a thread is suspended, it could be holding the lock.
+            // Failures are reported after resuming.
+            suspendedThreads_.reserve(count);
+            for (auto thread : registeredThreads_)
             {
-                THREADENTRY32 te;
-                te.dwSize = sizeof(te);
-                if (Thread32First(h, &te))
+                if (SuspendThread(thread) != (DWORD)-1)
                 {
-                    do
-                    {
-                        if (te.dwSize >= FIELD_OFFSET(THREADENTRY32, th32OwnerProcessID) + sizeof(te.th32OwnerProcessID))
-                        {
-                            if (te.th32OwnerProcessID == currentProcessId && te.th32ThreadID != currentThreadId)
-                            {
-                                //printf_s("Suspending pid 0x%04x tid 0x%04x\n", te.th32OwnerProcessID, te.th32ThreadID);
-                                HANDLE thread = OpenThread(THREAD_SUSPEND_RESUME, FALSE, te.th32ThreadID);
-                                if (thread == NULL)
-                                {
-                                    GLogger.writeln(L"suspendAllOtherThreadsAndStore_: failed to open thread.");
-                                }
-                                else
-                                {
-                                    if (SuspendThread(thread) == -1)
-                                    {
-                                        GLogger.writeln(L"suspendAllOtherThreadsAndStore_: failed to suspend thread.");
-                                    }
-                                    else
-                                    {
-                                        ++suspendedCount;
-                                        suspendedThreadIds_.push_back(te.th32ThreadID);
-                                        CloseHandle(thread);
-                                    }
-                                }
-                            }
-                        }
-
-                        te.dwSize = sizeof(te);
-                    } while (Thread32Next(h, &te));
+                    suspendedThreads_.push_back(thread);
                 }
-                CloseHandle(h);
             }
-
-            GLogger.writeln(L"suspendAllOtherThreadsAndStore_: returning (%d suspended).", suspendedCount);
         }
         void resumeAllOtherThreadsFromStore_()
         {
-            int resumedCount = 0;
+            // Nothing is logged until every thread runs again, see suspendAllOtherThreadsAndStore_.
+            size_t notSuspended = registeredThreads_.size() - suspendedThreads_.size();
+            size_t resumedCount = 0;
 
-            for (auto tid : suspendedThreadIds_)
+            for (auto thread : suspendedThreads_)
             {
-                HANDLE thread = OpenThread(THREAD_SUSPEND_RESUME, FALSE, tid);
-                if (thread == NULL)
-                {
-                    GLogger.writeln(L"resumeAllOtherThreadsFromStore_: failed to open thread.");
-                }
-                else
+                if (ResumeThread(thread) != (DWORD)-1)
                 {
-                    if (ResumeThread(thread) == -1)
-                    {
-                        GLogger.writeln(L"resumeAllOtherThreadsFromStore_: failed to resume thread.");
-                    }
-                    else
-                    {
-                        ++resumedCount;
-                        CloseHandle(thread);
-                    }
+                    ++resumedCount;
                 }
             }
 
-            if (static_cast<size_t>(resumedCount) != suspendedThreadIds_.size())
+            if (notSuspended != 0)
             {
-                GLogger.writeln(L"resumeAllOtherThreadsFromStore_: resumed count mismatch! %d != %llu", resumedCount, suspendedThreadIds_.size());
+                GLogger.writeln(L"resumeAllOtherThreadsFromStore_: failed to suspend %llu thread(s).", (unsigned long long)notSuspended);
             }
-            suspendedThreadIds_.clear();
+            if (resumedCount != suspendedThreads_.size())
+            {
+                GLogger.writeln(L"resumeAllOtherThreadsFromStore_: ERROR: failed to resume %llu of %llu thread(s).",
+                    (unsigned long long)(suspendedThreads_.size() - resumedCount), (unsigned long long)suspendedThreads_.size());
+            }
+            suspendedThreads_.clear();
 
-            GLogger.writeln(L"resumeAllOtherThreadsFromStore_: returning (%d resumed).", resumedCount);
+            if (borrowed_)
+            {
+                GThreadRegistry.Release();
+                borrowed_ = false;
+            }
+
+            GLogger.writeln(L"resumeAllOtherThreadsFromStore_: returning (%llu resumed).", (unsigned long long)resumedCount);
         }
 
     public:
@@ -179,7 +402,8 @@ namespace Utils
         // RAII logic.
 
         ScopedThreadFreeze()
-            : suspendedThreadIds_{}
+            : registeredThreads_{}
+            , suspendedThreads_{}
         {
             suspendAllOtherThreadsAndStore_();
         }
@@ -187,5 +411,25 @@ namespace Utils
         {
             resumeAllOtherThreadsFromStore_();
         }
+
+        /// <summary>
+        /// Call fn with the instruction pointer of every suspended thread, until it returns true.
+        /// Waits for each thread to actually stop, which SuspendThread doesn't.
+        /// </summary>
+        /// <returns>True if fn returned true, or if a thread's context couldn't be read.</returns>
+        template <typename Fn>
+        bool AnyInstructionPointer(Fn fn) const
+        {
+            for (auto thread : suspendedThreads_)
+            {
+                CONTEXT context;
+                context.ContextFlags = CONTEXT_CONTROL;
+                if (!GetThreadContext(thread, &context) || fn(static_cast<DWORD_PTR>(context.Rip)))
+                {
+                    return true;
+                }
+            }
+            return false;
+        }
     };
 }
@@ -0,0 +1,384 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <utility>
+#include <vector>
+#include <Windows.h>
+#include "../utils/codegen.h"
+#include "../utils/per_thread.h"
+
+
+namespace Utils
+{
+    /// <summary>
+    /// Arguments and return value of a call going through a MulticastHook.
+    /// Pre callbacks may change the arguments, post callbacks may change the return value.
+    /// </summary>
+    struct MulticastContext
+    {
+        std::uint64_t IntArgs[4];           // rcx, rdx, r8, r9
+        std::uint64_t FloatArgs[4];         // raw low 64 bits of xmm0 - xmm3
+        std::uint64_t* StackArgs;           // the fifth argument onward, in the caller's frame
+        std::uint64_t ReturnValue;          // rax
+        std::uint64_t FloatReturnValue;     // raw low 64 bits of xmm0
+        std::int32_t SkipOriginal;          // set by a pre callback to not call the original, ReturnValue is returned as is
+    };
+
+    typedef void (CODEGEN_CALL *MulticastCallback)(MulticastContext* context, void* userData);
+
+    constexpr std::uint32_t MULTICAST_MAX_STACK_ARGS = 8;
+
+    /// <summary>
+    /// Single detour for a target shared by any number of callbacks.
+    /// Instead of chaining one trampoline per hook, the generated dispatcher runs the pre callbacks,
+    /// calls the original once and runs the post callbacks, all in the same frame.
+    /// </summary>
+    /// <remarks>
+    /// Pre callbacks run by descending priority, post callbacks in the reverse order; ties run in subscription order.
+    /// The original gets the register arguments and up to MULTICAST_MAX_STACK_ARGS stack arguments.
+    /// Callers read a snapshot of the subscribers without a lock or any locked instruction; replaced snapshots
+    /// are freed once every thread that was inside a dispatcher has left. Subscribe and Unsubscribe
+    /// must be serialized by the owner. Installed instances and their dispatchers are never freed,
+    /// as a thread may be inside one at any time.
+    /// </remarks>
+    class MulticastHook
+    {
+    private:
+        struct Subscriber_
+        {
+            MulticastCallback Pre;
+            MulticastCallback Post;
+            void* UserData;
+            int Priority;
+            std::uint64_t Serial;
+        };
+
+        struct Callback_
+        {
+            MulticastCallback Function;
+            void* UserData;
+        };
+
+        // What callers run, without the subscribers' gaps: both ranges are in the order of calling.
+        // The dispatcher walks the ranges itself, Storage just owns them.
+        struct Snapshot_
+        {
+            const Callback_* Pre;
+            const Callback_* PreEnd;
+            const Callback_* Post;
+            const Callback_* PostEnd;
+            std::vector<Callback_> Storage;
+        };
+
+        // Per-thread state of callers, so that they never need a locked instruction.
+        // Depth counts the dispatchers the thread is inside of, Exits how many times it dropped back to zero.
+        struct Reader_
+        {
+            std::atomic<std::uint32_t> Depth{ 0 };
+            std::atomic<std::uint64_t> Exits{ 0 };
+        };
+
+        // A replaced snapshot, with the threads that may still be reading it.
+        struct Retired_
+        {
+            Snapshot_* Snapshot;
+            std::vector<std::pair<Reader_*, std::uint64_t>> Busy;
+        };
+
+        static_assert(sizeof(MulticastContext) == 0x60, "the dispatcher relies on this layout");
+        static_assert(sizeof(Callback_) == 0x10 && offsetof(Callback_, UserData) == 0x08, "the dispatcher relies on this layout");
+        static_assert(offsetof(Snapshot_, PreEnd) == 0x08 && offsetof(Snapshot_, Post) == 0x10 && offsetof(Snapshot_, PostEnd) == 0x18, "the dispatcher relies on this layout");
+        static_assert(offsetof(Reader_, Depth) == 0x00 && offsetof(Reader_, Exits) == 0x08, "the dispatcher relies on this layout");
+
+        // Readers of all instances, registered on first use and kept for the process lifetime.
+        // Each thread's is also in readerSlot_, for the dispatchers to find without a call.
+        static inline PerThread<Reader_> readers_;
+        static inline ThreadSlot readerSlot_;
+
+        LPVOID original_ = nullptr;             // written by MH_CreateHookEx
+        BYTE* dispatcher_ = nullptr;
+
+        std::atomic<Snapshot_*> current_;
+        std::vector<Subscriber_> subscribers_;  // by descending priority, only touched by the owner
+        std::vector<Retired_> retired_;
+        std::uint64_t serialCounter_ = 0;
+
+        MulticastHook()
+            : current_{ new Snapshot_() }
+        { }
+
+        ~MulticastHook()
+        {
+            delete current_.load();
+            for (auto& retired : retired_)
+            {
+                delete retired.Snapshot;
+            }
+        }
+
+        // Called by the dispatcher when its thread's reader isn't in readerSlot_ yet, or can't be read from there.
+        static Reader_* CODEGEN_CALL reader_()
+        {
+            auto reader = readers_.Get();
+            readerSlot_.Set(reader);
+            return reader;
+        }
+
+        // Call each callback of a snapshot range, with the range pointers at the given offsets of the snapshot in rsi.
+        static void emitCallbacks_(CodeBuilder& code, BYTE beginOffset, BYTE endOffset)
+        {
+            code.Emit({ 0x48, 0x8B, 0x7E, beginOffset });               // mov rdi, [rsi+begin]
+            code.Emit({ 0x4C, 0x8B, 0x66, endOffset });                 // mov r12, [rsi+end]
+            auto loop = code.Size();
+            code.Emit({ 0x4C, 0x39, 0xE7 });                            // cmp rdi, r12
+            code.Emit({ 0x0F, 0x83 });                                  // jae done
+            auto doneRel = code.Size();
+            code.Emit32(0);
+            code.Emit({ 0x48, 0x8D, 0x4D, 0x80 });                      // lea rcx, [rbp-80h] (the context)
+            code.Emit({ 0x48, 0x8B, 0x57, 0x08 });                      // mov rdx, [rdi+8] (UserData)
+            code.Emit({ 0xFF, 0x17 });                                  // call [rdi] (Function)
+            code.Emit({ 0x48, 0x83, 0xC7, 0x10 });                      // add rdi, 10h
+            code.Emit({ 0xE9 });                                        // jmp loop
+            code.Emit32(static_cast<std::uint32_t>(loop - (code.Size() + 4)));
+            // done:
+            code.PatchRel32(doneRel);
+        }
+
+        // The snapshot stays in rsi and the reader in rbx for the whole call, both are preserved by the callbacks and the original.
+        bool buildDispatcher_()
+        {
+            CodeBuilder code;
+            UnwindInfo unwind;
+            code.Emit({ 0x55 });                                        // push rbp
+            unwind.PushNonvol(code, UnwindInfo::Rbp);
+            code.Emit({ 0x48, 0x89, 0xE5 });                            // mov rbp, rsp
+            unwind.SetFrame(code, UnwindInfo::Rbp);
+            code.Emit({ 0x53 });                                        // push rbx
+            unwind.PushNonvol(code, UnwindInfo::Rbx);
+            code.Emit({ 0x56 });                                        // push rsi
+            unwind.PushNonvol(code, UnwindInfo::Rsi);
+            code.Emit({ 0x57 });                                        // push rdi
+            unwind.PushNonvol(code, UnwindInfo::Rdi);
+            code.Emit({ 0x41, 0x54 });                                  // push r12
+            unwind.PushNonvol(code, UnwindInfo::R12);
+            code.Emit({ 0x48, 0x81, 0xEC, 0xC0, 0x00, 0x00, 0x00 });    // sub rsp, 0C0h
+            unwind.Alloc(code, 0xC0);
+            unwind.EndPrologue(code);
+
+            // Spill the arguments into the context at [rbp-80h].
+            code.Emit({ 0x48, 0x89, 0x4D, 0x80 });                      // mov [rbp-80h], rcx
+            code.Emit({ 0x48, 0x89, 0x55, 0x88 });                      // mov [rbp-78h], rdx
+            code.Emit({ 0x4C, 0x89, 0x45, 0x90 });                      // mov [rbp-70h], r8
+            code.Emit({ 0x4C, 0x89, 0x4D, 0x98 });                      // mov [rbp-68h], r9
+            code.Emit({ 0x66, 0x0F, 0xD6, 0x45, 0xA0 });                // movq [rbp-60h], xmm0
+            code.Emit({ 0x66, 0x0F, 0xD6, 0x4D, 0xA8 });                // movq [rbp-58h], xmm1
+            code.Emit({ 0x66, 0x0F, 0xD6, 0x55, 0xB0 });                // movq [rbp-50h], xmm2
+            code.Emit({ 0x66, 0x0F, 0xD6, 0x5D, 0xB8 });                // movq [rbp-48h], xmm3
+            code.Emit({ 0x48, 0x8D, 0x45, 0x30 });                      // lea rax, [rbp+30h]
+            code.Emit({ 0x48, 0x89, 0x45, 0xC0 });                      // mov [rbp-40h], rax
+
+            // The thread's reader, only calling out the first time.
+            if (readerSlot_.EmitLoadRax(code))                          // mov rax, <reader slot>
+            {
+                code.Emit({ 0x48, 0x85, 0xC0 });                        // test rax, rax
+                code.Emit({ 0x75, 0x0C });                              // jnz +0Ch
+            }
+            code.Emit({ 0x48, 0xB8 });                                  // mov rax, reader_
+            code.Emit64(reinterpret_cast<std::uint64_t>(&MulticastHook::reader_));
+            code.Emit({ 0xFF, 0xD0 });                                  // call rax
+            code.Emit({ 0x48, 0x89, 0xC3 });                            // mov rbx, rax
+
+            // Plain increment, made visible to publish_ by its FlushProcessWriteBuffers.
+            code.Emit({ 0xFF, 0x03 });                                  // inc dword [rbx] (Depth)
+            code.Emit({ 0x48, 0xB8 });                                  // mov rax, &current_
+            code.Emit64(reinterpret_cast<std::uint64_t>(&current_));
+            code.Emit({ 0x48, 0x8B, 0x30 });                            // mov rsi, [rax]
+
+            code.Emit({ 0x31, 0xC0 });                                  // xor eax, eax
+            code.Emit({ 0x48, 0x89, 0x45, 0xC8 });                      // mov [rbp-38h], rax (ReturnValue)
+            code.Emit({ 0x48, 0x89, 0x45, 0xD0 });                      // mov [rbp-30h], rax (FloatReturnValue)
+            code.Emit({ 0x89, 0x45, 0xD8 });                            // mov [rbp-28h], eax (SkipOriginal)
+
+            emitCallbacks_(code, offsetof(Snapshot_, Pre), offsetof(Snapshot_, PreEnd));
+
+            code.Emit({ 0x83, 0x7D, 0xD8, 0x00 });                      // cmp dword [rbp-28h], 0
+            code.Emit({ 0x0F, 0x85 });                                  // jne skip
+            auto skipRel = code.Size();
+            code.Emit32(0);
+
+            // Copy the stack arguments, the original expects them right above its shadow space.
+            for (BYTE i = 0; i < MULTICAST_MAX_STACK_ARGS; i++)
+            {
+                code.Emit({ 0x48, 0x8B, 0x45, static_cast<BYTE>(0x30 + i * 8) });          // mov rax, [rbp+30h+i*8]
+                code.Emit({ 0x48, 0x89, 0x44, 0x24, static_cast<BYTE>(0x20 + i * 8) });    // mov [rsp+20h+i*8], rax
+            }
+
+            // Reload the (possibly changed) arguments and call the original.
+            code.Emit({ 0x48, 0x8B, 0x4D, 0x80 });                      // mov rcx, [rbp-80h]
+            code.Emit({ 0x48, 0x8B, 0x55, 0x88 });                      // mov rdx, [rbp-78h]
+            code.Emit({ 0x4C, 0x8B, 0x45, 0x90 });                      // mov r8, [rbp-70h]
+            code.Emit({ 0x4C, 0x8B, 0x4D, 0x98 });                      // mov r9, [rbp-68h]
+            code.Emit({ 0xF3, 0x0F, 0x7E, 0x45, 0xA0 });                // movq xmm0, [rbp-60h]
+            code.Emit({ 0xF3, 0x0F, 0x7E, 0x4D, 0xA8 });                // movq xmm1, [rbp-58h]
+            code.Emit({ 0xF3, 0x0F, 0x7E, 0x55, 0xB0 });                // movq xmm2, [rbp-50h]
+            code.Emit({ 0xF3, 0x0F, 0x7E, 0x5D, 0xB8 });                // movq xmm3, [rbp-48h]
+            code.Emit({ 0x48, 0xB8 });                                  // mov rax, &original_
+            code.Emit64(reinterpret_cast<std::uint64_t>(&original_));
+            code.Emit({ 0x48, 0x8B, 0x00 });                            // mov rax, [rax]
+            code.Emit({ 0xFF, 0xD0 });                                  // call rax
+            code.Emit({ 0x48, 0x89, 0x45, 0xC8 });                      // mov [rbp-38h], rax
+            code.Emit({ 0x66, 0x0F, 0xD6, 0x45, 0xD0 });                // movq [rbp-30h], xmm0
+
+            // skip:
+            code.PatchRel32(skipRel);
+            emitCallbacks_(code, offsetof(Snapshot_, Post), offsetof(Snapshot_, PostEnd));
+
+            // Leave: Exits is bumped before Depth drops to zero, both plain stores.
+            code.Emit({ 0x8B, 0x03 });                                  // mov eax, [rbx]
+            code.Emit({ 0x83, 0xE8, 0x01 });                            // sub eax, 1
+            code.Emit({ 0x75, 0x04 });                                  // jnz +4
+            code.Emit({ 0x48, 0xFF, 0x43, 0x08 });                      // inc qword [rbx+8] (Exits)
+            code.Emit({ 0x89, 0x03 });                                  // mov [rbx], eax
+
+            code.Emit({ 0x48, 0x8B, 0x45, 0xC8 });                      // mov rax, [rbp-38h]
+            code.Emit({ 0xF3, 0x0F, 0x7E, 0x45, 0xD0 });                // movq xmm0, [rbp-30h]
+            code.Emit({ 0x48, 0x8D, 0x65, 0xE0 });                      // lea rsp, [rbp-20h]
+            code.Emit({ 0x41, 0x5C, 0x5F, 0x5E, 0x5B });                // pop r12; pop rdi; pop rsi; pop rbx
+            code.Emit({ 0x5D });                                        // pop rbp
+            code.Emit({ 0xC3 });                                        // ret
+
+            // Callbacks and the original may throw or be sampled, so stack walks have to get through this frame.
+            dispatcher_ = GCodeHeap.CommitFunction(std::move(code), unwind);
+            return dispatcher_ != nullptr;
+        }
+
+        // Free the snapshots no caller can still be reading: each thread that was inside a dispatcher
+        // when the snapshot got replaced has since left all of them at least once.
+        void reclaim_()
+        {
+            auto it = std::remove_if(retired_.begin(), retired_.end(), [](Retired_& retired)
+            {
+                for (auto& [reader, exits] : retired.Busy)
+                {
+                    if (reader->Depth.load(std::memory_order_acquire) != 0 && reader->Exits.load(std::memory_order_acquire) == exits)
+                    {
+                        return false;
+                    }
+                }
+                delete retired.Snapshot;
+                return true;
+            });
+            retired_.erase(it, retired_.end());
+        }
+
+        void publish_()
+        {
+            auto snapshot = new Snapshot_();
+            auto& storage = snapshot->Storage;
+            for (auto& subscriber : subscribers_)
+            {
+                if (subscriber.Pre)
+                {
+                    storage.push_back({ subscriber.Pre, subscriber.UserData });
+                }
+            }
+            auto preCount = storage.size();
+            for (auto it = subscribers_.rbegin(); it != subscribers_.rend(); ++it)
+            {
+                if (it->Post)
+                {
+                    storage.push_back({ it->Post, it->UserData });
+                }
+            }
+            snapshot->Pre = storage.data();
+            snapshot->PreEnd = storage.data() + preCount;
+            snapshot->Post = snapshot->PreEnd;
+            snapshot->PostEnd = storage.data() + storage.size();
+
+            Retired_ retired{ current_.exchange(snapshot), {} };
+
+            // Drain the store buffers of every processor, so that any caller which could have loaded
+            // the old snapshot shows a non-zero depth below. This is what spares the dispatcher a fence.
+            FlushProcessWriteBuffers();
+
+            for (auto reader : readers_.All())
+            {
+                if (reader->Depth.load(std::memory_order_acquire) != 0)
+                {
+                    retired.Busy.emplace_back(reader, reader->Exits.load(std::memory_order_acquire));
+                }
+            }
+
+            retired_.push_back(std::move(retired));
+            reclaim_();
+        }
+
+    public:
+        /// <summary>
+        /// Create a multicast hook and its dispatcher, which is to be installed as the detour of the target.
+        /// </summary>
+        /// <returns>The new instance, or nullptr if the dispatcher could not be generated.</returns>
+        static MulticastHook* Create()
+        {
+#if defined(_M_X64) || defined(__x86_64__)
+            auto hook = new MulticastHook();
+            if (!hook->buildDispatcher_())
+            {
+                delete hook;
+                return nullptr;
+            }
+            return hook;
+#else
+            return nullptr;
+#endif
+        }
+
+        /// <summary>
+        /// Free a hook whose dispatcher never got installed. Installed ones must be kept forever.
+        /// </summary>
+        static void Destroy(MulticastHook* hook)
+        {
+            delete hook;
+        }
+
+        [[nodiscard]] LPVOID Dispatcher() const noexcept { return dispatcher_; }
+        [[nodiscard]] LPVOID* OriginalSlot() noexcept { return &original_; }
+        [[nodiscard]] std::size_t SubscriberCount() const noexcept { return subscribers_.size(); }
+
+        /// <summary>
+        /// Add a pair of callbacks, effective for calls entering the dispatcher from now on.
+        /// </summary>
+        /// <returns>Serial number to unsubscribe with.</returns>
+        std::uint64_t Subscribe(MulticastCallback pre, MulticastCallback post, void* userData, int priority)
+        {
+            auto serial = ++serialCounter_;
+
+            // Insert after every subscriber of the same or higher priority.
+            auto at = std::find_if(subscribers_.begin(), subscribers_.end(), [priority](const Subscriber_& item) { return item.Priority < priority; });
+            subscribers_.insert(at, Subscriber_{ pre, post, userData, priority, serial });
+
+            publish_();
+            return serial;
+        }
+
+        /// <summary>
+        /// Remove a pair of callbacks. Calls already past the pre callbacks will still run its post callback.
+        /// </summary>
+        bool Unsubscribe(std::uint64_t serial)
+        {
+            auto it = std::find_if(subscribers_.begin(), subscribers_.end(), [serial](const Subscriber_& item) { return item.Serial == serial; });
+            if (it == subscribers_.end())
+            {
+                return false;
+            }
+            subscribers_.erase(it);
+
+            publish_();
+            return true;
+        }
+    };
+}
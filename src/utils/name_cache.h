@@ -0,0 +1,309 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <Windows.h>
+
+
+namespace Utils
+{
+    /// <summary>
+    /// Strings of the engine's name table by name index, decoded on first use and interned for the lifetime of the cache.
+    /// Lookups in both directions read without taking a lock, only decoding a name that isn't cached yet takes one.
+    /// </summary>
+    class NameCache
+    {
+    public:
+        // Decodes the name at an index into a string which stays valid until the next call on the same thread, or returns nullptr.
+        typedef const wchar_t* (*tDecoder)(int index);
+
+        static constexpr int NotFound = -1;
+        static constexpr int MaxIndex = (1 << 22) - 1;
+
+        /// <summary>
+        /// Fold a character of a name, which the engine compares case-insensitively. They're ASCII in practice.
+        /// </summary>
+        static __forceinline wchar_t FoldChar(wchar_t c) noexcept
+        {
+            return (c >= L'A' && c <= L'Z') ? static_cast<wchar_t>(c - L'A' + L'a') : c;
+        }
+
+        /// <summary>
+        /// FNV-1a of the folded text of a name, the hash every name lookup by text is keyed on.
+        /// </summary>
+        /// <param name="outLength">Where to write out the length of the text, optional.</param>
+        static std::uint64_t HashText(const wchar_t* text, size_t* outLength = nullptr) noexcept
+        {
+            std::uint64_t hash = 14695981039346656037ull;
+            size_t length = 0;
+            for (; text[length] != L'\0'; length++)
+            {
+                hash = (hash ^ static_cast<std::uint64_t>(FoldChar(text[length]))) * 1099511628211ull;
+            }
+            if (outLength != nullptr)
+            {
+                *outLength = length;
+            }
+            return hash;
+        }
+
+    private:
+        static constexpr int ChunkBits_ = 12;
+        static constexpr int ChunkSize_ = 1 << ChunkBits_;
+        static constexpr int ChunkCount_ = (MaxIndex + 1) / ChunkSize_;
+        static constexpr size_t ArenaBlockSize_ = 64 * 1024;
+        static constexpr size_t InitialReverseSize_ = 4096;
+
+        struct Entry_
+        {
+            std::uint32_t Hash;
+            int Index;
+            size_t Length;
+            wchar_t Text[1];
+        };
+
+        struct Chunk_
+        {
+            std::atomic<const Entry_*> Entries[ChunkSize_];
+        };
+
+        // Open-addressed, string to entry. Replaced by a bigger copy when half full,
+        // the old one is kept alive since a reader may still be probing it.
+        struct Reverse_
+        {
+            size_t Mask;
+            std::unique_ptr<std::atomic<const Entry_*>[]> Slots;
+        };
+
+        tDecoder decoder_;
+
+        std::atomic<Chunk_*> chunks_[ChunkCount_] = {};
+        std::atomic<const Reverse_*> reverse_{ nullptr };
+
+        // Everything below is only touched with the lock held.
+        std::mutex fillMtx_;
+        std::vector<std::unique_ptr<Chunk_>> ownedChunks_;
+        std::vector<std::unique_ptr<Reverse_>> ownedReverses_;
+        size_t reverseCount_ = 0;
+        std::vector<std::unique_ptr<BYTE[]>> arenaBlocks_;
+        BYTE* arenaCursor_ = nullptr;
+        size_t arenaLeft_ = 0;
+
+        // Entries keep the low half of HashText.
+        static std::uint32_t hash_(const wchar_t* text, size_t* outLength) noexcept
+        {
+            return static_cast<std::uint32_t>(HashText(text, outLength));
+        }
+
+        static bool equals_(const Entry_* entry, const wchar_t* text, size_t length) noexcept
+        {
+            if (entry->Length != length)
+            {
+                return false;
+            }
+            for (size_t i = 0; i < length; i++)
+            {
+                if (FoldChar(entry->Text[i]) != FoldChar(text[i]))
+                {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        const Entry_* lookup_(int index) const noexcept
+        {
+            auto chunk = chunks_[index >> ChunkBits_].load(std::memory_order_acquire);
+            if (chunk == nullptr)
+            {
+                return nullptr;
+            }
+            return chunk->Entries[index & (ChunkSize_ - 1)].load(std::memory_order_acquire);
+        }
+
+        // Must be called with the lock held.
+        Entry_* allocate_(size_t length)
+        {
+            size_t size = offsetof(Entry_, Text) + (length + 1) * sizeof(wchar_t);
+            size = (size + alignof(Entry_) - 1) & ~(alignof(Entry_) - 1);
+
+            if (size > arenaLeft_)
+            {
+                size_t blockSize = size > ArenaBlockSize_ ? size : ArenaBlockSize_;
+                arenaBlocks_.emplace_back(new BYTE[blockSize]);
+                arenaCursor_ = arenaBlocks_.back().get();
+                arenaLeft_ = blockSize;
+            }
+
+            auto entry = reinterpret_cast<Entry_*>(arenaCursor_);
+            arenaCursor_ += size;
+            arenaLeft_ -= size;
+            return entry;
+        }
+
+        // Must be called with the lock held.
+        static void insertReverse_(const Reverse_* table, const Entry_* entry)
+        {
+            for (size_t slot = entry->Hash & table->Mask; ; slot = (slot + 1) & table->Mask)
+            {
+                auto existing = table->Slots[slot].load(std::memory_order_relaxed);
+                if (existing == nullptr)
+                {
+                    table->Slots[slot].store(entry, std::memory_order_release);
+                    return;
+                }
+                if (existing->Hash == entry->Hash && equals_(existing, entry->Text, entry->Length))
+                {
+                    return;
+                }
+            }
+        }
+
+        // Must be called with the lock held.
+        void addReverse_(const Entry_* entry)
+        {
+            auto table = reverse_.load(std::memory_order_relaxed);
+            size_t capacity = table == nullptr ? 0 : table->Mask + 1;
+
+            if ((reverseCount_ + 1) * 2 > capacity)
+            {
+                auto grown = std::make_unique<Reverse_>();
+                size_t grownCapacity = capacity == 0 ? InitialReverseSize_ : capacity * 2;
+                grown->Mask = grownCapacity - 1;
+                grown->Slots.reset(new std::atomic<const Entry_*>[grownCapacity]());
+
+                if (table != nullptr)
+                {
+                    for (size_t i = 0; i < capacity; i++)
+                    {
+                        auto moved = table->Slots[i].load(std::memory_order_relaxed);
+                        if (moved != nullptr)
+                        {
+                            insertReverse_(grown.get(), moved);
+                        }
+                    }
+                }
+
+                table = grown.get();
+                ownedReverses_.push_back(std::move(grown));
+                reverse_.store(table, std::memory_order_release);
+            }
+
+            insertReverse_(table, entry);
+            reverseCount_++;
+        }
+
+        const Entry_* fill_(int index)
+        {
+            // Decoded outside of the lock, two threads racing for the same name just both decode it.
+            auto text = decoder_ != nullptr ? decoder_(index) : nullptr;
+            if (text == nullptr)
+            {
+                return nullptr;
+            }
+
+            const std::lock_guard<std::mutex> lock(fillMtx_);
+
+            auto& chunkSlot = chunks_[index >> ChunkBits_];
+            auto chunk = chunkSlot.load(std::memory_order_relaxed);
+            if (chunk == nullptr)
+            {
+                ownedChunks_.emplace_back(new Chunk_());
+                chunk = ownedChunks_.back().get();
+                chunkSlot.store(chunk, std::memory_order_release);
+            }
+
+            auto& entrySlot = chunk->Entries[index & (ChunkSize_ - 1)];
+            auto existing = entrySlot.load(std::memory_order_relaxed);
+            if (existing != nullptr)
+            {
+                return existing;
+            }
+
+            size_t length;
+            auto hash = hash_(text, &length);
+            auto entry = allocate_(length);
+            entry->Hash = hash;
+            entry->Index = index;
+            entry->Length = length;
+            memcpy(entry->Text, text, (length + 1) * sizeof(wchar_t));
+
+            entrySlot.store(entry, std::memory_order_release);
+            addReverse_(entry);
+            return entry;
+        }
+
+    public:
+        explicit NameCache(tDecoder decoder)
+            : decoder_{ decoder }
+        {
+        }
+
+        NameCache(const NameCache&) = delete;
+        NameCache& operator=(const NameCache&) = delete;
+
+        /// <summary>
+        /// Get the text of a name, decoding it if this is the first time it's asked for.
+        /// </summary>
+        /// <param name="index">Index of the name, i.e. an FName without its instance number.</param>
+        /// <param name="outLength">Where to write out the length of the text, optional.</param>
+        /// <returns>The text, valid for the lifetime of the cache, or nullptr if the name couldn't be decoded.</returns>
+        const wchar_t* Find(int index, size_t* outLength = nullptr)
+        {
+            if (index < 0 || index > MaxIndex)
+            {
+                return nullptr;
+            }
+
+            auto entry = lookup_(index);
+            if (entry == nullptr)
+            {
+                entry = fill_(index);
+                if (entry == nullptr)
+                {
+                    return nullptr;
+                }
+            }
+
+            if (outLength != nullptr)
+            {
+                *outLength = entry->Length;
+            }
+            return entry->Text;
+        }
+
+        /// <summary>
+        /// Get the index of a name, compared case-insensitively like the engine does.
+        /// Only names decoded through the cache before are known.
+        /// </summary>
+        /// <returns>The index, or NotFound.</returns>
+        int FindIndex(const wchar_t* text) const
+        {
+            auto table = reverse_.load(std::memory_order_acquire);
+            if (table == nullptr)
+            {
+                return NotFound;
+            }
+
+            size_t length;
+            auto hash = hash_(text, &length);
+            for (size_t slot = hash & table->Mask; ; slot = (slot + 1) & table->Mask)
+            {
+                auto entry = table->Slots[slot].load(std::memory_order_acquire);
+                if (entry == nullptr)
+                {
+                    return NotFound;
+                }
+                if (entry->Hash == hash && equals_(entry, text, length))
+                {
+                    return entry->Index;
+                }
+            }
+        }
+    };
+}
@@ -0,0 +1,212 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <string_view>
+#include "../utils/scanner.h"
+
+// This header is intentionally free of Windows and proxy dependencies, like scanner.h.
+
+
+namespace Utils
+{
+    /// <summary>
+    /// Result of parsing a PEiD-style pattern.
+    /// </summary>
+    enum class PatternParseResult
+    {
+        Success = 0,
+        Empty = 1,
+        BadToken = 2,
+        TooLong = 3,
+    };
+
+    constexpr int HexDigitValue_(char c)
+    {
+        return (c >= '0' && c <= '9') ? c - '0'
+            : (c >= 'A' && c <= 'F') ? c - 'A' + 10
+            : (c >= 'a' && c <= 'f') ? c - 'a' + 10
+            : -1;
+    }
+
+    constexpr bool IsPatternSeparator_(char c)
+    {
+        return c == ' ' || c == '\t';
+    }
+
+    // Parse a two-char byte token where either char may be a '?' nibble wildcard.
+    constexpr bool ParseByteToken_(std::string_view token, bool allowWildcards, std::uint8_t* outValue, std::uint8_t* outMask)
+    {
+        if (token.size() != 2)
+        {
+            return false;
+        }
+
+        std::uint8_t value = 0, mask = 0;
+        for (std::size_t i = 0; i < 2; i++)
+        {
+            value <<= 4;
+            mask <<= 4;
+            if (token[i] == '?' && allowWildcards)
+            {
+                continue;
+            }
+
+            auto digit = HexDigitValue_(token[i]);
+            if (digit < 0)
+            {
+                return false;
+            }
+            value |= static_cast<std::uint8_t>(digit);
+            mask |= 0x0F;
+        }
+
+        *outValue = value;
+        *outMask = mask;
+        return true;
+    }
+
+    /// <summary>
+    /// Parse a PEiD-style pattern such as "48 8B ?? 55" into bytes and bitmasks (see PatternView).
+    /// Tokens are separated by spaces or tabs, and each one is either:
+    ///   - a two-digit hex byte, e.g. "8B";
+    ///   - "??" or "?" for a wildcard byte;
+    ///   - a byte with one wildcard nibble, e.g. "4?" or "?F";
+    ///   - a byte and the bits of it to compare, e.g. "40:F8" for any of 40-47.
+    /// Usable both at compile time and at runtime, never allocates, and has no length limit of its own.
+    /// Pass null output buffers to only count the bytes.
+    /// </summary>
+    /// <param name="capacity">Size of both output buffers, in bytes.</param>
+    constexpr PatternParseResult ParsePattern(std::string_view text, std::uint8_t* outBytes, std::uint8_t* outMasks, std::size_t capacity, std::size_t* outLength)
+    {
+        std::size_t length = 0;
+        std::size_t cursor = 0;
+
+        while (cursor < text.size())
+        {
+            if (IsPatternSeparator_(text[cursor]))
+            {
+                cursor++;
+                continue;
+            }
+
+            std::size_t tokenEnd = cursor;
+            while (tokenEnd < text.size() && !IsPatternSeparator_(text[tokenEnd]))
+            {
+                tokenEnd++;
+            }
+            auto token = text.substr(cursor, tokenEnd - cursor);
+            cursor = tokenEnd;
+
+            std::uint8_t value = 0, mask = 0;
+            if (token == "?")
+            {
+                value = 0x00;
+                mask = 0x00;
+            }
+            else if (token.size() == 5 && token[2] == ':')
+            {
+                std::uint8_t bitmask = 0, unused = 0;
+                if (!ParseByteToken_(token.substr(0, 2), false, &value, &unused)
+                    || !ParseByteToken_(token.substr(3, 2), false, &bitmask, &unused))
+                {
+                    return PatternParseResult::BadToken;
+                }
+                mask = bitmask;
+                value &= mask;
+            }
+            else if (!ParseByteToken_(token, true, &value, &mask))
+            {
+                return PatternParseResult::BadToken;
+            }
+
+            if (outBytes && outMasks)
+            {
+                if (length == capacity)
+                {
+                    return PatternParseResult::TooLong;
+                }
+                outBytes[length] = value;
+                outMasks[length] = mask;
+            }
+            length++;
+        }
+
+        if (length == 0)
+        {
+            return PatternParseResult::Empty;
+        }
+
+        *outLength = length;
+        return PatternParseResult::Success;
+    }
+
+    /// <summary>
+    /// Number of bytes of storage ParsePatternView needs for a pattern text (an upper bound, no parsing involved).
+    /// </summary>
+    constexpr std::size_t PatternStorageSize(std::string_view text)
+    {
+        return 2 * (text.size() / 2 + 1);
+    }
+
+    /// <summary>
+    /// Parse a pattern at runtime into caller-provided storage and prepare a scanner view over it.
+    /// The view borrows the storage, which must hold at least PatternStorageSize(text) bytes.
+    /// </summary>
+    constexpr PatternParseResult ParsePatternView(std::string_view text, std::uint8_t* storage, std::size_t storageSize, PatternView* outView)
+    {
+        if (storageSize < PatternStorageSize(text))
+        {
+            return PatternParseResult::TooLong;
+        }
+
+        auto capacity = storageSize / 2;
+        std::size_t length = 0;
+        auto rc = ParsePattern(text, storage, storage + capacity, capacity, &length);
+        if (rc != PatternParseResult::Success)
+        {
+            return rc;
+        }
+
+        *outView = { storage, storage + capacity, length, 0, 0 };
+        PrepareAnchors(outView->Bytes, outView->Masks, outView->Length, &outView->AnchorA, &outView->AnchorB);
+        return PatternParseResult::Success;
+    }
+
+    /// <summary>
+    /// A pattern parsed and prepared at compile time, see MakePattern.
+    /// </summary>
+    template<std::size_t Capacity>
+    struct StaticPattern
+    {
+        std::uint8_t Bytes[Capacity];
+        std::uint8_t Masks[Capacity];
+        std::size_t Length;
+        std::size_t AnchorA;
+        std::size_t AnchorB;
+
+        constexpr PatternView View() const noexcept
+        {
+            return { Bytes, Masks, Length, AnchorA, AnchorB };
+        }
+    };
+
+    /// <summary>
+    /// Build a ready-to-scan pattern from a PEiD-style literal.
+    /// Bind the result to a constexpr variable: a malformed literal then fails to compile.
+    /// </summary>
+    template<std::size_t N>
+    constexpr StaticPattern<N / 2 + 1> MakePattern(const char(&text)[N])
+    {
+        StaticPattern<N / 2 + 1> pattern{};
+
+        if (PatternParseResult::Success != ParsePattern(std::string_view(text, N - 1), pattern.Bytes, pattern.Masks, N / 2 + 1, &pattern.Length))
+        {
+            throw std::invalid_argument("MakePattern: malformed pattern literal");
+        }
+
+        PrepareAnchors(pattern.Bytes, pattern.Masks, pattern.Length, &pattern.AnchorA, &pattern.AnchorB);
+        return pattern;
+    }
+}
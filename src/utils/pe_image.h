@@ -0,0 +1,414 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// This header is intentionally free of Windows and proxy dependencies,
+// so that it can parse both the mapped game module and PE files read from disk on any host.
+
+
+namespace Utils
+{
+    // Section characteristics we care about (same values as IMAGE_SCN_* in winnt.h).
+    constexpr std::uint32_t PE_SCN_CNT_CODE = 0x00000020;
+    constexpr std::uint32_t PE_SCN_MEM_EXECUTE = 0x20000000;
+    constexpr std::uint32_t PE_SCN_MEM_READ = 0x40000000;
+    constexpr std::uint32_t PE_SCN_MEM_WRITE = 0x80000000;
+
+    /// <summary>
+    /// How the bytes handed to PeImage::Parse are laid out.
+    /// Mapped is a module loaded by the OS (sections at their RVAs),
+    /// File is the raw contents of a .exe/.dll (sections at their file offsets).
+    /// </summary>
+    enum class PeLayout
+    {
+        Mapped = 0,
+        File = 1
+    };
+
+    /// <summary>
+    /// A single entry of the section table.
+    /// </summary>
+    struct PeSection
+    {
+        char Name[9];
+        std::uint32_t VirtualAddress;
+        std::uint32_t VirtualSize;
+        std::uint32_t RawOffset;
+        std::uint32_t RawSize;
+        std::uint32_t Characteristics;
+
+        [[nodiscard]] bool IsExecutable() const noexcept { return (Characteristics & PE_SCN_MEM_EXECUTE) != 0; }
+    };
+
+    // Data directory indices we care about (same values as IMAGE_DIRECTORY_ENTRY_* in winnt.h).
+    constexpr std::uint32_t PE_DIRECTORY_IMPORT = 1;
+    constexpr std::uint32_t PE_DIRECTORY_EXCEPTION = 3;
+
+    /// <summary>
+    /// A function described by the x64 exception directory (.pdata), as RVAs.
+    /// </summary>
+    struct PeFunction
+    {
+        std::uint32_t Begin;
+        std::uint32_t End;
+    };
+
+    /// <summary>
+    /// Minimal, bounds-checked reader of PE32 / PE32+ headers and the section table.
+    /// Never reads outside of the buffer it was given.
+    /// </summary>
+    class PeImage
+    {
+    private:
+        const std::uint8_t* data_ = nullptr;
+        std::size_t size_ = 0;
+        PeLayout layout_ = PeLayout::Mapped;
+
+        bool is64_ = false;
+        std::uint16_t machine_ = 0;
+        std::uint32_t timeDateStamp_ = 0;
+        std::uint32_t sizeOfImage_ = 0;
+        std::uint32_t checkSum_ = 0;
+        std::size_t optionalOffset_ = 0;
+        std::vector<PeSection> sections_;
+
+        bool readBytes_(std::size_t offset, void* out, std::size_t count) const
+        {
+            if (offset > size_ || size_ - offset < count)
+            {
+                return false;
+            }
+            std::memcpy(out, data_ + offset, count);
+            return true;
+        }
+
+        template<typename T>
+        bool read_(std::size_t offset, T* out) const
+        {
+            return readBytes_(offset, out, sizeof(T));
+        }
+
+        // Compare a NUL-terminated string at an RVA, ASCII case-insensitively if asked to.
+        bool stringEquals_(std::uint32_t rva, const char* expected, bool ignoreCase) const
+        {
+            std::size_t offset = 0;
+            if (!RvaToOffset(rva, &offset))
+            {
+                return false;
+            }
+
+            for (std::size_t i = 0; ; i++)
+            {
+                char actual = 0;
+                if (!read_(offset + i, &actual))
+                {
+                    return false;
+                }
+
+                char wanted = expected[i];
+                if (ignoreCase)
+                {
+                    actual = (actual >= 'A' && actual <= 'Z') ? static_cast<char>(actual - 'A' + 'a') : actual;
+                    wanted = (wanted >= 'A' && wanted <= 'Z') ? static_cast<char>(wanted - 'A' + 'a') : wanted;
+                }
+                if (actual != wanted)
+                {
+                    return false;
+                }
+                if (actual == '\0')
+                {
+                    return true;
+                }
+            }
+        }
+
+    public:
+        PeImage() = default;
+
+        /// <summary>
+        /// Parse headers and the section table, replacing anything parsed before.
+        /// </summary>
+        /// <returns>False if the buffer doesn't hold a well-formed PE image.</returns>
+        bool Parse(const std::uint8_t* data, std::size_t size, PeLayout layout)
+        {
+            data_ = data;
+            size_ = data ? size : 0;
+            layout_ = layout;
+            sections_.clear();
+
+            // DOS header: "MZ" and the offset to the NT headers.
+            std::uint16_t dosMagic = 0;
+            std::uint32_t ntOffset = 0;
+            if (!read_(0x00, &dosMagic) || dosMagic != 0x5A4D || !read_(0x3C, &ntOffset))
+            {
+                return false;
+            }
+
+            // NT headers: "PE\0\0" and the file header.
+            std::uint32_t ntSignature = 0;
+            std::uint16_t sectionCount = 0, optionalHeaderSize = 0;
+            if (!read_(ntOffset, &ntSignature) || ntSignature != 0x00004550
+                || !read_(ntOffset + 0x04, &machine_)
+                || !read_(ntOffset + 0x06, &sectionCount)
+                || !read_(ntOffset + 0x08, &timeDateStamp_)
+                || !read_(ntOffset + 0x14, &optionalHeaderSize))
+            {
+                return false;
+            }
+
+            // Optional header: the fields below live at the same offsets in PE32 and PE32+.
+            std::size_t optionalOffset = ntOffset + 0x18;
+            std::uint16_t optionalMagic = 0;
+            if (!read_(optionalOffset, &optionalMagic) || (optionalMagic != 0x10B && optionalMagic != 0x20B)
+                || !read_(optionalOffset + 0x38, &sizeOfImage_)
+                || !read_(optionalOffset + 0x40, &checkSum_))
+            {
+                return false;
+            }
+            is64_ = optionalMagic == 0x20B;
+            optionalOffset_ = optionalOffset;
+
+            // Section table follows the optional header.
+            std::size_t sectionOffset = optionalOffset + optionalHeaderSize;
+            for (std::uint16_t i = 0; i < sectionCount; i++, sectionOffset += 40)
+            {
+                PeSection section{};
+                if (!readBytes_(sectionOffset + 0x00, section.Name, 8)
+                    || !read_(sectionOffset + 0x08, &section.VirtualSize)
+                    || !read_(sectionOffset + 0x0C, &section.VirtualAddress)
+                    || !read_(sectionOffset + 0x10, &section.RawSize)
+                    || !read_(sectionOffset + 0x14, &section.RawOffset)
+                    || !read_(sectionOffset + 0x24, &section.Characteristics))
+                {
+                    sections_.clear();
+                    return false;
+                }
+                section.Name[8] = '\0';
+                sections_.push_back(section);
+            }
+
+            return true;
+        }
+
+        [[nodiscard]] bool Is64() const noexcept { return is64_; }
+        [[nodiscard]] std::uint16_t Machine() const noexcept { return machine_; }
+        [[nodiscard]] std::uint32_t TimeDateStamp() const noexcept { return timeDateStamp_; }
+        [[nodiscard]] std::uint32_t SizeOfImage() const noexcept { return sizeOfImage_; }
+        [[nodiscard]] std::uint32_t CheckSum() const noexcept { return checkSum_; }
+        [[nodiscard]] const std::vector<PeSection>& Sections() const noexcept { return sections_; }
+
+        /// <summary>
+        /// Find a section by its (up to 8 chars long) name, e.g. ".text".
+        /// </summary>
+        [[nodiscard]] const PeSection* FindSection(const char* name) const
+        {
+            for (auto& section : sections_)
+            {
+                if (0 == std::strncmp(section.Name, name, 8))
+                {
+                    return &section;
+                }
+            }
+            return nullptr;
+        }
+
+        /// <summary>
+        /// Translate an RVA into an offset inside the parsed buffer.
+        /// </summary>
+        /// <returns>False if the RVA isn't backed by the buffer.</returns>
+        bool RvaToOffset(std::uint32_t rva, std::size_t* outOffset) const
+        {
+            if (layout_ == PeLayout::Mapped)
+            {
+                *outOffset = rva;
+                return rva < size_;
+            }
+
+            for (auto& section : sections_)
+            {
+                if (rva >= section.VirtualAddress && rva - section.VirtualAddress < section.RawSize)
+                {
+                    *outOffset = static_cast<std::size_t>(section.RawOffset) + (rva - section.VirtualAddress);
+                    return *outOffset < size_;
+                }
+            }
+            return false;
+        }
+
+        /// <summary>
+        /// Get an entry of the data directory (see PE_DIRECTORY_*).
+        /// </summary>
+        /// <returns>False if the image doesn't have that entry or it is empty.</returns>
+        bool DataDirectory(std::uint32_t index, std::uint32_t* outRva, std::uint32_t* outSize) const
+        {
+            std::size_t countOffset = optionalOffset_ + (is64_ ? 0x6C : 0x5C);
+            std::size_t entryOffset = countOffset + 4 + static_cast<std::size_t>(index) * 8;
+
+            std::uint32_t count = 0;
+            if (!read_(countOffset, &count) || index >= count
+                || !read_(entryOffset, outRva) || !read_(entryOffset + 4, outSize))
+            {
+                return false;
+            }
+            return *outRva != 0 && *outSize != 0;
+        }
+
+        /// <summary>
+        /// Read the x64 exception directory into a list of functions sorted by start address.
+        /// Entries whose unwind info is chained to another entry describe a part of a function, not its start,
+        /// so they are left out.
+        /// </summary>
+        /// <returns>False if the image has no readable exception directory, or it doesn't look sane
+        /// (e.g. because it is still encrypted).</returns>
+        bool ReadFunctions(std::vector<PeFunction>& outFunctions) const
+        {
+            outFunctions.clear();
+
+            std::uint32_t directoryRva = 0, directorySize = 0;
+            std::size_t directoryOffset = 0;
+            if (!is64_ || !DataDirectory(PE_DIRECTORY_EXCEPTION, &directoryRva, &directorySize)
+                || !RvaToOffset(directoryRva, &directoryOffset))
+            {
+                return false;
+            }
+
+            constexpr std::uint8_t UNW_FLAG_CHAININFO = 0x04;
+
+            std::size_t entryCount = directorySize / 12;
+            outFunctions.reserve(entryCount);
+            for (std::size_t i = 0; i < entryCount; i++)
+            {
+                std::uint32_t begin = 0, end = 0, unwind = 0;
+                if (!read_(directoryOffset + i * 12 + 0, &begin)
+                    || !read_(directoryOffset + i * 12 + 4, &end)
+                    || !read_(directoryOffset + i * 12 + 8, &unwind))
+                {
+                    break;
+                }
+                // The linker emits entries sorted and inside the image; anything else is garbage.
+                if (begin >= end || end > sizeOfImage_ || (!outFunctions.empty() && begin < outFunctions.back().Begin))
+                {
+                    outFunctions.clear();
+                    return false;
+                }
+
+                // An odd unwind RVA points to another RUNTIME_FUNCTION rather than to UNWIND_INFO.
+                if (unwind & 1)
+                {
+                    continue;
+                }
+
+                std::size_t unwindOffset = 0;
+                std::uint8_t versionAndFlags = 0;
+                if (RvaToOffset(unwind, &unwindOffset) && read_(unwindOffset, &versionAndFlags)
+                    && ((versionAndFlags >> 3) & UNW_FLAG_CHAININFO))
+                {
+                    continue;
+                }
+
+                outFunctions.push_back({ begin, end });
+            }
+
+            std::sort(outFunctions.begin(), outFunctions.end(), [](const PeFunction& a, const PeFunction& b) { return a.Begin < b.Begin; });
+            outFunctions.erase(std::unique(outFunctions.begin(), outFunctions.end(), [](const PeFunction& a, const PeFunction& b) { return a.Begin == b.Begin; }), outFunctions.end());
+            return true;
+        }
+
+        /// <summary>
+        /// Find the import address table slot of a function imported by name, e.g. ("user32.dll", "CreateWindowExW").
+        /// The module name is compared case-insensitively, the function name exactly. Imports by ordinal are not matched.
+        /// </summary>
+        /// <returns>False if the image doesn't import that function.</returns>
+        bool FindImport(const char* moduleName, const char* functionName, std::uint32_t* outSlotRva) const
+        {
+            std::uint32_t directoryRva = 0, directorySize = 0;
+            std::size_t directoryOffset = 0;
+            if (!DataDirectory(PE_DIRECTORY_IMPORT, &directoryRva, &directorySize)
+                || !RvaToOffset(directoryRva, &directoryOffset))
+            {
+                return false;
+            }
+
+            const std::size_t thunkSize = is64_ ? 8 : 4;
+            const std::uint64_t ordinalFlag = is64_ ? 0x8000000000000000ull : 0x80000000ull;
+
+            // Descriptors are 20 bytes each, terminated by an all-zero one.
+            for (std::size_t descriptor = directoryOffset; ; descriptor += 20)
+            {
+                std::uint32_t lookupRva = 0, nameRva = 0, addressRva = 0;
+                if (!read_(descriptor + 0x00, &lookupRva) || !read_(descriptor + 0x0C, &nameRva) || !read_(descriptor + 0x10, &addressRva))
+                {
+                    return false;
+                }
+                if (nameRva == 0 && addressRva == 0)
+                {
+                    return false;
+                }
+                if (!stringEquals_(nameRva, moduleName, true))
+                {
+                    continue;
+                }
+
+                // In a mapped image the address table already holds the resolved pointers, names are only left in the lookup table.
+                std::size_t lookupOffset = 0;
+                if (!RvaToOffset(lookupRva ? lookupRva : addressRva, &lookupOffset))
+                {
+                    return false;
+                }
+
+                for (std::uint32_t i = 0; ; i++)
+                {
+                    std::uint64_t thunk = 0;
+                    if (!readBytes_(lookupOffset + i * thunkSize, &thunk, thunkSize) || thunk == 0)
+                    {
+                        break;
+                    }
+
+                    // Skip the 2-byte hint in front of the name.
+                    if (!(thunk & ordinalFlag) && stringEquals_(static_cast<std::uint32_t>(thunk) + 2, functionName, false))
+                    {
+                        *outSlotRva = addressRva + i * static_cast<std::uint32_t>(thunkSize);
+                        return true;
+                    }
+                }
+            }
+        }
+
+        /// <summary>
+        /// Get the bytes of a section inside the parsed buffer, clamped to its bounds.
+        /// For mapped images that's [RVA, RVA + VirtualSize), for files [RawOffset, RawOffset + RawSize).
+        /// </summary>
+        /// <returns>False if the section has no bytes inside the buffer.</returns>
+        bool SectionBytes(const PeSection& section, const std::uint8_t** outStart, const std::uint8_t** outEnd) const
+        {
+            std::size_t offset, length;
+            if (layout_ == PeLayout::Mapped)
+            {
+                offset = section.VirtualAddress;
+                length = section.VirtualSize ? section.VirtualSize : section.RawSize;
+            }
+            else
+            {
+                offset = section.RawOffset;
+                length = section.RawSize;
+            }
+
+            if (offset >= size_ || length == 0)
+            {
+                return false;
+            }
+            if (length > size_ - offset)
+            {
+                length = size_ - offset;
+            }
+
+            *outStart = data_ + offset;
+            *outEnd = data_ + offset + length;
+            return true;
+        }
+    };
+}
@@ -0,0 +1,180 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+#include <Windows.h>
+#include "../utils/codegen.h"
+
+
+namespace Utils
+{
+    /// <summary>
+    /// Add to a counter that only the calling thread ever writes. A plain load and store, no locked instruction;
+    /// other threads may read it at any time and see either value.
+    /// </summary>
+    void BumpCounter(std::atomic<std::uint64_t>& counter, std::uint64_t value)
+    {
+        counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+    }
+
+    /// <summary>
+    /// A pointer per thread that generated code can load with a single instruction, instead of calling out to find
+    /// its thread's state. Null on every thread until it sets its own.
+    /// </summary>
+    /// <remarks>
+    /// On Windows it's a TLS index, inlined as a read of the TEB's slot for the first 64 indices.
+    /// Elsewhere it's an entry of a static TLS block at a fixed offset from the thread pointer.
+    /// Slots are never given back.
+    /// </remarks>
+    class ThreadSlot
+    {
+    private:
+#ifdef _WIN32
+        static constexpr DWORD TebSlotsOffset_ = 0x1480;
+        static constexpr DWORD TebSlots_ = 64;
+
+        DWORD index_;
+#else
+        static constexpr std::uint32_t Capacity_ = 64;
+
+        static inline std::atomic<std::uint32_t> count_{ 0 };
+        static inline thread_local void* slots_[Capacity_] __attribute__((tls_model("initial-exec"))) = {};
+
+        std::uint32_t index_;
+#endif
+
+    public:
+        ThreadSlot()
+        {
+#ifdef _WIN32
+            index_ = TlsAlloc();
+#else
+            index_ = count_.fetch_add(1);
+#endif
+        }
+
+        [[nodiscard]] bool IsValid() const noexcept
+        {
+#ifdef _WIN32
+            return index_ != TLS_OUT_OF_INDEXES;
+#else
+            return index_ < Capacity_;
+#endif
+        }
+
+        [[nodiscard]] void* Get() const
+        {
+            if (!IsValid())
+            {
+                return nullptr;
+            }
+#ifdef _WIN32
+            return TlsGetValue(index_);
+#else
+            return slots_[index_];
+#endif
+        }
+
+        void Set(void* value)
+        {
+            if (!IsValid())
+            {
+                return;
+            }
+#ifdef _WIN32
+            TlsSetValue(index_, value);
+#else
+            slots_[index_] = value;
+#endif
+        }
+
+        /// <summary>
+        /// Emit code loading the calling thread's value into rax.
+        /// </summary>
+        /// <returns>False if nothing was emitted: the slot can only be read through Get.</returns>
+        bool EmitLoadRax(CodeBuilder& code) const
+        {
+            if (!IsValid())
+            {
+                return false;
+            }
+
+#ifdef _WIN32
+            if (index_ >= TebSlots_)
+            {
+                return false;
+            }
+            code.Emit({ 0x65, 0x48, 0x8B, 0x04, 0x25 });                // mov rax, gs:[TlsSlots + index*8]
+            code.Emit32(TebSlotsOffset_ + index_ * 8);
+#else
+            // Static TLS sits at the same offset from the thread pointer on every thread.
+            std::uintptr_t threadPointer;
+            asm("mov %%fs:0, %0" : "=r"(threadPointer));
+            auto offset = static_cast<std::intptr_t>(reinterpret_cast<std::uintptr_t>(&slots_[index_]) - threadPointer);
+            if (offset < INT32_MIN || offset > INT32_MAX)
+            {
+                return false;
+            }
+            code.Emit({ 0x64, 0x48, 0x8B, 0x04, 0x25 });                // mov rax, fs:[offset]
+            code.Emit32(static_cast<std::uint32_t>(offset));
+#endif
+            return true;
+        }
+    };
+
+    /// <summary>
+    /// One T per thread, created on the thread's first Get and registered, so that any thread can go through all of them.
+    /// Instances are kept for the process lifetime, including those of threads that exited.
+    /// </summary>
+    /// <remarks>
+    /// The calling thread's pointer is a thread_local of the type, so there must be a single PerThread per T.
+    /// </remarks>
+    template <typename T>
+    class PerThread
+    {
+    private:
+        std::mutex mtx_;
+        std::vector<T*> all_;
+
+        static T*& local_()
+        {
+            thread_local T* state = nullptr;
+            return state;
+        }
+
+    public:
+        /// <summary>
+        /// The calling thread's instance. On its first call, a value-initialized T is passed to init before it's registered.
+        /// </summary>
+        template <typename TInit>
+        T* Get(TInit&& init)
+        {
+            auto& state = local_();
+            if (!state)
+            {
+                state = new T();
+                init(state);
+
+                const std::lock_guard<std::mutex> lock(mtx_);
+                all_.push_back(state);
+            }
+            return state;
+        }
+
+        T* Get()
+        {
+            return Get([](T*) {});
+        }
+
+        /// <summary>
+        /// Every instance registered so far. They are still written by their threads meanwhile.
+        /// </summary>
+        std::vector<T*> All()
+        {
+            const std::lock_guard<std::mutex> lock(mtx_);
+            return all_;
+        }
+    };
+}
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+
+namespace Utils
+{
+    /// <summary>
+    /// Collision-free map of a handful of 64-bit keys to small values: multiply-shift hashing into 2^SlotBits slots,
+    /// with a multiplier searched for when the table is built, so a lookup is one multiplication and one compare.
+    /// Immutable once built, and therefore safe to read from any number of threads.
+    /// </summary>
+    template <unsigned SlotBits>
+    class PerfectHashTable
+    {
+    public:
+        static constexpr size_t SlotCount = size_t{ 1 } << SlotBits;
+        static constexpr std::int32_t NotFound = -1;
+
+    private:
+        static constexpr int MaxAttempts_ = 4096;
+
+        std::uint64_t multiplier_ = 0;
+        std::uint64_t keys_[SlotCount] = {};
+        std::int32_t values_[SlotCount];
+
+        static __forceinline size_t slot_(std::uint64_t key, std::uint64_t multiplier)
+        {
+            return static_cast<size_t>((key * multiplier) >> (64 - SlotBits));
+        }
+
+    public:
+        PerfectHashTable()
+        {
+            for (auto& value : values_)
+            {
+                value = NotFound;
+            }
+        }
+
+        /// <summary>
+        /// Fill the table with the given keys, which must be distinct, and their values.
+        /// </summary>
+        /// <returns>False if there are too many keys, or if no multiplier separating them was found.</returns>
+        bool Build(const std::uint64_t* keys, const std::int32_t* values, size_t count)
+        {
+            if (count > SlotCount)
+            {
+                return false;
+            }
+
+            // Odd multipliers from a fixed sequence, so that a build is reproducible.
+            std::uint64_t candidate = 0x9E3779B97F4A7C15ull;
+            for (int attempt = 0; attempt < MaxAttempts_; attempt++)
+            {
+                candidate = (candidate * 6364136223846793005ull + 1442695040888963407ull) | 1;
+
+                bool taken[SlotCount] = {};
+                bool collides = false;
+                for (size_t i = 0; i < count && !collides; i++)
+                {
+                    auto slot = slot_(keys[i], candidate);
+                    collides = taken[slot];
+                    taken[slot] = true;
+                }
+                if (collides)
+                {
+                    continue;
+                }
+
+                multiplier_ = candidate;
+                for (size_t i = 0; i < SlotCount; i++)
+                {
+                    keys_[i] = 0;
+                    values_[i] = NotFound;
+                }
+                for (size_t i = 0; i < count; i++)
+                {
+                    auto slot = slot_(keys[i], candidate);
+                    keys_[slot] = keys[i];
+                    values_[slot] = values[i];
+                }
+                return true;
+            }
+            return false;
+        }
+
+        /// <summary>
+        /// Get the value of a key.
+        /// </summary>
+        /// <returns>The value, or NotFound.</returns>
+        __forceinline std::int32_t Find(std::uint64_t key) const
+        {
+            auto slot = slot_(key, multiplier_);
+            return keys_[slot] == key ? values_[slot] : NotFound;
+        }
+    };
+}
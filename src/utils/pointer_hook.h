@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstdint>
+#include <mutex>
+#include <Windows.h>
+#include "utils/memory.h"
+
+
+namespace Utils
+{
+    /// <summary>
+    /// Replace a function pointer the game calls through, such as a vtable slot or an import address table slot,
+    /// if it still holds the expected value. A single atomic exchange: no code is patched and no thread is frozen,
+    /// callers see either the old or the new pointer.
+    /// </summary>
+    /// <returns>False if the slot couldn't be made writable or didn't hold the expected value.</returns>
+    bool ExchangePointerSlot(LPVOID* slot, LPVOID expected, LPVOID desired)
+    {
+        // Serialized, so that restoring the protection of a page never races another write to it.
+        static std::mutex mtx;
+        const std::lock_guard<std::mutex> lock(mtx);
+
+        if (reinterpret_cast<std::uintptr_t>(slot) % sizeof(LPVOID) != 0)
+        {
+            return false;
+        }
+
+        MEMORY_BASIC_INFORMATION mi;
+        if (!VirtualQuery(slot, &mi, sizeof(mi)) || mi.State != MEM_COMMIT)
+        {
+            return false;
+        }
+
+        // Vtables and the import address table usually live in read-only data after the loader is done.
+        DWORD oldProtect = 0;
+        bool reprotect = !IsWritableProtection(mi.Protect);
+        if (reprotect && !VirtualProtect(slot, sizeof(LPVOID), IsExecutableProtection(mi.Protect) ? PAGE_EXECUTE_READWRITE : PAGE_READWRITE, &oldProtect))
+        {
+            return false;
+        }
+
+        bool swapped = InterlockedCompareExchangePointer(slot, desired, expected) == expected;
+
+        if (reprotect)
+        {
+            VirtualProtect(slot, sizeof(LPVOID), oldProtect, &oldProtect);
+        }
+        return swapped;
+    }
+}
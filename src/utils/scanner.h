@@ -0,0 +1,651 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include <emmintrin.h>
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+
+// This header is intentionally free of Windows and proxy dependencies,
+// so that the scanner can be built and checked against synthetic images on any x64 host.
+
+#ifdef _MSC_VER
+#define SCANNER_FORCEINLINE __forceinline
+#define SCANNER_TARGET_AVX2
+#define SCANNER_TARGET_XSAVE
+#else
+#define SCANNER_FORCEINLINE inline __attribute__((always_inline))
+#define SCANNER_TARGET_AVX2 __attribute__((target("avx2")))
+#define SCANNER_TARGET_XSAVE __attribute__((target("xsave")))
+#endif
+
+
+namespace Utils
+{
+    /// <summary>
+    /// Non-owning description of a byte pattern.
+    /// A byte at offset i matches if ((memory[i] ^ Bytes[i]) & Masks[i]) == 0,
+    /// so a mask of 0xFF is a fixed byte, a mask of 0x00 is a wildcard, and anything in between fixes only some bits.
+    /// AnchorA and AnchorB are offsets of the two rarest fixed bytes (see PrepareAnchors).
+    /// </summary>
+    struct PatternView
+    {
+        const std::uint8_t* Bytes;
+        const std::uint8_t* Masks;
+        std::size_t Length;
+        std::size_t AnchorA;
+        std::size_t AnchorB;
+    };
+
+
+    // Helpers.
+    // ======================================================================
+
+    /// <summary>
+    /// Rough measure of how often a byte shows up in x64 code, from 0 (rare) to 7 (everywhere).
+    /// Only used to pick anchors, so it doesn't have to be precise.
+    /// </summary>
+    constexpr int ByteCommonness(std::uint8_t b)
+    {
+        switch (b)
+        {
+        case 0x00: case 0xFF: case 0xCC:
+            return 7;
+        case 0x48: case 0x89: case 0x8B:
+            return 6;
+        case 0x24: case 0x4C: case 0x44: case 0x8D: case 0x0F: case 0xE8: case 0x01: case 0x20:
+            return 5;
+        case 0x83: case 0x85: case 0xC0: case 0xC3: case 0x90: case 0x74: case 0x75: case 0x08: case 0x10:
+        case 0x18: case 0x28: case 0x30: case 0x38: case 0x40: case 0x49: case 0x4D: case 0x41: case 0xEB:
+            return 4;
+        case 0x33: case 0xC7: case 0xC1: case 0xE9: case 0x45: case 0x4E: case 0x5C: case 0x6C: case 0x50:
+        case 0x02: case 0x03: case 0x04: case 0x80: case 0x84: case 0xF8: case 0xFE: case 0x58: case 0x60: case 0x68: case 0x70:
+            return 3;
+        default:
+            return (b < 0x10 || b > 0xF0) ? 2 : 1;
+        }
+    }
+
+    /// <summary>
+    /// Pick the two rarest fixed bytes of a pattern as scan anchors.
+    /// The second anchor prefers the farthest offset among equally rare bytes,
+    /// which makes coincidental double hits less likely.
+    /// If the pattern has only one fixed byte, both anchors point to it;
+    /// if it has none, both are zero and every position becomes a candidate.
+    /// </summary>
+    constexpr void PrepareAnchors(const std::uint8_t* bytes, const std::uint8_t* masks, std::size_t length, std::size_t* outA, std::size_t* outB)
+    {
+        std::size_t a = length, b = length;
+
+        for (std::size_t i = 0; i < length; i++)
+        {
+            if (masks[i] != 0xFF)
+            {
+                continue;
+            }
+            if (a == length || ByteCommonness(bytes[i]) < ByteCommonness(bytes[a]))
+            {
+                a = i;
+            }
+        }
+
+        for (std::size_t i = 0; i < length && a != length; i++)
+        {
+            if (masks[i] != 0xFF || i == a)
+            {
+                continue;
+            }
+            if (b == length || ByteCommonness(bytes[i]) < ByteCommonness(bytes[b])
+                || (ByteCommonness(bytes[i]) == ByteCommonness(bytes[b]) && (i > a ? i - a : a - i) > (b > a ? b - a : a - b)))
+            {
+                b = i;
+            }
+        }
+
+        *outA = a == length ? 0 : a;
+        *outB = b == length ? *outA : b;
+    }
+
+    SCANNER_FORCEINLINE unsigned CountTrailingZeros_(std::uint32_t value)
+    {
+#ifdef _MSC_VER
+        unsigned long index;
+        _BitScanForward(&index, value);
+        return static_cast<unsigned>(index);
+#else
+        return static_cast<unsigned>(__builtin_ctz(value));
+#endif
+    }
+
+    SCANNER_FORCEINLINE bool MatchesAt_(const std::uint8_t* pointer, const PatternView& pattern)
+    {
+        for (std::size_t i = 0; i < pattern.Length; i++)
+        {
+            if ((pointer[i] ^ pattern.Bytes[i]) & pattern.Masks[i])
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    SCANNER_TARGET_XSAVE bool CpuSupportsAVX2_()
+    {
+        int regs[4] = { 0, 0, 0, 0 };
+
+#ifdef _MSC_VER
+        __cpuid(regs, 0);
+        if (regs[0] < 7) return false;
+        __cpuid(regs, 1);
+#else
+        unsigned int eax, ebx, ecx, edx;
+        if (__get_cpuid_max(0, nullptr) < 7) return false;
+        __cpuid(1, eax, ebx, ecx, edx);
+        regs[2] = static_cast<int>(ecx);
+#endif
+
+        // The OS must have enabled saving of the YMM state (OSXSAVE + XCR0 bits 1 and 2).
+        if (!(regs[2] & (1 << 27)))
+        {
+            return false;
+        }
+        if ((_xgetbv(0) & 0x6) != 0x6)
+        {
+            return false;
+        }
+
+#ifdef _MSC_VER
+        __cpuidex(regs, 7, 0);
+#else
+        __cpuid_count(7, 0, eax, ebx, ecx, edx);
+        regs[1] = static_cast<int>(ebx);
+#endif
+        return (regs[1] & (1 << 5)) != 0;
+    }
+
+    bool CpuSupportsAVX2()
+    {
+        static const bool supported = CpuSupportsAVX2_();
+        return supported;
+    }
+
+
+    // Scanners.
+    // All of them return the lowest address in [start, end) at which the whole pattern fits and matches,
+    // or nullptr. The pattern must have its anchors prepared.
+    // ======================================================================
+
+    /// <summary>
+    /// Portable scanner: memchr for the first anchor, then a full check.
+    /// </summary>
+    const std::uint8_t* FindPatternScalar(const std::uint8_t* start, const std::uint8_t* end, const PatternView& pattern)
+    {
+        if (pattern.Length == 0 || end < start || static_cast<std::size_t>(end - start) < pattern.Length)
+        {
+            return nullptr;
+        }
+
+        const std::uint8_t* last = end - pattern.Length;
+        const std::uint8_t anchorByte = pattern.Bytes[pattern.AnchorA];
+
+        if (pattern.Masks[pattern.AnchorA] != 0xFF)
+        {
+            // No fully fixed bytes to look for, so every position is a candidate.
+            for (auto candidate = start; candidate <= last; candidate++)
+            {
+                if (MatchesAt_(candidate, pattern))
+                {
+                    return candidate;
+                }
+            }
+            return nullptr;
+        }
+
+        const std::uint8_t* cursor = start + pattern.AnchorA;
+        const std::uint8_t* cursorEnd = last + pattern.AnchorA + 1;
+        while (cursor < cursorEnd)
+        {
+            auto hit = static_cast<const std::uint8_t*>(std::memchr(cursor, anchorByte, cursorEnd - cursor));
+            if (!hit)
+            {
+                return nullptr;
+            }
+
+            auto candidate = hit - pattern.AnchorA;
+            if (MatchesAt_(candidate, pattern))
+            {
+                return candidate;
+            }
+            cursor = hit + 1;
+        }
+        return nullptr;
+    }
+
+    /// <summary>
+    /// SSE2 scanner: tests both anchors for 16 candidate positions per iteration.
+    /// </summary>
+    const std::uint8_t* FindPatternSSE2(const std::uint8_t* start, const std::uint8_t* end, const PatternView& pattern)
+    {
+        if (pattern.Length == 0 || end < start || static_cast<std::size_t>(end - start) < pattern.Length)
+        {
+            return nullptr;
+        }
+
+        if (pattern.Masks[pattern.AnchorA] != 0xFF)
+        {
+            return FindPatternScalar(start, end, pattern);
+        }
+
+        const std::uint8_t* last = end - pattern.Length;
+        const __m128i needleA = _mm_set1_epi8(static_cast<char>(pattern.Bytes[pattern.AnchorA]));
+        const __m128i needleB = _mm_set1_epi8(static_cast<char>(pattern.Bytes[pattern.AnchorB]));
+
+        // Loads at pointer + anchor + 15 stay below end as long as pointer + 15 <= last.
+        const std::uint8_t* pointer = start;
+        for (; pointer <= last && static_cast<std::size_t>(last - pointer) >= 15; pointer += 16)
+        {
+            __m128i blockA = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pointer + pattern.AnchorA));
+            __m128i blockB = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pointer + pattern.AnchorB));
+            __m128i hits = _mm_and_si128(_mm_cmpeq_epi8(blockA, needleA), _mm_cmpeq_epi8(blockB, needleB));
+
+            auto bits = static_cast<std::uint32_t>(_mm_movemask_epi8(hits));
+            while (bits)
+            {
+                auto candidate = pointer + CountTrailingZeros_(bits);
+                if (MatchesAt_(candidate, pattern))
+                {
+                    return candidate;
+                }
+                bits &= bits - 1;
+            }
+        }
+
+        return FindPatternScalar(pointer, end, pattern);
+    }
+
+    /// <summary>
+    /// AVX2 scanner: same as the SSE2 one, but with 32 candidate positions per iteration.
+    /// Only call it if CpuSupportsAVX2() returned true.
+    /// </summary>
+    SCANNER_TARGET_AVX2 const std::uint8_t* FindPatternAVX2(const std::uint8_t* start, const std::uint8_t* end, const PatternView& pattern)
+    {
+        if (pattern.Length == 0 || end < start || static_cast<std::size_t>(end - start) < pattern.Length)
+        {
+            return nullptr;
+        }
+
+        if (pattern.Masks[pattern.AnchorA] != 0xFF)
+        {
+            return FindPatternScalar(start, end, pattern);
+        }
+
+        const std::uint8_t* last = end - pattern.Length;
+        const __m256i needleA = _mm256_set1_epi8(static_cast<char>(pattern.Bytes[pattern.AnchorA]));
+        const __m256i needleB = _mm256_set1_epi8(static_cast<char>(pattern.Bytes[pattern.AnchorB]));
+
+        const std::uint8_t* pointer = start;
+        for (; pointer <= last && static_cast<std::size_t>(last - pointer) >= 31; pointer += 32)
+        {
+            __m256i blockA = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pointer + pattern.AnchorA));
+            __m256i blockB = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pointer + pattern.AnchorB));
+            __m256i hits = _mm256_and_si256(_mm256_cmpeq_epi8(blockA, needleA), _mm256_cmpeq_epi8(blockB, needleB));
+
+            auto bits = static_cast<std::uint32_t>(_mm256_movemask_epi8(hits));
+            while (bits)
+            {
+                auto candidate = pointer + CountTrailingZeros_(bits);
+                if (MatchesAt_(candidate, pattern))
+                {
+                    return candidate;
+                }
+                bits &= bits - 1;
+            }
+        }
+
+        return FindPatternSSE2(pointer, end, pattern);
+    }
+
+    /// <summary>
+    /// Scan [start, end) with the widest scanner the CPU supports.
+    /// </summary>
+    const std::uint8_t* FindPattern(const std::uint8_t* start, const std::uint8_t* end, const PatternView& pattern)
+    {
+        if (CpuSupportsAVX2())
+        {
+            return FindPatternAVX2(start, end, pattern);
+        }
+        return FindPatternSSE2(start, end, pattern);
+    }
+
+
+    // Batch scanning.
+    // ======================================================================
+
+    /// <summary>
+    /// One pattern of a batch scan and the slot for its result.
+    /// </summary>
+    struct BatchScanEntry
+    {
+        PatternView Pattern;
+        const std::uint8_t* Result;
+    };
+
+    /// <summary>
+    /// Scan [start, end) for all patterns in one sweep.
+    /// Patterns are bucketed by the value of their first anchor, every position whose byte
+    /// is some pattern's anchor is checked against that bucket only, and the sweep stops
+    /// as soon as every pattern is resolved. Each Result receives the lowest match or nullptr.
+    /// </summary>
+    /// <returns>Number of patterns that were found.</returns>
+    std::size_t FindPatterns(const std::uint8_t* start, const std::uint8_t* end, BatchScanEntry* entries, std::size_t count)
+    {
+        static const std::size_t NO_ENTRY = static_cast<std::size_t>(-1);
+        static const std::size_t MAX_SIMD_ANCHORS = 8;
+
+        std::size_t bucketHeads[256];
+        std::vector<std::size_t> bucketNext(count, NO_ENTRY);
+        std::uint8_t anchorValues[256];
+        std::size_t anchorValueCount = 0;
+        std::size_t pending = 0;
+        std::size_t found = 0;
+
+        for (auto& head : bucketHeads)
+        {
+            head = NO_ENTRY;
+        }
+
+        // Build the anchor buckets, resolving degenerate patterns right away.
+        for (std::size_t e = 0; e < count; e++)
+        {
+            auto& pattern = entries[e].Pattern;
+            entries[e].Result = nullptr;
+
+            if (pattern.Length == 0 || end < start || static_cast<std::size_t>(end - start) < pattern.Length)
+            {
+                continue;
+            }
+            if (pattern.Masks[pattern.AnchorA] != 0xFF)
+            {
+                entries[e].Result = FindPatternScalar(start, end, pattern);
+                found += entries[e].Result ? 1 : 0;
+                continue;
+            }
+
+            auto value = pattern.Bytes[pattern.AnchorA];
+            if (bucketHeads[value] == NO_ENTRY)
+            {
+                anchorValues[anchorValueCount++] = value;
+            }
+            bucketNext[e] = bucketHeads[value];
+            bucketHeads[value] = e;
+            pending++;
+        }
+
+        // Check all patterns anchored by the byte at the cursor, returns true once nothing is pending.
+        auto visit = [&](const std::uint8_t* cursor) -> bool
+        {
+            for (auto e = bucketHeads[*cursor]; e != NO_ENTRY; e = bucketNext[e])
+            {
+                auto& entry = entries[e];
+                if (entry.Result)
+                {
+                    continue;
+                }
+
+                auto& pattern = entry.Pattern;
+                if (static_cast<std::size_t>(cursor - start) < pattern.AnchorA
+                    || static_cast<std::size_t>(end - cursor) < pattern.Length - pattern.AnchorA)
+                {
+                    continue;
+                }
+
+                auto candidate = cursor - pattern.AnchorA;
+                if (MatchesAt_(candidate, pattern))
+                {
+                    entry.Result = candidate;
+                    found++;
+                    if (--pending == 0)
+                    {
+                        return true;
+                    }
+                }
+            }
+            return false;
+        };
+
+        if (pending == 0)
+        {
+            return found;
+        }
+
+        const std::uint8_t* cursor = start;
+
+        // With few distinct anchors, skip 16 bytes at a time unless one of them is present.
+        if (anchorValueCount <= MAX_SIMD_ANCHORS)
+        {
+            __m128i needles[MAX_SIMD_ANCHORS];
+            for (std::size_t a = 0; a < anchorValueCount; a++)
+            {
+                needles[a] = _mm_set1_epi8(static_cast<char>(anchorValues[a]));
+            }
+
+            for (; end - cursor >= 16; cursor += 16)
+            {
+                __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(cursor));
+                __m128i hits = _mm_cmpeq_epi8(block, needles[0]);
+                for (std::size_t a = 1; a < anchorValueCount; a++)
+                {
+                    hits = _mm_or_si128(hits, _mm_cmpeq_epi8(block, needles[a]));
+                }
+
+                auto bits = static_cast<std::uint32_t>(_mm_movemask_epi8(hits));
+                while (bits)
+                {
+                    if (visit(cursor + CountTrailingZeros_(bits)))
+                    {
+                        return found;
+                    }
+                    bits &= bits - 1;
+                }
+            }
+        }
+
+        for (; cursor < end; cursor++)
+        {
+            if (bucketHeads[*cursor] != NO_ENTRY && visit(cursor))
+            {
+                return found;
+            }
+        }
+
+        return found;
+    }
+
+    // Parallel scanning.
+    // ======================================================================
+
+    // Granularity at which a parallel scan hands out work and notices a better match.
+    constexpr std::size_t PARALLEL_SCAN_CHUNK_SIZE = 1 << 20;
+
+    /// <summary>
+    /// Default number of threads for a parallel scan: one per hardware thread, but no more than eight.
+    /// </summary>
+    unsigned ParallelScanThreadCount()
+    {
+        unsigned count = std::thread::hardware_concurrency();
+        return count == 0 ? 1 : (std::min)(count, 8u);
+    }
+
+    /// <summary>
+    /// State of a parallel scan, shared between the calling thread and the pool threads that join it.
+    /// Chunk i covers match positions [Start + i * chunk size, Start + (i + 1) * chunk size).
+    /// </summary>
+    struct ParallelScanState_
+    {
+        const std::uint8_t* Start = nullptr;
+        const std::uint8_t* End = nullptr;
+        PatternView Pattern{};
+        std::size_t ChunkCount = 0;
+
+        std::atomic<std::size_t> NextChunk{ 0 };
+        std::atomic<std::size_t> DoneChunks{ 0 };
+        std::atomic<std::uintptr_t> Best{ UINTPTR_MAX };
+
+        // Pool threads that may still join, so that a scan uses no more threads than it asked for.
+        std::atomic<int> Seats{ 0 };
+
+        std::mutex DoneMtx;
+        std::condition_variable DoneCv;
+    };
+
+    void ParallelScanWork_(ParallelScanState_& state)
+    {
+        for (;;)
+        {
+            std::size_t chunk = state.NextChunk.fetch_add(1, std::memory_order_relaxed);
+            if (chunk >= state.ChunkCount)
+            {
+                return;
+            }
+
+            // Chunks are handed out in address order, so once a match is known
+            // every chunk that starts above it can be skipped without being read.
+            auto chunkStart = state.Start + chunk * PARALLEL_SCAN_CHUNK_SIZE;
+            if (reinterpret_cast<std::uintptr_t>(chunkStart) < state.Best.load(std::memory_order_acquire))
+            {
+                // Extend the range by length - 1 so that matches straddling the next chunk are seen here.
+                auto chunkEnd = chunkStart + (std::min)(static_cast<std::size_t>(state.End - chunkStart), PARALLEL_SCAN_CHUNK_SIZE + state.Pattern.Length - 1);
+                if (auto found = FindPattern(chunkStart, chunkEnd, state.Pattern))
+                {
+                    auto value = reinterpret_cast<std::uintptr_t>(found);
+                    auto best = state.Best.load(std::memory_order_relaxed);
+                    while (value < best && !state.Best.compare_exchange_weak(best, value, std::memory_order_acq_rel))
+                    {
+                    }
+                }
+            }
+
+            if (state.DoneChunks.fetch_add(1, std::memory_order_acq_rel) + 1 == state.ChunkCount)
+            {
+                const std::lock_guard<std::mutex> lock(state.DoneMtx);
+                state.DoneCv.notify_all();
+            }
+        }
+    }
+
+    /// <summary>
+    /// Threads kept around between parallel scans. They sleep until a scan is posted,
+    /// then work through its chunks alongside the caller. The pool only grows, up to the most helpers a scan asked for.
+    /// </summary>
+    class ParallelScanPool_
+    {
+    private:
+        std::mutex mtx_;
+        std::condition_variable wake_;
+        std::shared_ptr<ParallelScanState_> job_;
+        std::uint64_t generation_ = 0;
+        std::size_t threadCount_ = 0;
+
+        void run_()
+        {
+            std::uint64_t seen = 0;
+            for (;;)
+            {
+                std::shared_ptr<ParallelScanState_> job;
+                {
+                    std::unique_lock<std::mutex> lock(mtx_);
+                    wake_.wait(lock, [&] { return generation_ != seen; });
+                    seen = generation_;
+                    job = job_;
+                }
+
+                if (job && job->Seats.fetch_sub(1, std::memory_order_relaxed) > 0)
+                {
+                    ParallelScanWork_(*job);
+                }
+            }
+        }
+
+    public:
+        /// <summary>
+        /// Post a scan to the pool, starting threads if it has fewer than helperCount.
+        /// A scan posted while another one is running replaces it for the threads that haven't picked it up yet.
+        /// </summary>
+        void Post(const std::shared_ptr<ParallelScanState_>& state, std::size_t helperCount)
+        {
+            state->Seats.store(static_cast<int>(helperCount), std::memory_order_relaxed);
+
+            const std::lock_guard<std::mutex> lock(mtx_);
+            for (; threadCount_ < helperCount; threadCount_++)
+            {
+                try
+                {
+                    std::thread([this]() { run_(); }).detach();
+                }
+                catch (const std::system_error&)
+                {
+                    break;
+                }
+            }
+
+            job_ = state;
+            generation_++;
+            wake_.notify_all();
+        }
+    };
+
+    /// <summary>
+    /// Scan [start, end) on several threads. Returns the same (lowest) match as FindPattern.
+    /// The calling thread works through chunks too and only waits for chunks that were started, never for pool threads,
+    /// so this is safe to call under the loader lock: pool threads that can't start in time simply find nothing left to do.
+    /// Small ranges are scanned on the calling thread alone.
+    /// </summary>
+    /// <param name="threadCount">Total number of threads including the caller, or 0 for ParallelScanThreadCount().</param>
+    const std::uint8_t* FindPatternParallel(const std::uint8_t* start, const std::uint8_t* end, const PatternView& pattern, unsigned threadCount = 0)
+    {
+        // Never destroyed: its threads are detached and may still be waiting on it at exit.
+        static ParallelScanPool_* pool = new ParallelScanPool_();
+
+        if (threadCount == 0)
+        {
+            threadCount = ParallelScanThreadCount();
+        }
+
+        std::size_t size = end > start ? static_cast<std::size_t>(end - start) : 0;
+        if (threadCount <= 1 || pattern.Length == 0 || size < 2 * PARALLEL_SCAN_CHUNK_SIZE + pattern.Length)
+        {
+            return FindPattern(start, end, pattern);
+        }
+
+        auto state = std::make_shared<ParallelScanState_>();
+        state->Start = start;
+        state->End = end;
+        state->Pattern = pattern;
+        state->ChunkCount = (size - pattern.Length + PARALLEL_SCAN_CHUNK_SIZE) / PARALLEL_SCAN_CHUNK_SIZE;
+
+        pool->Post(state, (std::min)(static_cast<std::size_t>(threadCount - 1), state->ChunkCount - 1));
+
+        ParallelScanWork_(*state);
+        {
+            std::unique_lock<std::mutex> lock(state->DoneMtx);
+            state->DoneCv.wait(lock, [&] { return state->DoneChunks.load(std::memory_order_acquire) == state->ChunkCount; });
+        }
+
+        auto best = state->Best.load(std::memory_order_acquire);
+        return best == UINTPTR_MAX ? nullptr : reinterpret_cast<const std::uint8_t*>(best);
+    }
+}
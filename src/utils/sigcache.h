@@ -0,0 +1,247 @@
+#pragma once
+
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include <Windows.h>
+#include "../utils/io.h"
+#include "../utils/pe_image.h"
+#include "../utils/scanner.h"
+
+
+#ifndef ASI_SIGCACHE_FNAME
+#error Must set ASI signature cache filename!
+#endif
+
+
+namespace Utils
+{
+    /// <summary>
+    /// Identifies a particular build of the game executable.
+    /// Any change to it invalidates every cached offset.
+    /// </summary>
+    struct ExecutableFingerprint
+    {
+        std::uint32_t TimeDateStamp;
+        std::uint32_t SizeOfImage;
+        std::uint32_t CheckSum;
+        std::uint32_t Reserved;
+        std::uint64_t FileSize;
+        std::uint64_t LastWriteTime;
+    };
+
+    /// <summary>
+    /// Persistent map of (executable fingerprint, pattern hash) to the RVA of the pattern's lowest match.
+    /// Lives in a small binary file next to the log, and is rewritten whenever a new offset is stored.
+    /// Cached offsets are only ever hints: callers must check the pattern at the offset before trusting it.
+    /// </summary>
+    class SignatureCache
+    {
+    private:
+        static constexpr std::uint64_t FileMagic = 0x3148434753504C42ull;  // "BLPSGCH1"
+
+        struct FileEntry_
+        {
+            std::uint64_t Key;
+            std::uint32_t Rva;
+            std::uint32_t Reserved;
+        };
+
+        std::mutex mtx_;
+        bool loaded_ = false;
+        bool usable_ = false;
+        ExecutableFingerprint fingerprint_{};
+        std::unordered_map<std::uint64_t, std::uint32_t> entries_;
+
+        bool computeFingerprint_(const BYTE* moduleBase, size_t moduleSize, ExecutableFingerprint* outFingerprint)
+        {
+            PeImage image;
+            if (!image.Parse(moduleBase, moduleSize, PeLayout::Mapped))
+            {
+                return false;
+            }
+
+            wchar_t exePath[MAX_PATH];
+            WIN32_FILE_ATTRIBUTE_DATA attributes;
+            if (!GetModuleFileNameW(nullptr, exePath, MAX_PATH)
+                || !GetFileAttributesExW(exePath, GetFileExInfoStandard, &attributes))
+            {
+                return false;
+            }
+
+            ZeroMemory(outFingerprint, sizeof(ExecutableFingerprint));
+            outFingerprint->TimeDateStamp = image.TimeDateStamp();
+            outFingerprint->SizeOfImage = image.SizeOfImage();
+            outFingerprint->CheckSum = image.CheckSum();
+            outFingerprint->FileSize = (static_cast<std::uint64_t>(attributes.nFileSizeHigh) << 32) | attributes.nFileSizeLow;
+            outFingerprint->LastWriteTime = (static_cast<std::uint64_t>(attributes.ftLastWriteTime.dwHighDateTime) << 32) | attributes.ftLastWriteTime.dwLowDateTime;
+            return true;
+        }
+
+        // Read the cache file, dropping it entirely if it was written for another build.
+        void load_(const BYTE* moduleBase, size_t moduleSize)
+        {
+            loaded_ = true;
+
+            if (!computeFingerprint_(moduleBase, moduleSize, &fingerprint_))
+            {
+                GLogger.writeln(L"SignatureCache: WARNING: failed to fingerprint the executable, the cache is disabled.");
+                return;
+            }
+            usable_ = true;
+
+            FILE* file = fopen(ASI_SIGCACHE_FNAME, "rb");
+            if (!file)
+            {
+                return;
+            }
+
+            std::uint64_t magic = 0;
+            std::uint32_t count = 0;
+            ExecutableFingerprint fileFingerprint{};
+            if (1 == fread(&magic, sizeof(magic), 1, file) && magic == FileMagic
+                && 1 == fread(&fileFingerprint, sizeof(fileFingerprint), 1, file)
+                && 0 == memcmp(&fileFingerprint, &fingerprint_, sizeof(ExecutableFingerprint))
+                && 1 == fread(&count, sizeof(count), 1, file))
+            {
+                FileEntry_ entry;
+                for (std::uint32_t i = 0; i < count && 1 == fread(&entry, sizeof(entry), 1, file); i++)
+                {
+                    entries_[entry.Key] = entry.Rva;
+                }
+                GLogger.writeln(L"SignatureCache: loaded %d cached offset(s).", static_cast<int>(entries_.size()));
+            }
+            else
+            {
+                GLogger.writeln(L"SignatureCache: cache file is stale or malformed, ignoring it.");
+            }
+
+            fclose(file);
+        }
+
+        // Write the whole cache to a temporary file and swap it in, so that a crash never leaves a torn file.
+        void save_()
+        {
+            const char* tempName = ASI_SIGCACHE_FNAME ".tmp";
+
+            FILE* file = fopen(tempName, "wb");
+            if (!file)
+            {
+                GLogger.writeln(L"SignatureCache: WARNING: failed to open %S for writing.", tempName);
+                return;
+            }
+
+            std::vector<FileEntry_> fileEntries;
+            fileEntries.reserve(entries_.size());
+            for (auto& entry : entries_)
+            {
+                fileEntries.push_back({ entry.first, entry.second, 0 });
+            }
+
+            auto count = static_cast<std::uint32_t>(fileEntries.size());
+            bool written = 1 == fwrite(&FileMagic, sizeof(FileMagic), 1, file)
+                && 1 == fwrite(&fingerprint_, sizeof(fingerprint_), 1, file)
+                && 1 == fwrite(&count, sizeof(count), 1, file)
+                && count == fwrite(fileEntries.data(), sizeof(FileEntry_), count, file);
+            written = (0 == fclose(file)) && written;
+
+            if (!written || !MoveFileExA(tempName, ASI_SIGCACHE_FNAME, MOVEFILE_REPLACE_EXISTING))
+            {
+                GLogger.writeln(L"SignatureCache: WARNING: failed to write the cache file (error = %d).", GetLastError());
+            }
+        }
+
+    public:
+        SignatureCache() = default;
+
+        /// <summary>
+        /// FNV-1a hash of a pattern (fixed bytes and wildcard positions) and where it is searched:
+        /// the section (null means the executable sections) and whether only function starts are tested.
+        /// </summary>
+        static std::uint64_t HashPattern(const PatternView& pattern, const char* sectionName, bool functionStartsOnly = false)
+        {
+            std::uint64_t hash = 0xCBF29CE484222325ull;
+            auto mix = [&hash](std::uint8_t value)
+            {
+                hash ^= value;
+                hash *= 0x100000001B3ull;
+            };
+
+            for (auto name = sectionName ? sectionName : ""; *name; name++)
+            {
+                mix(static_cast<std::uint8_t>(*name));
+            }
+            mix(0);
+
+            for (size_t i = 0; i < sizeof(pattern.Length); i++)
+            {
+                mix(static_cast<std::uint8_t>(pattern.Length >> (i * 8)));
+            }
+            for (size_t i = 0; i < pattern.Length; i++)
+            {
+                mix(pattern.Masks[i]);
+                mix(pattern.Bytes[i] & pattern.Masks[i]);
+            }
+            if (functionStartsOnly)
+            {
+                mix('F');
+            }
+
+            return hash;
+        }
+
+        /// <summary>
+        /// Get the cached RVA for a pattern hash, loading the cache on first use.
+        /// </summary>
+        bool Lookup(const BYTE* moduleBase, size_t moduleSize, std::uint64_t key, std::uint32_t* outRva)
+        {
+            const std::lock_guard<std::mutex> lock(mtx_);
+
+            if (!loaded_)
+            {
+                load_(moduleBase, moduleSize);
+            }
+
+            auto it = entries_.find(key);
+            if (!usable_ || it == entries_.end())
+            {
+                return false;
+            }
+
+            *outRva = it->second;
+            return true;
+        }
+
+        /// <summary>
+        /// Remember the RVA of a pattern's match, persisting the cache if that changed anything.
+        /// </summary>
+        void Store(const BYTE* moduleBase, size_t moduleSize, std::uint64_t key, std::uint32_t rva)
+        {
+            const std::lock_guard<std::mutex> lock(mtx_);
+
+            if (!loaded_)
+            {
+                load_(moduleBase, moduleSize);
+            }
+
+            if (!usable_)
+            {
+                return;
+            }
+
+            auto it = entries_.find(key);
+            if (it != entries_.end() && it->second == rva)
+            {
+                return;
+            }
+
+            entries_[key] = rva;
+            save_();
+        }
+    };
+}
+
+// Global instance.
+static Utils::SignatureCache GSignatureCache;
@@ -0,0 +1,206 @@
+#pragma once
+
+#include <mutex>
+#include <vector>
+#include <Windows.h>
+#include <tlhelp32.h>
+
+
+namespace Utils
+{
+    /// <summary>
+    /// Handles of every thread of the process, opened once and kept current by the proxy's
+    /// DLL_THREAD_ATTACH and DLL_THREAD_DETACH notifications, so that stopping the world
+    /// doesn't take a system-wide toolhelp snapshot and an OpenThread per thread each time.
+    /// </summary>
+    class ThreadRegistry
+    {
+    public:
+        static constexpr DWORD Access = THREAD_SUSPEND_RESUME | THREAD_GET_CONTEXT | THREAD_SET_CONTEXT | THREAD_QUERY_INFORMATION;
+
+    private:
+        struct Entry_
+        {
+            DWORD Id;
+            HANDLE Handle;
+        };
+
+        std::mutex mtx_;
+        bool populated_ = false;
+        std::vector<Entry_> threads_;
+        std::vector<HANDLE> retired_;   // Handles of exited threads, closed once nobody borrows them.
+        int borrowers_ = 0;
+
+        // Must be called with the lock held.
+        void add_(DWORD id)
+        {
+            for (const auto& entry : threads_)
+            {
+                if (entry.Id == id)
+                {
+                    return;
+                }
+            }
+
+            HANDLE handle = OpenThread(Access, FALSE, id);
+            if (handle != NULL)
+            {
+                threads_.push_back({ id, handle });
+            }
+        }
+
+        // Must be called with the lock held.
+        void remove_(size_t index)
+        {
+            if (borrowers_ > 0)
+            {
+                retired_.push_back(threads_[index].Handle);
+            }
+            else
+            {
+                CloseHandle(threads_[index].Handle);
+            }
+
+            threads_[index] = threads_.back();
+            threads_.pop_back();
+        }
+
+        // Threads that existed before the first use, later ones register themselves.
+        // Must be called with the lock held.
+        void populate_()
+        {
+            populated_ = true;
+
+            HANDLE snapshot = CreateToolhelp32Snapshot(TH32CS_SNAPTHREAD, 0);
+            if (snapshot == INVALID_HANDLE_VALUE)
+            {
+                return;
+            }
+
+            DWORD currentProcessId = GetCurrentProcessId();
+            THREADENTRY32 te;
+            te.dwSize = sizeof(te);
+            if (Thread32First(snapshot, &te))
+            {
+                do
+                {
+                    if (te.dwSize >= FIELD_OFFSET(THREADENTRY32, th32OwnerProcessID) + sizeof(te.th32OwnerProcessID)
+                        && te.th32OwnerProcessID == currentProcessId)
+                    {
+                        add_(te.th32ThreadID);
+                    }
+                    te.dwSize = sizeof(te);
+                } while (Thread32Next(snapshot, &te));
+            }
+            CloseHandle(snapshot);
+        }
+
+    public:
+        /// <summary>
+        /// Register the calling thread, from DLL_THREAD_ATTACH.
+        /// Nothing to do before the first use, the snapshot taken then finds the thread.
+        /// </summary>
+        void OnThreadAttach()
+        {
+            const std::lock_guard<std::mutex> lock(mtx_);
+            if (populated_)
+            {
+                add_(GetCurrentThreadId());
+            }
+        }
+
+        /// <summary>
+        /// Unregister the calling thread, from DLL_THREAD_DETACH.
+        /// </summary>
+        void OnThreadDetach()
+        {
+            const std::lock_guard<std::mutex> lock(mtx_);
+
+            DWORD id = GetCurrentThreadId();
+            for (size_t i = 0; i < threads_.size(); i++)
+            {
+                if (threads_[i].Id == id)
+                {
+                    remove_(i);
+                    return;
+                }
+            }
+        }
+
+        /// <summary>
+        /// Copy the handles of every thread but the calling one, opened with <see cref="ThreadRegistry::Access"/>.
+        /// They stay open until the matching <see cref="ThreadRegistry::Release"/>, even if their threads exit meanwhile.
+        /// Must not be called with any of the threads suspended, they may hold the registry's lock.
+        /// </summary>
+        /// <returns>The number of threads. If greater than capacity, nothing was copied and Release must not be called.</returns>
+        UINT Acquire(HANDLE* outHandles, UINT capacity)
+        {
+            const std::lock_guard<std::mutex> lock(mtx_);
+
+            if (!populated_)
+            {
+                populate_();
+            }
+
+            DWORD currentThreadId = GetCurrentThreadId();
+            UINT count = 0;
+            for (size_t i = 0; i < threads_.size(); )
+            {
+                // Threads killed by TerminateThread never detach.
+                DWORD exitCode;
+                if (GetExitCodeThread(threads_[i].Handle, &exitCode) && exitCode != STILL_ACTIVE)
+                {
+                    remove_(i);
+                    continue;
+                }
+
+                if (threads_[i].Id != currentThreadId)
+                {
+                    if (count < capacity)
+                    {
+                        outHandles[count] = threads_[i].Handle;
+                    }
+                    count++;
+                }
+                i++;
+            }
+
+            if (count <= capacity)
+            {
+                borrowers_++;
+            }
+            return count;
+        }
+
+        /// <summary>
+        /// Give back the handles copied by <see cref="ThreadRegistry::Acquire"/>.
+        /// </summary>
+        void Release()
+        {
+            const std::lock_guard<std::mutex> lock(mtx_);
+
+            if (--borrowers_ == 0)
+            {
+                for (auto handle : retired_)
+                {
+                    CloseHandle(handle);
+                }
+                retired_.clear();
+            }
+        }
+
+        // Adapters for MH_THREAD_SOURCE, with the registry as the context.
+
+        static UINT WINAPI AcquireForHooks(HANDLE* pThreads, UINT capacity, LPVOID pContext)
+        {
+            return static_cast<ThreadRegistry*>(pContext)->Acquire(pThreads, capacity);
+        }
+        static VOID WINAPI ReleaseForHooks(LPVOID pContext)
+        {
+            static_cast<ThreadRegistry*>(pContext)->Release();
+        }
+    };
+}
+
+// Global instance.
+static Utils::ThreadRegistry GThreadRegistry;
@@ -0,0 +1,437 @@
+// HookManager and SharedHookManager as the DLL builds them, over the POSIX backend and compat/Windows.h.
+
+#define ASI_LOG_FNAME "hook_manager_test.log"
+#define ASI_SIGCACHE_FNAME "hook_manager_test.sigcache"
+
+#include "utils/hook.h"
+#include "spi/shared_hook_manager.h"
+#include "tests/hook_targets.h"
+#include "tests/test.h"
+
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <sys/mman.h>
+
+
+static TargetFn volatile GTargets[2] = { Target<0>, Target<100> };
+
+// Not code, so creating a hook on it fails.
+static BYTE GNotCode[64];
+
+static char* Name(const char* name)
+{
+    return const_cast<char*>(name);
+}
+
+
+TEST(HookManagerInstallUninstall)
+{
+    CHECK_EQ(MH_Initialize(), MH_OK);
+    Utils::HookManager manager;
+
+    CHECK(manager.Install((LPVOID)Target<0>, GDetours[1], (LPVOID*)&GOriginals[1], Name("first")));
+    CHECK_EQ(GTargets[0](1, 1), Unhooked + 8);
+    CHECK_EQ(GOriginals[1](1, 1), Unhooked);
+
+    // The manager's hooks all share one identity, so there's one per target.
+    MH_STATUS status;
+    CHECK(!manager.Install((LPVOID)Target<0>, GDetours[2], (LPVOID*)&GOriginals[2], Name("second")));
+    CHECK(!manager.IsOK(status));
+    CHECK_EQ(status, MH_ERROR_ALREADY_CREATED);
+
+    CHECK(!manager.Install((LPVOID)GNotCode, GDetours[2], (LPVOID*)&GOriginals[2], Name("not code")));
+    CHECK_EQ(GTargets[0](1, 1), Unhooked + 8);
+
+    CHECK(manager.Uninstall((LPVOID)Target<0>));
+    CHECK(manager.IsOK(status));
+    CHECK_EQ(GTargets[0](1, 1), Unhooked);
+    CHECK(!manager.Uninstall((LPVOID)Target<0>));
+
+    CHECK_EQ(MH_Uninitialize(), MH_OK);
+}
+
+TEST(HookManagerBatchIsAllOrNothing)
+{
+    CHECK_EQ(MH_Initialize(), MH_OK);
+    Utils::HookManager manager;
+
+    Utils::HookRequest requests[] = {
+        { (LPVOID)Target<0>, GDetours[1], (LPVOID*)&GOriginals[1], "zero" },
+        { (LPVOID)Target<100>, GDetours[2], (LPVOID*)&GOriginals[2], "hundred" },
+    };
+    CHECK(manager.InstallBatch(requests, 2));
+    CHECK_EQ(GTargets[0](1, 1), Unhooked + 8);
+    CHECK_EQ(GTargets[1](1, 1), Unhooked + 100 + 64);
+    CHECK(manager.Uninstall((LPVOID)Target<0>));
+    CHECK(manager.Uninstall((LPVOID)Target<100>));
+
+    // The second hook can't be created: the first one is removed again, and its original reset.
+    Utils::HookRequest failing[] = {
+        { (LPVOID)Target<0>, GDetours[1], (LPVOID*)&GOriginals[1], "zero" },
+        { (LPVOID)GNotCode, GDetours[2], (LPVOID*)&GOriginals[2], "not code" },
+    };
+    CHECK(!manager.InstallBatch(failing, 2));
+    CHECK(GOriginals[1] == nullptr);
+    CHECK_EQ(GTargets[0](1, 1), Unhooked);
+    CHECK_EQ(MH_RemoveHook(nullptr, (LPVOID)Target<0>), MH_ERROR_NOT_CREATED);
+
+    CHECK_EQ(MH_Uninitialize(), MH_OK);
+}
+
+TEST(SharedHookManagerChainsByName)
+{
+    CHECK_EQ(MH_Initialize(), MH_OK);
+    SPI::SharedHookManager manager;
+
+    for (int i = 1; i <= 3; i++)
+    {
+        char name[] = "hook0";
+        name[4] += i;
+        CHECK(manager.Install((LPVOID)Target<0>, GDetours[i], (LPVOID*)&GOriginals[i], name));
+    }
+    CHECK_EQ(GTargets[0](1, 1), Unhooked + 8 + 64 + 512);
+    CHECK(manager.HookExists(Name("hook2")));
+
+    CHECK(!manager.Install((LPVOID)Target<100>, GDetours[1], (LPVOID*)&GOriginals[1], Name("hook1")));
+
+    CHECK(manager.Uninstall(Name("hook2")));
+    CHECK_EQ(GTargets[0](1, 1), Unhooked + 8 + 512);
+    CHECK(!manager.Uninstall(Name("hook2")));
+    CHECK(!manager.HookExists(Name("hook2")));
+
+    CHECK(manager.Uninstall(Name("hook1")));
+    CHECK(manager.Uninstall(Name("hook3")));
+    CHECK_EQ(GTargets[0](1, 1), Unhooked);
+
+    // A failed create puts the manager in bad status, it refuses anything from then on.
+    MH_STATUS status;
+    CHECK(!manager.Install((LPVOID)GNotCode, GDetours[1], (LPVOID*)&GOriginals[1], Name("not code")));
+    CHECK(!manager.IsOK(status));
+    CHECK_EQ(status, MH_ERROR_NOT_EXECUTABLE);
+    CHECK(!manager.Install((LPVOID)Target<0>, GDetours[1], (LPVOID*)&GOriginals[1], Name("hook1")));
+    CHECK_EQ(GTargets[0](1, 1), Unhooked);
+
+    CHECK_EQ(MH_Uninitialize(), MH_OK);
+}
+
+TEST(SharedHookManagerBatch)
+{
+    CHECK_EQ(MH_Initialize(), MH_OK);
+    SPI::SharedHookManager manager;
+
+    CHECK(!manager.QueueInstall((LPVOID)Target<0>, GDetours[1], (LPVOID*)&GOriginals[1], Name("one")));
+    CHECK(!manager.CommitBatch());
+
+    CHECK(manager.BeginBatch());
+    CHECK(!manager.BeginBatch());
+    CHECK(manager.QueueInstall((LPVOID)Target<0>, GDetours[1], (LPVOID*)&GOriginals[1], Name("one")));
+    CHECK(!manager.QueueInstall((LPVOID)Target<100>, GDetours[2], (LPVOID*)&GOriginals[2], Name("one")));
+    CHECK(manager.QueueInstall((LPVOID)Target<0>, GDetours[2], (LPVOID*)&GOriginals[2], Name("two")));
+    CHECK_EQ(GTargets[0](1, 1), Unhooked);
+    CHECK(manager.CommitBatch());
+    CHECK_EQ(GTargets[0](1, 1), Unhooked + 8 + 64);
+    CHECK(manager.HookExists(Name("one")));
+    CHECK(manager.HookExists(Name("two")));
+
+    // A name that's taken drops the whole batch.
+    CHECK(manager.BeginBatch());
+    CHECK(manager.QueueInstall((LPVOID)Target<100>, GDetours[3], (LPVOID*)&GOriginals[3], Name("three")));
+    CHECK(manager.QueueInstall((LPVOID)Target<100>, GDetours[1], (LPVOID*)&GOriginals[1], Name("one")));
+    CHECK(!manager.CommitBatch());
+    CHECK(!manager.HookExists(Name("three")));
+    CHECK_EQ(GTargets[1](1, 1), Unhooked + 100);
+
+    // So does a hook that can't be created, after the ones before it were.
+    CHECK(manager.BeginBatch());
+    CHECK(manager.QueueInstall((LPVOID)Target<100>, GDetours[3], (LPVOID*)&GOriginals[3], Name("three")));
+    CHECK(manager.QueueInstall((LPVOID)GNotCode, GDetours[1], (LPVOID*)&GOriginals[1], Name("not code")));
+    CHECK(!manager.CommitBatch());
+    CHECK(!manager.HookExists(Name("three")));
+    CHECK(GOriginals[3] == nullptr);
+    CHECK_EQ(GTargets[1](1, 1), Unhooked + 100);
+
+    CHECK(manager.BeginBatch());
+    CHECK(manager.QueueInstall((LPVOID)Target<100>, GDetours[3], (LPVOID*)&GOriginals[3], Name("three")));
+    CHECK(manager.AbortBatch());
+    CHECK(!manager.AbortBatch());
+    CHECK(!manager.CommitBatch());
+    CHECK_EQ(GTargets[1](1, 1), Unhooked + 100);
+
+    CHECK_EQ(MH_Uninitialize(), MH_OK);
+    CHECK_EQ(GTargets[0](1, 1), Unhooked);
+}
+
+// A vtable in read-only memory, like the game's after the loader is done with it.
+TEST(SharedHookManagerInstallSlot)
+{
+    CHECK_EQ(MH_Initialize(), MH_OK);
+    SPI::SharedHookManager manager;
+
+    auto page = static_cast<LPVOID*>(mmap(nullptr, 4096, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    CHECK(page != MAP_FAILED);
+    page[0] = (LPVOID)Target<0>;
+    page[1] = (LPVOID)GNotCode;
+    CHECK_EQ(mprotect(page, 4096, PROT_READ), 0);
+
+    auto call = [&]() { return reinterpret_cast<TargetFn>(*reinterpret_cast<LPVOID volatile*>(&page[0]))(1, 1); };
+
+    CHECK(manager.InstallSlot(&page[0], GDetours[1], (LPVOID*)&GOriginals[1], Name("slot")));
+    CHECK_EQ(call(), Unhooked + 8);
+    CHECK(GOriginals[1] == Target<0>);
+
+    // Chained onto the previous detour.
+    CHECK(manager.InstallSlot(&page[0], GDetours[2], (LPVOID*)&GOriginals[2], Name("slot2")));
+    CHECK_EQ(call(), Unhooked + 8 + 64);
+    CHECK(!manager.InstallSlot(&page[0], GDetours[3], (LPVOID*)&GOriginals[3], Name("slot2")));
+
+    // Only the last one in can be taken out.
+    CHECK(!manager.Uninstall(Name("slot")));
+    CHECK(manager.Uninstall(Name("slot2")));
+    CHECK(manager.Uninstall(Name("slot")));
+    CHECK_EQ(call(), Unhooked);
+
+    CHECK(!manager.InstallSlot(&page[1], GDetours[1], (LPVOID*)&GOriginals[1], Name("data")));
+
+    // The page got its protection back.
+    MEMORY_BASIC_INFORMATION mi;
+    CHECK(VirtualQuery(page, &mi, sizeof(mi)) != 0);
+    CHECK_EQ(mi.Protect, (DWORD)PAGE_READONLY);
+
+    munmap(page, 4096);
+    CHECK_EQ(MH_Uninitialize(), MH_OK);
+}
+
+// Called by the dispatcher, so with the Windows x64 convention.
+__attribute__((ms_abi, noinline, used)) static int MulticastTarget(int a, int b)
+{
+    int result = a * 3 + b;
+    GSink = result;
+    return result ^ GSink ^ result;
+}
+
+typedef int (__attribute__((ms_abi)) *MulticastTargetFn)(int, int);
+static MulticastTargetFn volatile GMulticastTarget = MulticastTarget;
+
+static void CODEGEN_CALL AddTenToFirst(Utils::MulticastContext* context, void*)
+{
+    context->IntArgs[0] += 10;
+}
+
+static void CODEGEN_CALL AddUserDataToResult(Utils::MulticastContext* context, void* userData)
+{
+    context->ReturnValue += reinterpret_cast<std::uintptr_t>(userData);
+}
+
+static void CODEGEN_CALL SkipOriginal(Utils::MulticastContext* context, void*)
+{
+    context->SkipOriginal = 1;
+    context->ReturnValue = 7;
+}
+
+TEST(SharedHookManagerSubscribe)
+{
+    CHECK_EQ(MH_Initialize(), MH_OK);
+    SPI::SharedHookManager manager;
+
+    CHECK(manager.Subscribe((LPVOID)MulticastTarget, AddTenToFirst, AddUserDataToResult, (void*)1000, 0, Name("sub")));
+    CHECK_EQ(GMulticastTarget(1, 1), 34 + 1000);
+    CHECK(!manager.Subscribe((LPVOID)MulticastTarget, nullptr, nullptr, nullptr, 0, Name("sub")));
+    CHECK(manager.SubscriptionExists(Name("sub")));
+
+    // Runs first, and the original is skipped for everyone; post callbacks still run.
+    CHECK(manager.Subscribe((LPVOID)MulticastTarget, SkipOriginal, nullptr, nullptr, 10, Name("skip")));
+    CHECK_EQ(GMulticastTarget(1, 1), 7 + 1000);
+
+    CHECK(manager.Unsubscribe(Name("skip")));
+    CHECK(!manager.Unsubscribe(Name("skip")));
+    CHECK_EQ(GMulticastTarget(1, 1), 34 + 1000);
+
+    CHECK(manager.Unsubscribe(Name("sub")));
+    CHECK_EQ(GMulticastTarget(1, 1), 4);
+
+    CHECK_EQ(MH_Uninitialize(), MH_OK);
+}
+
+// Inline hooks, slot hooks and subscriptions share one namespace, whichever way they are installed.
+TEST(SubscriptionNamesAreTaken)
+{
+    CHECK_EQ(MH_Initialize(), MH_OK);
+    SPI::SharedHookManager manager;
+
+    CHECK(manager.Subscribe((LPVOID)MulticastTarget, AddTenToFirst, nullptr, nullptr, 0, Name("taken")));
+    CHECK(!manager.Install((LPVOID)Target<0>, GDetours[1], (LPVOID*)&GOriginals[1], Name("taken")));
+    CHECK_EQ(GTargets[0](1, 1), Unhooked);
+
+    CHECK(manager.BeginBatch());
+    CHECK(manager.QueueInstall((LPVOID)Target<0>, GDetours[1], (LPVOID*)&GOriginals[1], Name("free")));
+    CHECK(manager.QueueInstall((LPVOID)Target<100>, GDetours[2], (LPVOID*)&GOriginals[2], Name("taken")));
+    CHECK(!manager.CommitBatch());
+    CHECK(!manager.HookExists(Name("free")));
+    CHECK_EQ(GTargets[0](1, 1), Unhooked);
+
+    CHECK(manager.Install((LPVOID)Target<0>, GDetours[1], (LPVOID*)&GOriginals[1], Name("hook")));
+    CHECK(!manager.Subscribe((LPVOID)MulticastTarget, AddTenToFirst, nullptr, nullptr, 0, Name("hook")));
+
+    CHECK_EQ(MH_Uninitialize(), MH_OK);
+}
+
+// Appends its digit to the first argument, so that the result spells the order the pre callbacks ran in.
+template <int N>
+static void CODEGEN_CALL AppendDigit(Utils::MulticastContext* context, void*)
+{
+    context->IntArgs[0] = context->IntArgs[0] * 10 + N;
+}
+
+TEST(MulticastOrderAndConcurrentChanges)
+{
+    CHECK_EQ(MH_Initialize(), MH_OK);
+    SPI::SharedHookManager manager;
+
+    CHECK(manager.Subscribe((LPVOID)MulticastTarget, AppendDigit<1>, nullptr, nullptr, 1, Name("one")));
+    CHECK(manager.Subscribe((LPVOID)MulticastTarget, AppendDigit<3>, nullptr, nullptr, 3, Name("three")));
+    CHECK(manager.Subscribe((LPVOID)MulticastTarget, AppendDigit<2>, nullptr, nullptr, 2, Name("two")));
+    CHECK_EQ(GMulticastTarget(0, 0), 321 * 3);
+
+    // Other threads call nonstop while subscriptions come and go: each call sees either snapshot, whole.
+    std::atomic<bool> stop{ false };
+    std::atomic<long> bad{ 0 };
+    std::vector<std::thread> workers;
+    for (int i = 0; i < 4; i++)
+    {
+        workers.emplace_back([&] {
+            while (!stop)
+            {
+                int result = GMulticastTarget(0, 0);
+                if (result != 321 * 3 && result != 3241 * 3)
+                {
+                    bad++;
+                }
+            }
+        });
+    }
+    for (int i = 0; i < 200; i++)
+    {
+        CHECK(manager.Subscribe((LPVOID)MulticastTarget, AppendDigit<4>, nullptr, nullptr, 2, Name("four")));
+        CHECK(manager.Unsubscribe(Name("four")));
+    }
+    stop = true;
+    for (auto& worker : workers)
+    {
+        worker.join();
+    }
+    CHECK_EQ(bad.load(), 0);
+
+    CHECK_EQ(MH_Uninitialize(), MH_OK);
+}
+
+static void CheckBytes(const Utils::CodeBuilder& code, std::size_t from, const std::vector<BYTE>& expected)
+{
+    CHECK_EQ(code.Size(), from + expected.size());
+    for (std::size_t i = 0; i < expected.size() && from + i < code.Size(); i++)
+    {
+        if (code.Bytes[from + i] != expected[i])
+        {
+            std::printf("  byte %zu: %02X, expected %02X\n", i, code.Bytes[from + i], expected[i]);
+        }
+        CHECK_EQ(code.Bytes[from + i], expected[i]);
+    }
+}
+
+// Unwind data as the Windows x64 unwinder reads it, for the dispatcher's prologue and for a smaller frame.
+TEST(UnwindInfoLayout)
+{
+    Utils::CodeBuilder code;
+    Utils::UnwindInfo unwind;
+    code.Emit({ 0x55 });                                        // push rbp
+    unwind.PushNonvol(code, Utils::UnwindInfo::Rbp);
+    code.Emit({ 0x48, 0x89, 0xE5 });                            // mov rbp, rsp
+    unwind.SetFrame(code, Utils::UnwindInfo::Rbp);
+    code.Emit({ 0x53 });                                        // push rbx
+    unwind.PushNonvol(code, Utils::UnwindInfo::Rbx);
+    code.Emit({ 0x56 });                                        // push rsi
+    unwind.PushNonvol(code, Utils::UnwindInfo::Rsi);
+    code.Emit({ 0x57 });                                        // push rdi
+    unwind.PushNonvol(code, Utils::UnwindInfo::Rdi);
+    code.Emit({ 0x41, 0x54 });                                  // push r12
+    unwind.PushNonvol(code, Utils::UnwindInfo::R12);
+    code.Emit({ 0x48, 0x81, 0xEC, 0xC0, 0x00, 0x00, 0x00 });    // sub rsp, 0C0h
+    unwind.Alloc(code, 0xC0);
+    unwind.EndPrologue(code);
+    code.Emit({ 0xC3 });                                        // ret
+
+    auto table = unwind.AppendTo(code);
+    CHECK_EQ(table, 20u);
+    CheckBytes(code, table, {
+        0x00, 0x00, 0x00, 0x00, 0x11, 0x00, 0x00, 0x00, 0x20, 0x00, 0x00, 0x00,     // code at 0 - 11h, unwind info at 20h
+        0x01, 0x10, 0x08, 0x05,                                                     // version 1, prologue 10h, 8 slots, rbp
+        0x10, 0x01, 0x18, 0x00,                                                     // 10h: alloc 0C0h
+        0x09, 0xC0,                                                                 // 09h: push r12
+        0x07, 0x70,                                                                 // 07h: push rdi
+        0x06, 0x60,                                                                 // 06h: push rsi
+        0x05, 0x30,                                                                 // 05h: push rbx
+        0x04, 0x03,                                                                 // 04h: rbp = rsp
+        0x01, 0x50,                                                                 // 01h: push rbp
+    });
+
+    // No frame register, a small allocation, and an odd count of slots.
+    Utils::CodeBuilder small;
+    Utils::UnwindInfo smallUnwind;
+    small.Emit({ 0x53 });                                       // push rbx
+    smallUnwind.PushNonvol(small, Utils::UnwindInfo::Rbx);
+    small.Emit({ 0x56 });                                       // push rsi
+    smallUnwind.PushNonvol(small, Utils::UnwindInfo::Rsi);
+    small.Emit({ 0x48, 0x83, 0xEC, 0x20 });                     // sub rsp, 20h
+    smallUnwind.Alloc(small, 0x20);
+    smallUnwind.EndPrologue(small);
+    small.Emit({ 0xC3 });                                       // ret
+
+    table = smallUnwind.AppendTo(small);
+    CHECK_EQ(table, 8u);
+    CheckBytes(small, table, {
+        0x00, 0x00, 0x00, 0x00, 0x07, 0x00, 0x00, 0x00, 0x14, 0x00, 0x00, 0x00,
+        0x01, 0x06, 0x03, 0x00,
+        0x06, 0x32,                                                                 // 06h: alloc 20h
+        0x02, 0x60,
+        0x01, 0x30,
+        0x00, 0x00,                                                                 // padding
+    });
+}
+
+// Last, since the profiler can't be turned off again.
+TEST(InstrumentedHooksAndDiscardedThunks)
+{
+    CHECK_EQ(MH_Initialize(), MH_OK);
+    SPI::SharedHookManager manager;
+    CHECK(GHookProfiler.Enable());
+
+    CHECK(manager.Install((LPVOID)Target<0>, GDetours[1], (LPVOID*)&GOriginals[1], Name("timed")));
+    for (int i = 0; i < 10; i++)
+    {
+        CHECK_EQ(GTargets[0](1, 1), Unhooked + 8);
+    }
+
+    Utils::HookStatsSnapshot stats;
+    CHECK(manager.GetStats(Name("timed"), &stats));
+    CHECK_EQ(stats.Calls, 10u);
+
+    // The thunk of a hook that failed to install is given back, so its id is the next one out.
+    SPI::SharedHookManager failing;
+    CHECK(!failing.Install((LPVOID)GNotCode, GDetours[2], (LPVOID*)&GOriginals[2], Name("not code")));
+    std::uint32_t id;
+    auto thunk = GHookProfiler.Instrument(GDetours[2], "probe", &id);
+    CHECK_EQ(id, 1u);
+    GHookProfiler.Discard(id, thunk);
+
+    CHECK(manager.Uninstall(Name("timed")));
+    CHECK_EQ(GTargets[0](1, 1), Unhooked);
+    CHECK_EQ(MH_Uninitialize(), MH_OK);
+}
+
+int main(int argc, char** argv)
+{
+    Utils::SetupOutput();
+    int result = Test::RunAll(argc, argv);
+    Utils::TeardownOutput();
+    return result;
+}
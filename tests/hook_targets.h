@@ -0,0 +1,29 @@
+#pragma once
+
+// Targets and detours shared by the hook tests: Target<N>(a, b) returns 3a + b + N, and detour N adds 8^N to
+// whatever the rest of the chain returns, so a result tells which detours ran.
+
+#define NOINLINE __attribute__((noinline, used))
+
+static volatile int GSink;
+
+template <int N>
+NOINLINE int Target(int a, int b)
+{
+    int result = a * 3 + b + N;
+    GSink = result;
+    return result ^ GSink ^ result;  // Same as result, but keeps the body longer than a patch.
+}
+
+typedef int (*TargetFn)(int, int);
+static TargetFn GOriginals[4];
+
+template <int N>
+NOINLINE int Detour(int a, int b)
+{
+    return GOriginals[N](a, b) + (1 << (N * 3));
+}
+
+static LPVOID GDetours[4] = { nullptr, (LPVOID)Detour<1>, (LPVOID)Detour<2>, (LPVOID)Detour<3> };
+
+static const int Unhooked = 4;  // Target<0>(1, 1)
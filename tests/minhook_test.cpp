@@ -0,0 +1,295 @@
+// Real hooks on real code through the POSIX backend: create, enable, chain, remove, and toggle under load.
+
+// Short enough for the tests to wait it out.
+#define RETIRED_BUFFER_GRACE_MS 20
+
+#include "minhook/include/MinHook.h"
+#include "tests/hook_targets.h"
+#include "tests/test.h"
+
+#include <atomic>
+#include <chrono>
+#include <dlfcn.h>
+#include <thread>
+#include <vector>
+
+
+static TargetFn volatile GTarget = Target<0>;
+
+typedef int (*AtoiFn)(const char*);
+static AtoiFn GOriginalAtoi;
+
+static int AtoiDetour(const char* text)
+{
+    return GOriginalAtoi(text) + 1000;
+}
+
+
+TEST(CreateEnableDisableRemove)
+{
+    CHECK_EQ(MH_Initialize(), MH_OK);
+
+    CHECK_EQ(MH_CreateHookEx(1, (LPVOID*)&GOriginals[1], GDetours[1], (LPVOID)Target<0>), MH_OK);
+    CHECK_EQ(GTarget(1, 1), Unhooked);
+
+    // The trampoline is built when the hook is enabled, on top of whatever else hooks the target by then.
+    CHECK_EQ(MH_EnableHookEx(1, (LPVOID)Target<0>), MH_OK);
+    CHECK_EQ(GTarget(1, 1), Unhooked + 8);
+    CHECK_EQ(GOriginals[1](1, 1), Unhooked);
+    CHECK_EQ(MH_EnableHookEx(1, (LPVOID)Target<0>), MH_ERROR_ENABLED);
+
+    CHECK_EQ(MH_DisableHookEx(1, (LPVOID)Target<0>), MH_OK);
+    CHECK_EQ(GTarget(1, 1), Unhooked);
+
+    CHECK_EQ(MH_EnableHookEx(1, (LPVOID)Target<0>), MH_OK);
+    CHECK_EQ(MH_RemoveHookEx(nullptr, 1, (LPVOID)Target<0>), MH_OK);
+    CHECK_EQ(GTarget(1, 1), Unhooked);
+    CHECK_EQ(MH_RemoveHookEx(nullptr, 1, (LPVOID)Target<0>), MH_ERROR_NOT_CREATED);
+
+    CHECK_EQ(MH_Uninitialize(), MH_OK);
+}
+
+TEST(ChainRemovedFromTheMiddle)
+{
+    CHECK_EQ(MH_Initialize(), MH_OK);
+
+    for (int i = 1; i <= 3; i++)
+    {
+        CHECK_EQ(MH_CreateHookEx(i, (LPVOID*)&GOriginals[i], GDetours[i], (LPVOID)Target<0>), MH_OK);
+        CHECK_EQ(MH_EnableHookEx(i, (LPVOID)Target<0>), MH_OK);
+    }
+    CHECK_EQ(GTarget(1, 1), Unhooked + 8 + 64 + 512);
+
+    ULONG_PTR idents[4] = {};
+    UINT count = 0;
+    CHECK_EQ(MH_EnumerateHooksOnTarget((LPVOID)Target<0>, idents, 4, &count), MH_OK);
+    CHECK_EQ(count, 3u);
+
+    CHECK_EQ(MH_RemoveHookEx(nullptr, 2, (LPVOID)Target<0>), MH_OK);
+    CHECK_EQ(GTarget(1, 1), Unhooked + 8 + 512);
+
+    CHECK_EQ(MH_DisableHookEx(3, (LPVOID)Target<0>), MH_OK);
+    CHECK_EQ(GTarget(1, 1), Unhooked + 8);
+
+    CHECK_EQ(MH_RemoveHookEx(nullptr, 1, (LPVOID)Target<0>), MH_OK);
+    CHECK_EQ(MH_RemoveHookEx(nullptr, 3, (LPVOID)Target<0>), MH_OK);
+    CHECK_EQ(GTarget(1, 1), Unhooked);
+
+    CHECK_EQ(MH_Uninitialize(), MH_OK);
+}
+
+TEST(QueuedEnableAppliesTogether)
+{
+    CHECK_EQ(MH_Initialize(), MH_OK);
+
+    for (int i = 1; i <= 2; i++)
+    {
+        CHECK_EQ(MH_CreateHookEx(i, (LPVOID*)&GOriginals[i], GDetours[i], (LPVOID)Target<0>), MH_OK);
+        CHECK_EQ(MH_QueueEnableHookEx(i, (LPVOID)Target<0>), MH_OK);
+    }
+    CHECK_EQ(GTarget(1, 1), Unhooked);
+    CHECK_EQ(MH_ApplyQueued(), MH_OK);
+    CHECK_EQ(GTarget(1, 1), Unhooked + 8 + 64);
+
+    CHECK_EQ(MH_Uninitialize(), MH_OK);
+    CHECK_EQ(GTarget(1, 1), Unhooked);
+}
+
+// Two callers queue their own hooks at the same time: each applies or drops only its own.
+TEST(InterleavedBatchesApplySeparately)
+{
+    CHECK_EQ(MH_Initialize(), MH_OK);
+
+    CHECK_EQ(MH_CreateHookEx(1, (LPVOID*)&GOriginals[1], GDetours[1], (LPVOID)Target<0>), MH_OK);
+    CHECK_EQ(MH_QueueEnableHookEx(1, (LPVOID)Target<0>), MH_OK);
+    CHECK_EQ(MH_CreateHookEx(2, (LPVOID*)&GOriginals[2], GDetours[2], (LPVOID)Target<0>), MH_OK);
+    CHECK_EQ(MH_QueueEnableHookEx(2, (LPVOID)Target<0>), MH_OK);
+
+    MH_HOOK_KEY second[] = { { 2, (LPVOID)Target<0> } };
+    CHECK_EQ(MH_ApplyQueuedEx(second, 1), MH_OK);
+    CHECK_EQ(GTarget(1, 1), Unhooked + 64);
+
+    // A failing batch drops its own queued changes, not the ones of the first caller.
+    CHECK_EQ(MH_CreateHookEx(3, (LPVOID*)&GOriginals[3], GDetours[3], (LPVOID)Target<0>), MH_OK);
+    CHECK_EQ(MH_QueueEnableHookEx(3, (LPVOID)Target<0>), MH_OK);
+    MH_HOOK_KEY failing[] = { { 3, (LPVOID)Target<0> }, { 4, (LPVOID)Target<0> } };
+    CHECK_EQ(MH_ApplyQueuedEx(failing, 2), MH_ERROR_NOT_CREATED);
+    CHECK_EQ(GTarget(1, 1), Unhooked + 64);
+
+    MH_HOOK_KEY first[] = { { 1, (LPVOID)Target<0> } };
+    CHECK_EQ(MH_ApplyQueuedEx(first, 1), MH_OK);
+    CHECK_EQ(GTarget(1, 1), Unhooked + 8 + 64);
+
+    // Hook 3's change was dropped, so there is nothing left in the queue.
+    CHECK_EQ(MH_ApplyQueued(), MH_OK);
+    CHECK_EQ(GTarget(1, 1), Unhooked + 8 + 64);
+
+    CHECK_EQ(MH_Uninitialize(), MH_OK);
+}
+
+// A detour that never calls the original, so its hook needs no ppOriginal.
+static int ReplacingDetour(int, int)
+{
+    return -1;
+}
+
+// Where the holder thread below picks the trampoline up from, cleared once it's in a register.
+static LPVOID volatile GHeldAddress;
+static volatile int GHolding;
+static volatile int GRelease;
+
+// The buffer of a removed hook is freed once its grace period is over, unless some thread still points into it.
+TEST(RetiredBufferIsFreed)
+{
+    CHECK_EQ(MH_Initialize(), MH_OK);
+
+    CHECK_EQ(MH_CreateHookEx(1, NULL, (LPVOID)ReplacingDetour, (LPVOID)Target<0>), MH_OK);
+    CHECK_EQ(MH_EnableHookEx(1, (LPVOID)Target<0>), MH_OK);
+    CHECK_EQ(GTarget(1, 1), -1);
+
+    // Another thread holds the trampoline in a register only, as a detour about to call it would.
+    GHeldAddress = g_hooks.pItems[FindHookEntry(1, (LPVOID)Target<0>)].pExecBuffer->trampoline;
+    GHolding = 0;
+    GRelease = 0;
+    std::thread holder([] {
+#if defined(__x86_64__)
+        __asm__ volatile(
+            "movq %0, %%rbx\n\t"
+            "movq $0, %0\n\t"
+            "movl $1, %1\n"
+            "1:\n\t"
+            "pause\n\t"
+            "cmpl $0, %2\n\t"
+            "je 1b\n\t"
+            : "+m"(GHeldAddress), "=m"(GHolding)
+            : "m"(GRelease)
+            : "rbx", "memory");
+#else
+        __asm__ volatile(
+            "movl %0, %%ebx\n\t"
+            "movl $0, %0\n\t"
+            "movl $1, %1\n"
+            "1:\n\t"
+            "pause\n\t"
+            "cmpl $0, %2\n\t"
+            "je 1b\n\t"
+            : "+m"(GHeldAddress), "=m"(GHolding)
+            : "m"(GRelease)
+            : "ebx", "memory");
+#endif
+    });
+    while (!GHolding)
+    {
+        std::this_thread::yield();
+    }
+
+    CHECK_EQ(MH_RemoveHookEx(nullptr, 1, (LPVOID)Target<0>), MH_OK);
+    CHECK_EQ(g_retired.size, 1u);
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(RETIRED_BUFFER_GRACE_MS * 2));
+    CHECK_EQ(MH_CreateHookEx(2, NULL, (LPVOID)ReplacingDetour, (LPVOID)Target<0>), MH_OK);
+    CHECK_EQ(g_retired.size, 1u);
+
+    GRelease = 1;
+    holder.join();
+
+    // Its grace period started over when it was found in use.
+    std::this_thread::sleep_for(std::chrono::milliseconds(RETIRED_BUFFER_GRACE_MS * 2));
+    CHECK_EQ(MH_RemoveHookEx(nullptr, 2, (LPVOID)Target<0>), MH_OK);
+    CHECK_EQ(g_retired.size, 0u);
+    CHECK_EQ(g_pinnedBuffers, 0u);
+
+    CHECK_EQ(MH_Uninitialize(), MH_OK);
+}
+
+// A trampoline handed out through ppOriginal is never reused, since a detour may call it at any time.
+TEST(SharedTrampolineIsPinned)
+{
+    CHECK_EQ(MH_Initialize(), MH_OK);
+
+    CHECK_EQ(MH_CreateHookEx(1, (LPVOID*)&GOriginals[1], GDetours[1], (LPVOID)Target<0>), MH_OK);
+    CHECK_EQ(MH_EnableHookEx(1, (LPVOID)Target<0>), MH_OK);
+    CHECK_EQ(GTarget(1, 1), Unhooked + 8);
+
+    CHECK_EQ(MH_RemoveHookEx(nullptr, 1, (LPVOID)Target<0>), MH_OK);
+    CHECK_EQ(g_retired.size, 0u);
+    CHECK_EQ(g_pinnedBuffers, 1u);
+
+    // Neither the grace period nor new hooks on the same target give its slot away.
+    std::this_thread::sleep_for(std::chrono::milliseconds(RETIRED_BUFFER_GRACE_MS * 2));
+    CHECK_EQ(MH_CreateHookEx(2, (LPVOID*)&GOriginals[2], GDetours[2], (LPVOID)Target<0>), MH_OK);
+    CHECK_EQ(MH_EnableHookEx(2, (LPVOID)Target<0>), MH_OK);
+    CHECK_EQ(GTarget(1, 1), Unhooked + 64);
+    CHECK_EQ(GOriginals[1](1, 1), Unhooked);
+    CHECK_EQ(Detour<1>(1, 1), Unhooked + 8);
+
+    // A hook that was never enabled can't have been called, its buffer goes straight back.
+    CHECK_EQ(MH_CreateHookEx(3, (LPVOID*)&GOriginals[3], GDetours[3], (LPVOID)Target<0>), MH_OK);
+    CHECK_EQ(MH_RemoveHookEx(nullptr, 3, (LPVOID)Target<0>), MH_OK);
+    CHECK_EQ(g_pinnedBuffers, 1u);
+    CHECK_EQ(g_retired.size, 0u);
+
+    CHECK_EQ(MH_Uninitialize(), MH_OK);
+    CHECK_EQ(g_pinnedBuffers, 0u);
+}
+
+// A libc function, in a library mapped far away from the test's own image.
+TEST(HookSharedLibraryFunction)
+{
+    CHECK_EQ(MH_Initialize(), MH_OK);
+
+    AtoiFn atoiPtr = (AtoiFn)dlsym(RTLD_DEFAULT, "atoi");
+    CHECK(atoiPtr != nullptr);
+    CHECK_EQ(MH_CreateHook((LPVOID)atoiPtr, (LPVOID)AtoiDetour, (LPVOID*)&GOriginalAtoi), MH_OK);
+    CHECK_EQ(MH_EnableHook((LPVOID)atoiPtr), MH_OK);
+    CHECK_EQ(atoiPtr("42"), 1042);
+    CHECK_EQ(MH_RemoveHook(nullptr, (LPVOID)atoiPtr), MH_OK);
+    CHECK_EQ(atoiPtr("42"), 42);
+
+    CHECK_EQ(MH_Uninitialize(), MH_OK);
+}
+
+// Other threads call the target nonstop while it is patched and unpatched: each call must see the hook or not, never a torn patch.
+TEST(ToggleUnderLoad)
+{
+    CHECK_EQ(MH_Initialize(), MH_OK);
+
+    std::atomic<bool> stop{ false };
+    std::atomic<long> calls{ 0 };
+    std::atomic<long> bad{ 0 };
+    std::vector<std::thread> workers;
+    for (int i = 0; i < 4; i++)
+    {
+        workers.emplace_back([&] {
+            long count = 0;
+            while (!stop)
+            {
+                int result = GTarget(1, 1);
+                if (result != Unhooked && result != Unhooked + 8)
+                {
+                    bad++;
+                }
+                count++;
+            }
+            calls += count;
+        });
+    }
+
+    CHECK_EQ(MH_CreateHookEx(1, (LPVOID*)&GOriginals[1], GDetours[1], (LPVOID)Target<0>), MH_OK);
+    for (int i = 0; i < 50; i++)
+    {
+        CHECK_EQ(MH_EnableHookEx(1, (LPVOID)Target<0>), MH_OK);
+        CHECK_EQ(MH_DisableHookEx(1, (LPVOID)Target<0>), MH_OK);
+    }
+    stop = true;
+    for (auto& worker : workers)
+    {
+        worker.join();
+    }
+
+    CHECK(calls.load() > 0);
+    CHECK_EQ(bad.load(), 0);
+    CHECK_EQ(MH_Uninitialize(), MH_OK);
+}
+
+TEST_MAIN()
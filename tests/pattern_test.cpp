@@ -0,0 +1,290 @@
+// The PEiD-style pattern parser: every token form, the error cases, and a seeded fuzz run against a reference tokenizer.
+
+#include "src/utils/pattern.h"
+#include "tests/test.h"
+
+#include <cctype>
+#include <random>
+#include <string>
+#include <vector>
+
+
+using Utils::PatternParseResult;
+
+// Parsed into buffers followed by canaries, so that a write past capacity shows up.
+struct Parsed
+{
+    static constexpr std::uint8_t Canary = 0xA5;
+
+    PatternParseResult Result;
+    std::vector<std::uint8_t> Bytes;
+    std::vector<std::uint8_t> Masks;
+    std::size_t Length = 0;
+    bool Overrun = false;
+
+    Parsed(std::string_view text, std::size_t capacity)
+    {
+        std::vector<std::uint8_t> bytes(capacity + 8, Canary), masks(capacity + 8, Canary);
+        Result = Utils::ParsePattern(text, bytes.data(), masks.data(), capacity, &Length);
+        for (std::size_t i = capacity; i < bytes.size(); i++)
+        {
+            Overrun |= bytes[i] != Canary || masks[i] != Canary;
+        }
+        if (Result == PatternParseResult::Success)
+        {
+            Bytes.assign(bytes.begin(), bytes.begin() + Length);
+            Masks.assign(masks.begin(), masks.begin() + Length);
+        }
+    }
+
+    explicit Parsed(std::string_view text)
+        : Parsed(text, Utils::PatternStorageSize(text) / 2)
+    {
+    }
+};
+
+
+// Compile-time parsing, which is what the game patterns in src/conf/patterns.h rely on.
+constexpr auto GStatic = Utils::MakePattern("48 8B ?? 4? ?F 40:F8");
+static_assert(GStatic.Length == 6, "");
+static_assert(GStatic.Bytes[0] == 0x48 && GStatic.Masks[0] == 0xFF, "");
+static_assert(GStatic.Masks[2] == 0x00, "");
+static_assert(GStatic.Bytes[3] == 0x40 && GStatic.Masks[3] == 0xF0, "");
+static_assert(GStatic.Bytes[4] == 0x0F && GStatic.Masks[4] == 0x0F, "");
+static_assert(GStatic.Bytes[5] == 0x40 && GStatic.Masks[5] == 0xF8, "");
+static_assert(GStatic.Masks[GStatic.AnchorA] == 0xFF && GStatic.Masks[GStatic.AnchorB] == 0xFF, "");
+
+
+TEST(TokenForms)
+{
+    Parsed p("48 8b ?? ? 4? ?F 47:F8\t00");
+    CHECK_EQ(p.Result, PatternParseResult::Success);
+    CHECK_EQ(p.Length, 8u);
+
+    const std::uint8_t bytes[] = { 0x48, 0x8B, 0x00, 0x00, 0x40, 0x0F, 0x40, 0x00 };
+    const std::uint8_t masks[] = { 0xFF, 0xFF, 0x00, 0x00, 0xF0, 0x0F, 0xF8, 0xFF };
+    for (std::size_t i = 0; i < p.Length && i < 8; i++)
+    {
+        CHECK_EQ(p.Bytes[i], bytes[i]);
+        CHECK_EQ(p.Masks[i], masks[i]);
+    }
+}
+
+TEST(SeparatorsAreSkipped)
+{
+    Parsed p("  \t48   8B\t\t");
+    CHECK_EQ(p.Result, PatternParseResult::Success);
+    CHECK_EQ(p.Length, 2u);
+}
+
+TEST(Errors)
+{
+    CHECK_EQ(Parsed("").Result, PatternParseResult::Empty);
+    CHECK_EQ(Parsed(" \t ").Result, PatternParseResult::Empty);
+
+    for (const char* bad : { "4", "488B", "4G", "??? ", "48 ?:FF", "48:F", "48:FFF", "4?:F0", "48:?F", "48,8B", "48\n8B", "xx" })
+    {
+        Parsed p(bad);
+        if (p.Result != PatternParseResult::BadToken)
+        {
+            std::printf("  accepted \"%s\"\n", bad);
+        }
+        CHECK_EQ(p.Result, PatternParseResult::BadToken);
+    }
+}
+
+TEST(CapacityIsRespected)
+{
+    Parsed fits("48 8B 55", 3);
+    CHECK_EQ(fits.Result, PatternParseResult::Success);
+    CHECK(!fits.Overrun);
+
+    Parsed tooLong("48 8B 55 56", 3);
+    CHECK_EQ(tooLong.Result, PatternParseResult::TooLong);
+    CHECK(!tooLong.Overrun);
+
+    // Without buffers the bytes are only counted.
+    std::size_t length = 0;
+    CHECK_EQ(Utils::ParsePattern("48 ?? 55 56", nullptr, nullptr, 0, &length), PatternParseResult::Success);
+    CHECK_EQ(length, 4u);
+}
+
+TEST(ParsePatternView)
+{
+    std::string text = "?? 48 8B ?? E8";
+    std::vector<std::uint8_t> storage(Utils::PatternStorageSize(text));
+    Utils::PatternView view{};
+    CHECK_EQ(Utils::ParsePatternView(text, storage.data(), storage.size(), &view), PatternParseResult::Success);
+    CHECK_EQ(view.Length, 5u);
+    CHECK_EQ(view.Masks[view.AnchorA], 0xFF);
+    CHECK_EQ(view.Masks[view.AnchorB], 0xFF);
+    CHECK(view.AnchorA != view.AnchorB);
+
+    CHECK_EQ(Utils::ParsePatternView(text, storage.data(), storage.size() - 1, &view), PatternParseResult::TooLong);
+    CHECK_EQ(Utils::ParsePatternView("?? 4G", storage.data(), storage.size(), &view), PatternParseResult::BadToken);
+}
+
+
+// Fuzzing.
+// ======================================================================
+
+static bool IsHex(char c)
+{
+    return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F');
+}
+
+// What ParsePattern should answer, written from its documented grammar only.
+static PatternParseResult ReferenceResult(const std::string& text, std::size_t* outLength)
+{
+    std::size_t count = 0;
+    std::size_t i = 0;
+    while (i < text.size())
+    {
+        if (text[i] == ' ' || text[i] == '\t')
+        {
+            i++;
+            continue;
+        }
+        std::string token;
+        while (i < text.size() && text[i] != ' ' && text[i] != '\t')
+        {
+            token += text[i++];
+        }
+
+        bool valid = token == "?"
+            || (token.size() == 2 && (IsHex(token[0]) || token[0] == '?') && (IsHex(token[1]) || token[1] == '?'))
+            || (token.size() == 5 && token[2] == ':' && IsHex(token[0]) && IsHex(token[1]) && IsHex(token[3]) && IsHex(token[4]));
+        if (!valid)
+        {
+            return PatternParseResult::BadToken;
+        }
+        count++;
+    }
+
+    *outLength = count;
+    return count == 0 ? PatternParseResult::Empty : PatternParseResult::Success;
+}
+
+// Any string over the pattern alphabet: same verdict as the reference, and never a write past the buffers.
+TEST(FuzzRandomText)
+{
+    static const char alphabet[] = "0123456789abcdefABCDEF??::  \tgx";
+    std::mt19937 rng(7);
+
+    for (int round = 0; round < 200000; round++)
+    {
+        std::string text(std::uniform_int_distribution<int>(0, 24)(rng), ' ');
+        for (auto& c : text)
+        {
+            c = alphabet[rng() % (sizeof(alphabet) - 1)];
+        }
+
+        std::size_t expectedLength = 0;
+        auto expected = ReferenceResult(text, &expectedLength);
+        Parsed p(text);
+        if (p.Result != expected || p.Overrun || (expected == PatternParseResult::Success && p.Length != expectedLength))
+        {
+            std::printf("  \"%s\": result %d, length %zu, overrun %d\n", text.c_str(), (int)p.Result, p.Length, (int)p.Overrun);
+            CHECK_EQ(p.Result, expected);
+            CHECK(!p.Overrun);
+            return;
+        }
+
+        // One byte less room than it needs is too long, never an overrun.
+        if (expected == PatternParseResult::Success)
+        {
+            Parsed short_(text, expectedLength - 1);
+            CHECK_EQ(short_.Result, PatternParseResult::TooLong);
+            CHECK(!short_.Overrun);
+        }
+    }
+}
+
+static std::string Hex(std::uint8_t value)
+{
+    static const char digits[] = "0123456789ABCDEF";
+    return { digits[value >> 4], digits[value & 15] };
+}
+
+// Random patterns written out in any of the token forms that can express them, then parsed back.
+TEST(FuzzRoundTrip)
+{
+    std::mt19937 rng(11);
+
+    for (int round = 0; round < 50000; round++)
+    {
+        std::size_t length = std::uniform_int_distribution<std::size_t>(1, 40)(rng);
+        std::vector<std::uint8_t> bytes(length), masks(length);
+        std::string text;
+
+        for (std::size_t i = 0; i < length; i++)
+        {
+            std::uint8_t value = static_cast<std::uint8_t>(rng());
+            std::uint8_t mask;
+            std::string token;
+            switch (rng() % 5)
+            {
+            case 0:
+                mask = 0x00;
+                token = rng() % 2 ? "??" : "?";
+                break;
+            case 1:
+                mask = 0xF0;
+                token = Hex(value).substr(0, 1) + "?";
+                break;
+            case 2:
+                mask = 0x0F;
+                token = "?" + Hex(value).substr(1, 1);
+                break;
+            case 3:
+                mask = static_cast<std::uint8_t>(rng());
+                token = Hex(value) + ":" + Hex(mask);
+                break;
+            default:
+                mask = 0xFF;
+                token = Hex(value);
+                if (rng() % 2)
+                {
+                    for (auto& c : token)
+                    {
+                        c = static_cast<char>(std::tolower(c));
+                    }
+                }
+                break;
+            }
+
+            bytes[i] = value & mask;
+            masks[i] = mask;
+            text += std::string(rng() % 3 == 0 ? " \t" : " ") + token;
+        }
+
+        std::vector<std::uint8_t> storage(Utils::PatternStorageSize(text));
+        Utils::PatternView view{};
+        auto rc = Utils::ParsePatternView(text, storage.data(), storage.size(), &view);
+        bool same = rc == PatternParseResult::Success && view.Length == length;
+        for (std::size_t i = 0; same && i < length; i++)
+        {
+            same = (view.Bytes[i] & view.Masks[i]) == bytes[i] && view.Masks[i] == masks[i];
+        }
+        if (!same)
+        {
+            std::printf("  \"%s\" did not parse back\n", text.c_str());
+            CHECK(same);
+            return;
+        }
+
+        // Anchors are fully fixed bytes whenever the pattern has any.
+        bool anyFixed = false;
+        for (auto mask : masks)
+        {
+            anyFixed |= mask == 0xFF;
+        }
+        if (anyFixed)
+        {
+            CHECK_EQ(view.Masks[view.AnchorA], 0xFF);
+            CHECK_EQ(view.Masks[view.AnchorB], 0xFF);
+        }
+    }
+}
+
+TEST_MAIN()
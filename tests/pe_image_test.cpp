@@ -0,0 +1,421 @@
+// The PE reader on a synthetic image built here, as a file and as mapped by a loader, in PE32+ and PE32,
+// and on every truncation of it.
+
+#include "src/utils/pe_image.h"
+#include "tests/test.h"
+
+#include <string>
+#include <sys/mman.h>
+#include <unistd.h>
+
+
+// Layout of the test image. Sections are 0x1000-aligned in memory and 0x200-aligned in the file.
+//   .text   RVA 0x1000, file 0x400, code.
+//   .rdata  RVA 0x2000, file 0x600: import descriptors, names, lookup tables, address tables, .pdata and unwind info.
+//   .data   RVA 0x3000, file 0xC00, with more virtual than raw size.
+static constexpr std::uint32_t NtOffset = 0x80;
+static constexpr std::uint32_t TimeStamp = 0x5F3E2A10;
+static constexpr std::uint32_t CheckSum = 0x0001F00D;
+static constexpr std::uint32_t ImageSize = 0x4000;
+
+static constexpr std::uint32_t ImportRva = 0x2000;
+static constexpr std::uint32_t Kernel32IatRva = 0x2300;
+static constexpr std::uint32_t User32IatRva = 0x2340;
+static constexpr std::uint32_t PdataRva = 0x2400;
+static constexpr std::uint32_t PdataSize = 4 * 12;
+
+static constexpr std::uint64_t ResolvedAddress = 0x7FF612340000ull;
+
+class TestImage
+{
+private:
+    std::vector<std::uint8_t> file_;
+    bool is64_;
+
+    template <typename T>
+    void put_(std::size_t offset, T value)
+    {
+        std::memcpy(&file_[offset], &value, sizeof(T));
+    }
+
+    void putString_(std::size_t offset, const char* text)
+    {
+        std::memcpy(&file_[offset], text, std::strlen(text) + 1);
+    }
+
+    void putThunk_(std::size_t offset, std::uint64_t value)
+    {
+        if (is64_)
+        {
+            put_<std::uint64_t>(offset, value);
+        }
+        else
+        {
+            put_<std::uint32_t>(offset, static_cast<std::uint32_t>(value));
+        }
+    }
+
+    // File offset of an RVA in .rdata.
+    static std::size_t rdata_(std::uint32_t rva)
+    {
+        return rva - 0x2000 + 0x600;
+    }
+
+    void putSection_(std::size_t offset, const char* name, std::uint32_t rva, std::uint32_t virtualSize, std::uint32_t rawOffset, std::uint32_t rawSize, std::uint32_t characteristics)
+    {
+        std::memcpy(&file_[offset], name, std::strlen(name));
+        put_<std::uint32_t>(offset + 0x08, virtualSize);
+        put_<std::uint32_t>(offset + 0x0C, rva);
+        put_<std::uint32_t>(offset + 0x10, rawSize);
+        put_<std::uint32_t>(offset + 0x14, rawOffset);
+        put_<std::uint32_t>(offset + 0x24, characteristics);
+    }
+
+public:
+    explicit TestImage(bool is64)
+        : file_(0xE00, 0), is64_(is64)
+    {
+        const std::uint64_t ordinalFlag = is64 ? 0x8000000000000000ull : 0x80000000ull;
+        const std::uint32_t thunkSize = is64 ? 8 : 4;
+        const std::uint16_t optionalSize = is64 ? 0xF0 : 0xE0;
+        const std::size_t optional = NtOffset + 0x18;
+        const std::size_t directories = optional + (is64 ? 0x70 : 0x60);
+
+        put_<std::uint16_t>(0x00, 0x5A4D);
+        put_<std::uint32_t>(0x3C, NtOffset);
+
+        put_<std::uint32_t>(NtOffset, 0x00004550);
+        put_<std::uint16_t>(NtOffset + 0x04, is64 ? 0x8664 : 0x014C);
+        put_<std::uint16_t>(NtOffset + 0x06, 3);
+        put_<std::uint32_t>(NtOffset + 0x08, TimeStamp);
+        put_<std::uint16_t>(NtOffset + 0x14, optionalSize);
+
+        put_<std::uint16_t>(optional, is64 ? 0x20B : 0x10B);
+        put_<std::uint32_t>(optional + 0x38, ImageSize);
+        put_<std::uint32_t>(optional + 0x40, CheckSum);
+        put_<std::uint32_t>(directories - 4, 16);
+        put_<std::uint32_t>(directories + Utils::PE_DIRECTORY_IMPORT * 8, ImportRva);
+        put_<std::uint32_t>(directories + Utils::PE_DIRECTORY_IMPORT * 8 + 4, 3 * 20);
+        put_<std::uint32_t>(directories + Utils::PE_DIRECTORY_EXCEPTION * 8, PdataRva);
+        put_<std::uint32_t>(directories + Utils::PE_DIRECTORY_EXCEPTION * 8 + 4, PdataSize);
+
+        std::size_t sections = optional + optionalSize;
+        putSection_(sections + 0 * 40, ".text", 0x1000, 0x40, 0x400, 0x200, Utils::PE_SCN_CNT_CODE | Utils::PE_SCN_MEM_EXECUTE | Utils::PE_SCN_MEM_READ);
+        putSection_(sections + 1 * 40, ".rdata", 0x2000, 0x600, 0x600, 0x600, Utils::PE_SCN_MEM_READ);
+        putSection_(sections + 2 * 40, ".data", 0x3000, 0x800, 0xC00, 0x200, Utils::PE_SCN_MEM_READ | Utils::PE_SCN_MEM_WRITE);
+
+        // .text: a recognizable byte run.
+        for (std::size_t i = 0; i < 0x40; i++)
+        {
+            file_[0x400 + i] = static_cast<std::uint8_t>(0x90 + i);
+        }
+
+        // Imports: GetProcAddress from KERNEL32.dll; an ordinal, CreateWindowExW and MessageBoxW from USER32.dll.
+        put_<std::uint32_t>(rdata_(ImportRva) + 0x00, 0x2200);
+        put_<std::uint32_t>(rdata_(ImportRva) + 0x0C, 0x2100);
+        put_<std::uint32_t>(rdata_(ImportRva) + 0x10, Kernel32IatRva);
+        put_<std::uint32_t>(rdata_(ImportRva) + 20 + 0x00, 0x2240);
+        put_<std::uint32_t>(rdata_(ImportRva) + 20 + 0x0C, 0x2110);
+        put_<std::uint32_t>(rdata_(ImportRva) + 20 + 0x10, User32IatRva);
+
+        putString_(rdata_(0x2100), "KERNEL32.dll");
+        putString_(rdata_(0x2110), "USER32.dll");
+        putString_(rdata_(0x2120 + 2), "GetProcAddress");
+        putString_(rdata_(0x2140 + 2), "CreateWindowExW");
+        putString_(rdata_(0x2160 + 2), "MessageBoxW");
+
+        const std::uint64_t kernel32[] = { 0x2120 };
+        const std::uint64_t user32[] = { ordinalFlag | 5, 0x2140, 0x2160 };
+        for (std::uint32_t i = 0; i < 1; i++)
+        {
+            putThunk_(rdata_(0x2200) + i * thunkSize, kernel32[i]);
+            putThunk_(rdata_(Kernel32IatRva) + i * thunkSize, kernel32[i]);
+        }
+        for (std::uint32_t i = 0; i < 3; i++)
+        {
+            putThunk_(rdata_(0x2240) + i * thunkSize, user32[i]);
+            putThunk_(rdata_(User32IatRva) + i * thunkSize, user32[i]);
+        }
+
+        // .pdata: two function starts, a chained part, and an entry pointing to another entry.
+        const std::uint32_t pdata[][3] = {
+            { 0x1000, 0x1010, 0x2500 },
+            { 0x1010, 0x1020, 0x2510 },
+            { 0x1020, 0x1030, PdataRva | 1 },
+            { 0x1030, 0x1040, 0x2500 },
+        };
+        for (std::size_t i = 0; i < 4; i++)
+        {
+            for (std::size_t j = 0; j < 3; j++)
+            {
+                put_<std::uint32_t>(rdata_(PdataRva) + i * 12 + j * 4, pdata[i][j]);
+            }
+        }
+        file_[rdata_(0x2500)] = 0x01;                   // Version 1, no flags.
+        file_[rdata_(0x2510)] = 0x01 | (0x04 << 3);     // Version 1, UNW_FLAG_CHAININFO.
+    }
+
+    std::vector<std::uint8_t>& File()
+    {
+        return file_;
+    }
+
+    // As a loader maps it: headers, then each section at its RVA, with the address tables resolved.
+    std::vector<std::uint8_t> Mapped() const
+    {
+        std::vector<std::uint8_t> mapped(ImageSize, 0);
+        std::copy(file_.begin(), file_.begin() + 0x400, mapped.begin());
+        std::copy(file_.begin() + 0x400, file_.begin() + 0x600, mapped.begin() + 0x1000);
+        std::copy(file_.begin() + 0x600, file_.begin() + 0xC00, mapped.begin() + 0x2000);
+        std::copy(file_.begin() + 0xC00, file_.begin() + 0xE00, mapped.begin() + 0x3000);
+
+        std::size_t thunkSize = is64_ ? 8 : 4;
+        std::memcpy(&mapped[Kernel32IatRva], &ResolvedAddress, thunkSize);
+        for (std::size_t i = 0; i < 3; i++)
+        {
+            std::memcpy(&mapped[User32IatRva + i * thunkSize], &ResolvedAddress, thunkSize);
+        }
+        return mapped;
+    }
+};
+
+// A copy right before an inaccessible page, so that reading past the end faults.
+class GuardedCopy
+{
+private:
+    std::size_t mapped_;
+    std::uint8_t* base_;
+
+public:
+    const std::uint8_t* Data;
+
+    explicit GuardedCopy(const std::vector<std::uint8_t>& bytes, std::size_t size)
+    {
+        std::size_t page = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+        mapped_ = (size + page - 1) / page * page + page;
+        base_ = static_cast<std::uint8_t*>(mmap(nullptr, mapped_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+        mprotect(base_ + mapped_ - page, page, PROT_NONE);
+        auto start = base_ + mapped_ - page - size;
+        std::memcpy(start, bytes.data(), size);
+        Data = start;
+    }
+
+    ~GuardedCopy()
+    {
+        munmap(base_, mapped_);
+    }
+};
+
+
+static void CheckHeaders(const Utils::PeImage& image, bool is64)
+{
+    CHECK_EQ(image.Is64(), is64);
+    CHECK_EQ(image.Machine(), is64 ? 0x8664 : 0x014C);
+    CHECK_EQ(image.TimeDateStamp(), TimeStamp);
+    CHECK_EQ(image.SizeOfImage(), ImageSize);
+    CHECK_EQ(image.CheckSum(), CheckSum);
+
+    CHECK_EQ(image.Sections().size(), 3u);
+    auto text = image.FindSection(".text");
+    CHECK(text != nullptr);
+    CHECK(text && text->IsExecutable());
+    CHECK(text && std::string(text->Name) == ".text");
+    auto data = image.FindSection(".data");
+    CHECK(data && !data->IsExecutable());
+    CHECK(data && data->VirtualSize == 0x800 && data->RawSize == 0x200);
+    CHECK(image.FindSection(".reloc") == nullptr);
+}
+
+TEST(ParsesFileAndMappedHeaders)
+{
+    for (bool is64 : { true, false })
+    {
+        TestImage test(is64);
+        auto mapped = test.Mapped();
+
+        Utils::PeImage file, image;
+        CHECK(file.Parse(test.File().data(), test.File().size(), Utils::PeLayout::File));
+        CheckHeaders(file, is64);
+        CHECK(image.Parse(mapped.data(), mapped.size(), Utils::PeLayout::Mapped));
+        CheckHeaders(image, is64);
+    }
+}
+
+TEST(RvaToOffsetAndSectionBytes)
+{
+    TestImage test(true);
+    auto mapped = test.Mapped();
+    Utils::PeImage file, image;
+    CHECK(file.Parse(test.File().data(), test.File().size(), Utils::PeLayout::File));
+    CHECK(image.Parse(mapped.data(), mapped.size(), Utils::PeLayout::Mapped));
+
+    std::size_t offset = 0;
+    CHECK(file.RvaToOffset(0x1008, &offset));
+    CHECK_EQ(offset, 0x408u);
+    CHECK(file.RvaToOffset(0x2100, &offset));
+    CHECK_EQ(offset, 0x700u);
+    CHECK(!file.RvaToOffset(0x3400, &offset));     // Past the raw bytes of .data.
+    CHECK(!file.RvaToOffset(0x0800, &offset));     // Between the headers and the first section.
+    CHECK(image.RvaToOffset(0x3400, &offset));
+    CHECK_EQ(offset, 0x3400u);
+    CHECK(!image.RvaToOffset(ImageSize, &offset));
+
+    // The same code bytes either way, the file's cut to the raw size and the image's to the virtual size.
+    const std::uint8_t* start = nullptr;
+    const std::uint8_t* end = nullptr;
+    CHECK(file.SectionBytes(*file.FindSection(".text"), &start, &end));
+    CHECK_EQ(end - start, 0x200);
+    CHECK_EQ(start[5], 0x95);
+    CHECK(image.SectionBytes(*image.FindSection(".text"), &start, &end));
+    CHECK_EQ(end - start, 0x40);
+    CHECK_EQ(start[5], 0x95);
+    CHECK(image.SectionBytes(*image.FindSection(".data"), &start, &end));
+    CHECK_EQ(end - start, 0x800);
+
+    // Clamped to the buffer.
+    Utils::PeImage cut;
+    CHECK(cut.Parse(test.File().data(), 0x500, Utils::PeLayout::File));
+    CHECK(cut.SectionBytes(*cut.FindSection(".text"), &start, &end));
+    CHECK_EQ(end - start, 0x100);
+    CHECK(!cut.SectionBytes(*cut.FindSection(".rdata"), &start, &end));
+}
+
+TEST(DataDirectory)
+{
+    TestImage test(true);
+    Utils::PeImage file;
+    CHECK(file.Parse(test.File().data(), test.File().size(), Utils::PeLayout::File));
+
+    std::uint32_t rva = 0, size = 0;
+    CHECK(file.DataDirectory(Utils::PE_DIRECTORY_EXCEPTION, &rva, &size));
+    CHECK_EQ(rva, PdataRva);
+    CHECK_EQ(size, PdataSize);
+    CHECK(!file.DataDirectory(0, &rva, &size));     // Present but empty.
+    CHECK(!file.DataDirectory(16, &rva, &size));    // Past NumberOfRvaAndSizes.
+}
+
+TEST(ReadFunctions)
+{
+    TestImage test(true);
+    auto mapped = test.Mapped();
+
+    for (auto layout : { Utils::PeLayout::File, Utils::PeLayout::Mapped })
+    {
+        auto& bytes = layout == Utils::PeLayout::File ? test.File() : mapped;
+        Utils::PeImage image;
+        CHECK(image.Parse(bytes.data(), bytes.size(), layout));
+
+        // The chained part and the entry pointing to another entry are left out.
+        std::vector<Utils::PeFunction> functions;
+        CHECK(image.ReadFunctions(functions));
+        CHECK_EQ(functions.size(), 2u);
+        CHECK(functions.size() == 2 && functions[0].Begin == 0x1000 && functions[0].End == 0x1010);
+        CHECK(functions.size() == 2 && functions[1].Begin == 0x1030 && functions[1].End == 0x1040);
+    }
+
+    // An unsorted table is taken for garbage.
+    auto scrambled = test.File();
+    std::swap_ranges(scrambled.begin() + 0xA00, scrambled.begin() + 0xA00 + 12, scrambled.begin() + 0xA00 + 36);
+    Utils::PeImage image;
+    std::vector<Utils::PeFunction> functions;
+    CHECK(image.Parse(scrambled.data(), scrambled.size(), Utils::PeLayout::File));
+    CHECK(!image.ReadFunctions(functions));
+    CHECK(functions.empty());
+
+    // PE32 images have no .pdata of this kind.
+    TestImage test32(false);
+    CHECK(image.Parse(test32.File().data(), test32.File().size(), Utils::PeLayout::File));
+    CHECK(!image.ReadFunctions(functions));
+}
+
+TEST(FindImport)
+{
+    for (bool is64 : { true, false })
+    {
+        TestImage test(is64);
+        auto mapped = test.Mapped();
+        std::uint32_t thunkSize = is64 ? 8 : 4;
+
+        for (auto layout : { Utils::PeLayout::File, Utils::PeLayout::Mapped })
+        {
+            auto& bytes = layout == Utils::PeLayout::File ? test.File() : mapped;
+            Utils::PeImage image;
+            CHECK(image.Parse(bytes.data(), bytes.size(), layout));
+
+            std::uint32_t slot = 0;
+            CHECK(image.FindImport("kernel32.dll", "GetProcAddress", &slot));
+            CHECK_EQ(slot, Kernel32IatRva);
+            CHECK(image.FindImport("USER32.DLL", "MessageBoxW", &slot));
+            CHECK_EQ(slot, User32IatRva + 2 * thunkSize);
+            CHECK(image.FindImport("user32.dll", "CreateWindowExW", &slot));
+            CHECK_EQ(slot, User32IatRva + thunkSize);
+
+            CHECK(!image.FindImport("user32.dll", "createwindowexw", &slot));
+            CHECK(!image.FindImport("user32.dll", "GetProcAddress", &slot));
+            CHECK(!image.FindImport("gdi32.dll", "BitBlt", &slot));
+        }
+    }
+}
+
+TEST(RejectsMalformedHeaders)
+{
+    TestImage test(true);
+    Utils::PeImage image;
+
+    CHECK(!image.Parse(nullptr, 0, Utils::PeLayout::File));
+
+    auto badDos = test.File();
+    badDos[0] = 'X';
+    CHECK(!image.Parse(badDos.data(), badDos.size(), Utils::PeLayout::File));
+
+    auto badNt = test.File();
+    badNt[NtOffset] = 'X';
+    CHECK(!image.Parse(badNt.data(), badNt.size(), Utils::PeLayout::File));
+
+    auto badOptional = test.File();
+    badOptional[NtOffset + 0x18] = 0x07;
+    CHECK(!image.Parse(badOptional.data(), badOptional.size(), Utils::PeLayout::File));
+
+    auto farNt = test.File();
+    farNt[0x3C + 3] = 0x80;
+    CHECK(!image.Parse(farNt.data(), farNt.size(), Utils::PeLayout::File));
+    CHECK(image.Sections().empty());
+}
+
+// Every prefix of the image either parses or doesn't, and nothing reads past its end.
+TEST(TruncatedImages)
+{
+    for (bool is64 : { true, false })
+    {
+        TestImage test(is64);
+        auto mapped = test.Mapped();
+
+        for (auto layout : { Utils::PeLayout::File, Utils::PeLayout::Mapped })
+        {
+            auto& bytes = layout == Utils::PeLayout::File ? test.File() : mapped;
+            for (std::size_t size = 0; size <= bytes.size(); size += size < 0x400 ? 1 : 7)
+            {
+                GuardedCopy copy(bytes, size);
+                Utils::PeImage image;
+                bool parsed = image.Parse(copy.Data, size, layout);
+                CHECK(parsed == (size >= 0x98 + (is64 ? 0xF0u : 0xE0u) + 3 * 40));
+
+                std::vector<Utils::PeFunction> functions;
+                std::uint32_t slot = 0;
+                image.ReadFunctions(functions);
+                image.FindImport("user32.dll", "MessageBoxW", &slot);
+                for (auto& section : image.Sections())
+                {
+                    const std::uint8_t* start = nullptr;
+                    const std::uint8_t* end = nullptr;
+                    if (image.SectionBytes(section, &start, &end))
+                    {
+                        CHECK(start >= copy.Data && end <= copy.Data + size);
+                    }
+                }
+            }
+        }
+    }
+}
+
+TEST_MAIN()
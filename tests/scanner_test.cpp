@@ -0,0 +1,261 @@
+// The vectorized scanners against the byte-at-a-time loop that ScanProcess used before them, on random buffers.
+
+#include "src/utils/scanner.h"
+#include "tests/test.h"
+
+#include <random>
+#include <string>
+#include <sys/mman.h>
+#include <unistd.h>
+
+
+typedef unsigned char BYTE;
+
+// The loop ScanProcess had before it called FindPattern, as it was. It returns as soon as
+// the first length - 1 bytes match, so the last pattern byte is never compared.
+static BYTE* OldScanProcess(BYTE* start, BYTE* end, BYTE* pattern, BYTE* mask)
+{
+    size_t patternLength = strlen((char*)mask);
+
+    BYTE* pointer = start;
+    while (pointer < end)
+    {
+        for (size_t matchLength = 0; matchLength < patternLength; matchLength++)
+        {
+            if (matchLength + 1 == patternLength)
+            {
+                return pointer;
+            }
+            if (pointer + matchLength >= end)
+            {
+                return nullptr;
+            }
+            if ((pattern[matchLength] != pointer[matchLength]) && (mask[matchLength] != '?'))
+            {
+                break;
+            }
+        }
+
+        pointer++;
+    }
+    return nullptr;
+}
+
+// A buffer whose last byte is right before an inaccessible page, so that reading past end faults.
+class GuardedBuffer
+{
+private:
+    size_t mapped_;
+    BYTE* base_;
+
+public:
+    BYTE* Start;
+    BYTE* End;
+
+    explicit GuardedBuffer(size_t size)
+    {
+        size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        mapped_ = (size + page - 1) / page * page + page;
+        base_ = static_cast<BYTE*>(mmap(nullptr, mapped_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+        mprotect(base_ + mapped_ - page, page, PROT_NONE);
+        End = base_ + mapped_ - page;
+        Start = End - size;
+    }
+
+    ~GuardedBuffer()
+    {
+        munmap(base_, mapped_);
+    }
+};
+
+// A pattern as ScanProcess takes it (bytes and an x/? mask) and as the scanners take it.
+struct TestPattern
+{
+    std::vector<BYTE> Bytes;
+    std::string Mask;
+    std::vector<BYTE> Masks;
+    Utils::PatternView View;
+
+    TestPattern(std::vector<BYTE> bytes, std::string mask)
+        : Bytes(std::move(bytes)), Mask(std::move(mask))
+    {
+        for (char c : Mask)
+        {
+            Masks.push_back(c == '?' ? 0x00 : 0xFF);
+        }
+        View = { Bytes.data(), Masks.data(), Bytes.size(), 0, 0 };
+        Utils::PrepareAnchors(View.Bytes, View.Masks, View.Length, &View.AnchorA, &View.AnchorB);
+    }
+
+    // The old loop stops one byte short, so one trailing wildcard makes it compare the whole pattern.
+    BYTE* OldScan(BYTE* start, BYTE* end) const
+    {
+        std::vector<BYTE> bytes = Bytes;
+        std::string mask = Mask + "?";
+        bytes.push_back(0);
+        return OldScanProcess(start, end, bytes.data(), (BYTE*)mask.c_str());
+    }
+};
+
+typedef const std::uint8_t* (*ScanFn)(const std::uint8_t*, const std::uint8_t*, const Utils::PatternView&);
+
+// Random data over a small alphabet so partial matches are frequent, with copies of the pattern
+// (some of them with their last byte changed) planted here and there.
+static void FillBuffer(std::mt19937& rng, BYTE* start, BYTE* end, const TestPattern& pattern)
+{
+    std::uniform_int_distribution<int> alphabet(0, 3);
+    for (BYTE* p = start; p < end; p++)
+    {
+        *p = static_cast<BYTE>(0x40 + alphabet(rng));
+    }
+
+    size_t size = static_cast<size_t>(end - start);
+    if (size < pattern.Bytes.size())
+    {
+        return;
+    }
+    std::uniform_int_distribution<size_t> position(0, size - pattern.Bytes.size());
+    for (int i = std::uniform_int_distribution<int>(0, 3)(rng); i > 0; i--)
+    {
+        BYTE* at = start + position(rng);
+        std::copy(pattern.Bytes.begin(), pattern.Bytes.end(), at);
+        if (rng() % 2)
+        {
+            at[pattern.Bytes.size() - 1] ^= 0x80;
+        }
+    }
+}
+
+static TestPattern RandomPattern(std::mt19937& rng)
+{
+    size_t length = std::uniform_int_distribution<size_t>(1, 24)(rng);
+    std::vector<BYTE> bytes(length);
+    std::string mask(length, 'x');
+    for (size_t i = 0; i < length; i++)
+    {
+        // Mostly the buffer's alphabet, sometimes a byte that only planted copies contain.
+        bytes[i] = static_cast<BYTE>(rng() % 8 ? 0x40 + rng() % 4 : rng() % 256);
+        if (rng() % 4 == 0)
+        {
+            mask[i] = '?';
+        }
+    }
+    return TestPattern(std::move(bytes), std::move(mask));
+}
+
+// Same result as the old loop for every scanner, on sizes around the vector widths and on larger ones.
+static void CheckAgainstOldLoop(ScanFn scan, unsigned seed)
+{
+    std::mt19937 rng(seed);
+    for (int round = 0; round < 3000; round++)
+    {
+        TestPattern pattern = RandomPattern(rng);
+        size_t size = round % 3 == 0 ? std::uniform_int_distribution<size_t>(4096, 20000)(rng) : std::uniform_int_distribution<size_t>(0, 100)(rng);
+
+        GuardedBuffer buffer(size);
+        FillBuffer(rng, buffer.Start, buffer.End, pattern);
+
+        // Start at an odd offset too, so that the vector loads aren't always aligned.
+        for (size_t skip : { size_t(0), size_t(1) })
+        {
+            BYTE* start = buffer.Start + (std::min)(skip, size);
+            BYTE* expected = pattern.OldScan(start, buffer.End);
+            const std::uint8_t* found = scan(start, buffer.End, pattern.View);
+            if (found != expected)
+            {
+                std::printf("  round %d, size %zu, skip %zu, pattern %s: found at %td, expected %td\n", round, size, skip, pattern.Mask.c_str(),
+                    found ? found - start : -1, expected ? expected - start : -1);
+                CHECK(found == expected);
+                return;
+            }
+        }
+    }
+}
+
+
+TEST(ScalarMatchesOldLoop)
+{
+    CheckAgainstOldLoop(Utils::FindPatternScalar, 1);
+}
+
+TEST(SSE2MatchesOldLoop)
+{
+    CheckAgainstOldLoop(Utils::FindPatternSSE2, 2);
+}
+
+TEST(AVX2MatchesOldLoop)
+{
+    if (!Utils::CpuSupportsAVX2())
+    {
+        std::printf("  no AVX2 on this CPU, skipped\n");
+        return;
+    }
+    CheckAgainstOldLoop(Utils::FindPatternAVX2, 3);
+}
+
+TEST(FindPatternMatchesOldLoop)
+{
+    CheckAgainstOldLoop(Utils::FindPattern, 4);
+}
+
+// Matches planted right across chunk boundaries, scanned over and over on the same pool threads.
+TEST(ParallelMatchesFindPattern)
+{
+    std::mt19937 rng(5);
+    size_t size = 6 * Utils::PARALLEL_SCAN_CHUNK_SIZE + 123;
+    GuardedBuffer buffer(size);
+
+    for (int round = 0; round < 40; round++)
+    {
+        TestPattern pattern = RandomPattern(rng);
+        FillBuffer(rng, buffer.Start, buffer.End, pattern);
+        size_t chunk = 1 + rng() % 5;
+        size_t straddle = rng() % pattern.Bytes.size();
+        std::copy(pattern.Bytes.begin(), pattern.Bytes.end(), buffer.Start + chunk * Utils::PARALLEL_SCAN_CHUNK_SIZE - straddle);
+
+        const std::uint8_t* expected = Utils::FindPattern(buffer.Start, buffer.End, pattern.View);
+        for (unsigned threads : { 2u, 3u, 8u })
+        {
+            CHECK(Utils::FindPatternParallel(buffer.Start, buffer.End, pattern.View, threads) == expected);
+        }
+    }
+}
+
+// Patterns without a fully fixed byte have no anchor, every scanner falls back to checking each position.
+TEST(AllWildcardsMatchFirstPosition)
+{
+    GuardedBuffer buffer(64);
+    std::memset(buffer.Start, 0x90, 64);
+    TestPattern pattern({ 0, 0, 0 }, "???");
+
+    for (ScanFn scan : { Utils::FindPatternScalar, Utils::FindPatternSSE2, Utils::FindPattern })
+    {
+        CHECK(scan(buffer.Start, buffer.End, pattern.View) == buffer.Start);
+        CHECK(scan(buffer.End - 3, buffer.End, pattern.View) == buffer.End - 3);
+        CHECK(scan(buffer.End - 2, buffer.End, pattern.View) == nullptr);
+    }
+}
+
+// The one place where the scanners deliberately differ from the old loop: the last pattern byte is compared.
+TEST(LastByteIsCompared)
+{
+    GuardedBuffer buffer(64);
+    std::memset(buffer.Start, 0x90, 64);
+    BYTE code[] = { 0x48, 0x89, 0x5C, 0x24, 0x08 };
+    std::memcpy(buffer.Start + 20, code, sizeof(code));
+
+    BYTE wrongLast[] = { 0x48, 0x89, 0x5C, 0x24, 0x10 };
+    TestPattern pattern({ wrongLast, wrongLast + 5 }, "xxxxx");
+    CHECK(OldScanProcess(buffer.Start, buffer.End, wrongLast, (BYTE*)"xxxxx") == buffer.Start + 20);
+    CHECK(Utils::FindPattern(buffer.Start, buffer.End, pattern.View) == nullptr);
+
+    TestPattern right({ code, code + 5 }, "xxxxx");
+    CHECK(Utils::FindPattern(buffer.Start, buffer.End, right.View) == buffer.Start + 20);
+
+    // Nor did the old loop need the last byte to be inside the range.
+    std::memcpy(buffer.End - 4, code, 4);
+    CHECK(OldScanProcess(buffer.End - 8, buffer.End, code, (BYTE*)"xxxxx") == buffer.End - 4);
+    CHECK(Utils::FindPattern(buffer.End - 8, buffer.End, right.View) == nullptr);
+}
+
+TEST_MAIN()
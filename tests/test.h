@@ -0,0 +1,80 @@
+#pragma once
+
+// Minimal test harness for the Linux test target, see tests/CMakeLists.txt.
+// Every test binary defines its cases with TEST() and ends with TEST_MAIN(); it exits non-zero if any CHECK failed.
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+
+namespace Test
+{
+    struct Case
+    {
+        const char* Name;
+        void (*Run)();
+    };
+
+    inline std::vector<Case>& Cases()
+    {
+        static std::vector<Case> cases;
+        return cases;
+    }
+
+    inline int& Failures()
+    {
+        static int failures = 0;
+        return failures;
+    }
+
+    struct Registrar
+    {
+        Registrar(const char* name, void (*run)())
+        {
+            Cases().push_back({ name, run });
+        }
+    };
+
+    // Runs the cases whose name contains filter, all of them without one.
+    inline int RunAll(int argc, char** argv)
+    {
+        setvbuf(stdout, nullptr, _IONBF, 0);
+
+        const char* filter = argc > 1 ? argv[1] : nullptr;
+        int ran = 0;
+        for (auto& test : Cases())
+        {
+            if (filter && !std::strstr(test.Name, filter))
+            {
+                continue;
+            }
+
+            int before = Failures();
+            std::printf("[ RUN  ] %s\n", test.Name);
+            test.Run();
+            std::printf("[ %s ] %s\n", Failures() == before ? " OK " : "FAIL", test.Name);
+            ran++;
+        }
+
+        std::printf("%d test(s), %d failed check(s)\n", ran, Failures());
+        return Failures() == 0 && ran > 0 ? 0 : 1;
+    }
+}
+
+#define TEST(NAME) \
+    static void NAME(); \
+    static Test::Registrar NAME##Registrar_{ #NAME, NAME }; \
+    static void NAME()
+
+#define CHECK(COND) \
+    do { if (!(COND)) { std::printf("  %s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #COND); Test::Failures()++; } } while (0)
+
+#define CHECK_EQ(A, B) \
+    do { \
+        auto a_ = (A); auto b_ = (B); \
+        if (!(a_ == b_)) { std::printf("  %s:%d: CHECK_EQ(%s, %s) failed: %lld != %lld\n", __FILE__, __LINE__, #A, #B, (long long)a_, (long long)b_); Test::Failures()++; } \
+    } while (0)
+
+#define TEST_MAIN() \
+    int main(int argc, char** argv) { return Test::RunAll(argc, argv); }
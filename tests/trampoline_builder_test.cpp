@@ -0,0 +1,285 @@
+// BuildTrampoline and BuildPatch on typical MSVC x64 prologues, and on random bytes.
+// Every trampoline it accepts must branch where the original code branched, and copy everything else unchanged.
+
+#include "minhook/src/trampoline_builder.h"
+#include "tests/test.h"
+
+#include <algorithm>
+#include <initializer_list>
+#include <random>
+
+
+namespace
+{
+    struct Prologue
+    {
+        const char* Name;
+        uint8_t Code[24];
+        unsigned Size;
+        bool RipRelative;   // Can't move out of rel32 reach of its operand.
+    };
+
+    // Starts of functions as MSVC emits them, each followed by the int3 padding of the next function.
+    const Prologue Prologues[] = {
+        { "mov [rsp+8],rbx; push rdi; sub rsp,20h", { 0x48, 0x89, 0x5C, 0x24, 0x08, 0x57, 0x48, 0x83, 0xEC, 0x20, 0x48, 0x8B, 0xD9 }, 13, false },
+        { "push rbx; sub rsp,20h; mov rbx,rcx", { 0x40, 0x53, 0x48, 0x83, 0xEC, 0x20, 0x48, 0x8B, 0xD9 }, 9, false },
+        { "sub rsp,28h; call rel32", { 0x48, 0x83, 0xEC, 0x28, 0xE8, 0x10, 0x20, 0x00, 0x00, 0x48, 0x83, 0xC4, 0x28, 0xC3 }, 14, false },
+        { "mov rax,[rip]; test rax,rax; jz short; ret", { 0x48, 0x8B, 0x05, 0x00, 0x10, 0x00, 0x00, 0x48, 0x85, 0xC0, 0x74, 0x01, 0xC3, 0x33, 0xC0, 0xC3 }, 16, true },
+        { "lea rcx,[rip]; jmp rel32", { 0x48, 0x8D, 0x0D, 0x40, 0x00, 0x01, 0x00, 0xE9, 0x00, 0x30, 0x00, 0x00 }, 12, true },
+        { "jmp rel32 thunk", { 0xE9, 0x7B, 0x44, 0x02, 0x00, 0xCC, 0xCC, 0xCC }, 8, false },
+        { "jmp [rip] import thunk", { 0xFF, 0x25, 0x00, 0x20, 0x00, 0x00, 0xCC, 0xCC }, 8, true },
+        { "test ecx,ecx; jne rel32; xor eax,eax; ret", { 0x85, 0xC9, 0x0F, 0x85, 0x00, 0x01, 0x00, 0x00, 0x33, 0xC0, 0xC3 }, 11, false },
+        { "cmp rdx,8; jb short (internal)", { 0x48, 0x83, 0xFA, 0x08, 0x72, 0xFE, 0x48, 0x8B, 0xC1, 0xC3 }, 10, false },
+        { "xor eax,eax; ret; padding", { 0x33, 0xC0, 0xC3, 0xCC, 0xCC, 0xCC, 0xCC, 0xCC }, 8, false },
+    };
+
+    const uintptr_t TargetAddress = 0x140001000ULL;
+    const unsigned SlotSize = 64 - 24;  // MEMORY_SLOT_SIZE - offsetof(EXEC_BUFFER, trampoline)
+
+    // Destination of the branch or RIP relative operand of the instruction at code, running at ip.
+    // Returns 1 with it in dest, 0 if the instruction has none, -1 if it doesn't decode.
+    // The absolute forms the builder emits are resolved through their embedded address.
+    int Dest(const uint8_t* code, uint64_t ip, uint64_t* dest, unsigned* len, bool built)
+    {
+        hde64s hs;
+        *len = hde64_disasm(code, &hs);
+        if (hs.flags & F_ERROR)
+        {
+            return -1;
+        }
+
+        if (built && code[0] == 0xFF && (code[1] == 0x15 || code[1] == 0x25) && *len == 6)
+        {
+            int32_t disp;
+            memcpy(&disp, code + 2, sizeof(disp));
+            if (disp == (code[1] == 0x15 ? 2 : 0))
+            {
+                unsigned skip = code[1] == 0x15 ? 8 : 6;
+                memcpy(dest, code + skip, 8);
+                *len = skip + 8;
+                return 1;
+            }
+        }
+        if (built && (code[0] & 0xF0) == 0x70 && code[1] == 0x0E && code[2] == 0xFF && code[3] == 0x25)
+        {
+            // Inverted jcc over a jmp [rip].
+            memcpy(dest, code + 8, 8);
+            *len = 16;
+            return 1;
+        }
+        if ((hs.modrm & 0xC7) == 0x05)
+        {
+            *dest = ip + hs.len + (int32_t)hs.disp.disp32;
+            return 1;
+        }
+        if (hs.opcode == 0xE8 || hs.opcode == 0xE9 || (hs.opcode2 & 0xF0) == 0x80)
+        {
+            *dest = ip + hs.len + (int32_t)hs.imm.imm32;
+            return 1;
+        }
+        if (hs.opcode == 0xEB || (hs.opcode & 0xF0) == 0x70 || (hs.opcode & 0xFC) == 0xE0)
+        {
+            *dest = ip + hs.len + (int8_t)hs.imm.imm8;
+            return 1;
+        }
+        return 0;
+    }
+
+    // Every moved instruction must reach what the original reached, jumps inside the patched bytes excepted.
+    bool Verify(const TRAMPOLINE_BUILD& tb)
+    {
+        if (tb.codeSize > tb.trampolineSize || tb.nIP == 0 || tb.nIP > TRAMPOLINE_MAX_IPS)
+        {
+            return false;
+        }
+        for (unsigned i = 1; i < tb.nIP; i++)
+        {
+            if (tb.oldIPs[i] <= tb.oldIPs[i - 1] || tb.newIPs[i] <= tb.newIPs[i - 1])
+            {
+                return false;
+            }
+        }
+
+        for (unsigned i = 0; i < tb.nIP; i++)
+        {
+            uint8_t original[32] = {};
+            memcpy(original, tb.pSource + tb.oldIPs[i], std::min<size_t>(sizeof(original), tb.sourceSize - tb.oldIPs[i]));
+            uint8_t moved[32] = {};
+            memcpy(moved, tb.pTrampoline + tb.newIPs[i], std::min<size_t>(sizeof(moved), tb.codeSize - tb.newIPs[i]));
+
+            uint64_t originalDest = 0;
+            uint64_t movedDest = 0;
+            unsigned originalLen;
+            unsigned movedLen;
+            int originalKind = Dest(original, tb.targetAddress + tb.oldIPs[i], &originalDest, &originalLen, false);
+            int movedKind = Dest(moved, tb.trampolineAddress + tb.newIPs[i], &movedDest, &movedLen, true);
+            if (originalKind < 0 || movedKind < 0)
+            {
+                return false;
+            }
+
+            bool internal = originalKind && originalDest >= tb.targetAddress && originalDest < tb.targetAddress + sizeof(JMP_REL);
+            if (originalKind && !internal && originalDest != movedDest)
+            {
+                return false;
+            }
+            if (!originalKind && memcmp(original, moved, originalLen) != 0)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool Build(TRAMPOLINE_BUILD& tb, const uint8_t* code, size_t size, const uint8_t* above, uintptr_t trampolineAddress, uint8_t* out)
+    {
+        tb = {};
+        tb.pSource = code;
+        tb.sourceSize = size;
+        tb.pAbove = above;
+        tb.targetAddress = TargetAddress;
+        tb.trampolineAddress = trampolineAddress;
+        tb.pTrampoline = out;
+        tb.trampolineSize = SlotSize;
+        return BuildTrampoline(&tb) != 0;
+    }
+}
+
+
+TEST(ProloguesNearAndFar)
+{
+    static const uint8_t padding[sizeof(JMP_REL)] = { 0xCC, 0xCC, 0xCC, 0xCC, 0xCC };
+
+    for (const auto& prologue : Prologues)
+    {
+        // Within rel32 reach, then far enough to need the absolute forms.
+        for (uintptr_t trampolineAddress : { TargetAddress - 0x100000, (uintptr_t)0x7FF712340000ULL })
+        {
+            uint8_t out[64];
+            TRAMPOLINE_BUILD tb;
+            bool far = trampolineAddress > TargetAddress;
+            bool built = Build(tb, prologue.Code, prologue.Size, padding, trampolineAddress, out);
+            if (built != !(far && prologue.RipRelative) || (built && !Verify(tb)))
+            {
+                std::printf("  %s, trampoline at %llx\n", prologue.Name, (unsigned long long)trampolineAddress);
+            }
+            CHECK_EQ(built, !(far && prologue.RipRelative));
+            CHECK(!built || Verify(tb));
+        }
+    }
+}
+
+TEST(MovesWholeInstructionsAndJumpsBack)
+{
+    const auto& prologue = Prologues[0];
+    uint8_t out[64];
+    TRAMPOLINE_BUILD tb;
+    CHECK(Build(tb, prologue.Code, prologue.Size, nullptr, TargetAddress - 0x100000, out));
+
+    // mov [rsp+8],rbx is 5 bytes by itself, then the jump back to the push.
+    CHECK_EQ(tb.nIP, 1u);
+    CHECK_EQ(tb.patchAbove, 0);
+    CHECK_EQ(tb.codeSize, 10u);
+    CHECK(0 == memcmp(out, prologue.Code, 5));
+    CHECK_EQ(out[5], 0xE9);
+    int32_t back;
+    memcpy(&back, out + 6, sizeof(back));
+    CHECK_EQ(tb.trampolineAddress + 10 + back, TargetAddress + 5);
+}
+
+TEST(FarRipRelativeOperandIsRejected)
+{
+    // mov rax,[rip+x] can't be rewritten when the trampoline is out of rel32 reach of x.
+    const auto& prologue = Prologues[3];
+    uint8_t out[64];
+    TRAMPOLINE_BUILD tb;
+    CHECK(!Build(tb, prologue.Code, prologue.Size, nullptr, 0x7FF712340000ULL, out));
+}
+
+TEST(ShortFunctionPatchesAbove)
+{
+    // xor eax,eax; ret: 3 bytes, followed by something that isn't padding.
+    static const uint8_t code[] = { 0x33, 0xC0, 0xC3, 0x48, 0x89, 0x5C };
+    static const uint8_t padding[sizeof(JMP_REL)] = { 0xCC, 0xCC, 0xCC, 0xCC, 0xCC };
+    static const uint8_t notPadding[sizeof(JMP_REL)] = { 0xC3, 0xCC, 0xCC, 0xCC, 0xCC };
+    uint8_t out[64];
+    TRAMPOLINE_BUILD tb;
+
+    CHECK(Build(tb, code, sizeof(code), padding, TargetAddress - 0x100000, out));
+    CHECK_EQ(tb.patchAbove, 1);
+    CHECK(!Build(tb, code, sizeof(code), notPadding, TargetAddress - 0x100000, out));
+    CHECK(!Build(tb, code, sizeof(code), nullptr, TargetAddress - 0x100000, out));
+
+    uint8_t patch[TRAMPOLINE_MAX_PATCH];
+    uintptr_t relay = TargetAddress + 0x10000;
+    CHECK_EQ(BuildPatch(TargetAddress, relay, 1, patch), (unsigned)TRAMPOLINE_MAX_PATCH);
+    CHECK_EQ(patch[0], 0xE9);
+    int32_t disp;
+    memcpy(&disp, patch + 1, sizeof(disp));
+    CHECK_EQ(TargetAddress + disp, relay);
+    CHECK_EQ(patch[5], 0xEB);
+    CHECK_EQ((int8_t)patch[6], -7);
+}
+
+TEST(NeverReadsPastTheSource)
+{
+    // A truncated instruction at the end of the source must fail, not be decoded from whatever follows.
+    static const uint8_t code[] = { 0x48, 0x89, 0x5C, 0x24 };
+    uint8_t out[64];
+    TRAMPOLINE_BUILD tb;
+    CHECK(!Build(tb, code, sizeof(code), nullptr, TargetAddress - 0x100000, out));
+}
+
+TEST(PatchOutOfReach)
+{
+    uint8_t patch[TRAMPOLINE_MAX_PATCH];
+    CHECK_EQ(BuildPatch(TargetAddress, 0x7FF712340000ULL, 0, patch), 0u);
+    CHECK_EQ(BuildPatch(TargetAddress, TargetAddress - 0x7FFF0000ULL, 0, patch), (unsigned)sizeof(JMP_REL));
+}
+
+// Random code, biased towards the opcodes the builder rewrites, into buffers of random size.
+TEST(FuzzInvariants)
+{
+    static const uint8_t hot[] = { 0xE8, 0xE9, 0xEB, 0x74, 0x75, 0x0F, 0x84, 0xFF, 0x25, 0x15, 0x05, 0x8B, 0x48, 0x4C, 0xC3, 0xC2, 0xE0, 0xE3, 0x90, 0xCC, 0x00, 0x66, 0xF3 };
+    std::mt19937_64 rng(17);
+    unsigned accepted = 0;
+    unsigned failures = 0;
+
+    for (unsigned run = 0; run < 300000; run++)
+    {
+        std::vector<uint8_t> code(rng() % (TRAMPOLINE_MAX_SOURCE + 1));
+        for (auto& byte : code)
+        {
+            byte = (rng() & 1) ? hot[rng() % sizeof(hot)] : (uint8_t)rng();
+        }
+        uint8_t above[sizeof(JMP_REL)];
+        for (auto& byte : above)
+        {
+            byte = (rng() & 1) ? 0xCC : (uint8_t)rng();
+        }
+        std::vector<uint8_t> out(rng() % 65);
+
+        TRAMPOLINE_BUILD tb = {};
+        tb.pSource = code.data();
+        tb.sourceSize = code.size();
+        tb.pAbove = (rng() & 1) ? above : nullptr;
+        tb.targetAddress = 0x140000000ULL + (rng() % 0x100000);
+        tb.trampolineAddress = (rng() & 3) ? tb.targetAddress - 0x80000000ULL + (rng() % 0x100000000ULL) : 0x7FF000000000ULL + (rng() % 0x10000);
+        tb.pTrampoline = out.data();
+        tb.trampolineSize = (unsigned)out.size();
+        if (BuildTrampoline(&tb))
+        {
+            accepted++;
+            if (!Verify(tb))
+            {
+                failures++;
+            }
+        }
+    }
+
+    std::printf("  %u accepted\n", accepted);
+    CHECK(accepted > 0);
+    CHECK_EQ(failures, 0u);
+}
+
+TEST_MAIN()